@@ -0,0 +1,174 @@
+//
+//  BackendBenchmark.cpp
+//  PeculiarLog
+//
+//  Fetch and filter throughput of every engine back end built in, on the same file and patterns:
+//
+//    clang++ -std=gnu++14 -O2 -IPeculiarLog/SearchEngine PeculiarLog/SearchEngine/*.cpp Benchmarks/BackendBenchmark.cpp
+//            -lhs -lpcre2-8 -o backend-benchmark
+//    ./backend-benchmark big.log error 'request.*beta' 'L[0-9]*7 '
+//
+//  Hosts without hyperscan add -DSE_SUPPORT_HYPERSCAN=0. Every pattern is filtered with a cold filter
+//  cache, the best of several runs is reported to keep page cache effects out of the comparison.
+//
+
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "SearchEngine.hpp"
+
+static const int s_runs = 3;
+
+struct Completion {
+    std::mutex              lock;
+    std::condition_variable cond;
+    bool                    done = false;
+    SearchEngineError       result = NoError;
+    SEBlockInfo             info = {};
+
+    static void complete(void* userData, SearchEngineError result, const SEBlockInfo* info)
+    {
+        auto completion = (Completion*)userData;
+        std::lock_guard<std::mutex> guard(completion->lock);
+        completion->result = result;
+        completion->info = *info;
+        completion->done = true;
+        completion->cond.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return done; });
+    }
+};
+
+struct Measure {
+    double      seconds = 0;
+    uint32_t    lines = 0;
+};
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool fetch(const char* file, SearchEngineBack back, SEContext* context, Measure* measure)
+{
+    memset(context, 0, sizeof(SEContext));
+    context->back = back;
+    if (se_init(file, context) != NoError)
+        return false;
+
+    Completion completion;
+    double start = now();
+    if (se_fetch_async(context, nullptr, &Completion::complete, &completion) != NoError)
+        return false;
+    completion.wait();
+    measure->seconds = now() - start;
+    measure->lines = completion.info.lines;
+    return completion.result == NoError;
+}
+
+static bool filter(SEContext* context, const char* pattern, Measure* measure)
+{
+    // the cache always keeps the last compiled pattern, a placeholder takes its place under zero budget
+    // and the budget is restored, so that every run scans the file again
+    char error[MAX_ERROR_LENGTH + 1] = {0};
+    se_set_cache_budget(context, 0);
+    se_set_pattern(context, "\x01", error);
+    se_set_cache_budget(context, 256 * 1024 * 1024);
+
+    double start = now();
+    if (se_set_pattern(context, pattern, error) != NoError) {
+        printf("  %s: %s\n", pattern, error);
+        return false;
+    }
+
+    Completion completion;
+    if (se_filter_async(context, 0, nullptr, &Completion::complete, &completion) != NoError)
+        return false;
+    completion.wait();
+    measure->seconds = now() - start;
+    measure->lines = completion.info.lines;
+    return completion.result == NoError;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        printf("usage: %s <file> <pattern> [pattern ...]\n", argv[0]);
+        return 1;
+    }
+
+    struct Back {
+        SearchEngineBack    back;
+        const char*         name;
+    };
+    std::vector<Back> backs;
+#if SE_SUPPORT_HYPERSCAN
+    backs.push_back({Hyperscan, "hyperscan"});
+#endif
+#if SE_SUPPORT_PORTABLE
+    backs.push_back({Portable, "portable"});
+#endif
+
+    const char* file = argv[1];
+    std::vector<std::vector<double>> rates(backs.size());
+    std::vector<std::vector<uint32_t>> counts(backs.size());
+    for (size_t b = 0; b < backs.size(); b++) {
+        double fetchTime = 1e9;
+        uint64_t bytes = 0;
+        SEContext context;
+        Measure measure;
+        for (int run = 0; run < s_runs; run++) {
+            if (!fetch(file, backs[b].back, &context, &measure)) {
+                printf("[!] unable to fetch %s with %s engine\n", file, backs[b].name);
+                return 1;
+            }
+            fetchTime = std::min(fetchTime, measure.seconds);
+            bytes = context.bytes;
+            if (run + 1 < s_runs)
+                se_destroy(&context);
+        }
+        rates[b].push_back(bytes / fetchTime / 1e6);
+        counts[b].push_back(measure.lines);
+
+        for (int i = 2; i < argc; i++) {
+            double filterTime = 1e9;
+            for (int run = 0; run < s_runs; run++) {
+                if (!filter(&context, argv[i], &measure))
+                    break;
+                filterTime = std::min(filterTime, measure.seconds);
+            }
+            rates[b].push_back(bytes / filterTime / 1e6);
+            counts[b].push_back(measure.lines);
+        }
+        se_destroy(&context);
+    }
+
+    printf("\n%-24s", "MB/s (lines)");
+    for (auto& back : backs) {
+        printf("%24s", back.name);
+    }
+    printf("\n");
+    for (int i = 1; i < argc; i++) {
+        printf("%-24.24s", (i == 1)? "fetch" : argv[i]);
+        for (size_t b = 0; b < backs.size(); b++) {
+            char cell[64];
+            snprintf(cell, sizeof(cell), "%.0f (%u)", rates[b][i - 1], counts[b][i - 1]);
+            printf("%24s", cell);
+        }
+        // line counts must agree, otherwise the faster back end is not doing the same work
+        if (backs.size() > 1 && counts[0][i - 1] != counts[1][i - 1])
+            printf("  [!] results differ");
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -12,7 +12,11 @@ import Cocoa
 class AppDelegate: NSObject, NSApplicationDelegate {
 
     func applicationDidFinishLaunching(_ aNotification: Notification) {
-        // Insert code here to initialize your application
+        // lines piped to the app are shown as they arrive
+        var stdinStat = stat()
+        if (fstat(STDIN_FILENO, &stdinStat) == 0 && (stdinStat.st_mode & S_IFMT) == S_IFIFO) {
+            _ = application(NSApp, openFile: "/dev/stdin")
+        }
     }
 
     func applicationWillTerminate(_ aNotification: Notification) {
@@ -10,6 +10,7 @@ import Cocoa
 
 public protocol LogViewDelegate {
     func patternCompilationError(_ error: String)
+    func filterChanged()
     func selectionChanged()
 }
 
@@ -23,7 +24,7 @@ class LogViewController: NSViewController {
     private var currentMatchColor: NSColor = NSColor.red
     private var currentScopeColor: NSColor = NSColor.textColor
     
-    private var rowInfoCache: (line: String, number: Int, scope: Bool, newWidth: Bool)?
+    private var rowInfoCache: (line: String, number: Int, scope: Bool, newWidth: Bool, match: NSRange)?
     
     override func viewDidLoad() {
         super.viewDidLoad()
@@ -41,12 +42,59 @@ class LogViewController: NSViewController {
         #endif
 
             guard let engine = representedObject as? SearchEngine else { return }
+            
+            engine.filterProgress = { [weak self] in
+                self?.filterProgress()
+            }
 
-            adjustColumnWidth(for:"LogLineColumn", length: String(engine.totalLines + 1).count) // lines start with 1
+            adjustColumnWidth(for:"LogLineColumn", length: String(max(engine.totalLines, engine.estimatedLines) + 1).count) // lines start with 1
             adjustColumnWidth(for:"LogDataColumn", length: engine.maxLength)
             tableView.reloadData()
         }
     }
+    
+    // more lines are available while file is being opened
+    func loadProgress() {
+        guard let engine = self.representedObject as? SearchEngine else { return }
+        
+        adjustColumnWidth(for:"LogLineColumn", length: String(max(engine.totalLines, engine.estimatedLines) + 1).count)
+        if (!engine.isFiltered) {
+            adjustColumnWidth(for:"LogDataColumn", length: engine.maxLength)
+            tableView.noteNumberOfRowsChanged()
+        }
+    }
+
+    // more rows are filtered in background, rows may be added above the view so it's kept at the same lines
+    func filterProgress() {
+        guard let engine = self.representedObject as? SearchEngine else { return }
+        
+        let topLine = absLine(at: tableView.rows(in: tableView.visibleRect).location)
+        let selectedLine = absLine(at: tableView.selectedRow)
+        
+        engine.mergeFilter()
+        
+        if (engine.lineCount != 0) {
+            adjustColumnWidth(for:"LogDataColumn", length: engine.maxLength)
+        }
+        tableView.reloadData()
+        
+        let selectedRow = (selectedLine != 0) ? engine.getRowForAbsLine(selectedLine) : -1
+        if (selectedRow >= 0) {
+            tableView.selectRowIndexes(IndexSet(integer: selectedRow), byExtendingSelection: false)
+        }
+        let topRow = (topLine != 0) ? engine.getRowForAbsLine(topLine) : -1
+        if (topRow >= 0) {
+            tableView.scroll(tableView.rect(ofRow: topRow).origin)
+        }
+        delegate?.filterChanged()
+    }
+    
+    // absolute line number shown in the row, 0 if there is no such row
+    private func absLine(at row: Int) -> Int {
+        guard let engine = self.representedObject as? SearchEngine else { return 0 }
+        guard row >= 0 && row < tableView.numberOfRows && row < engine.lineCount else { return 0 }
+        return engine.getLine(row).number
+    }
 
     func adjustColumnWidth(for column:String, length:Int) {
 
@@ -73,6 +121,31 @@ class LogViewController: NSViewController {
         currentMatchColor = matchColor
         currentScopeColor = scopeColor
         
+        if (pattern.count == 0) {
+            applyPattern(pattern, reportError: reportError)
+            return
+        }
+        
+        // compile on engine thread so that typing is not blocked, only the latest pattern is applied
+        engine.compilePattern(pattern) { [weak self] (result, error) in
+            guard let strongSelf = self, strongSelf.currentPattern == pattern else { return }
+            guard result else {
+                if (reportError) {
+                    strongSelf.delegate?.patternCompilationError(error)
+                }
+                return
+            }
+            strongSelf.applyPattern(pattern, reportError: reportError)
+        }
+    }
+    
+    private func applyPattern(_ pattern: String, reportError: Bool) {
+        guard let engine = self.representedObject as? SearchEngine else { return }
+        
+        // lines in the view are filtered first, so that matches around them are shown right away
+        let viewportLine = absLine(at: tableView.rows(in: tableView.visibleRect).location)
+        
+        // compiled pattern is taken from engine filter cache
         let (result, error) = engine.setPattern(pattern)
         guard result else {
             if (reportError) {
@@ -82,7 +155,7 @@ class LogViewController: NSViewController {
         }
         
         if (pattern.count != 0) {
-            guard engine.filter() else { return }
+            guard engine.filter(viewportLine: viewportLine) else { return }
         }
         
         if (engine.lineCount != 0) {
@@ -90,6 +163,40 @@ class LogViewController: NSViewController {
         }
         
         tableView.reloadData()
+        if (viewportLine != 0 && engine.lineCount != 0) {
+            let row = engine.isFiltered ? engine.getRowForAbsLine(viewportLine) : viewportLine - 1
+            tableView.scroll(tableView.rect(ofRow: max(row, 0)).origin)
+        }
+        delegate?.filterChanged()
+    }
+    
+    func updateScope(matchColor: NSColor, scopeColor: NSColor) {
+        guard let engine = self.representedObject as? SearchEngine else { return }
+        currentMatchColor = matchColor
+        currentScopeColor = scopeColor
+        
+        if (engine.lineCount != 0) {
+            adjustColumnWidth(for:"LogDataColumn", length: engine.maxLength)
+        }
+        
+        tableView.reloadData()
+    }
+    
+    // moves selection to the nearest match of the current pattern after (or before) the selected line,
+    // even if it is not filtered yet or the view is not filtered, completion is called on main queue
+    func gotoMatch(backward: Bool, completion: @escaping (Bool) -> Void) {
+        guard let engine = self.representedObject as? SearchEngine, currentPattern.count != 0 else {
+            completion(false)
+            return
+        }
+        
+        engine.findNext(currentPattern, from: absLine(at: tableView.selectedRow), backward: backward) { [weak self] (line) in
+            guard let strongSelf = self, let line = line else {
+                completion(false)
+                return
+            }
+            completion(strongSelf.gotoAbsLine(line))
+        }
     }
     
     func gotoAbsLine(_ line: Int) -> Bool {
@@ -204,7 +311,12 @@ extension LogViewController: NSTableViewDataSource, NSTableViewDelegate {
             attEntry.addAttribute(.font, value: font, range: NSMakeRange(0, lineInfo.line.count))
             attEntry.addAttribute(.foregroundColor, value: cell.textField?.textColor as Any, range: NSMakeRange(0, lineInfo.line.count))
             
-            if (!lineInfo.scope) {
+            if (!lineInfo.scope && engine.fieldMode) {
+                // color matched field value, query is not a regex
+                if (lineInfo.match.location != NSNotFound) {
+                    attEntry.addAttribute(.foregroundColor, value: currentMatchColor, range: lineInfo.match)
+                }
+            } else if (!lineInfo.scope) {
                 // color match line
                 do {
                     var options: NSRegularExpression.Options = []
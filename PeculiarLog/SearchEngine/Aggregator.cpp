@@ -0,0 +1,127 @@
+//
+//  Aggregator.cpp
+//  PeculiarLog
+//
+
+#include <algorithm>
+
+#include "SearchEngine.hpp"
+#include "Aggregator.hpp"
+#include "FieldParser.hpp"
+
+bool ColumnExtractor::extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength)
+{
+    const char* p = line;
+    const char* end = line + length;
+    
+    if (m_delimiter == 0) {
+        auto isSpace = [](char c) { return c == ' ' || c == '\t'; };
+        for (uint32_t column = 0; ; column++) {
+            while (p < end && isSpace(*p))
+                p++;
+            if (p == end)
+                return false;
+            const char* start = p;
+            while (p < end && !isSpace(*p))
+                p++;
+            if (column == m_column) {
+                *key = start;
+                *keyLength = uint32_t(p - start);
+                return true;
+            }
+        }
+    }
+    
+    for (uint32_t column = 0; column < m_column; column++) {
+        auto delimiter = (const char*)memchr(p, m_delimiter, end - p);
+        if (!delimiter)
+            return false;
+        p = delimiter + 1;
+    }
+    auto delimiter = (const char*)memchr(p, m_delimiter, end - p);
+    *key = p;
+    *keyLength = uint32_t(((delimiter)? delimiter : end) - p);
+    return true;
+}
+
+bool FieldExtractor::extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength)
+{
+    bool found = false;
+    auto visitor = [&](const char* field, uint32_t fieldLength, const char* value, uint32_t valueLength) -> bool {
+        if (fieldLength != m_field.size() || memcmp(field, m_field.data(), fieldLength) != 0)
+            return true;
+        *key = value;
+        *keyLength = valueLength;
+        found = true;
+        return false;
+    };
+    
+    FieldParser::tokenize(line, length, visitor);
+    return found;
+}
+
+void Aggregator::reset(uint32_t blockIdx)
+{
+    m_workers[blockIdx].counts.clear();
+}
+
+void Aggregator::add(uint32_t blockIdx, const char* line, uint32_t length)
+{
+    const char* key = nullptr;
+    uint32_t keyLength = 0;
+    if (!m_extractor->extract(blockIdx, line, length, &key, &keyLength))
+        return;
+    
+    auto& worker = m_workers[blockIdx];
+    worker.key.assign(key, keyLength);
+    worker.counts[worker.key]++;
+}
+
+uint32_t Aggregator::merge(uint32_t blockCount, uint32_t topK, SEKeyCount* keys, uint64_t* distinct)
+{
+    // start from the biggest map to move the least number of keys
+    uint32_t largest = 0;
+    for (uint32_t i = 1; i < blockCount; i++) {
+        if (m_workers[i].counts.size() > m_workers[largest].counts.size())
+            largest = i;
+    }
+    
+    auto total = std::move(m_workers[largest].counts);
+    m_workers[largest].counts.clear();
+    for (uint32_t i = 0; i < blockCount; i++) {
+        for (auto& entry : m_workers[i].counts) {
+            total[entry.first] += entry.second;
+        }
+        m_workers[i].counts.clear();
+    }
+    
+    if (distinct)
+        *distinct = total.size();
+    
+    m_top.assign(total.begin(), total.end());
+    uint32_t count = std::min<uint32_t>(topK, uint32_t(m_top.size()));
+    std::partial_sort(m_top.begin(), m_top.begin() + count, m_top.end(), [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b) {
+        return (a.second != b.second)? a.second > b.second : a.first < b.first;
+    });
+    m_top.resize(count);
+    
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i].key = m_top[i].first.data();
+        keys[i].length = uint32_t(m_top[i].first.size());
+        keys[i].count = m_top[i].second;
+    }
+    
+    return count;
+}
+
+size_t Aggregator::memoryUsage() const
+{
+    size_t size = sizeof(Aggregator);
+    for (auto& worker : m_workers) {
+        size += worker.counts.bucket_count() * sizeof(void*) + worker.counts.size() * (sizeof(std::string) + sizeof(uint64_t) + 2 * sizeof(void*));
+    }
+    for (auto& entry : m_top) {
+        size += sizeof(entry) + entry.first.capacity();
+    }
+    return size;
+}
@@ -0,0 +1,71 @@
+//
+//  Aggregator.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// extracts grouping key from a line, lines of a block are handled by a single worker
+class KeyExtractor {
+
+public:
+    virtual ~KeyExtractor() {}
+    
+    virtual bool        extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength) = 0;
+};
+
+// awk-like column split on whitespace runs if delimiter is 0, cut-like otherwise
+class ColumnExtractor : public KeyExtractor {
+
+public:
+    ColumnExtractor(char delimiter, uint32_t column) : m_delimiter(delimiter), m_column(column) {}
+    
+    bool                extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength) override;
+    
+private:
+    
+    char                m_delimiter;
+    uint32_t            m_column;
+};
+
+// value of JSON or key=value field
+class FieldExtractor : public KeyExtractor {
+
+public:
+    FieldExtractor(const char* field) : m_field(field) {}
+    
+    bool                extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength) override;
+    
+private:
+    
+    std::string         m_field;
+};
+
+// counts keys per block in parallel and merges them into top-K list
+class Aggregator {
+
+public:
+    Aggregator(std::shared_ptr<KeyExtractor> extractor) : m_extractor(extractor) {}
+    
+    void                reset(uint32_t blockIdx);
+    void                add(uint32_t blockIdx, const char* line, uint32_t length);
+    uint32_t            merge(uint32_t blockCount, uint32_t topK, SEKeyCount* keys, uint64_t* distinct);
+    size_t              memoryUsage() const;
+    
+private:
+    
+    struct Worker {
+        std::unordered_map<std::string, uint64_t>   counts;
+        std::string                                 key;    // reused for lookups
+    };
+    
+    std::shared_ptr<KeyExtractor>                   m_extractor;
+    Worker                                          m_workers[MAX_BLOCK_COUNT];
+    std::vector<std::pair<std::string, uint64_t>>   m_top;  // merged result, owns returned keys
+};
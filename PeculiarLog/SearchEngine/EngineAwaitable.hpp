@@ -0,0 +1,101 @@
+//
+//  EngineAwaitable.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include "SearchEngine.hpp"
+
+#if __cplusplus >= 202002L
+
+#include <atomic>
+#include <coroutine>
+#include <functional>
+#include <utility>
+
+struct SEAsyncResult {
+    SearchEngineError   error;
+    SEBlockInfo         info;
+};
+
+// co_await of se_fetch_async or se_filter_async, coroutine is resumed on the worker which finished
+// the last task, or isn't suspended at all if the operation completes or fails right away
+class SEAsyncAwaitable {
+
+public:
+    typedef std::function<void(uint32_t index, uint32_t done, uint32_t total)> Progress;
+    typedef std::function<SearchEngineError(SEProgressCallback, SECompletionCallback, void*)> Start;
+
+    SEAsyncAwaitable(Start start, Progress progress)
+        : m_start(std::move(start)), m_progress(std::move(progress))
+    {
+    }
+
+    SEAsyncAwaitable(const SEAsyncAwaitable&) = delete;
+    SEAsyncAwaitable& operator=(const SEAsyncAwaitable&) = delete;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        auto err = m_start(&SEAsyncAwaitable::progress, &SEAsyncAwaitable::complete, this);
+        if (err != NoError) {
+            m_result = {err, {0, 0, ASCIIEncoding, 0}};
+            return false;
+        }
+
+        // whoever comes second resumes, the awaitable must not be touched once completion has it
+        return !m_completed.exchange(true, std::memory_order_acq_rel);
+    }
+
+    SEAsyncResult await_resume() const noexcept
+    {
+        return m_result;
+    }
+
+private:
+
+    static void progress(void* userData, uint32_t index, uint32_t done, uint32_t total)
+    {
+        auto self = static_cast<SEAsyncAwaitable*>(userData);
+        if (self->m_progress)
+            self->m_progress(index, done, total);
+    }
+
+    static void complete(void* userData, SearchEngineError result, const SEBlockInfo* info)
+    {
+        auto self = static_cast<SEAsyncAwaitable*>(userData);
+        self->m_result = {result, info ? *info : SEBlockInfo{0, 0, ASCIIEncoding, 0}};
+        if (self->m_completed.exchange(true, std::memory_order_acq_rel))
+            self->m_handle.resume();
+    }
+
+private:
+
+    Start                   m_start;
+    Progress                m_progress;
+    std::coroutine_handle<> m_handle;
+    std::atomic<bool>       m_completed {false};
+    SEAsyncResult           m_result = {NoError, {0, 0, ASCIIEncoding, 0}};
+};
+
+inline SEAsyncAwaitable se_fetch_await(SEContext* context, SEAsyncAwaitable::Progress progress = nullptr)
+{
+    return SEAsyncAwaitable([context](SEProgressCallback progress, SECompletionCallback completion, void* userData) {
+        return se_fetch_async(context, progress, completion, userData);
+    }, std::move(progress));
+}
+
+inline SEAsyncAwaitable se_filter_await(SEContext* context, uint32_t viewportLine, SEAsyncAwaitable::Progress progress = nullptr)
+{
+    return SEAsyncAwaitable([context, viewportLine](SEProgressCallback progress, SECompletionCallback completion, void* userData) {
+        return se_filter_async(context, viewportLine, progress, completion, userData);
+    }, std::move(progress));
+}
+
+#endif
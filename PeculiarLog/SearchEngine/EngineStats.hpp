@@ -0,0 +1,178 @@
+//
+//  EngineStats.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+// counters are written by workers scanning the block and read by anyone,
+// relaxed ordering is enough and padding avoids false sharing
+struct alignas(64) ChunkCounters {
+    std::atomic<uint64_t>   bytes {0};
+    std::atomic<uint64_t>   scanTime {0};
+    std::atomic<uint64_t>   callbacks {0};
+    std::atomic<uint64_t>   matches {0};
+    std::atomic<uint64_t>   candidates {0};
+    std::atomic<uint64_t>   scopeLines {0};
+    std::atomic<uint64_t>   pageFaults {0};
+
+    void reset() {
+        bytes.store(0, std::memory_order_relaxed);
+        scanTime.store(0, std::memory_order_relaxed);
+        callbacks.store(0, std::memory_order_relaxed);
+        matches.store(0, std::memory_order_relaxed);
+        candidates.store(0, std::memory_order_relaxed);
+        scopeLines.store(0, std::memory_order_relaxed);
+        pageFaults.store(0, std::memory_order_relaxed);
+    }
+
+    void load(SEChunkStats* stats) const {
+        stats->bytes = bytes.load(std::memory_order_relaxed);
+        stats->scanTime = scanTime.load(std::memory_order_relaxed);
+        stats->callbacks = callbacks.load(std::memory_order_relaxed);
+        stats->matches = matches.load(std::memory_order_relaxed);
+        stats->candidates = candidates.load(std::memory_order_relaxed);
+        stats->scopeLines = scopeLines.load(std::memory_order_relaxed);
+        stats->pageFaults = pageFaults.load(std::memory_order_relaxed);
+        stats->bytesPerSecond = (stats->scanTime)? uint64_t(double(stats->bytes) * 1e9 / stats->scanTime) : 0;
+    }
+};
+
+static inline uint64_t steadyTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// work finished within a block is added to its slot as every piece or chunk is done, so
+// workers of different blocks never share a cache line and readers sum slots up
+struct alignas(64) ProgressSlot {
+    std::atomic<uint64_t>   bytes {0};
+    std::atomic<uint64_t>   lines {0};
+    std::atomic<uint64_t>   matches {0};
+    std::atomic<uint64_t>   updateTime {0};
+};
+
+struct OperationProgress {
+    ProgressSlot            slots[MAX_BLOCK_COUNT];
+    std::atomic<uint64_t>   totalBytes {0};
+    std::atomic<uint64_t>   startTime {0};
+
+    // caller makes sure no worker of the previous operation is still running
+    void start(uint64_t total) {
+        for (auto& slot : slots) {
+            slot.bytes.store(0, std::memory_order_relaxed);
+            slot.lines.store(0, std::memory_order_relaxed);
+            slot.matches.store(0, std::memory_order_relaxed);
+            slot.updateTime.store(0, std::memory_order_relaxed);
+        }
+        totalBytes.store(total, std::memory_order_relaxed);
+        startTime.store(steadyTime(), std::memory_order_relaxed);
+    }
+
+    // work which grows the operation, e.g. lines appended to a stream, is added to the total too
+    void grow(uint64_t bytes) {
+        totalBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void add(uint32_t blockIdx, uint64_t bytes, uint64_t lines, uint64_t matches) {
+        auto& slot = slots[blockIdx];
+        slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        slot.lines.fetch_add(lines, std::memory_order_relaxed);
+        slot.matches.fetch_add(matches, std::memory_order_relaxed);
+        slot.updateTime.store(steadyTime(), std::memory_order_relaxed);
+    }
+
+    void load(SEProgress* progress) const {
+        uint64_t lastUpdate = 0;
+        progress->bytes = 0;
+        progress->lines = 0;
+        progress->matches = 0;
+        for (auto& slot : slots) {
+            progress->bytes += slot.bytes.load(std::memory_order_relaxed);
+            progress->lines += slot.lines.load(std::memory_order_relaxed);
+            progress->matches += slot.matches.load(std::memory_order_relaxed);
+            lastUpdate = std::max(lastUpdate, slot.updateTime.load(std::memory_order_relaxed));
+        }
+        progress->totalBytes = totalBytes.load(std::memory_order_relaxed);
+        progress->complete = (progress->bytes >= progress->totalBytes);
+
+        // counters are read one by one, so the snapshot may be slightly behind the workers
+        uint64_t start = startTime.load(std::memory_order_relaxed);
+        uint64_t end = (progress->complete)? std::max(lastUpdate, start) : steadyTime();
+        progress->elapsedTime = (end > start)? end - start : 0;
+        progress->remainingTime = 0;
+        if (!progress->complete && progress->bytes)
+            progress->remainingTime = uint64_t(double(progress->elapsedTime) * (progress->totalBytes - progress->bytes) / progress->bytes);
+    }
+};
+
+struct EngineStats {
+    ChunkCounters           fetch[MAX_BLOCK_COUNT];
+    ChunkCounters           filter[MAX_BLOCK_COUNT];
+    OperationProgress       fetchProgress;
+    OperationProgress       filterProgress;
+
+    std::atomic<uint64_t>   compileTime {0};
+    std::atomic<uint64_t>   predictionHits {0};
+    std::atomic<uint64_t>   predictionMisses {0};
+    std::atomic<uint64_t>   cacheHits {0};
+    std::atomic<uint64_t>   cacheMisses {0};
+    std::atomic<uint64_t>   skippedBytes {0};
+
+    static void count(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+// measures time and page faults of a single chunk scan
+class ScanProbe {
+
+public:
+    ScanProbe() {
+        m_faults = pageFaults();
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    void finish(ChunkCounters& counters, uint64_t bytes, uint64_t callbacks, uint64_t matches) {
+        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        counters.bytes.store(bytes, std::memory_order_relaxed);
+        counters.scanTime.store(time.count(), std::memory_order_relaxed);
+        counters.callbacks.store(callbacks, std::memory_order_relaxed);
+        counters.matches.store(matches, std::memory_order_relaxed);
+        counters.pageFaults.store(pageFaults() - m_faults, std::memory_order_relaxed);
+    }
+
+    // chunks of a block may be scanned by several workers, their counters are summed up
+    void add(ChunkCounters& counters, uint64_t bytes, uint64_t callbacks, uint64_t matches, uint64_t candidates) {
+        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counters.scanTime.fetch_add(time.count(), std::memory_order_relaxed);
+        counters.callbacks.fetch_add(callbacks, std::memory_order_relaxed);
+        counters.matches.fetch_add(matches, std::memory_order_relaxed);
+        counters.candidates.fetch_add(candidates, std::memory_order_relaxed);
+        counters.pageFaults.fetch_add(pageFaults() - m_faults, std::memory_order_relaxed);
+    }
+
+    static uint64_t pageFaults() {
+        struct rusage usage;
+    #ifdef RUSAGE_THREAD
+        if (getrusage(RUSAGE_THREAD, &usage) != 0)
+            return 0;
+    #else
+        // per thread usage is not available, faults of concurrent scans are included
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+    #endif
+        return usage.ru_minflt + usage.ru_majflt;
+    }
+
+private:
+
+    std::chrono::steady_clock::time_point   m_start;
+    uint64_t                                m_faults = 0;
+};
@@ -0,0 +1,89 @@
+//
+//  FieldParser.cpp
+//  PeculiarLog
+//
+
+#include "SearchEngine.hpp"
+#include "FieldParser.hpp"
+
+static void setError(char* error, const char* message)
+{
+    printf("[!] unable to parse field query: %s\n", message);
+    if (error)
+        snprintf(error, MAX_ERROR_LENGTH + 1, "%s", message);
+}
+
+bool FieldParser::parseQuery(const char* query, std::vector<FieldPredicate>& predicates, char* error)
+{
+    predicates.clear();
+    
+    const char* p = query;
+    while (*p) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p)
+            break;
+        
+        FieldPredicate predicate;
+        const char* key = p;
+        while (isKeyChar(*p))
+            p++;
+        if (p == key) {
+            setError(error, "field name expected");
+            return false;
+        }
+        predicate.key.assign(key, p - key);
+        
+        if (p[0] == '=') {
+            predicate.op = FieldPredicate::Equal;
+            p += 1;
+        } else if (p[0] == '!' && p[1] == '=') {
+            predicate.op = FieldPredicate::NotEqual;
+            p += 2;
+        } else if (p[0] == '~') {
+            predicate.op = FieldPredicate::Match;
+            p += 1;
+        } else {
+            setError(error, "'=', '!=' or '~' expected after field name");
+            return false;
+        }
+        
+        if (*p == '"') {
+            // quoted value, '\"' and '\\' are unescaped
+            p++;
+            while (*p && *p != '"') {
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+                    p++;
+                predicate.value.push_back(*p++);
+            }
+            if (*p != '"') {
+                setError(error, "unterminated quoted value");
+                return false;
+            }
+            p++;
+        } else {
+            const char* value = p;
+            while (*p && *p != ' ' && *p != '\t')
+                p++;
+            predicate.value.assign(value, p - value);
+        }
+        
+        if (predicate.op == FieldPredicate::Match && predicate.value.empty()) {
+            setError(error, "empty regex for field");
+            return false;
+        }
+        
+        predicates.push_back(predicate);
+        if (predicates.size() > s_maxPredicates) {
+            setError(error, "too many field predicates");
+            return false;
+        }
+    }
+    
+    if (predicates.empty()) {
+        setError(error, "empty field query");
+        return false;
+    }
+    
+    return true;
+}
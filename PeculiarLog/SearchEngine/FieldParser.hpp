@@ -0,0 +1,264 @@
+//
+//  FieldParser.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+struct FieldPredicate {
+    enum Op {
+        Equal,          // key=value
+        NotEqual,       // key!=value, also true if key is missing
+        Match,          // key~regex, regex is matched against value only
+    };
+
+    std::string     key;                // nested JSON keys are joined with '.'
+    std::string     value;
+    Op              op;
+};
+
+class FieldParser {
+
+public:
+    static const uint32_t s_maxPredicates   = 16;
+    static const uint32_t s_maxDepth        = 32;
+    static const uint32_t s_maxPath         = 256;
+
+    // space separated terms, values with spaces can be put in double quotes
+    static bool     parseQuery(const char* query, std::vector<FieldPredicate>& predicates, char* error);
+
+    // lines starting with '{' are JSON objects, any other line is a sequence of key=value pairs,
+    // visitor is called for every scalar value and returns false to stop
+    template<typename Visitor>
+    static void     tokenize(const char* line, uint32_t length, Visitor& visitor);
+
+private:
+
+    template<typename Visitor>
+    struct JSONScanner {
+        const char* end;
+        Visitor&    visitor;
+        char        path[s_maxPath];
+        uint32_t    depth = 0;
+        bool        stop = false;
+
+        const char* value(const char* p, uint32_t pathLength);
+        const char* object(const char* p, uint32_t pathLength);
+        const char* array(const char* p, uint32_t pathLength);
+        const char* string(const char* p);
+        const char* skip(const char* p) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+            return p;
+        }
+    };
+
+    static bool     isKeyChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-';
+    }
+
+    template<typename Visitor>
+    static void     tokenizeKeyValue(const char* line, uint32_t length, Visitor& visitor);
+};
+
+// MARK: - Tokenizer
+
+template<typename Visitor>
+void FieldParser::tokenize(const char* line, uint32_t length, Visitor& visitor)
+{
+    const char* p = line;
+    const char* end = line + length;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    if (p < end && *p == '{') {
+        // malformed JSON is scanned up to the first error
+        JSONScanner<Visitor> scanner = {end, visitor};
+        scanner.object(p, 0);
+    } else {
+        tokenizeKeyValue(p, uint32_t(end - p), visitor);
+    }
+}
+
+template<typename Visitor>
+void FieldParser::tokenizeKeyValue(const char* line, uint32_t length, Visitor& visitor)
+{
+    const char* end = line + length;
+    const char* p = line;
+    while (p < end) {
+        auto eq = (const char*)memchr(p, '=', end - p);
+        if (!eq)
+            return;
+
+        // key is the run of key characters right before '='
+        const char* key = eq;
+        while (key > p && isKeyChar(key[-1]))
+            key--;
+
+        const char* value = eq + 1;
+        const char* next;
+        if (value < end && *value == '"') {
+            value++;
+            next = value;
+            while (next < end && *next != '"') {
+                next += (*next == '\\')? 2 : 1;
+            }
+            if (next > end)
+                next = end;
+        } else {
+            next = value;
+            while (next < end && *next != ' ' && *next != '\t' && *next != '\r')
+                next++;
+        }
+
+        if (key < eq && !visitor(key, uint32_t(eq - key), value, uint32_t(next - value)))
+            return;
+
+        p = (next < end)? next + 1 : end;
+    }
+}
+
+template<typename Visitor>
+const char* FieldParser::JSONScanner<Visitor>::value(const char* p, uint32_t pathLength)
+{
+    p = skip(p);
+    if (p >= end)
+        return nullptr;
+
+    switch (*p) {
+        case '{':
+            return object(p, pathLength);
+        case '[':
+            return array(p, pathLength);
+        case '"': {
+            auto next = string(p);
+            if (next && pathLength < s_maxPath && !visitor(path, pathLength, p + 1, uint32_t(next - p - 2)))
+                stop = true;
+            return (stop)? nullptr : next;
+        }
+        default: {
+            // number, boolean or null
+            auto next = p;
+            while (next < end && *next != ',' && *next != '}' && *next != ']' && *next != ' ' && *next != '\t' && *next != '\r')
+                next++;
+            if (next == p)
+                return nullptr;
+            if (pathLength < s_maxPath && !visitor(path, pathLength, p, uint32_t(next - p)))
+                stop = true;
+            return (stop)? nullptr : next;
+        }
+    }
+}
+
+template<typename Visitor>
+const char* FieldParser::JSONScanner<Visitor>::object(const char* p, uint32_t pathLength)
+{
+    if (++depth > s_maxDepth)
+        return nullptr;
+
+    p = skip(p + 1);
+    if (p < end && *p == '}') {
+        depth--;
+        return p + 1;
+    }
+
+    while (p && p < end) {
+        p = skip(p);
+        if (p >= end || *p != '"')
+            return nullptr;
+
+        auto keyEnd = string(p);
+        if (!keyEnd)
+            return nullptr;
+
+        // append key to the path, values of keys which don't fit are not reported
+        uint32_t keyLength = uint32_t(keyEnd - p - 2);
+        uint32_t length = pathLength + ((pathLength)? 1 : 0) + keyLength;
+        uint32_t childLength = s_maxPath;
+        if (length < s_maxPath) {
+            if (pathLength)
+                path[pathLength] = '.';
+            memcpy(path + length - keyLength, p + 1, keyLength);
+            childLength = length;
+        }
+
+        p = skip(keyEnd);
+        if (p >= end || *p != ':')
+            return nullptr;
+
+        p = value(p + 1, childLength);
+        if (!p)
+            return nullptr;
+
+        p = skip(p);
+        if (p < end && *p == ',') {
+            p++;
+        } else if (p < end && *p == '}') {
+            depth--;
+            return p + 1;
+        } else {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+template<typename Visitor>
+const char* FieldParser::JSONScanner<Visitor>::array(const char* p, uint32_t pathLength)
+{
+    if (++depth > s_maxDepth)
+        return nullptr;
+
+    // elements are reported with the path of the array itself
+    p = skip(p + 1);
+    if (p < end && *p == ']') {
+        depth--;
+        return p + 1;
+    }
+
+    while (p && p < end) {
+        p = value(p, pathLength);
+        if (!p)
+            return nullptr;
+
+        p = skip(p);
+        if (p < end && *p == ',') {
+            p++;
+        } else if (p < end && *p == ']') {
+            depth--;
+            return p + 1;
+        } else {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+template<typename Visitor>
+const char* FieldParser::JSONScanner<Visitor>::string(const char* p)
+{
+    // returns pointer past closing quote, escapes are not decoded
+    p++;
+    while (p < end) {
+        auto quote = (const char*)memchr(p, '"', end - p);
+        if (!quote)
+            return nullptr;
+
+        // quote is escaped if preceded by odd number of backslashes
+        const char* bs = quote;
+        while (bs > p && bs[-1] == '\\')
+            bs--;
+        if ((quote - bs) % 2 == 0)
+            return quote + 1;
+
+        p = quote + 1;
+    }
+    return nullptr;
+}
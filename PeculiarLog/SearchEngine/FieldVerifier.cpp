@@ -0,0 +1,188 @@
+//
+//  FieldVerifier.cpp
+//  PeculiarLog
+//
+
+#include <strings.h>
+
+#include "FieldVerifier.hpp"
+
+#if SE_SUPPORT_HYPERSCAN
+
+std::shared_ptr<FieldVerifier> FieldVerifier::create(const char* query, bool ignoreCase, bool utf8, char* error, std::string& prefilter)
+{
+    std::shared_ptr<FieldVerifier> verifier(new FieldVerifier());
+    verifier->m_ignoreCase = ignoreCase;
+    
+    auto& predicates = verifier->m_predicates;
+    if (!FieldParser::parseQuery(query, predicates, error))
+        return nullptr;
+    
+    // the longest exact value is the most selective literal, otherwise lines must contain one of the keys
+    const FieldPredicate* literal = nullptr;
+    for (uint32_t i = 0; i < predicates.size(); i++) {
+        auto& predicate = predicates[i];
+        if (predicate.op == FieldPredicate::NotEqual) {
+            verifier->m_negativeMask |= 1 << i;
+            continue;
+        }
+        verifier->m_positiveMask |= 1 << i;
+        if (predicate.op == FieldPredicate::Equal && !predicate.value.empty()) {
+            if (!literal || literal->op != FieldPredicate::Equal || literal->value.size() < predicate.value.size())
+                literal = &predicate;
+        } else if (!literal) {
+            literal = &predicate;
+        }
+    }
+    
+    if (!literal) {
+        const char* message = "field query needs '=' or '~' predicate";
+        printf("[!] %s\n", message);
+        if (error)
+            snprintf(error, MAX_ERROR_LENGTH + 1, "%s", message);
+        return nullptr;
+    }
+    
+    // JSON keys are matched by the last path component
+    std::string text = literal->value;
+    if (literal->op != FieldPredicate::Equal || text.empty()) {
+        auto dot = literal->key.rfind('.');
+        text = (dot == std::string::npos)? literal->key : literal->key.substr(dot + 1);
+    }
+    // non-ASCII bytes are kept as is, in UTF-8 mode \x escapes are code points rather than bytes
+    prefilter.clear();
+    for (unsigned char c : text) {
+        if (c >= 0x80) {
+            prefilter += c;
+            continue;
+        }
+        char hex[8];
+        snprintf(hex, sizeof(hex), "\\x%02x", c);
+        prefilter += hex;
+    }
+    
+    // values are matched as a whole buffer, so anchors refer to the value
+    verifier->m_regexDB.resize(predicates.size(), nullptr);
+    for (uint32_t i = 0; i < predicates.size(); i++) {
+        if (predicates[i].op != FieldPredicate::Match)
+            continue;
+        
+        hs_compile_error_t *compile_err;
+        unsigned int flags = HS_FLAG_SINGLEMATCH | HS_FLAG_ALLOWEMPTY | ((ignoreCase)? HS_FLAG_CASELESS : 0) | ((utf8)? HS_FLAG_UTF8 | HS_FLAG_UCP : 0);
+        if (hs_compile(predicates[i].value.c_str(), flags, HS_MODE_BLOCK, nullptr, &verifier->m_regexDB[i], &compile_err) != HS_SUCCESS) {
+            printf("[!] unable to compile field regex: %s\n", compile_err->message);
+            if (error)
+                snprintf(error, MAX_ERROR_LENGTH + 1, "%s", compile_err->message);
+            hs_free_compile_error(compile_err);
+            return nullptr;
+        }
+        
+        size_t size = 0;
+        if (hs_database_size(verifier->m_regexDB[i], &size) == HS_SUCCESS)
+            verifier->m_databaseSize += size;
+        
+        // one scratch fits all field regexes
+        if (hs_alloc_scratch(verifier->m_regexDB[i], &verifier->m_baseScratch) != HS_SUCCESS) {
+            printf("[!] unable to allocate scratch space for field regex\n");
+            return nullptr;
+        }
+    }
+    
+    return verifier;
+}
+
+FieldVerifier::~FieldVerifier()
+{
+    for (int i = 0; i < MAX_BLOCK_COUNT; i++) {
+        if (m_scratch[i])
+            hs_free_scratch(m_scratch[i]);
+    }
+    if (m_baseScratch)
+        hs_free_scratch(m_baseScratch);
+    
+    for (auto db : m_regexDB) {
+        if (db)
+            hs_free_database(db);
+    }
+}
+
+bool FieldVerifier::matchValue(uint32_t slot, uint32_t predicateIdx, const char* value, uint32_t length)
+{
+    auto& predicate = m_predicates[predicateIdx];
+    if (predicate.op != FieldPredicate::Match) {
+        if (length != predicate.value.size())
+            return false;
+        if (m_ignoreCase)
+            return strncasecmp(value, predicate.value.c_str(), length) == 0;
+        return memcmp(value, predicate.value.c_str(), length) == 0;
+    }
+    
+    if (!m_scratch[slot] && hs_clone_scratch(m_baseScratch, &m_scratch[slot]) != HS_SUCCESS)
+        return false;
+    
+    // scan is terminated by the first match
+    auto res = hs_scan(m_regexDB[predicateIdx], value, length, 0, m_scratch[slot],
+        [](unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
+            return 1;
+        }, nullptr);
+    return res == HS_SCAN_TERMINATED;
+}
+
+bool FieldVerifier::match(uint32_t slot, const char* line, uint32_t length)
+{
+    uint32_t found = 0;
+    bool rejected = false;
+    auto visitor = [&](const char* key, uint32_t keyLength, const char* value, uint32_t valueLength) -> bool {
+        for (uint32_t i = 0; i < m_predicates.size(); i++) {
+            auto& predicate = m_predicates[i];
+            if (predicate.key.size() != keyLength || memcmp(predicate.key.data(), key, keyLength) != 0)
+                continue;
+            if (!matchValue(slot, i, value, valueLength))
+                continue;
+            if (m_negativeMask & (1 << i)) {
+                rejected = true;
+                return false;
+            }
+            found |= 1 << i;
+        }
+        // negative predicates need the whole line to be scanned
+        return m_negativeMask || (found & m_positiveMask) != m_positiveMask;
+    };
+    
+    FieldParser::tokenize(line, length, visitor);
+    return !rejected && (found & m_positiveMask) == m_positiveMask;
+}
+
+bool FieldVerifier::locate(const char* line, uint32_t length, uint32_t* offset, uint32_t* matchLength)
+{
+    // value of the first positive predicate found in the line, regexes are not evaluated again
+    bool located = false;
+    auto visitor = [&](const char* key, uint32_t keyLength, const char* value, uint32_t valueLength) -> bool {
+        for (uint32_t i = 0; i < m_predicates.size(); i++) {
+            auto& predicate = m_predicates[i];
+            if (!(m_positiveMask & (1 << i)) || predicate.key.size() != keyLength || memcmp(predicate.key.data(), key, keyLength) != 0)
+                continue;
+            if (predicate.op == FieldPredicate::Equal && !matchValue(0, i, value, valueLength))
+                continue;
+            *offset = uint32_t(value - line);
+            *matchLength = valueLength;
+            located = true;
+            return false;
+        }
+        return true;
+    };
+    
+    FieldParser::tokenize(line, length, visitor);
+    return located;
+}
+
+size_t FieldVerifier::memoryUsage() const
+{
+    size_t size = sizeof(FieldVerifier) + m_databaseSize;
+    for (auto& predicate : m_predicates) {
+        size += predicate.key.capacity() + predicate.value.capacity();
+    }
+    return size;
+}
+
+#endif // SE_SUPPORT_HYPERSCAN
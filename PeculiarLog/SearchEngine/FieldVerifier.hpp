@@ -0,0 +1,54 @@
+//
+//  FieldVerifier.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "SearchEngine.hpp"
+
+#if SE_SUPPORT_HYPERSCAN
+
+#include "hs.h"
+
+#include "LineVerifier.hpp"
+#include "FieldParser.hpp"
+
+// checks field predicates of JSON or key=value lines, field regexes are matched with hyperscan
+class FieldVerifier : public LineVerifier {
+
+public:
+    // prefilter is a pattern every matching line must contain
+    static std::shared_ptr<FieldVerifier> create(const char* query, bool ignoreCase, bool utf8, char* error, std::string& prefilter);
+
+    ~FieldVerifier();
+
+    bool                match(uint32_t slot, const char* line, uint32_t length) override;
+    size_t              memoryUsage() const override;
+    bool                locate(const char* line, uint32_t length, uint32_t* offset, uint32_t* matchLength) override;
+
+private:
+
+    FieldVerifier() {}
+
+    bool                matchValue(uint32_t slot, uint32_t predicateIdx, const char* value, uint32_t length);
+
+private:
+
+    std::vector<FieldPredicate>     m_predicates;
+    std::vector<hs_database_t*>     m_regexDB;          // per predicate, null unless it is a regex
+    bool                            m_ignoreCase = false;
+    uint32_t                        m_positiveMask = 0; // predicates which must be found
+    uint32_t                        m_negativeMask = 0;
+    size_t                          m_databaseSize = 0;
+
+    // scratch is cloned on first use of a block
+    hs_scratch_t*                   m_baseScratch = nullptr;
+    hs_scratch_t*                   m_scratch[MAX_BLOCK_COUNT] = {};
+};
+
+#endif // SE_SUPPORT_HYPERSCAN
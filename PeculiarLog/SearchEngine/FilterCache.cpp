@@ -0,0 +1,138 @@
+//
+//  FilterCache.cpp
+//  PeculiarLog
+//
+
+#include "SearchEngine.hpp"
+
+std::string FilterCacheKey::str() const
+{
+    // pattern goes last so that it can contain any character
+    char prefix[32];
+    char type = (templates)? 't' : (fields)? 'f' : (watchlist)? ((literal)? 'l' : 'w') : 'r';
+    snprintf(prefix, sizeof(prefix), "%08x:%c%u:%c:", flags, (hamming)? 'h' : 'e', distance, type);
+    return std::string(prefix) + pattern;
+}
+
+size_t FilterResult::memoryUsage() const
+{
+    size_t size = sizeof(FilterResult) + databaseSize;
+    if (verifier)
+        size += verifier->memoryUsage();
+    size += grams.memoryUsage();
+    for (int i = 0; i < blockCount; i++) {
+        size += blocks[i].matches.capacity() * sizeof(uint32_t);
+        size += blocks[i].hits.capacity() * sizeof(uint32_t);
+    }
+    for (auto& entry : watchlist) {
+        size += sizeof(std::string) + entry.capacity();
+    }
+    return size;
+}
+
+FilterCache::FilterCache(size_t budget)
+{
+    m_budget = budget;
+}
+
+std::shared_ptr<FilterResult> FilterCache::find(const FilterCacheKey& key)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    auto it = m_index.find(key.str());
+    if (it == m_index.end())
+        return nullptr;
+
+    // move entry to the front of LRU list
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+
+
+    return it->second->result;
+}
+
+void FilterCache::insert(const FilterCacheKey& key, std::shared_ptr<FilterResult> result)
+{
+    if (!result)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    auto str = key.str();
+    auto it = m_index.find(str);
+    if (it != m_index.end()) {
+        // replace existing entry, result size may have changed
+        m_usage -= it->second->size;
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    size_t size = result->memoryUsage() + str.size();
+    m_lru.push_front({str, result, size});
+    m_index[str] = m_lru.begin();
+    m_usage += size;
+
+    evict();
+}
+
+void FilterCache::setBudget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_budget = budget;
+    evict();
+}
+
+size_t FilterCache::getUsage()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    return m_usage;
+}
+
+size_t FilterCache::trim(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // the most recent entry is kept, it's the result currently shown by the engine
+    size_t freed = 0;
+    while (freed < bytes && m_lru.size() > 1) {
+        auto& entry = m_lru.back();
+        freed += entry.size;
+        m_usage -= entry.size;
+        m_index.erase(entry.key);
+        m_lru.pop_back();
+    }
+    return freed;
+}
+
+void FilterCache::forEach(const std::function<void(FilterResult&)>& func)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    for (auto& entry : m_lru) {
+        func(*entry.result);
+        m_usage -= entry.size;
+        entry.size = entry.result->memoryUsage() + entry.key.size();
+        m_usage += entry.size;
+    }
+}
+
+void FilterCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_index.clear();
+    m_lru.clear();
+    m_usage = 0;
+}
+
+void FilterCache::evict()
+{
+    // always keep the most recent entry, even if it doesn't fit the budget
+    while (m_usage > m_budget && m_lru.size() > 1) {
+        auto& entry = m_lru.back();
+        m_usage -= entry.size;
+        m_index.erase(entry.key);
+        m_lru.pop_back();
+    }
+}
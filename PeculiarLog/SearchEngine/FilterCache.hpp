@@ -0,0 +1,85 @@
+//
+//  FilterCache.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "GramIndex.hpp"
+#include "LineVerifier.hpp"
+
+struct FilterCacheKey {
+    std::string     pattern;
+    uint32_t        flags;          // engine specific compile flags
+    uint32_t        distance = 0;   // approximate matching distance
+    bool            hamming = false;
+    bool            fields = false;     // pattern is a field query
+    bool            templates = false;  // pattern is a list of template IDs
+    bool            watchlist = false;  // pattern is a list of entries, one per line
+    bool            literal = false;    // watchlist entries are matched as literals
+
+    std::string     str() const;
+};
+
+struct FilterResult {
+
+    struct Block {
+        std::vector<uint32_t>   matches;            // block relative numbers of matching lines
+        uint32_t                maxLength = 0;      // max length of matching lines
+        bool                    filtered = false;   // block is scanned with the pattern
+        std::vector<uint32_t>   hits;               // watchlist entries found on matching lines, once per line
+    };
+
+    std::shared_ptr<void>   database;           // compiled pattern owned by backend
+    size_t                  databaseSize = 0;
+    std::shared_ptr<LineVerifier> verifier;     // confirms lines found by prefiltering database
+    std::vector<std::string> watchlist;         // entries of watchlist filter, indexed by entry number
+    GramQuery               grams;              // trigrams required by the pattern, empty if any chunk may match
+    bool                    complete = false;   // all blocks are filtered
+    uint32_t                blockCount = 0;
+    Block                   blocks[MAX_BLOCK_COUNT] = {};
+
+    size_t                  memoryUsage() const;
+};
+
+class FilterCache {
+
+public:
+    FilterCache(size_t budget);
+
+    std::shared_ptr<FilterResult>   find(const FilterCacheKey& key);
+    void                            insert(const FilterCacheKey& key, std::shared_ptr<FilterResult> result);
+    void                            setBudget(size_t budget);
+    size_t                          getUsage();
+    // evicts least recent entries until the given amount is freed, returns freed amount
+    size_t                          trim(size_t bytes);
+    // entries are updated in place, sizes are accounted again afterwards
+    void                            forEach(const std::function<void(FilterResult&)>& func);
+    void                            clear();
+
+private:
+
+    void                            evict();
+
+private:
+
+    struct Entry {
+        std::string                     key;
+        std::shared_ptr<FilterResult>   result;
+        size_t                          size;
+    };
+
+    std::mutex                                                      m_lock;
+    std::list<Entry>                                                m_lru;  // most recent first
+    std::unordered_map<std::string, std::list<Entry>::iterator>     m_index;
+    size_t                                                          m_budget = 0;
+    size_t                                                          m_usage = 0;
+};
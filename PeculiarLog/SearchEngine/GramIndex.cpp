@@ -0,0 +1,352 @@
+//
+//  GramIndex.cpp
+//  PeculiarLog
+//
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "GramIndex.hpp"
+
+uint8_t GramIndex::fold(uint8_t c)
+{
+    return c | (uint8_t(c - 'A') < 26) << 5;
+}
+
+uint32_t GramIndex::gramBit(uint8_t a, uint8_t b, uint8_t c)
+{
+    uint32_t gram = (fold(a) << 16) | (fold(b) << 8) | fold(c);
+    return (gram * 0x9e3779b1u) >> 16;
+}
+
+void GramIndex::build(const char* data, uint64_t size, uint64_t* bitmap)
+{
+    if (size < 3)
+        return;
+
+    // trigram rolls over the data, trigrams crossing line ends are set too and only cost a few bits
+    auto bytes = (const uint8_t*)data;
+    uint32_t gram = (fold(bytes[0]) << 8) | fold(bytes[1]);
+    for (uint64_t i = 2; i < size; i++) {
+        gram = ((gram << 8) | fold(bytes[i])) & 0xffffff;
+        uint32_t bit = (gram * 0x9e3779b1u) >> 16;
+        bitmap[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+void GramQuery::addPattern(const std::string& pattern, bool caseless)
+{
+    m_caseless |= caseless;
+
+    // quoted sequences may contain anything, so they aren't parsed
+    std::vector<Literals> alternatives;
+    if (pattern.find("\\Q") != std::string::npos ||
+        !parseAlternatives(pattern.data(), pattern.data() + pattern.size(), alternatives)) {
+        m_any = true;
+        return;
+    }
+
+    for (auto& literals : alternatives) {
+        addAlternative(literals, caseless);
+    }
+}
+
+void GramQuery::addLiteral(const std::string& literal, bool caseless)
+{
+    m_caseless |= caseless;
+    addAlternative(Literals(1, literal), caseless);
+}
+
+void GramQuery::addAlternative(const Literals& literals, bool caseless)
+{
+    std::vector<uint32_t> bits;
+    for (auto& literal : literals) {
+        auto bytes = (const uint8_t*)literal.data();
+        for (size_t i = 0; i + 2 < literal.size(); i++) {
+            // caseless non-ASCII characters may match ASCII ones, e.g. KELVIN SIGN matches 'k'
+            if (caseless && ((bytes[i] | bytes[i + 1] | bytes[i + 2]) & 0x80))
+                continue;
+            bits.push_back(GramIndex::gramBit(bytes[i], bytes[i + 1], bytes[i + 2]));
+        }
+    }
+
+    if (bits.empty()) {
+        m_any = true;
+        return;
+    }
+
+    std::sort(bits.begin(), bits.end());
+    bits.erase(std::unique(bits.begin(), bits.end()), bits.end());
+    m_alternatives.push_back(std::move(bits));
+}
+
+bool GramQuery::mayMatch(const uint64_t* bitmap) const
+{
+    for (auto& bits : m_alternatives) {
+        bool found = true;
+        for (auto bit : bits) {
+            if (!((bitmap[bit >> 6] >> (bit & 63)) & 1)) {
+                found = false;
+                break;
+            }
+        }
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+size_t GramQuery::memoryUsage() const
+{
+    size_t size = sizeof(GramQuery);
+    for (auto& bits : m_alternatives) {
+        size += sizeof(bits) + bits.capacity() * sizeof(uint32_t);
+    }
+    return size;
+}
+
+bool GramQuery::parseAlternatives(const char* p, const char* end, std::vector<Literals>& alternatives)
+{
+    // top level alternatives are split first, groups and classes are skipped as a whole
+    const char* start = p;
+    while (p < end) {
+        if (*p == '\\') {
+            if (p + 1 >= end)
+                return false;
+            p += 2;
+        } else if (*p == '[') {
+            p = skipClass(p, end);
+            if (!p)
+                return false;
+        } else if (*p == '(') {
+            p = skipGroup(p, end);
+            if (!p)
+                return false;
+            p++;
+        } else if (*p == '|') {
+            alternatives.emplace_back();
+            if (!parseSequence(start, p, alternatives.back()))
+                return false;
+            start = ++p;
+        } else {
+            p++;
+        }
+    }
+
+    alternatives.emplace_back();
+    return parseSequence(start, end, alternatives.back());
+}
+
+bool GramQuery::parseSequence(const char* p, const char* end, Literals& literals)
+{
+    // consecutive literal characters which are not optional make a run, anything else ends it
+    std::string run;
+    auto flush = [&]() {
+        if (run.size() >= 3)
+            literals.push_back(run);
+        run.clear();
+    };
+
+    while (p < end) {
+        int literal = -1;
+        Literals inner;
+        bool innerRequired = false;
+        uint32_t min = 0;
+
+        char c = *p;
+        if (c == '\\') {
+            if (p + 1 >= end)
+                return false;
+            uint8_t e = p[1];
+            p += 2;
+            if (isdigit(e)) {
+                // back reference or octal code
+                while (p < end && isdigit(uint8_t(*p)))
+                    p++;
+            } else if (isalpha(e)) {
+                // escapes with arguments like \x{...} or \p{...} aren't followed any further
+                if (!strchr("dDwWsSbBhHvVRXAzZntrfea", e))
+                    return false;
+            } else {
+                literal = e;
+            }
+        } else if (c == '[') {
+            p = skipClass(p, end);
+            if (!p)
+                return false;
+        } else if (c == '(') {
+            const char* close = skipGroup(p, end);
+            if (!close)
+                return false;
+            const char* body = p + 1;
+            bool descend = true;
+            if (body < close && *body == '*')
+                return false;   // verbs like (*UTF) or (*CR)
+            if (body < close && *body == '?') {
+                // lookarounds, named and atomic groups are not looked into, option settings
+                // like (?i) change the rest of the pattern, so nothing is required then
+                if (body + 1 < close && body[1] == ':')
+                    body += 2;
+                else if (body + 1 < close && strchr("=!<>|#'P", body[1]))
+                    descend = false;
+                else
+                    return false;
+            }
+            if (descend) {
+                std::vector<Literals> alternatives;
+                if (!parseAlternatives(body, close, alternatives))
+                    return false;
+                if (alternatives.size() == 1) {
+                    inner = std::move(alternatives[0]);
+                    innerRequired = true;
+                }
+            }
+            p = close + 1;
+        } else if (c == ')' || c == '*' || c == '+' || c == '?') {
+            return false;       // unbalanced group or quantifier without atom, reported by the engine
+        } else if (c == '{' && parseQuantifier(p, end, &min)) {
+            return false;
+        } else if (c == '.' || c == '^' || c == '$') {
+            p++;
+        } else {
+            literal = uint8_t(c);
+            p++;
+        }
+
+        bool optional = false;
+        bool repeated = false;
+        if (p < end) {
+            const char* next = nullptr;
+            if (*p == '?' || *p == '*') {
+                optional = true;
+                p++;
+            } else if (*p == '+') {
+                repeated = true;
+                p++;
+            } else if (*p == '{' && (next = parseQuantifier(p, end, &min))) {
+                optional = (min == 0);
+                repeated = !optional;
+                p = next;
+            }
+            // lazy and possessive quantifiers
+            if ((optional || repeated) && p < end && (*p == '?' || *p == '+'))
+                p++;
+        }
+
+        if (literal >= 0 && !optional) {
+            run += char(literal);
+            if (repeated)
+                flush();
+            continue;
+        }
+
+        // quantifier of UTF-8 pattern applies to the whole character, not to its last byte
+        if (literal >= 0x80) {
+            while (!run.empty() && (uint8_t(run.back()) & 0x80))
+                run.pop_back();
+        }
+        flush();
+        if (innerRequired && !optional)
+            literals.insert(literals.end(), inner.begin(), inner.end());
+    }
+
+    flush();
+    return true;
+}
+
+const char* GramQuery::skipClass(const char* p, const char* end)
+{
+    // closing bracket right after the opening one is a member of the class
+    p++;
+    if (p < end && *p == '^')
+        p++;
+    if (p < end && *p == ']')
+        p++;
+
+    while (p < end) {
+        if (*p == '\\') {
+            if (p + 1 >= end)
+                return nullptr;
+            p += 2;
+        } else if (*p == '[' && p + 1 < end && strchr(":.=", p[1])) {
+            // POSIX class like [:alpha:]
+            const char* q = p + 2;
+            while (q + 1 < end && !(q[0] == p[1] && q[1] == ']'))
+                q++;
+            if (q + 1 >= end)
+                return nullptr;
+            p = q + 2;
+        } else if (*p == ']') {
+            return p + 1;
+        } else {
+            p++;
+        }
+    }
+    return nullptr;
+}
+
+const char* GramQuery::skipGroup(const char* p, const char* end)
+{
+    int depth = 0;
+    while (p < end) {
+        if (*p == '\\') {
+            if (p + 1 >= end)
+                return nullptr;
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skipClass(p, end);
+            if (!p)
+                return nullptr;
+            continue;
+        }
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
+        p++;
+    }
+    return nullptr;
+}
+
+const char* GramQuery::parseQuantifier(const char* p, const char* end, uint32_t* min)
+{
+    // {n}, {n,}, {n,m} and {,m}, spaces are allowed by newer PCRE2, anything else is a literal brace
+    auto spaces = [&](const char* q) {
+        while (q < end && (*q == ' ' || *q == '\t'))
+            q++;
+        return q;
+    };
+
+    const char* q = spaces(p + 1);
+    bool digits = false;
+    uint32_t value = 0;
+    while (q < end && isdigit(uint8_t(*q))) {
+        value = std::min<uint32_t>(value * 10 + (*q - '0'), 1000000);
+        digits = true;
+        q++;
+    }
+    q = spaces(q);
+    if (q < end && *q == ',') {
+        q = spaces(q + 1);
+        bool maxDigits = false;
+        while (q < end && isdigit(uint8_t(*q))) {
+            maxDigits = true;
+            q++;
+        }
+        if (!digits && !maxDigits)
+            return nullptr;
+        q = spaces(q);
+    } else if (!digits) {
+        return nullptr;
+    }
+
+    if (q >= end || *q != '}')
+        return nullptr;
+
+    *min = value;
+    return q + 1;
+}
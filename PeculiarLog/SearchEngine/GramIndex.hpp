@@ -0,0 +1,62 @@
+//
+//  GramIndex.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// trigrams of a filter chunk hashed to a bitmap, ASCII letters are folded to lower case,
+// so the same bitmap rules out chunks for patterns matched with and without case
+class GramIndex {
+
+public:
+    static const uint32_t   s_bitmapWords = 1024;   // 64K bits, 8 KB per chunk of 4 MB
+
+    // bits of all trigrams of data are set, bitmap is expected to be cleared by the caller
+    static void             build(const char* data, uint64_t size, uint64_t* bitmap);
+    static uint32_t         gramBit(uint8_t a, uint8_t b, uint8_t c);
+    static uint8_t          fold(uint8_t c);
+};
+
+// trigrams every match of a pattern contains, taken from literals the pattern can't match without,
+// a match needs all trigrams of at least one alternative, so a chunk missing one of every alternative
+// can't have a match
+class GramQuery {
+
+public:
+    // regex syntax of hyperscan and PCRE2, parts the parser isn't sure about don't require anything
+    void                    addPattern(const std::string& pattern, bool caseless);
+    void                    addLiteral(const std::string& literal, bool caseless);
+
+    // nothing is ruled out, every chunk has to be scanned
+    bool                    empty() const { return m_any || m_alternatives.empty(); }
+    // caseless patterns can match non-ASCII text with ASCII letters, e.g. 'k' matches KELVIN SIGN,
+    // so their trigrams rule out chunks of ASCII blocks only
+    bool                    caseless() const { return m_caseless; }
+    bool                    mayMatch(const uint64_t* bitmap) const;
+    size_t                  memoryUsage() const;
+
+private:
+
+    typedef std::vector<std::string> Literals;
+
+    void                    addAlternative(const Literals& literals, bool caseless);
+
+    static bool             parseAlternatives(const char* p, const char* end, std::vector<Literals>& alternatives);
+    static bool             parseSequence(const char* p, const char* end, Literals& literals);
+    static const char*      skipClass(const char* p, const char* end);
+    static const char*      skipGroup(const char* p, const char* end);
+    static const char*      parseQuantifier(const char* p, const char* end, uint32_t* min);
+
+private:
+
+    std::vector<std::vector<uint32_t>>  m_alternatives;     // bit numbers of required trigrams
+    bool                                m_any = false;      // some alternative requires no trigram
+    bool                                m_caseless = false;
+};
@@ -7,15 +7,21 @@
 //
 
 #include <algorithm>
+#include <fstream>
 #include <functional>
+#include <sstream>
 #include "HyperscanEngine.hpp"
+#include "PcreVerifier.hpp"
+#include "FieldVerifier.hpp"
+#include "RegexExtractor.hpp"
+#include "UTF8Validator.hpp"
 
-#define DEBUG_BLOCKS    0
-#define DEBUG_GETLINE   0
-#define DEBUG_GETROW    0
+#if SE_SUPPORT_HYPERSCAN
 
 static const unsigned int SE_HS_EOL_ID      = 0x5EE0;
+static const unsigned int SE_HS_HEADER_ID   = 0x5EE1;
 static const unsigned int SE_HS_PATTERN_ID  = 0x5EAA;
+static const unsigned int SE_HS_WATCH_ID    = 0x10000;  // watchlist entry N gets SE_HS_WATCH_ID + N, clear of EOL ID
 unsigned int HyperscanEngine::s_filterIDs[2] = {
     SE_HS_EOL_ID,
     SE_HS_PATTERN_ID,
@@ -32,6 +38,42 @@ hs_error_t HS_CDECL hs_scan(const hs_database_t *db, const char *data, unsigned
     return hs_scan(db, data, length, flags, scratch, closure, &func);
 }
 
+static std::atomic<size_t> s_workerScratchSize {0};
+
+struct WorkerScratch {
+    hs_scratch_t*   scratch = nullptr;
+    size_t          size = 0;
+    
+    ~WorkerScratch() {
+        if (scratch)
+            hs_free_scratch(scratch);
+        s_workerScratchSize -= size;
+    }
+};
+
+hs_scratch_t* HyperscanEngine::workerScratch(const hs_database_t* db)
+{
+    static thread_local WorkerScratch worker;
+    
+    // scratch is reallocated only if current one is too small for the database
+    if (hs_alloc_scratch(db, &worker.scratch) != HS_SUCCESS) {
+        printf("[!] unable to allocate scratch space\n");
+        return nullptr;
+    }
+    
+    size_t size = 0;
+    if (hs_scratch_size(worker.scratch, &size) == HS_SUCCESS && size != worker.size) {
+        s_workerScratchSize += size - worker.size;
+        worker.size = size;
+    }
+    return worker.scratch;
+}
+
+size_t HyperscanEngine::workerScratchSize()
+{
+    return s_workerScratchSize.load(std::memory_order_relaxed);
+}
+
 HyperscanEngine::HyperscanEngine() {}
 HyperscanEngine::~HyperscanEngine() {}
 
@@ -47,33 +89,24 @@ SearchEngineError HyperscanEngine::init(const char* file)
     
     hs_compile_error_t *compile_err;
     m_eolDB = nullptr;
-    if (hs_compile_lit(s_eolPattern, 0, strlen(s_eolPattern), HS_MODE_BLOCK, &pi, &m_eolDB, &compile_err) != HS_SUCCESS) {
+    if (!m_recordHeader.empty()) {
+        // header is anchored at line start and found by the same scan which counts lines
+        std::string header = "^(?:" + m_recordHeader + ")";
+        const char* patterns[2] = {s_eolPattern, header.c_str()};
+        unsigned int flags[2] = {HS_FLAG_DOTALL, HS_FLAG_MULTILINE};
+        unsigned int ids[2] = {SE_HS_EOL_ID, SE_HS_HEADER_ID};
+        if (hs_compile_multi(patterns, flags, ids, 2, HS_MODE_BLOCK, &pi, &m_eolDB, &compile_err) != HS_SUCCESS) {
+            printf("[!] unable to compile record header: %s\n", compile_err->message);
+            hs_free_compile_error(compile_err);
+            return BadArgument;
+        }
+    } else if (hs_compile_lit(s_eolPattern, 0, strlen(s_eolPattern), HS_MODE_BLOCK, &pi, &m_eolDB, &compile_err) != HS_SUCCESS) {
         printf("[!] unable to compile EOL pattern: %s\n", compile_err->message);
         hs_free_compile_error(compile_err);
         return UnknownError;
     }
     
-    m_baseScratch = nullptr;
-    auto res = hs_alloc_scratch(m_eolDB, &m_baseScratch);
-    if (res != HS_SUCCESS) {
-        printf("[!] unable to allocate scratch space for EOL\n");
-        hs_free_database(m_eolDB);
-        m_eolDB = nullptr;
-        return UnknownError;
-    }
-    
     m_patternDB = nullptr;
-    m_filterScratch = nullptr;
-    for (int block=0; block < MAX_BLOCK_COUNT; block++) {
-        m_scratchPool[block] = nullptr;
-    }
-    
-    m_predictedAbsLineNum = -1;
-    m_predictedLinePos = -1;
-    m_predictedLineNum = -1;
-    m_recentBlock = -1;
-    m_recentLineOffset = 0;
-    m_recentAbsLineOffset = 0;
     
     return err;
 }
@@ -89,60 +122,97 @@ SearchEngineError HyperscanEngine::fetch(uint32_t blockIdx, SEBlockInfo* info)
     if (!m_blocks[blockIdx].active)
         return BadArgument;
     
-    hs_clone_scratch(m_baseScratch, &m_scratchPool[blockIdx]);
+    // line index and block info are known from sidecar index
+    if (restoreBlock(blockIdx, info))
+        return NoError;
+    
+    auto scratch = workerScratch(m_eolDB);
+    if (!scratch)
+        return EngineOpFailed;
     
     uint64_t pos = m_blocks[blockIdx].byteOffset;
     uint64_t size = m_blocks[blockIdx].size;
+    
+    auto& lineIndex = m_blocks[blockIdx].lineIndex;
+    lineIndex.clear();
+    lineIndex.push_back(pos);
+    auto& records = m_blocks[blockIdx].records;
+    records.clear();
 
+    // block is scanned in pieces split at line starts, so that bounded memory mode
+    // can release pages behind the scan and multibyte sequences never cross pieces
+    ScanProbe probe;
     uint64_t lastHit = 0;
-    auto res = hs_scan(m_eolDB, m_mem + pos, (unsigned int)size, 0, m_scratchPool[blockIdx],
-        [&, &lines = info->lines, &maxLength = info->maxLength]
-        (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-            // for every EOL update max length and increment match line counter
-            if ((to - lastHit - 1) > maxLength) {
-                maxLength = uint32_t(to - lastHit - 1);
+    uint64_t end = pos + size;
+    info->encoding = ASCIIEncoding;
+    const uint64_t pieceSize = s_filterChunkSize;
+    prefetchRange(pos, std::min(pieceSize, size));
+    for (uint64_t piece = pos; piece < end; ) {
+        uint64_t pieceEnd = lineStartAfter(std::min(piece + pieceSize, end), end);
+        prefetchRange(pieceEnd, std::min(pieceSize, end - pieceEnd));
+        
+        uint64_t base = piece - pos;
+        uint32_t pieceLines = info->lines;
+        auto res = hs_scan(m_eolDB, m_mem + piece, (unsigned int)(pieceEnd - piece), 0, scratch,
+            [&, &lines = info->lines, &maxLength = info->maxLength]
+            (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
+                // header is reported before EOL of its line, possibly more than once
+                if (id == SE_HS_HEADER_ID) {
+                    if (records.empty() || records.back() != lines)
+                        records.push_back(lines);
+                    return 0;
+                }
+                // for every EOL update max length and increment match line counter
+                to += base;
+                if ((to - lastHit - 1) > maxLength) {
+                    maxLength = uint32_t(to - lastHit - 1);
+                }
+                lastHit = to;
+                lines++;
+                // index every s_lineIndexStride line start
+                if (lines % s_lineIndexStride == 0) {
+                    lineIndex.push_back(pos + to);
+                }
+                return 0;
             }
-            lastHit = to;
-            lines++;
-            return 0;
+        );
+        
+        if (res != HS_SUCCESS) {
+            printf("[!] unable to fetch lines\n");
+            return EngineOpFailed;
         }
-    );
-    
-    if (res != HS_SUCCESS) {
-        printf("[!] unable to fetch lines\n");
-        return EngineOpFailed;
+        
+        auto encoding = UTF8Validator::validate(m_mem + piece, pieceEnd - piece);
+        if (encoding == InvalidUTF8Encoding || info->encoding == ASCIIEncoding)
+            info->encoding = encoding;
+        
+        scannedRange(piece, pieceEnd - piece);
+        m_stats.fetchProgress.add(blockIdx, pieceEnd - piece, info->lines - pieceLines, 0);
+        piece = pieceEnd;
     }
 
     m_blocks[blockIdx].lines = info->lines;
+    info->records = uint32_t(records.size());
     
-#if DEBUG_BLOCKS
-    printf("[#] fetch block %2d ready (%d lines, %d cols)\n", blockIdx, info->lines, info->maxLength);
-#endif
+    if (info->encoding == InvalidUTF8Encoding)
+        printf("[!] block %d is not valid UTF-8, patterns are matched as bytes\n", blockIdx);
+    m_blocks[blockIdx].encoding = info->encoding;
+    m_blocks[blockIdx].maxLength = info->maxLength;
+    
+    probe.finish(m_stats.fetch[blockIdx], size, info->lines, 0);
+    blockFetched(blockIdx);
     
     return NoError;
 }
 
 void HyperscanEngine::close()
 {
-    for (int i=0; i < MAX_BLOCK_COUNT; i++) {
-        if (m_scratchPool[i])
-            hs_free_scratch(m_scratchPool[i]);
-    }
+    // running tasks may use pattern databases freed below
+    stopAsync();
     
-    if (m_filterScratch) {
-        hs_free_scratch(m_filterScratch);
-        m_filterScratch = nullptr;
-    }
-    
-    if (m_baseScratch) {
-        hs_free_scratch(m_baseScratch);
-        m_baseScratch = nullptr;
-    }
-
-    if (m_patternDB) {
-        hs_free_database(m_patternDB);
-        m_patternDB = nullptr;
-    }
+    // pattern database and verifier are owned by filter result
+    m_patternDB = nullptr;
+    m_verifier = nullptr;
     
     if (m_eolDB) {
         hs_free_database(m_eolDB);
@@ -152,759 +222,313 @@ void HyperscanEngine::close()
     SearchEngine::close();
 }
 
-SearchEngineError HyperscanEngine::getLine(uint32_t number, SELineInfo* lineInfo)
+SearchEngineError HyperscanEngine::getStats(SEStats* stats)
 {
-    if (!lineInfo)
-        return BadArgument;
+    auto err = SearchEngine::getStats(stats);
+    if (err != NoError)
+        return err;
     
-    if (! m_filtered) {
-        
-        int blockIdx = 0;
-        uint32_t lineOffset = 0;
-        if (number > m_recentLineOffset) {
-            blockIdx = m_recentBlock;
-            lineOffset = m_recentLineOffset;
-        } else {
-            lineOffset = m_blocks[blockIdx].lines;
-        }
-        
-        uint32_t currentLine = 0;
-        while (number >= lineOffset) {
-            currentLine = lineOffset;
-            lineOffset += m_blocks[++blockIdx].lines;
-        }
-        
-        if (blockIdx != m_recentBlock) {
-            m_predictedAbsLineNum = -1;
-            m_predictedLineNum = -1;
-            m_predictedLinePos = -1;
-        }
-        
-        uint64_t basePos = m_blocks[blockIdx].byteOffset;
-        uint64_t pos = basePos;
-        if (number == m_predictedLineNum) {
-            currentLine = m_predictedLineNum;
-            pos = m_predictedLinePos;
-        }
-
-        uint64_t scanSize = m_blocks[blockIdx].size - (pos - basePos);
-
-        uint64_t lastHit = 0;
-        auto res = hs_scan(m_eolDB, m_mem + pos, (unsigned int)scanSize, 0, m_baseScratch,
-            [&, &length = lineInfo->length]
-            (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                // get line length and return when line counter matches target number
-                if (currentLine == number) {
-                    length = uint32_t(to - lastHit - 1);
-                    return 1;
-                }
-                lastHit = uint32_t(to);
-                currentLine++;
-                return 0;
-            }
-        );
-        
-        if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-            printf("[!] unable to find line %d\n", number);
-            return UnknownError;
-        }
-
-        lineInfo->line = m_mem + pos + lastHit;
-        lineInfo->number = number;
-        lineInfo->scope = false;
-        m_predictedLinePos = pos + lastHit + lineInfo->length + 1;
-        m_predictedLineNum = number + 1;
-        m_recentBlock = blockIdx;
-        m_recentLineOffset = lineOffset;
-        
-        lineInfo->number++; // correct display line number (starting from 1)
-        
-        // skip \r at the end of the line if exists
-        if (lineInfo->length && lineInfo->line[lineInfo->length-1] == '\r')
-            lineInfo->length--;
-    } else {
-        int blockIdx = 0;
-
-        lineInfo->number = 0;
-        uint32_t lineOffset = 0;
-        uint32_t absLineOffset = 0;
-        if (number > m_recentLineOffset) {
-            blockIdx = m_recentBlock;
-            lineOffset = m_recentLineOffset;
-            absLineOffset = m_recentAbsLineOffset;
-        } else {
-            lineOffset = m_blocks[blockIdx].filteredLines + m_blocks[blockIdx].lendedHeadLines + m_blocks[blockIdx].lendedTailLines;
-            absLineOffset = m_blocks[blockIdx].lines;
-        }
-        
-        uint32_t currentLine = 0;
-        while (number >= lineOffset) {
-            currentLine = lineOffset;
-            lineInfo->number = absLineOffset;
-            blockIdx++;
-            lineOffset += m_blocks[blockIdx].filteredLines + m_blocks[blockIdx].lendedHeadLines + m_blocks[blockIdx].lendedTailLines;
-            absLineOffset += m_blocks[blockIdx].lines;
-        }
-        
-        uint32_t baseLine = currentLine;
-        if (blockIdx != m_recentBlock) {
-        #if DEBUG_GETLINE
-            printf("[#] unexpected block %d (expected %d)\n", blockIdx, m_recentBlock);
-        #endif
-            m_beforeTracker[blockIdx].reset();
-            m_afterTracker[blockIdx].reset();
-            m_predictedAbsLineNum = -1;
-            m_predictedLineNum = -1;
-            m_predictedLinePos = -1;
-        }
-        
-        uint64_t basePos = m_blocks[blockIdx].byteOffset;
-        uint64_t searchPos = basePos;
-        if (number != m_predictedLineNum) {
-        #if DEBUG_GETLINE
-            printf("[#] unexpected line %d (expected %d)\n", number, m_predictedLineNum);
-        #endif
-            m_beforeTracker[blockIdx].reset();
-            m_afterTracker[blockIdx].reset();
-            m_predictedAbsLineNum = -1;
-            m_predictedLineNum = -1;
-            m_predictedLinePos = -1;
-        } else {
-            lineInfo->number = m_predictedAbsLineNum;
-            currentLine = m_predictedLineNum;
-            searchPos = m_predictedLinePos;
-        }
-        uint64_t scanSize = m_blocks[blockIdx].size - (searchPos - basePos);
-        
-        uint64_t lastHit = 0;
-        bool patternMatch = false;
-        
-    #if DEBUG_GETLINE
-        printf("[#] get line %d for block %2d starting with line %d at offset %lld\n", number, blockIdx, currentLine, searchPos);
-    #endif
-        
-        if (m_scopeBefore || m_scopeAfter) {
-            // advanced search with scope support
-            auto btracker = &m_beforeTracker[blockIdx];
-            auto atracker = &m_afterTracker[blockIdx];
-
-            if (m_blocks[blockIdx].filteredLines) {
-                
-                bool lineFound = false;
-                uint32_t lendedTailLines = m_blocks[blockIdx].lendedTailLines;
-                uint32_t lendedHeadLines = m_blocks[blockIdx].lendedHeadLines;
-                if (btracker->hasBaseLine()) {
-                    // return line from 'before' scope including base line
-                    if (! btracker->isEmpty()) {
-                        __unused auto topLine = btracker->getTopScopeLine();
-                        assert(currentLine == topLine);
-                        // search offset points to the right line, pop scope line
-                        __unused auto curPos = btracker->popScope(lineInfo->length);
-                        assert(curPos == searchPos);
-                        lineInfo->scope = true;
-                        lineFound = true;
-                    } else {
-                        __unused auto topLine = btracker->getTopScopeLine();
-                        assert(currentLine == topLine);
-                        // search offset points to the right line, pop base line
-                        __unused auto curPos = btracker->popBaseLine(lineInfo->length);
-                        assert(curPos == searchPos);
-                        lineInfo->scope = false;
-                        lineFound = true;
-
-                        // reset 'before' tracker if we reached match line
-                        btracker->reset();
-                    }
-                } else if (currentLine > lineOffset - lendedHeadLines) {
-                    if (btracker->getCount()) {
-                        uint64_t curPos = btracker->popScope(lineInfo->length);
-                        assert(curPos != -1);
-                        
-                        lastHit = curPos - searchPos;
-                        lineInfo->scope = true;
-                        lineFound = true;
-                    }
-                }
-
-                if (!lineFound) {
-                    // search filtered line with scope
-                    auto res = hs_scan(m_patternDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_filterScratch,
-                        [&, &btracker = btracker, &atracker = atracker, &absNumber = lineInfo->number, &length = lineInfo->length, &isScope = lineInfo->scope]
-                        (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                            if (id == SE_HS_EOL_ID) {
-                                // for every EOL match check if we have pattern match within this line
-                                // in this case get line length and return when line counter matches target number
-                                if (patternMatch) {
-                                    uint32_t scopeBaseLine = currentLine + btracker->getCount();
-                                    
-                                    // setup scope trackers
-                                    atracker->reset();
-                                    atracker->pushBaseLine(scopeBaseLine, lastHit + searchPos, uint32_t(to - lastHit - 1));
-                                    btracker->pushBaseLine(scopeBaseLine, lastHit + searchPos, uint32_t(to - lastHit - 1));
-
-                                    // return line from 'before' scope
-                                    if (btracker->getCount()) {
-                                        absNumber -= btracker->getCount();
-                                        uint64_t curPos = btracker->popScope(length);
-                                        while(curPos != -1) {
-                                            if (currentLine == number) {
-                                                lastHit = curPos - searchPos;
-                                                isScope = true;
-                                                return 1;
-                                            }
-                                            curPos = btracker->popScope(length);
-                                            currentLine++;
-                                            absNumber++;
-                                        }
-                                    }
-                                    
-                                    // reset 'before' tracker if we reached match line
-                                    btracker->reset();
-
-                                    // check if we reached desired pattern match
-                                    if (currentLine == number) {
-                                        length = uint32_t(to - lastHit - 1);
-                                        isScope = false;
-                                        return 1;
-                                    }
-                                    currentLine++;
-                                } else {
-                                    uint32_t len = uint32_t(to - lastHit - 1);
-                                    
-                                    // keep tracking scope lines
-                                    
-                                    if (atracker->hasBaseLine()) {
-                                        if (!atracker->isFull()) {
-                                            // return line from 'after' scope
-                                            atracker->pushScope(lastHit + searchPos, len);
-                                            if (currentLine == number) {
-                                                length = len;
-                                                isScope = true;
-                                                return 1;
-                                            }
-                                            currentLine++;
-                                        } else {
-                                            btracker->pushScope(lastHit + searchPos, len);
-                                        }
-                                    } else if (currentLine < baseLine + lendedTailLines) {
-                                        if (currentLine == number) {
-                                            length = uint32_t(to - lastHit - 1);
-                                            isScope = true;
-                                            return 1;
-                                        }
-                                        currentLine++;
-                                    } else {
-                                        btracker->pushScope(lastHit + searchPos, len);
-                                    }
-                                }
-                                // save pointer to the next line, reset pattern match flag
-                                lastHit = to;
-                                absNumber++;
-                                patternMatch = false;
-                            } else if (id == SE_HS_PATTERN_ID) {
-                                // for every pattern match within the line set flag
-                                patternMatch = true;
-                            }
-                            return 0;
-                        }
-                    );
-                    if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-                        printf("[!] unable to find filtered line %d with scope\n", number);
-                        return UnknownError;
-                    }
-
-                    // borrow for head search should reach the end of block
-                    if (lendedHeadLines && res == HS_SUCCESS) {
-                        if (btracker->getCount()) {
-                            // align scope with lended lines
-                            btracker->dropScope(btracker->getCount() - lendedHeadLines);
-                            // correct abs line number
-                            lineInfo->number -= btracker->getCount();
-                            // return line from 'before' scope
-                            uint64_t curPos = btracker->popScope(lineInfo->length);
-                            while((currentLine != number) && (curPos != -1)) {
-                                curPos = btracker->popScope(lineInfo->length);
-                                currentLine++;
-                                lineInfo->number++;
-                            }
-                            assert(curPos != -1);
-                            
-                            lastHit = curPos - searchPos;
-                            lineInfo->scope = true;
-                        }
-                    }
-                }
-            } else {
-                // search borrowed line with scope in the block without matches
-                bool lineFound = false;
-                uint32_t lendedTailLines = m_blocks[blockIdx].lendedTailLines;
-                uint32_t lendedHeadLines = m_blocks[blockIdx].lendedHeadLines;
-                
-                if (currentLine > lineOffset - lendedHeadLines) {
-                    if (btracker->getCount()) {
-                        uint64_t curPos = btracker->popScope(lineInfo->length);
-                        assert(curPos != -1);
-                        
-                        lastHit = curPos - searchPos;
-                        lineInfo->scope = true;
-                        lineFound = true;
-                    }
-                }
-                
-                if (!lineFound) {
-                    auto res = hs_scan(m_eolDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_baseScratch,
-                        [&, &absNumber = lineInfo->number, &length = lineInfo->length, &isScope = lineInfo->scope]
-                        (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                            uint32_t len = uint32_t(to - lastHit - 1);
-                            if (currentLine < baseLine + lendedTailLines) {
-                                // return lines for the tail of previous block
-                                if (currentLine == number) {
-                                    length = len;
-                                    isScope = true;
-                                    return 1;
-                                }
-                                currentLine++;
-                            }
-                            if (lendedHeadLines) {
-                                // borrow lines to the head of next block
-                                btracker->pushScope(lastHit + searchPos, len);
-                            }
-                            lastHit = to;
-                            absNumber++;
-                            return 0;
-                        }
-                    );
-                    if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-                        printf("[!] unable to find borrowed line %d with scope\n", number);
-                        return UnknownError;
-                    }
-                    
-                    // borrow head search should reach the end of block
-                    if (lendedHeadLines && res == HS_SUCCESS) {
-                        if (btracker->getCount()) {
-                            // align scope with lended lines
-                            btracker->dropScope(btracker->getCount() - lendedHeadLines);
-                            // correct abs line number
-                            lineInfo->number -= btracker->getCount();
-                            // return line from 'before' scope
-                            uint64_t curPos = btracker->popScope(lineInfo->length);
-                            while((currentLine != number) && (curPos != -1)) {
-                                curPos = btracker->popScope(lineInfo->length);
-                                currentLine++;
-                                lineInfo->number++;
-                            }
-                            assert(curPos != -1);
-                            
-                            lastHit = curPos - searchPos;
-                            lineInfo->scope = true;
-                        }
-                    }
-                }
-            }
-        } else {
-            // optimized search without scope support
-            auto res = hs_scan(m_patternDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_filterScratch,
-                [&, &absNumber = lineInfo->number, &length = lineInfo->length]
-                (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                    if (id == SE_HS_EOL_ID) {
-                        // for every EOL match check if we have pattern match within this line
-                        // in this case get line length and return when line counter matches target number
-                        if (patternMatch) {
-                            if (currentLine == number) {
-                                length = uint32_t(to - lastHit - 1);
-                                return 1;
-                            }
-                            currentLine++;
-                        }
-                        // save pointer to the next line, reset pattern match flag
-                        lastHit = to;
-                        absNumber++;
-                        patternMatch = false;
-                    } else if (id == SE_HS_PATTERN_ID) {
-                        // for every pattern match within the line set flag
-                        patternMatch = true;
-                    }
-                    return 0;
-                }
-            );
-            if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-                printf("[!] unable to find filtered line %d\n", number);
-                return UnknownError;
-            }
-            lineInfo->scope = false;
-        }
-
-        lineInfo->line = m_mem + searchPos + lastHit;
-        m_predictedLinePos = searchPos + lastHit + lineInfo->length + 1;
-        m_predictedAbsLineNum = lineInfo->number + 1;
-        m_predictedLineNum = number + 1;
-        m_recentBlock = blockIdx;
-        m_recentLineOffset = lineOffset;
-        m_recentAbsLineOffset = absLineOffset;
-        
-        lineInfo->number++; // correct display line number (starting from 1)
-
-        // skip \r at the end of the line if exists
-        if (lineInfo->length && lineInfo->line[lineInfo->length-1] == '\r')
-            lineInfo->length--;
-    }
+    size_t size = 0;
+    if (m_eolDB && hs_database_size(m_eolDB, &size) == HS_SUCCESS)
+        stats->databaseSize += size;
+    if (m_patternDB && hs_database_size(m_patternDB, &size) == HS_SUCCESS)
+        stats->databaseSize += size;
+    
+    stats->scratchSize += workerScratchSize();
     
     return NoError;
 }
 
-SearchEngineError HyperscanEngine::getRowForAbsLine(uint32_t absLine, uint32_t* row)
+SearchEngineError HyperscanEngine::setIgnoreCase(bool ignoreCase)
 {
-    if (! row)
-        return BadArgument;
-    
-    if (! m_filtered) {
-        *row = absLine;
-    }
-
-    // find block with line
-    uint32_t dummy = 0;
-    int blockIdx = 0;
-
-    uint32_t absLineCount = 0;
-    uint32_t lineOffset = m_blocks[blockIdx].filteredLines + m_blocks[blockIdx].lendedHeadLines + m_blocks[blockIdx].lendedTailLines;
-    uint32_t absLineOffset = m_blocks[blockIdx].lines;
-    
-    uint32_t currentLine = 0;
-    while (absLine >= absLineOffset) {
-        currentLine = lineOffset;
-        absLineCount = absLineOffset;
-        blockIdx++;
-        lineOffset += m_blocks[blockIdx].filteredLines + m_blocks[blockIdx].lendedHeadLines + m_blocks[blockIdx].lendedTailLines;
-        absLineOffset += m_blocks[blockIdx].lines;
-    }
-    
-    uint32_t baseLine = currentLine;
-    
-    uint64_t basePos = m_blocks[blockIdx].byteOffset;
-    uint64_t searchPos = basePos;
-    uint64_t scanSize = m_blocks[blockIdx].size - (searchPos - basePos);
-    bool patternMatch = false;
-    
-#if DEBUG_GETROW
-    printf("[#] get row for absolute line %d in block %2d starting with line %d at offset %lld\n", absLine, blockIdx, currentLine, searchPos);
-#endif
-    
-    if (m_scopeBefore || m_scopeAfter) {
-        // advanced search with scope support
-        ScopeTracker<MAX_SCOPE_BEFORE, TrackingPolicy::Ring>  btracker;
-        ScopeTracker<MAX_SCOPE_AFTER, TrackingPolicy::Fixed>  atracker;
-        btracker.setSize(m_scopeBefore);
-        atracker.setSize(m_scopeAfter);
-        
-        if (m_blocks[blockIdx].filteredLines) {
-            
-            bool lineFound = false;
-            uint32_t lendedTailLines = m_blocks[blockIdx].lendedTailLines;
-            uint32_t lendedHeadLines = m_blocks[blockIdx].lendedHeadLines;
-            if (btracker.hasBaseLine()) {
-                // return line from 'before' scope including base line
-                if (! btracker.isEmpty()) {
-                    __unused auto topLine = btracker.getTopScopeLine();
-                    assert(currentLine == topLine);
-                    // search offset points to the right line, pop scope line
-                    __unused auto curPos = btracker.popScope(dummy);
-                    assert(curPos == searchPos);
-                    lineFound = true;
-                } else {
-                    __unused auto topLine = btracker.getTopScopeLine();
-                    assert(currentLine == topLine);
-                    // search offset points to the right line, pop base line
-                    __unused auto curPos = btracker.popBaseLine(dummy);
-                    assert(curPos == searchPos);
-                    lineFound = true;
-
-                    // reset 'before' tracker if we reached match line
-                    btracker.reset();
-                }
-            } else if (currentLine > lineOffset - lendedHeadLines) {
-                if (btracker.getCount()) {
-                    __unused auto curPos = btracker.popScope(dummy);
-                    assert(curPos != -1);
-                    lineFound = true;
-                }
-            }
-
-            if (!lineFound) {
-                // search filtered line with scope
-                auto res = hs_scan(m_patternDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_filterScratch,
-                    [&, &btracker = btracker, &atracker = atracker]
-                    (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                        if (id == SE_HS_EOL_ID) {
-                            // for every EOL match check if we have pattern match within this line
-                            // in this case get line length and return when line counter matches target number
-                            if (patternMatch) {
-                                uint32_t scopeBaseLine = currentLine + btracker.getCount();
-                                
-                                // setup scope trackers
-                                atracker.reset();
-                                atracker.pushBaseLine(scopeBaseLine, 0, 0);
-                                btracker.pushBaseLine(scopeBaseLine, 0, 0);
-
-                                // return line from 'before' scope
-                                if (btracker.getCount()) {
-                                    absLineCount -= btracker.getCount();
-                                    uint64_t curPos = btracker.popScope(dummy);
-                                    while(curPos != -1) {
-                                        if (absLineCount >= absLine) {
-                                            return 1;
-                                        }
-                                        curPos = btracker.popScope(dummy);
-                                        currentLine++;
-                                        absLineCount++;
-                                    }
-                                }
-                                
-                                // reset 'before' tracker if we reached match line
-                                btracker.reset();
-
-                                // check if we reached desired pattern match
-                                if (absLineCount >= absLine) {
-                                    return 1;
-                                }
-                                currentLine++;
-                            } else {
-                                // keep tracking scope lines
-                                
-                                if (atracker.hasBaseLine()) {
-                                    if (!atracker.isFull()) {
-                                        // return 'after' scope
-                                        atracker.pushScope(0, 0);
-                                        if (absLineCount >= absLine) {
-                                            return 1;
-                                        }
-                                        currentLine++;
-                                    } else {
-                                        btracker.pushScope(0, 0);
-                                    }
-                                } else if (currentLine < baseLine + lendedTailLines) {
-                                    if (absLineCount >= absLine) {
-                                        return 1;
-                                    }
-                                    currentLine++;
-                                } else {
-                                    btracker.pushScope(0, 0);
-                                }
-                            }
-                            // save pointer to the next line, reset pattern match flag
-                            absLineCount++;
-                            patternMatch = false;
-                        } else if (id == SE_HS_PATTERN_ID) {
-                            // for every pattern match within the line set flag
-                            patternMatch = true;
-                        }
-                        return 0;
-                    }
-                );
-                if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-                    printf("[!] unable to find filtered line %d with scope\n", absLine);
-                    return UnknownError;
-                }
-
-                // borrow head search should reach the end of block
-                if (lendedHeadLines && res == HS_SUCCESS) {
-                    if (btracker.getCount()) {
-                        // align scope with lended lines
-                        btracker.dropScope(btracker.getCount() - lendedHeadLines);
-                        // correct abs line number
-                        absLineCount -= btracker.getCount();
-                        // return line from 'before' scope
-                        uint64_t curPos = btracker.popScope(dummy);
-                        while((currentLine != absLine) && (curPos != -1)) {
-                            curPos = btracker.popScope(absLineCount);
-                            currentLine++;
-                        }
-                        assert(curPos != -1);
-                    }
-                }
-            }
-        } else {
-            // search borrowed line with scope in the block without matches
-            bool lineFound = false;
-            uint32_t lendedTailLines = m_blocks[blockIdx].lendedTailLines;
-            uint32_t lendedHeadLines = m_blocks[blockIdx].lendedHeadLines;
-            
-            if (currentLine > lineOffset - lendedHeadLines) {
-                if (btracker.getCount()) {
-                    __unused auto curPos = btracker.popScope(dummy);
-                    assert(curPos != -1);
-                    
-                    lineFound = true;
-                }
-            }
-            
-            if (!lineFound) {
-                auto res = hs_scan(m_eolDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_baseScratch,
-                    [&]
-                    (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                        if (absLineCount < baseLine + lendedTailLines) {
-                            // return lines for the tail of previous block
-                            currentLine++;
-                        }
-                        if (lendedHeadLines) {
-                            // borrow lines to the head of next block
-                            btracker.pushScope(0, 0);
-                        }
-                        absLineCount++;
-                        if (absLineCount >= absLine) {
-                            return 1;
-                        }
-                        return 0;
-                    }
-                );
-                if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-                    printf("[!] unable to find borrowed line %d with scope\n", absLine);
-                    return UnknownError;
-                }
-                
-                // borrow head search should reach the end of block
-                if (lendedHeadLines && res == HS_SUCCESS) {
-                    if (btracker.getCount()) {
-                        // align scope with lended lines
-                        btracker.dropScope(btracker.getCount() - lendedHeadLines);
-                        // correct abs line number
-                        absLineCount -= btracker.getCount();
-                        // returning line from 'before' scope
-                        uint64_t curPos = btracker.popScope(dummy);
-                        while((currentLine != absLine) && (curPos != -1)) {
-                            curPos = btracker.popScope(absLineCount);
-                            currentLine++;
-                        }
-                        assert(curPos != -1);
-                    }
-                }
-            }
-        }
-    } else {
-        // optimized search without scope support
-        auto res = hs_scan(m_patternDB, m_mem + searchPos, (unsigned int)scanSize, 0, m_filterScratch,
-            [&]
-            (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                if (id == SE_HS_EOL_ID) {
-                    // for every EOL match check if we have pattern match within this line
-                    // in this case return when absolute line counter more or equal than target number
-                    if (patternMatch) {
-                        currentLine++;
-                    }
-                    // save pointer to the next line, reset pattern match flag
-                    absLineCount++;
-                    if (absLineCount >= absLine) {
-                        return 1;
-                    }
-                    patternMatch = false;
-                } else if (id == SE_HS_PATTERN_ID) {
-                    // for every pattern match within the line set flag
-                    patternMatch = true;
-                }
-                return 0;
-            }
-        );
-        if (!(res == HS_SUCCESS || res == HS_SCAN_TERMINATED)) {
-            printf("[!] unable to find filtered line %d\n", absLine);
-            return UnknownError;
-        }
-    }
+    m_ignoreCase = ignoreCase;
+    return NoError;
+}
 
-    *row = (currentLine)? currentLine - 1 : currentLine;
+SearchEngineError HyperscanEngine::setFuzzy(uint32_t distance, bool hamming)
+{
+    if (distance > MAX_FUZZY_DISTANCE)
+        return BadArgument;
     
+    m_fuzzyDistance = distance;
+    m_fuzzyHamming = hamming;
     return NoError;
 }
 
-SearchEngineError HyperscanEngine::setIgnoreCase(bool ignoreCase)
+SearchEngineError HyperscanEngine::setFieldMode(bool fieldMode)
 {
-    m_ignoreCase = ignoreCase;
+    m_fieldMode = fieldMode;
     return NoError;
 }
 
-SearchEngineError HyperscanEngine::setScope(uint32_t before, uint32_t after)
+SearchEngineError HyperscanEngine::setUTF8(bool utf8)
 {
-    m_scopeBefore = before;
-    m_scopeAfter = after;
-    printf("[+] set scope B%d A%d\n", m_scopeBefore, m_scopeAfter);
+    // hyperscan doesn't define results for invalid UTF-8 input
+    if (utf8 && fileEncoding() == InvalidUTF8Encoding)
+        return NotSupported;
+    
+    m_utf8 = utf8;
+    return NoError;
+}
 
-    for (int block=0; block < MAX_BLOCK_COUNT; block++) {
-        m_beforeTracker[block].setSize(m_scopeBefore);
-        m_afterTracker[block].setSize(m_scopeAfter);
+FilterCacheKey HyperscanEngine::compileKey(const char* pattern)
+{
+    FilterCacheKey key = {pattern, (m_ignoreCase)? HS_FLAG_CASELESS : 0u};
+    if (m_utf8 && fileEncoding() == UTF8Encoding) {
+        // code points for '.' and classes, unicode properties for \w, \b and caseless matching
+        key.flags |= HS_FLAG_UTF8 | HS_FLAG_UCP;
     }
-
-    return NoError;
+    key.fields = m_fieldMode;
+    if (!m_fieldMode) {
+        // field values are always matched exactly
+        key.distance = m_fuzzyDistance;
+        key.hamming = m_fuzzyHamming;
+    }
+    return key;
 }
 
-SearchEngineError HyperscanEngine::setPattern(const char* pattern, char* error)
+std::shared_ptr<FilterResult> HyperscanEngine::compilePattern(const FilterCacheKey& key, char* error)
 {
+    // called from setPattern() and compile thread, must not touch engine state except cache and stats
+    if (key.watchlist)
+        return compileWatchlist(key, error);
+    
     const char* patterns[2] = {
         s_eolPattern,
-        pattern,
+        key.pattern.c_str(),
     };
     
     unsigned int flags[2] = {
         HS_FLAG_DOTALL,
-        0
+        key.flags
     };
     
-    flags[1] = (m_ignoreCase)? HS_FLAG_CASELESS : 0;
-
-    printf("[+] set pattern = \"%s\"\n", pattern);
+    // approximate matching is applied to the pattern only, EOL must stay exact
+    hs_expr_ext_t ext = {};
+    const hs_expr_ext_t* exts[2] = {
+        nullptr,
+        (key.distance)? &ext : nullptr
+    };
+    if (key.hamming) {
+        ext.flags = HS_EXT_FLAG_HAMMING_DISTANCE;
+        ext.hamming_distance = key.distance;
+    } else {
+        ext.flags = HS_EXT_FLAG_EDIT_DISTANCE;
+        ext.edit_distance = key.distance;
+    }
     
-    if (pattern[0] == 0)
-        m_filtered = false;
-    else
-        m_filtered = true;
+    auto stime = std::chrono::steady_clock::now();
+    auto result = std::make_shared<FilterResult>();
+    
+    // lines containing prefilter literal are parsed and checked against field predicates
+    std::string prefilter;
+    if (key.fields) {
+        result->verifier = FieldVerifier::create(key.pattern.c_str(), (key.flags & HS_FLAG_CASELESS) != 0, (key.flags & HS_FLAG_UTF8) != 0, error, prefilter);
+        if (!result->verifier)
+            return nullptr;
+        patterns[1] = prefilter.c_str();
+    }
     
-    if (m_filtered) {
-        if (m_patternDB) {
-            hs_free_database(m_patternDB);
-            m_patternDB = nullptr;
+    hs_database_t* patternDB = nullptr;
+    hs_compile_error_t *compile_err;
+    if (hs_compile_ext_multi(patterns, flags, s_filterIDs, exts, 2, HS_MODE_BLOCK, nullptr, &patternDB, &compile_err) != HS_SUCCESS) {
+    #if SE_SUPPORT_PCRE2
+        // constructs like backreferences and lookarounds are approximated by prefilter database,
+        // lines it reports are confirmed with PCRE2 which also validates the pattern syntax,
+        // approximate matches can't be confirmed so fuzzy patterns never fall back
+        bool fallback = (key.distance == 0 && !key.fields);
+        if (fallback) {
+            printf("[+] pattern is not supported by hyperscan (%s), falling back to PCRE2\n", compile_err->message);
+            hs_free_compile_error(compile_err);
+            
+            result->verifier = PcreVerifier::create(key.pattern.c_str(), (key.flags & HS_FLAG_CASELESS) != 0, (key.flags & HS_FLAG_UTF8) != 0, error);
+            if (!result->verifier)
+                return nullptr;
+            
+            flags[1] |= HS_FLAG_PREFILTER;
         }
-        m_patternDB = nullptr;
-        hs_compile_error_t *compile_err;
-        if (hs_compile_multi(patterns, flags, s_filterIDs, 2, HS_MODE_BLOCK, nullptr, &m_patternDB, &compile_err) != HS_SUCCESS) {
+        if (!fallback || hs_compile_ext_multi(patterns, flags, s_filterIDs, exts, 2, HS_MODE_BLOCK, nullptr, &patternDB, &compile_err) != HS_SUCCESS)
+    #endif
+        {
             printf("[!] unable to compile filter pattern: %s\n", compile_err->message);
             if (error) {
                 size_t len = strlen(compile_err->message);
                 strncpy(error, compile_err->message, (len > MAX_ERROR_LENGTH)? MAX_ERROR_LENGTH : len);
             }
             hs_free_compile_error(compile_err);
-            return UnknownError;
+            return nullptr;
         }
+    }
+    
+    // database is shared with filter cache and released with the last result using it
+    result->database = std::shared_ptr<void>(patternDB, [](void* db) {
+        hs_free_database((hs_database_t*)db);
+    });
+    hs_database_size(patternDB, &result->databaseSize);
+    compileGrams(key, (key.flags & HS_FLAG_CASELESS) != 0, result.get());
+    
+    auto ctime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stime);
+    m_stats.compileTime.store(ctime.count(), std::memory_order_relaxed);
+    
+    return result;
+}
 
-        if (m_filterScratch) {
-            hs_free_scratch(m_filterScratch);
-            m_filterScratch = nullptr;
-        }
-        
-        if (hs_alloc_scratch(m_patternDB, &m_filterScratch) != HS_SUCCESS) {
-            printf("[!] unable to allocate scratch space for filter\n");
-            hs_free_database(m_patternDB);
-            m_patternDB = nullptr;
+SearchEngineError HyperscanEngine::setPattern(const char* pattern, char* error)
+{
+    printf("[+] set pattern = \"%s\"\n", pattern);
+    
+    m_templateFilter = false;
+    
+    if (pattern[0] == 0)
+        m_filtered = false;
+    else
+        m_filtered = true;
+    
+    if (m_filtered)
+        return useFilter(compileKey(pattern), error);
+    
+    return NoError;
+}
+
+SearchEngineError HyperscanEngine::setWatchlist(const char* path, bool literal, char* error)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        printf("[!] failed to open %s\n", path);
+        return FileOpenFailed;
+    }
+    
+    // whole list is the cache key, so editing the file and loading it again compiles it again
+    std::stringstream content;
+    content << file.rdbuf();
+    
+    FilterCacheKey key = compileKey("");
+    key.pattern = content.str();
+    key.watchlist = true;
+    key.literal = literal;
+    key.fields = false;
+    key.distance = 0;
+    key.hamming = false;
+    if (literal) {
+        // literals are matched as bytes
+        key.flags &= HS_FLAG_CASELESS;
+    }
+    
+    printf("[+] set watchlist = \"%s\"\n", path);
+    
+    m_templateFilter = false;
+    m_filtered = true;
+    
+    return useFilter(key, error);
+}
+
+SearchEngineError HyperscanEngine::useFilter(const FilterCacheKey& key, char* error)
+{
+    auto result = m_filterCache.find(key);
+    EngineStats::count((result)? m_stats.cacheHits : m_stats.cacheMisses);
+    if (!result) {
+        result = compilePattern(key, error);
+        if (!result)
             return UnknownError;
-        }
-        
-        for (int block=0; block < MAX_BLOCK_COUNT; block++) {
-            m_blocks[block].filteredLines = 0;
-            m_blocks[block].scopeLines = 0;
-            m_blocks[block].headLines = 0;
-            m_blocks[block].tailLines = 0;
-            m_blocks[block].lendedHeadLines = 0;
-            m_blocks[block].lendedTailLines = 0;
-            m_beforeTracker[block].reset();
-            m_afterTracker[block].reset();
-        }
+        cacheFilterResult(key, result);
     }
     
-    m_predictedLinePos = -1;
-    m_predictedLineNum = -1;
-    m_recentBlock = -1;
-    m_recentLineOffset = 0;
-    m_recentAbsLineOffset = 0;
+    m_patternDB = (hs_database_t*)result->database.get();
+    m_verifier = result->verifier.get();
+    m_filterKey = key;
+    resetFilterResult(result);
     
     return NoError;
 }
 
+std::shared_ptr<FilterResult> HyperscanEngine::compileWatchlist(const FilterCacheKey& key, char* error)
+{
+    auto stime = std::chrono::steady_clock::now();
+    auto result = std::make_shared<FilterResult>();
+    
+    // one entry per line, empty lines are skipped
+    size_t pos = 0;
+    while (pos < key.pattern.size()) {
+        size_t end = key.pattern.find('\n', pos);
+        if (end == std::string::npos)
+            end = key.pattern.size();
+        size_t length = end - pos;
+        if (length && key.pattern[end - 1] == '\r')
+            length--;
+        if (length)
+            result->watchlist.emplace_back(key.pattern, pos, length);
+        pos = end + 1;
+    }
+    
+    if (result->watchlist.empty()) {
+        printf("[!] watchlist is empty\n");
+        if (error)
+            strncpy(error, "watchlist is empty", MAX_ERROR_LENGTH);
+        return nullptr;
+    }
+    
+    // EOL goes first, entries are compiled into the same database so that scan time
+    // depends on the size of the file and not on the number of entries
+    size_t count = result->watchlist.size() + 1;
+    std::vector<const char*> patterns(count);
+    std::vector<size_t> lengths(count);
+    std::vector<unsigned int> flags(count, key.flags);
+    std::vector<unsigned int> ids(count);
+    
+    patterns[0] = s_eolPattern;
+    lengths[0] = strlen(s_eolPattern);
+    flags[0] = (key.literal)? 0 : HS_FLAG_DOTALL;
+    ids[0] = SE_HS_EOL_ID;
+    for (size_t i = 1; i < count; i++) {
+        patterns[i] = result->watchlist[i - 1].c_str();
+        lengths[i] = result->watchlist[i - 1].size();
+        ids[i] = SE_HS_WATCH_ID + unsigned(i - 1);
+    }
+    
+    hs_database_t* patternDB = nullptr;
+    hs_compile_error_t *compile_err;
+    hs_error_t res;
+    if (key.literal)
+        res = hs_compile_lit_multi(patterns.data(), flags.data(), ids.data(), lengths.data(), unsigned(count), HS_MODE_BLOCK, nullptr, &patternDB, &compile_err);
+    else
+        res = hs_compile_multi(patterns.data(), flags.data(), ids.data(), unsigned(count), HS_MODE_BLOCK, nullptr, &patternDB, &compile_err);
+    if (res != HS_SUCCESS) {
+        char message[MAX_ERROR_LENGTH + 1] = {0};
+        if (compile_err->expression > 0)
+            snprintf(message, sizeof(message), "entry %d: %s", compile_err->expression, compile_err->message);
+        else
+            snprintf(message, sizeof(message), "%s", compile_err->message);
+        printf("[!] unable to compile watchlist: %s\n", message);
+        if (error)
+            strncpy(error, message, MAX_ERROR_LENGTH);
+        hs_free_compile_error(compile_err);
+        return nullptr;
+    }
+    
+    result->database = std::shared_ptr<void>(patternDB, [](void* db) {
+        hs_free_database((hs_database_t*)db);
+    });
+    hs_database_size(patternDB, &result->databaseSize);
+    compileGrams(key, (key.flags & HS_FLAG_CASELESS) != 0, result.get());
+    
+    auto ctime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stime);
+    m_stats.compileTime.store(ctime.count(), std::memory_order_relaxed);
+    
+    printf("[+] watchlist of %zu entries compiled in %lldms\n", result->watchlist.size(), (long long)(ctime.count() / 1000000));
+    return result;
+}
+
+std::shared_ptr<KeyExtractor> HyperscanEngine::createExtractor(const SEKeyExtractor* extractor, char* error)
+{
+    if (extractor->type != RegexKey)
+        return SearchEngine::createExtractor(extractor, error);
+    
+    if (!extractor->pattern || !extractor->pattern[0])
+        return nullptr;
+    
+    return RegexExtractor::create(extractor->pattern, m_ignoreCase, error);
+}
+
 SearchEngineError HyperscanEngine::filter(uint32_t blockIdx, SEBlockInfo* info)
 {
     if (!m_filtered)
@@ -919,118 +543,126 @@ SearchEngineError HyperscanEngine::filter(uint32_t blockIdx, SEBlockInfo* info)
     if (!m_blocks[blockIdx].active)
         return BadArgument;
     
-    if (m_scratchPool[blockIdx]) {
-        hs_free_scratch(m_scratchPool[blockIdx]);
-        m_scratchPool[blockIdx] = nullptr;
+    auto result = &m_filterResult->blocks[blockIdx];
+    if (result->filtered) {
+        // block is restored from filter cache
+        info->lines = uint32_t(result->matches.size());
+        info->maxLength = result->maxLength;
+        m_stats.filter[blockIdx].reset();
+        m_stats.filter[blockIdx].matches.store(info->lines, std::memory_order_relaxed);
+        return NoError;
     }
-    hs_clone_scratch(m_filterScratch, &m_scratchPool[blockIdx]);
+    
+    if (m_templateFilter)
+        return filterTemplates(blockIdx, info);
     
     auto block = &m_blocks[blockIdx];
-    uint64_t pos = block->byteOffset;
-    uint64_t size = block->size;
     
+    // scope lines are not collected here, segments are built around matches once all blocks are filtered
+    ScanProbe probe;
+    uint64_t callbacks = 0;
+    uint64_t candidates = 0;
     uint32_t maxLength = 0;
+    auto hits = (m_filterResult->watchlist.empty())? nullptr : &result->hits;
+    uint32_t slot = acquireSlot();
+    auto err = filterBlock(slot, blockIdx, result->matches, &maxLength, &callbacks, &candidates, hits);
+    releaseSlot(slot);
+    scannedRange(block->byteOffset, block->size);
+    if (err != NoError)
+        return err;
+    
+    info->lines = uint32_t(result->matches.size());
+    info->maxLength = maxLength;
+    
+    result->maxLength = maxLength;
+    result->filtered = true;
+    
+    probe.finish(m_stats.filter[blockIdx], block->size, callbacks, result->matches.size());
+    m_stats.filter[blockIdx].candidates.store(candidates, std::memory_order_relaxed);
+    m_stats.filterProgress.add(blockIdx, block->size, block->lines, result->matches.size());
+    
+    return NoError;
+}
+
+SearchEngineError HyperscanEngine::filterRange(uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                               uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits)
+{
+    return scanRange(m_patternDB, m_verifier, slot, pos, size, firstLine, matches, maxLength, callbacks, candidates, hits);
+}
+
+SearchEngineError HyperscanEngine::findRange(const FilterResult& pattern, uint32_t slot, uint64_t pos, uint64_t size, std::vector<uint32_t>& matches,
+                                             uint64_t* callbacks, uint64_t* candidates)
+{
+    uint32_t maxLength = 0;
+    return scanRange((hs_database_t*)pattern.database.get(), pattern.verifier.get(), slot, pos, size, 0, matches, &maxLength, callbacks, candidates, nullptr);
+}
+
+SearchEngineError HyperscanEngine::scanRange(hs_database_t* patternDB, LineVerifier* verifier, uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine,
+                                             std::vector<uint32_t>& matches, uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits)
+{
+    auto scratch = workerScratch(patternDB);
+    if (!scratch)
+        return EngineOpFailed;
+    
+    matches.clear();
+    if (hits)
+        hits->clear();
+    
+    uint32_t line = firstLine;
     uint64_t lastHit = 0;
     bool patternMatch = false;
-    if (m_scopeBefore || m_scopeAfter) {
-        auto btracker = &m_beforeTracker[blockIdx];
-        auto atracker = &m_afterTracker[blockIdx];
-        auto res = hs_scan(m_patternDB, m_mem + pos, (unsigned int)size, 0, m_scratchPool[blockIdx],
-            [&, &btracker = btracker, &atracker = atracker, &block = block, &lines = block->filteredLines]
-            (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                if (id == SE_HS_EOL_ID) {
-                    // for every EOL match check if we have pattern match within this line
-                    // in this case increment match line counter and update max length
-                    if (patternMatch) {
-                        maxLength = std::max(uint32_t(to - lastHit - 1), maxLength);
-                        // for the first pattern match take 'before' lines into account, for all other matches take both
-                        if (lines) {
-                            maxLength = std::max(atracker->getMaxLength(), std::max(btracker->getMaxLength(), maxLength));
-                            block->scopeLines += btracker->getCount() + atracker->getCount();
-                        } else {
-                            maxLength = std::max(btracker->getMaxLength(), maxLength);
-                            block->scopeLines += btracker->getCount();
-                            block->headLines = block->tailLines;
-                        }
-                        
-                        block->tailLines = 0;
-                        lines++;
-                        btracker->reset();
-                        atracker->reset();
-                    } else {
-                        uint32_t len = uint32_t(to - lastHit - 1);
-                        // for the first pattern match take 'before' lines into account, for all other matches take both
-                        if (lines) {
-                            if (!atracker->isFull())
-                                atracker->pushScope(lastHit, len);
-                            else
-                                btracker->pushScope(lastHit, len);
-                        } else {
-                            btracker->pushScope(lastHit, len);
-                        }
-                        block->tailLines++;
-                    }
-                    // save pointer to the next line, reset pattern match flag
-                    lastHit = to;
-                    patternMatch = false;
-                } else {
-                    // for every pattern match within the line set flag
-                    patternMatch = true;
+    std::vector<uint32_t> lineHits;
+    auto res = hs_scan(patternDB, m_mem + pos, (unsigned int)size, 0, scratch,
+        [&]
+        (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
+            (*callbacks)++;
+            if (id == SE_HS_EOL_ID) {
+                // for every EOL match check if we have pattern match within this line
+                // in this case save line number and update max length
+                if (patternMatch && verifier) {
+                    // prefilter database may report false positives, confirm the line
+                    uint32_t length = uint32_t(to - lastHit - 1);
+                    const char* data = m_mem + pos + lastHit;
+                    if (length && data[length - 1] == '\r')
+                        length--;
+                    patternMatch = verifier->match(slot, data, length);
+                    (*candidates)++;
                 }
-                
-                return 0;
-            }
-        );
-        if (res != HS_SUCCESS) {
-            printf("[!] unable to filter lines with scope\n");
-            return EngineOpFailed;
-        }
-        
-        // take scope lines after the last match into account
-        maxLength = std::max(atracker->getMaxLength(), maxLength);
-        block->scopeLines += (block->filteredLines)? atracker->getCount() : 0;
-        
-        // update head/tail lines for the merge
-        block->headLines = (block->filteredLines)? block->headLines - m_scopeBefore : block->tailLines;
-        block->tailLines = (block->filteredLines)? block->tailLines - m_scopeAfter : 0;
-
-        block->filteredLines += block->scopeLines;
-    } else {
-        auto res = hs_scan(m_patternDB, m_mem + pos, (unsigned int)size, 0, m_scratchPool[blockIdx],
-            [&, &lines = block->filteredLines]
-            (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
-                if (id == SE_HS_EOL_ID) {
-                    // for every EOL match check if we have pattern match within this line
-                    // in this case increment match line counter and update max length
-                    if (patternMatch) {
-                        maxLength = std::max(uint32_t(to - lastHit - 1), maxLength);
-                        lines++;
+                if (patternMatch) {
+                    *maxLength = std::max(uint32_t(to - lastHit - 1), *maxLength);
+                    matches.push_back(line);
+                    if (hits) {
+                        // every match reported for an entry is an occurrence
+                        std::sort(lineHits.begin(), lineHits.end());
+                        for (auto hit = lineHits.begin(); hit != lineHits.end(); ) {
+                            auto next = std::upper_bound(hit, lineHits.end(), *hit);
+                            hits->push_back(*hit);
+                            hits->push_back(uint32_t(next - hit));
+                            hit = next;
+                        }
                     }
-                    // save pointer to the next line, reset pattern match flag
-                    lastHit = to;
-                    patternMatch = false;
-                } else {
-                    // for every pattern match within the line set flag
-                    patternMatch = true;
                 }
-                
-                return 0;
+                // save pointer to the next line, reset pattern match flag
+                lastHit = to;
+                line++;
+                patternMatch = false;
+                lineHits.clear();
+            } else {
+                // for every pattern match within the line set flag
+                patternMatch = true;
+                if (hits && id >= SE_HS_WATCH_ID)
+                    lineHits.push_back(id - SE_HS_WATCH_ID);
             }
-        );
-        if (res != HS_SUCCESS) {
-            printf("[!] unable to filter lines\n");
-            return EngineOpFailed;
+            
+            return 0;
         }
+    );
+    if (res != HS_SUCCESS) {
+        printf("[!] unable to filter lines\n");
+        return EngineOpFailed;
     }
     
-    info->lines = block->filteredLines;
-    info->maxLength = maxLength;
-
-#if DEBUG_BLOCKS
-    printf("[#] filter block %2d ready (%d lines, %3d cols, +%d scope lines %+d|%+d)\n",
-           blockIdx, info->lines - block->scopeLines, info->maxLength,
-           block->scopeLines, block->headLines, block->tailLines);
-#endif
-    
     return NoError;
 }
+
+#endif // SE_SUPPORT_HYPERSCAN
@@ -8,10 +8,12 @@
 
 #pragma once
 
-#include "hs.h"
-
 #include "SearchEngine.hpp"
 
+#if SE_SUPPORT_HYPERSCAN
+
+#include "hs.h"
+
 class HyperscanEngine : public SearchEngine {
     
 public:
@@ -22,14 +24,37 @@ public:
     SearchEngineError   fetch(uint32_t blockIdx, SEBlockInfo* info) override;
     void                close() override;
     
-    SearchEngineError   getLine(uint32_t number, SELineInfo* lineInfo) override;
-    SearchEngineError   getRowForAbsLine(uint32_t absLine, uint32_t* row) override;
+    SearchEngineError   getStats(SEStats* stats) override;
     
     SearchEngineError   setIgnoreCase(bool ignoreCase) override;
-    SearchEngineError   setScope(uint32_t before, uint32_t after) override;
+    SearchEngineError   setFuzzy(uint32_t distance, bool hamming) override;
+    SearchEngineError   setFieldMode(bool fieldMode) override;
+    SearchEngineError   setUTF8(bool utf8) override;
     SearchEngineError   setPattern(const char* pattern, char* error) override;
+    SearchEngineError   setWatchlist(const char* path, bool literal, char* error) override;
     SearchEngineError   filter(uint32_t blockIdx, SEBlockInfo* info) override;
     
+    // scratch of the calling thread, shared by all engines and grown to fit every database scanned on the thread
+    static hs_scratch_t*    workerScratch(const hs_database_t* db);
+    static size_t           workerScratchSize();
+    
+protected:
+    
+    FilterCacheKey      compileKey(const char* pattern) override;
+    std::shared_ptr<FilterResult> compilePattern(const FilterCacheKey& key, char* error) override;
+    std::shared_ptr<KeyExtractor> createExtractor(const SEKeyExtractor* extractor, char* error) override;
+    SearchEngineError   filterRange(uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                    uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits) override;
+    SearchEngineError   findRange(const FilterResult& pattern, uint32_t slot, uint64_t pos, uint64_t size, std::vector<uint32_t>& matches,
+                                  uint64_t* callbacks, uint64_t* candidates) override;
+    
+private:
+    
+    SearchEngineError   useFilter(const FilterCacheKey& key, char* error);
+    SearchEngineError   scanRange(hs_database_t* patternDB, LineVerifier* verifier, uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine,
+                                  std::vector<uint32_t>& matches, uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits);
+    std::shared_ptr<FilterResult> compileWatchlist(const FilterCacheKey& key, char* error);
+    
 private:
     
     static unsigned int s_filterIDs[2];
@@ -38,9 +63,8 @@ private:
     
     hs_database_t*      m_eolDB;
     hs_database_t*      m_patternDB;
-    hs_scratch_t*       m_baseScratch;
-    hs_scratch_t*       m_filterScratch;
-    hs_scratch_t*       m_scratchPool[MAX_BLOCK_COUNT] = {0};
+    LineVerifier*       m_verifier = nullptr;
 
 };
 
+#endif // SE_SUPPORT_HYPERSCAN
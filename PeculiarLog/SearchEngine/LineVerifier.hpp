@@ -0,0 +1,23 @@
+//
+//  LineVerifier.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// confirms candidate lines reported by a prefiltering pattern database,
+// blocks and their chunks are filtered in parallel, so any per-match state must be kept per worker slot
+class LineVerifier {
+
+public:
+    virtual ~LineVerifier() {}
+
+    virtual bool        match(uint32_t slot, const char* line, uint32_t length) = 0;
+    virtual size_t      memoryUsage() const = 0;
+    
+    // span of a confirmed match within the line used for highlighting, called from the main thread
+    virtual bool        locate(const char* line, uint32_t length, uint32_t* offset, uint32_t* matchLength) { return false; }
+};
@@ -0,0 +1,102 @@
+//
+//  MemoryBudget.cpp
+//  PeculiarLog
+//
+
+#include <algorithm>
+
+#include "SearchEngine.hpp"
+#include "MemoryBudget.hpp"
+
+MemoryBudget& MemoryBudget::shared()
+{
+    static MemoryBudget* budget = new MemoryBudget();
+    return *budget;
+}
+
+void MemoryBudget::attach(SearchEngine* engine)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (std::find(m_engines.begin(), m_engines.end(), engine) == m_engines.end())
+        m_engines.push_back(engine);
+}
+
+void MemoryBudget::detach(SearchEngine* engine)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_engines.erase(std::remove(m_engines.begin(), m_engines.end(), engine), m_engines.end());
+}
+
+void MemoryBudget::setActive(SearchEngine* engine)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    auto it = std::find(m_engines.begin(), m_engines.end(), engine);
+    if (it == m_engines.end())
+        return;
+
+    m_engines.erase(it);
+    m_engines.push_back(engine);
+}
+
+void MemoryBudget::setLimit(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_limit = bytes;
+    evict();
+}
+
+size_t MemoryBudget::getLimit()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    return m_limit;
+}
+
+void MemoryBudget::getUsage(size_t* usage, bool* exceeded)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    *usage = 0;
+    for (auto engine : m_engines) {
+        *usage += engine->memoryUsage();
+    }
+    *exceeded = *usage > m_limit;
+}
+
+void MemoryBudget::rebalance()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    evict();
+}
+
+void MemoryBudget::evict()
+{
+    size_t usage = 0;
+    for (auto engine : m_engines) {
+        usage += engine->memoryUsage();
+    }
+
+    for (auto engine : m_engines) {
+        if (usage <= m_limit)
+            break;
+        usage -= engine->trimCache(usage - m_limit);
+    }
+
+    // bitmaps only let filters skip chunks, the active document keeps them
+    for (size_t i = 0; i + 1 < m_engines.size(); i++) {
+        if (usage <= m_limit)
+            break;
+        usage -= m_engines[i]->trimIndex(usage - m_limit);
+    }
+
+    // line indexes can't be dropped, the overrun is reported once until usage fits again
+    bool exceeded = usage > m_limit;
+    if (exceeded && !m_exceeded)
+        printf("[!] memory budget exceeded, %zu of %zu bytes used by line indexes\n", usage, m_limit);
+    m_exceeded = exceeded;
+}
@@ -0,0 +1,42 @@
+//
+//  MemoryBudget.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+class SearchEngine;
+
+// caps line indexes and filter caches of all open documents, once the limit is exceeded cached
+// filter results are evicted from documents which were active least recently, the active one goes last,
+// then trigram bitmaps of documents in the background, line indexes stay and may keep usage over the limit
+class MemoryBudget {
+
+public:
+    static MemoryBudget&    shared();
+
+    void                    attach(SearchEngine* engine);
+    void                    detach(SearchEngine* engine);
+    void                    setActive(SearchEngine* engine);
+    void                    setLimit(size_t bytes);
+    size_t                  getLimit();
+    // usage of all documents, exceeded if nothing is left to evict
+    void                    getUsage(size_t* usage, bool* exceeded);
+    void                    rebalance();
+
+private:
+
+    MemoryBudget() {}
+
+    void                    evict();
+
+private:
+
+    std::mutex                  m_lock;
+    std::vector<SearchEngine*>  m_engines;      // least recently active first
+    size_t                      m_limit = PROCESS_MEMORY_BUDGET;
+    bool                        m_exceeded = false;
+};
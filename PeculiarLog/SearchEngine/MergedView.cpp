@@ -0,0 +1,239 @@
+//
+//  MergedView.cpp
+//  PeculiarLog
+//
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include "MergedView.hpp"
+#include "TimestampParser.hpp"
+#include "WorkerPool.hpp"
+
+// times are searched as unsigned values, so that the whole range is covered
+static inline int64_t timeFromKey(uint64_t key)
+{
+    return int64_t(key ^ (1ULL << 63));
+}
+
+static inline uint64_t keyFromTime(int64_t time)
+{
+    return uint64_t(time) ^ (1ULL << 63);
+}
+
+MergedView::MergedView(const std::vector<SearchEngine*>& sources)
+    : m_sources(sources), m_counts(sources.size(), 0)
+{
+}
+
+SearchEngineError MergedView::open()
+{
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        SEOpenInfo info;
+        auto err = m_sources[i]->getOpenInfo(&info);
+        if (err != NoError)
+            return err;
+
+        if (!info.complete) {
+            printf("[!] unable to merge document %zu, it's not fetched yet\n", i);
+            return BadArgument;
+        }
+    }
+
+    return refresh();
+}
+
+SearchEngineError MergedView::refresh()
+{
+    auto err = buildTimeIndex();
+    if (err != NoError)
+        return err;
+
+    // rows are sought between the earliest and the latest timestamp, rows before the first one have no time
+    const int64_t noTime = TimestampParser::s_noTime;
+    m_rows = 0;
+    m_untimedRows = rowsBefore(noTime + 1, nullptr);
+    m_firstTime = INT64_MAX;
+    m_lastTime = noTime;
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        m_counts[i] = m_sources[i]->viewRows();
+        m_rows += m_counts[i];
+
+        uint32_t first = m_sources[i]->viewRowsBefore(noTime + 1);
+        if (first < m_counts[i]) {
+            m_firstTime = std::min(m_firstTime, m_sources[i]->viewRowTime(first));
+            m_lastTime = std::max(m_lastTime, m_sources[i]->viewRowTime(m_counts[i] - 1));
+        }
+    }
+
+    m_checkpoints.clear();
+    seek(0);
+
+    return NoError;
+}
+
+uint64_t MergedView::rows()
+{
+    return m_rows;
+}
+
+SearchEngineError MergedView::getLine(uint64_t row, SEMergedLineInfo* info)
+{
+    if (!info || row >= m_rows)
+        return BadArgument;
+
+    // rows before the one sought are materialized too, views are usually read from top to bottom
+    if (row < m_windowStart || row > m_position + s_stepLimit) {
+        auto checkpoint = m_checkpoints.find(row - row % s_checkpointStride);
+        if (checkpoint != m_checkpoints.end()) {
+            restore(checkpoint->first, checkpoint->second);
+        } else {
+            const uint64_t seekBack = s_seekBack;
+            seek(row - std::min(row, seekBack));
+        }
+    }
+
+    while (m_position <= row) {
+        step();
+    }
+
+    auto& entry = m_window[row - m_windowStart];
+    info->source = entry.source;
+    info->time = entry.time;
+
+    return m_sources[entry.source]->getLine(entry.row, &info->line);
+}
+
+SearchEngineError MergedView::buildTimeIndex()
+{
+    std::vector<SearchEngine*> pending;
+    uint32_t tasks = 0;
+    for (auto source : m_sources) {
+        if (source->hasTimeIndex())
+            continue;
+        pending.push_back(source);
+        tasks += source->blockCount();
+    }
+    if (pending.empty())
+        return NoError;
+
+    // blocks are indexed in parallel, times are carried over blocks once all of them are done
+    std::mutex lock;
+    std::condition_variable cond;
+    SearchEngineError result = NoError;
+    for (auto source : pending) {
+        for (uint32_t i = 0; i < source->blockCount(); i++) {
+            WorkerPool::shared().submit(source, [&, source, i]() {
+                auto err = source->buildTimeIndex(i);
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (err != NoError)
+                    result = err;
+                if (--tasks == 0)
+                    cond.notify_one();
+            });
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [&]() { return tasks == 0; });
+
+    if (result != NoError) {
+        printf("[!] unable to build time index: %d\n", result);
+        return result;
+    }
+
+    for (auto source : pending) {
+        source->finishTimeIndex();
+    }
+
+    return NoError;
+}
+
+uint64_t MergedView::rowsBefore(int64_t time, std::vector<uint32_t>* positions)
+{
+    uint64_t rows = 0;
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        uint32_t count = m_sources[i]->viewRowsBefore(time);
+        if (positions)
+            (*positions)[i] = count;
+        rows += count;
+    }
+    return rows;
+}
+
+void MergedView::seek(uint64_t row)
+{
+    // latest time with no more than the row rows before it, the row has this time
+    int64_t time = TimestampParser::s_noTime;
+    if (row >= m_untimedRows) {
+        uint64_t low = keyFromTime(m_firstTime);
+        uint64_t high = keyFromTime(m_lastTime);
+        while (low < high) {
+            uint64_t mid = low + (high - low) / 2 + 1;
+            if (rowsBefore(timeFromKey(mid), nullptr) <= row) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        time = timeFromKey(low);
+    }
+
+    // rows with the same time are taken in document order
+    std::vector<uint32_t> positions(m_sources.size(), 0);
+    std::vector<uint32_t> after = m_counts;
+    uint64_t left = row - rowsBefore(time, &positions);
+    if (time != INT64_MAX)
+        rowsBefore(time + 1, &after);
+
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        uint32_t take = uint32_t(std::min<uint64_t>(after[i] - positions[i], left));
+        positions[i] += take;
+        left -= take;
+    }
+
+    restore(row, positions);
+}
+
+void MergedView::restore(uint64_t row, const std::vector<uint32_t>& positions)
+{
+    m_heap.clear();
+    m_window.clear();
+    m_positions = positions;
+
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        if (positions[i] < m_counts[i])
+            m_heap.push_back({m_sources[i]->viewRowTime(positions[i]), uint32_t(i), positions[i]});
+    }
+    std::make_heap(m_heap.begin(), m_heap.end(), std::greater<Entry>());
+
+    m_windowStart = row;
+    m_position = row;
+}
+
+void MergedView::step()
+{
+    if (m_position % s_checkpointStride == 0)
+        m_checkpoints.emplace(m_position, m_positions);
+
+    std::pop_heap(m_heap.begin(), m_heap.end(), std::greater<Entry>());
+    Entry entry = m_heap.back();
+    m_heap.pop_back();
+
+    uint32_t next = ++m_positions[entry.source];
+    if (next < m_counts[entry.source]) {
+        auto source = m_sources[entry.source];
+        m_heap.push_back({source->viewRowTime(next, entry.row, entry.time), entry.source, next});
+        std::push_heap(m_heap.begin(), m_heap.end(), std::greater<Entry>());
+    }
+
+    m_window.push_back(entry);
+    m_position++;
+    if (m_window.size() > s_windowSize) {
+        m_window.pop_front();
+        m_windowStart++;
+    }
+}
@@ -0,0 +1,74 @@
+//
+//  MergedView.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "SearchEngine.hpp"
+
+// rows of several documents ordered by time, each document keeps its own view, filtered or not,
+// rows with the same time follow document order, rows are materialized on demand around the row
+// being read, merge positions passed on the way are kept as checkpoints to come back to, any other
+// row is found by counting rows of every document before a given time
+class MergedView {
+
+public:
+    static const uint32_t s_windowSize = 1024;     // rows kept behind the last one read, scrolling back doesn't seek
+    static const uint32_t s_seekBack   = 64;       // rows materialized before the row which is sought
+    static const uint32_t s_stepLimit  = 4096;     // rows read ahead rather than sought
+    static const uint32_t s_checkpointStride = 1024;
+
+    MergedView(const std::vector<SearchEngine*>& sources);
+
+    // documents must be fetched, missing time indexes are built on shared workers
+    SearchEngineError   open();
+    // views of documents have changed, e.g. filtered or appended
+    SearchEngineError   refresh();
+
+    uint64_t            rows();
+    SearchEngineError   getLine(uint64_t row, SEMergedLineInfo* info);
+
+private:
+
+    struct Entry {
+        int64_t     time;
+        uint32_t    source;
+        uint32_t    row;
+
+        bool operator>(const Entry& other) const
+        {
+            if (time != other.time)
+                return time > other.time;
+            if (source != other.source)
+                return source > other.source;
+            return row > other.row;
+        }
+    };
+
+    SearchEngineError   buildTimeIndex();
+    uint64_t            rowsBefore(int64_t time, std::vector<uint32_t>* positions);
+    void                seek(uint64_t row);
+    void                restore(uint64_t row, const std::vector<uint32_t>& positions);
+    void                step();
+
+private:
+
+    std::vector<SearchEngine*>  m_sources;
+    std::vector<uint32_t>       m_counts;       // rows of every document view
+    uint64_t                    m_rows = 0;
+    uint64_t                    m_untimedRows = 0;  // rows before the first timestamp of their document
+    int64_t                     m_firstTime = 0;
+    int64_t                     m_lastTime = 0;
+
+    std::vector<Entry>          m_heap;         // next row of every document which has one left
+    std::vector<uint32_t>       m_positions;    // next row of every document
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_checkpoints;   // positions at every s_checkpointStride row
+    std::deque<Entry>           m_window;       // materialized rows before the next one
+    uint64_t                    m_windowStart = 0;
+    uint64_t                    m_position = 0; // next row taken from the heap
+};
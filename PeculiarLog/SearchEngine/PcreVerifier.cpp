@@ -0,0 +1,102 @@
+//
+//  PcreVerifier.cpp
+//  PeculiarLog
+//
+
+#include <string.h>
+
+#include "PcreVerifier.hpp"
+
+#if SE_SUPPORT_PCRE2
+
+std::shared_ptr<PcreVerifier> PcreVerifier::create(const char* pattern, bool ignoreCase, bool utf8, char* error, bool multiline)
+{
+    int errorCode = 0;
+    PCRE2_SIZE errorOffset = 0;
+    uint32_t options = ((ignoreCase)? PCRE2_CASELESS : 0) | ((utf8)? PCRE2_UTF | PCRE2_UCP : 0) | ((multiline)? PCRE2_MULTILINE : 0);
+    auto code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, options, &errorCode, &errorOffset, nullptr);
+    if (!code) {
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(errorCode, message, sizeof(message));
+        printf("[!] unable to compile PCRE2 pattern: %s (offset %zu)\n", (char*)message, (size_t)errorOffset);
+        if (error)
+            snprintf(error, MAX_ERROR_LENGTH + 1, "%.*s", (int)MAX_ERROR_LENGTH, (char*)message);
+        return nullptr;
+    }
+    
+    // interpreter is used if JIT is not available on the host
+    if (pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) != 0) {
+        printf("[+] PCRE2 JIT is not available, using interpreter\n");
+    }
+    
+    std::shared_ptr<PcreVerifier> verifier(new PcreVerifier());
+    verifier->m_code = code;
+    verifier->m_matchOptions = (utf8)? PCRE2_NO_UTF_CHECK : 0;
+    
+    size_t size = 0;
+    if (pcre2_pattern_info(code, PCRE2_INFO_SIZE, &size) == 0)
+        verifier->m_codeSize += size;
+    size = 0;
+    if (pcre2_pattern_info(code, PCRE2_INFO_JITSIZE, &size) == 0)
+        verifier->m_codeSize += size;
+    
+    return verifier;
+}
+
+PcreVerifier::~PcreVerifier()
+{
+    for (int i = 0; i < MAX_BLOCK_COUNT; i++) {
+        if (m_matchData[i])
+            pcre2_match_data_free(m_matchData[i]);
+        if (m_matchContext[i])
+            pcre2_match_context_free(m_matchContext[i]);
+        if (m_jitStack[i])
+            pcre2_jit_stack_free(m_jitStack[i]);
+    }
+    
+    if (m_code)
+        pcre2_code_free(m_code);
+}
+
+void PcreVerifier::prepare(uint32_t slot)
+{
+    if (m_matchData[slot])
+        return;
+    
+    // default JIT stack lives on the machine stack and is too small for heavy backtracking
+    m_matchData[slot] = pcre2_match_data_create_from_pattern(m_code, nullptr);
+    m_matchContext[slot] = pcre2_match_context_create(nullptr);
+    m_jitStack[slot] = pcre2_jit_stack_create(s_jitStackStart, s_jitStackMax, nullptr);
+    if (m_matchContext[slot] && m_jitStack[slot])
+        pcre2_jit_stack_assign(m_matchContext[slot], nullptr, m_jitStack[slot]);
+}
+
+bool PcreVerifier::match(uint32_t slot, const char* line, uint32_t length)
+{
+    prepare(slot);
+    
+    // errors like match or stack limit are treated as no match
+    int rc = pcre2_match(m_code, (PCRE2_SPTR)line, length, 0, m_matchOptions, m_matchData[slot], m_matchContext[slot]);
+    return rc >= 0;
+}
+
+bool PcreVerifier::find(uint32_t slot, const char* data, size_t length, size_t start, size_t* matchStart, size_t* matchEnd)
+{
+    prepare(slot);
+    
+    int rc = pcre2_match(m_code, (PCRE2_SPTR)data, length, start, m_matchOptions, m_matchData[slot], m_matchContext[slot]);
+    if (rc < 0)
+        return false;
+    
+    auto ovector = pcre2_get_ovector_pointer(m_matchData[slot]);
+    *matchStart = ovector[0];
+    *matchEnd = ovector[1];
+    return true;
+}
+
+size_t PcreVerifier::memoryUsage() const
+{
+    return sizeof(PcreVerifier) + m_codeSize;
+}
+
+#endif // SE_SUPPORT_PCRE2
@@ -0,0 +1,56 @@
+//
+//  PcreVerifier.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include "SearchEngine.hpp"
+
+#if SE_SUPPORT_PCRE2
+
+#include <memory>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include "pcre2.h"
+
+#include "LineVerifier.hpp"
+
+class PcreVerifier : public LineVerifier {
+
+public:
+    // multiline pattern matches ^ and $ at line boundaries, so that it can be searched for in a range of lines
+    static std::shared_ptr<PcreVerifier> create(const char* pattern, bool ignoreCase, bool utf8, char* error, bool multiline = false);
+
+    ~PcreVerifier();
+
+    bool                match(uint32_t slot, const char* line, uint32_t length) override;
+    size_t              memoryUsage() const override;
+
+    // leftmost match at or after start, data is searched as a whole and matches may cross lines
+    bool                find(uint32_t slot, const char* data, size_t length, size_t start, size_t* matchStart, size_t* matchEnd);
+
+private:
+
+    PcreVerifier() {}
+
+    void                prepare(uint32_t slot);
+
+private:
+
+    static const size_t s_jitStackStart = 32 * 1024;
+    static const size_t s_jitStackMax   = 1024 * 1024;
+
+private:
+
+    pcre2_code*             m_code = nullptr;
+    size_t                  m_codeSize = 0;
+    uint32_t                m_matchOptions = 0;     // UTF-8 is validated by fetch, no need to check every line
+
+    // created on first use of a worker slot
+    pcre2_match_data*       m_matchData[MAX_BLOCK_COUNT] = {};
+    pcre2_match_context*    m_matchContext[MAX_BLOCK_COUNT] = {};
+    pcre2_jit_stack*        m_jitStack[MAX_BLOCK_COUNT] = {};
+};
+
+#endif // SE_SUPPORT_PCRE2
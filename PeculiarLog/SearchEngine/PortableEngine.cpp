@@ -0,0 +1,542 @@
+//
+//  PortableEngine.cpp
+//  PeculiarLog
+//
+
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "PortableEngine.hpp"
+#include "UTF8Validator.hpp"
+
+#if SE_SUPPORT_PORTABLE
+
+struct PortableMatcher {
+    std::vector<std::string>                    literals;   // lines containing any of them match, found with memmem
+    std::shared_ptr<PcreVerifier>               regex;      // searched for over the range unless there are literals
+    std::vector<std::shared_ptr<PcreVerifier>>  entries;    // watchlist entries which are not literals, checked on matching lines
+    std::vector<std::string>                    watchlist;  // literal watchlist entries, checked on matching lines
+};
+
+static bool isLiteral(const std::string& pattern)
+{
+    return pattern.find_first_of("\\^$.|?*+()[]{}\n") == std::string::npos;
+}
+
+// every character but letters and digits is escaped, so that literal entries can be a part of a regex
+static std::string escape(const std::string& literal)
+{
+    std::string escaped;
+    for (char c : literal) {
+        if (!isalnum((unsigned char)c) && !(c & 0x80))
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static inline uint32_t lineLength(const char* line, const char* eol)
+{
+    uint32_t length = uint32_t(eol - line);
+    if (length && line[length - 1] == '\r')
+        length--;
+    return length;
+}
+
+PortableEngine::PortableEngine() {}
+PortableEngine::~PortableEngine() {}
+
+SearchEngineError PortableEngine::init(const char* file)
+{
+    SearchEngineError err = SearchEngine::init(file);
+    if (err != NoError)
+        return err;
+
+    printf("[+] portable engine, patterns are matched with PCRE2\n");
+
+    if (!m_recordHeader.empty()) {
+        // header is anchored at line start and checked on every line counted by fetch
+        std::string header = "^(?:" + m_recordHeader + ")";
+        m_header = PcreVerifier::create(header.c_str(), false, false, nullptr);
+        if (!m_header) {
+            printf("[!] unable to compile record header\n");
+            return BadArgument;
+        }
+    }
+
+    m_matcher = nullptr;
+
+    return NoError;
+}
+
+SearchEngineError PortableEngine::fetch(uint32_t blockIdx, SEBlockInfo* info)
+{
+    if (!info)
+        return BadArgument;
+
+    if (blockIdx > MAX_BLOCK_COUNT - 1)
+        return BadArgument;
+
+    if (!m_blocks[blockIdx].active)
+        return BadArgument;
+
+    // line index and block info are known from sidecar index
+    if (restoreBlock(blockIdx, info))
+        return NoError;
+
+    uint64_t pos = m_blocks[blockIdx].byteOffset;
+    uint64_t size = m_blocks[blockIdx].size;
+
+    auto& lineIndex = m_blocks[blockIdx].lineIndex;
+    lineIndex.clear();
+    lineIndex.push_back(pos);
+    auto& records = m_blocks[blockIdx].records;
+    records.clear();
+
+    // block is scanned in pieces split at line starts, as hyperscan engine does, last line without EOL is not counted
+    ScanProbe probe;
+    uint32_t slot = (m_header)? acquireSlot() : 0;
+    uint64_t end = pos + size;
+    info->encoding = ASCIIEncoding;
+    const uint64_t pieceSize = s_filterChunkSize;
+    prefetchRange(pos, std::min(pieceSize, size));
+    for (uint64_t piece = pos; piece < end; ) {
+        uint64_t pieceEnd = lineStartAfter(std::min(piece + pieceSize, end), end);
+        prefetchRange(pieceEnd, std::min(pieceSize, end - pieceEnd));
+
+        uint32_t pieceLines = info->lines;
+        const char* line = m_mem + piece;
+        const char* lineEnd = m_mem + pieceEnd;
+        while (line < lineEnd) {
+            auto eol = (const char*)memchr(line, s_eolPattern[0], lineEnd - line);
+            if (!eol)
+                break;
+
+            if (m_header && m_header->match(slot, line, uint32_t(eol - line)))
+                records.push_back(info->lines);
+            info->maxLength = std::max(info->maxLength, uint32_t(eol - line));
+            info->lines++;
+            // index every s_lineIndexStride line start
+            if (info->lines % s_lineIndexStride == 0)
+                lineIndex.push_back(eol + 1 - m_mem);
+            line = eol + 1;
+        }
+
+        auto encoding = UTF8Validator::validate(m_mem + piece, pieceEnd - piece);
+        if (encoding == InvalidUTF8Encoding || info->encoding == ASCIIEncoding)
+            info->encoding = encoding;
+
+        scannedRange(piece, pieceEnd - piece);
+        m_stats.fetchProgress.add(blockIdx, pieceEnd - piece, info->lines - pieceLines, 0);
+        piece = pieceEnd;
+    }
+    if (m_header)
+        releaseSlot(slot);
+
+    m_blocks[blockIdx].lines = info->lines;
+    info->records = uint32_t(records.size());
+
+    if (info->encoding == InvalidUTF8Encoding)
+        printf("[!] block %d is not valid UTF-8, patterns are matched as bytes\n", blockIdx);
+    m_blocks[blockIdx].encoding = info->encoding;
+    m_blocks[blockIdx].maxLength = info->maxLength;
+
+    probe.finish(m_stats.fetch[blockIdx], size, info->lines, 0);
+    blockFetched(blockIdx);
+
+    return NoError;
+}
+
+void PortableEngine::close()
+{
+    // running tasks may still use the matcher
+    stopAsync();
+    
+    // matcher is owned by filter result
+    m_matcher = nullptr;
+    m_header = nullptr;
+
+    SearchEngine::close();
+}
+
+SearchEngineError PortableEngine::getStats(SEStats* stats)
+{
+    auto err = SearchEngine::getStats(stats);
+    if (err != NoError)
+        return err;
+
+    if (m_filtered && m_filterResult)
+        stats->databaseSize += m_filterResult->databaseSize;
+    if (m_header)
+        stats->databaseSize += m_header->memoryUsage();
+
+    return NoError;
+}
+
+SearchEngineError PortableEngine::setIgnoreCase(bool ignoreCase)
+{
+    m_ignoreCase = ignoreCase;
+    return NoError;
+}
+
+SearchEngineError PortableEngine::setFuzzy(uint32_t distance, bool hamming)
+{
+    if (distance > MAX_FUZZY_DISTANCE)
+        return BadArgument;
+
+    if (distance) {
+        printf("[!] approximate matching is not supported by portable engine\n");
+        return NotSupported;
+    }
+
+    m_fuzzyDistance = 0;
+    m_fuzzyHamming = hamming;
+    return NoError;
+}
+
+SearchEngineError PortableEngine::setFieldMode(bool fieldMode)
+{
+    // field predicates are matched with hyperscan
+    if (fieldMode) {
+        printf("[!] field queries are not supported by portable engine\n");
+        return NotSupported;
+    }
+
+    m_fieldMode = false;
+    return NoError;
+}
+
+SearchEngineError PortableEngine::setUTF8(bool utf8)
+{
+    // lines are not checked again by PCRE2, so the file must be valid UTF-8
+    if (utf8 && fileEncoding() == InvalidUTF8Encoding)
+        return NotSupported;
+
+    m_utf8 = utf8;
+    return NoError;
+}
+
+FilterCacheKey PortableEngine::compileKey(const char* pattern)
+{
+    FilterCacheKey key = {pattern, (m_ignoreCase)? s_caselessFlag : 0u};
+    if (m_utf8 && fileEncoding() == UTF8Encoding)
+        key.flags |= s_utf8Flag;
+    return key;
+}
+
+std::shared_ptr<FilterResult> PortableEngine::compilePattern(const FilterCacheKey& key, char* error)
+{
+    // called from setPattern() and compile thread, must not touch engine state except cache and stats
+    auto stime = std::chrono::steady_clock::now();
+    auto result = std::make_shared<FilterResult>();
+    auto matcher = std::make_shared<PortableMatcher>();
+    bool caseless = (key.flags & s_caselessFlag) != 0;
+    bool utf8 = (key.flags & s_utf8Flag) != 0;
+
+    if (key.watchlist) {
+        // one entry per line, empty lines are skipped
+        size_t pos = 0;
+        while (pos < key.pattern.size()) {
+            size_t end = key.pattern.find('\n', pos);
+            if (end == std::string::npos)
+                end = key.pattern.size();
+            size_t length = end - pos;
+            if (length && key.pattern[end - 1] == '\r')
+                length--;
+            if (length)
+                result->watchlist.emplace_back(key.pattern, pos, length);
+            pos = end + 1;
+        }
+
+        if (result->watchlist.empty()) {
+            printf("[!] watchlist is empty\n");
+            if (error)
+                strncpy(error, "watchlist is empty", MAX_ERROR_LENGTH);
+            return nullptr;
+        }
+
+        // exact literals are found with memmem, anything else as a single alternation of all entries
+        if (key.literal && !caseless) {
+            matcher->literals = result->watchlist;
+            matcher->watchlist = result->watchlist;
+        } else {
+            std::string alternation;
+            for (size_t i = 0; i < result->watchlist.size(); i++) {
+                std::string entry = (key.literal)? escape(result->watchlist[i]) : result->watchlist[i];
+                char message[MAX_ERROR_LENGTH + 1] = {0};
+                auto verifier = PcreVerifier::create(entry.c_str(), caseless, utf8, message);
+                if (!verifier) {
+                    printf("[!] unable to compile watchlist: entry %zu: %s\n", i + 1, message);
+                    if (error)
+                        snprintf(error, MAX_ERROR_LENGTH + 1, "entry %zu: %s", i + 1, message);
+                    return nullptr;
+                }
+                matcher->entries.push_back(verifier);
+                alternation += ((i)? "|(?:" : "(?:") + entry + ")";
+            }
+            matcher->regex = PcreVerifier::create(alternation.c_str(), caseless, utf8, error, true);
+            if (!matcher->regex)
+                return nullptr;
+        }
+    } else if (isLiteral(key.pattern) && !caseless) {
+        matcher->literals.push_back(key.pattern);
+    } else {
+        matcher->regex = PcreVerifier::create(key.pattern.c_str(), caseless, utf8, error, true);
+        if (!matcher->regex)
+            return nullptr;
+    }
+
+    result->databaseSize = sizeof(PortableMatcher);
+    if (matcher->regex)
+        result->databaseSize += matcher->regex->memoryUsage();
+    for (auto& entry : matcher->entries)
+        result->databaseSize += entry->memoryUsage();
+    for (auto& literal : matcher->literals)
+        result->databaseSize += literal.size();
+    result->database = matcher;
+    compileGrams(key, caseless, result.get());
+
+    auto ctime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stime);
+    m_stats.compileTime.store(ctime.count(), std::memory_order_relaxed);
+
+    return result;
+}
+
+SearchEngineError PortableEngine::setPattern(const char* pattern, char* error)
+{
+    printf("[+] set pattern = \"%s\"\n", pattern);
+
+    m_templateFilter = false;
+
+    if (pattern[0] == 0)
+        m_filtered = false;
+    else
+        m_filtered = true;
+
+    if (m_filtered)
+        return useFilter(compileKey(pattern), error);
+
+    return NoError;
+}
+
+SearchEngineError PortableEngine::setWatchlist(const char* path, bool literal, char* error)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        printf("[!] failed to open %s\n", path);
+        return FileOpenFailed;
+    }
+
+    // whole list is the cache key, so editing the file and loading it again compiles it again
+    std::stringstream content;
+    content << file.rdbuf();
+
+    FilterCacheKey key = compileKey("");
+    key.pattern = content.str();
+    key.watchlist = true;
+    key.literal = literal;
+    if (literal) {
+        // literals are matched as bytes
+        key.flags &= s_caselessFlag;
+    }
+
+    printf("[+] set watchlist = \"%s\"\n", path);
+
+    m_templateFilter = false;
+    m_filtered = true;
+
+    return useFilter(key, error);
+}
+
+SearchEngineError PortableEngine::useFilter(const FilterCacheKey& key, char* error)
+{
+    auto result = m_filterCache.find(key);
+    EngineStats::count((result)? m_stats.cacheHits : m_stats.cacheMisses);
+    if (!result) {
+        result = compilePattern(key, error);
+        if (!result)
+            return UnknownError;
+        cacheFilterResult(key, result);
+    }
+
+    m_matcher = (PortableMatcher*)result->database.get();
+    m_filterKey = key;
+    resetFilterResult(result);
+
+    return NoError;
+}
+
+SearchEngineError PortableEngine::filter(uint32_t blockIdx, SEBlockInfo* info)
+{
+    if (!m_filtered)
+        return NoError;
+
+    if (!info)
+        return BadArgument;
+
+    if (blockIdx > MAX_BLOCK_COUNT - 1)
+        return BadArgument;
+
+    if (!m_blocks[blockIdx].active)
+        return BadArgument;
+
+    auto result = &m_filterResult->blocks[blockIdx];
+    if (result->filtered) {
+        // block is restored from filter cache
+        info->lines = uint32_t(result->matches.size());
+        info->maxLength = result->maxLength;
+        m_stats.filter[blockIdx].reset();
+        m_stats.filter[blockIdx].matches.store(info->lines, std::memory_order_relaxed);
+        return NoError;
+    }
+
+    if (m_templateFilter)
+        return filterTemplates(blockIdx, info);
+
+    auto block = &m_blocks[blockIdx];
+
+    ScanProbe probe;
+    uint64_t callbacks = 0;
+    uint64_t candidates = 0;
+    uint32_t maxLength = 0;
+    auto hits = (m_filterResult->watchlist.empty())? nullptr : &result->hits;
+    uint32_t slot = acquireSlot();
+    auto err = filterBlock(slot, blockIdx, result->matches, &maxLength, &callbacks, &candidates, hits);
+    releaseSlot(slot);
+    scannedRange(block->byteOffset, block->size);
+    if (err != NoError)
+        return err;
+
+    info->lines = uint32_t(result->matches.size());
+    info->maxLength = maxLength;
+
+    result->maxLength = maxLength;
+    result->filtered = true;
+
+    probe.finish(m_stats.filter[blockIdx], block->size, callbacks, result->matches.size());
+    m_stats.filter[blockIdx].candidates.store(candidates, std::memory_order_relaxed);
+    m_stats.filterProgress.add(blockIdx, block->size, block->lines, result->matches.size());
+
+    return NoError;
+}
+
+SearchEngineError PortableEngine::filterRange(uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                              uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits)
+{
+    return scanRange(m_matcher, slot, pos, size, firstLine, matches, maxLength, callbacks, candidates, hits);
+}
+
+SearchEngineError PortableEngine::findRange(const FilterResult& pattern, uint32_t slot, uint64_t pos, uint64_t size, std::vector<uint32_t>& matches,
+                                            uint64_t* callbacks, uint64_t* candidates)
+{
+    uint32_t maxLength = 0;
+    return scanRange((PortableMatcher*)pattern.database.get(), slot, pos, size, 0, matches, &maxLength, callbacks, candidates, nullptr);
+}
+
+SearchEngineError PortableEngine::scanRange(PortableMatcher* matcher, uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                            uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits)
+{
+    if (!matcher)
+        return EngineOpFailed;
+
+    matches.clear();
+    if (hits)
+        hits->clear();
+
+    const char* data = m_mem + pos;
+    const char* end = data + size;
+    auto& literals = matcher->literals;
+
+    // next occurrence of every literal, searched for again once the scan passes it
+    std::vector<const char*> next(literals.size());
+    for (size_t i = 0; i < literals.size(); i++) {
+        auto found = (const char*)memmem(data, size, literals[i].data(), literals[i].size());
+        next[i] = (found)? found : end;
+    }
+
+    // candidate is the leftmost match after the current line start, lines are counted up to it
+    // and the rest of its line is skipped, so every matching line costs a single search
+    const char* line = data;
+    uint32_t number = firstLine;
+    while (line < end) {
+        const char* found = end;
+        const char* foundEnd = end;
+        if (!literals.empty()) {
+            for (size_t i = 0; i < literals.size(); i++) {
+                if (next[i] < line) {
+                    auto p = (const char*)memmem(line, end - line, literals[i].data(), literals[i].size());
+                    next[i] = (p)? p : end;
+                }
+                if (next[i] < found) {
+                    found = next[i];
+                    foundEnd = found + literals[i].size();
+                }
+            }
+        } else {
+            size_t matchStart, matchEnd;
+            if (matcher->regex->find(slot, data, size, line - data, &matchStart, &matchEnd)) {
+                found = data + matchStart;
+                foundEnd = data + std::max(matchStart, matchEnd);
+            }
+        }
+        if (found >= end)
+            break;
+        (*callbacks)++;
+
+        for (const char* eol; (eol = (const char*)memchr(line, s_eolPattern[0], found - line)); number++) {
+            line = eol + 1;
+        }
+        auto eol = (const char*)memchr(found, s_eolPattern[0], end - found);
+        if (!eol)
+            break;
+
+        // match which crosses lines is confirmed within its own line
+        bool matched = true;
+        if (foundEnd > eol) {
+            matched = matcher->regex->match(slot, line, lineLength(line, eol));
+            (*candidates)++;
+        }
+
+        if (matched) {
+            *maxLength = std::max(uint32_t(eol - line), *maxLength);
+            matches.push_back(number);
+            if (hits) {
+                // literals are counted at every position they occur like hyperscan reports them,
+                // patterns once per match, matches of a pattern don't overlap
+                uint32_t length = lineLength(line, eol);
+                for (uint32_t i = 0; i < matcher->watchlist.size(); i++) {
+                    auto& entry = matcher->watchlist[i];
+                    uint32_t count = 0;
+                    for (auto p = line; (p = (const char*)memmem(p, line + length - p, entry.data(), entry.size())); p++)
+                        count++;
+                    if (count) {
+                        hits->push_back(i);
+                        hits->push_back(count);
+                    }
+                }
+                for (uint32_t i = 0; i < matcher->entries.size(); i++) {
+                    uint32_t count = 0;
+                    size_t start = 0, matchStart, matchEnd;
+                    while (start <= length && matcher->entries[i]->find(slot, line, length, start, &matchStart, &matchEnd)) {
+                        count++;
+                        start = (matchEnd > matchStart)? matchEnd : matchStart + 1;
+                    }
+                    if (count) {
+                        hits->push_back(i);
+                        hits->push_back(count);
+                    }
+                }
+            }
+        }
+
+        line = eol + 1;
+        number++;
+    }
+
+    return NoError;
+}
+
+#endif // SE_SUPPORT_PORTABLE
@@ -0,0 +1,67 @@
+//
+//  PortableEngine.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include "SearchEngine.hpp"
+
+#if SE_SUPPORT_PORTABLE
+
+#include <memory>
+
+#include "PcreVerifier.hpp"
+
+struct PortableMatcher;
+
+// lines are found with memchr and plain literals with memmem, both vectorized by libc on any host,
+// other patterns are searched for with PCRE2 JIT over the whole range and confirmed per line,
+// approximate matching, field queries and regex keys need hyperscan and are not supported
+class PortableEngine : public SearchEngine {
+
+public:
+    PortableEngine();
+    ~PortableEngine();
+
+    SearchEngineError   init(const char* file) override;
+    SearchEngineError   fetch(uint32_t blockIdx, SEBlockInfo* info) override;
+    void                close() override;
+
+    SearchEngineError   getStats(SEStats* stats) override;
+
+    SearchEngineError   setIgnoreCase(bool ignoreCase) override;
+    SearchEngineError   setFuzzy(uint32_t distance, bool hamming) override;
+    SearchEngineError   setFieldMode(bool fieldMode) override;
+    SearchEngineError   setUTF8(bool utf8) override;
+    SearchEngineError   setPattern(const char* pattern, char* error) override;
+    SearchEngineError   setWatchlist(const char* path, bool literal, char* error) override;
+    SearchEngineError   filter(uint32_t blockIdx, SEBlockInfo* info) override;
+
+protected:
+
+    FilterCacheKey      compileKey(const char* pattern) override;
+    std::shared_ptr<FilterResult> compilePattern(const FilterCacheKey& key, char* error) override;
+    SearchEngineError   filterRange(uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                    uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits) override;
+    SearchEngineError   findRange(const FilterResult& pattern, uint32_t slot, uint64_t pos, uint64_t size, std::vector<uint32_t>& matches,
+                                  uint64_t* callbacks, uint64_t* candidates) override;
+
+private:
+
+    SearchEngineError   useFilter(const FilterCacheKey& key, char* error);
+    SearchEngineError   scanRange(PortableMatcher* matcher, uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                  uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits);
+
+private:
+
+    static const uint32_t   s_caselessFlag = 1;
+    static const uint32_t   s_utf8Flag = 2;
+
+private:
+
+    PortableMatcher*                m_matcher = nullptr;    // owned by filter result
+    std::shared_ptr<PcreVerifier>   m_header;               // first line of a record
+};
+
+#endif // SE_SUPPORT_PORTABLE
@@ -0,0 +1,69 @@
+//
+//  RegexExtractor.cpp
+//  PeculiarLog
+//
+
+#include <string.h>
+
+#include "RegexExtractor.hpp"
+#include "HyperscanEngine.hpp"
+
+#if SE_SUPPORT_HYPERSCAN
+
+std::shared_ptr<RegexExtractor> RegexExtractor::create(const char* pattern, bool ignoreCase, char* error)
+{
+    std::shared_ptr<RegexExtractor> extractor(new RegexExtractor());
+    
+    // start of match is needed to cut the key out of the line
+    hs_compile_error_t *compile_err;
+    unsigned int flags = HS_FLAG_SOM_LEFTMOST | ((ignoreCase)? HS_FLAG_CASELESS : 0);
+    if (hs_compile(pattern, flags, HS_MODE_BLOCK, nullptr, &extractor->m_database, &compile_err) != HS_SUCCESS) {
+        printf("[!] unable to compile key pattern: %s\n", compile_err->message);
+        if (error) {
+            size_t len = strlen(compile_err->message);
+            strncpy(error, compile_err->message, (len > MAX_ERROR_LENGTH)? MAX_ERROR_LENGTH : len);
+        }
+        hs_free_compile_error(compile_err);
+        return nullptr;
+    }
+    
+    return extractor;
+}
+
+RegexExtractor::~RegexExtractor()
+{
+    if (m_database)
+        hs_free_database(m_database);
+}
+
+bool RegexExtractor::extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength)
+{
+    auto scratch = HyperscanEngine::workerScratch(m_database);
+    if (!scratch)
+        return false;
+    
+    // every match end is reported, keep the leftmost start and the longest match from it
+    struct Span {
+        unsigned long long from = -1;
+        unsigned long long to = 0;
+    } span;
+    
+    auto res = hs_scan(m_database, line, length, 0, scratch,
+        [](unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *ctx) -> int {
+            auto span = (Span*)ctx;
+            if (from < span->from || (from == span->from && to > span->to)) {
+                span->from = from;
+                span->to = to;
+            }
+            return 0;
+        }, &span);
+    
+    if (res != HS_SUCCESS || span.from == (unsigned long long)-1)
+        return false;
+    
+    *key = line + span.from;
+    *keyLength = uint32_t(span.to - span.from);
+    return true;
+}
+
+#endif // SE_SUPPORT_HYPERSCAN
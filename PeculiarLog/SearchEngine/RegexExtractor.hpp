@@ -0,0 +1,37 @@
+//
+//  RegexExtractor.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <memory>
+
+#include "SearchEngine.hpp"
+
+#if SE_SUPPORT_HYPERSCAN
+
+#include "hs.h"
+
+#include "Aggregator.hpp"
+
+// key is the leftmost-longest match of the regex within the line
+class RegexExtractor : public KeyExtractor {
+
+public:
+    static std::shared_ptr<RegexExtractor> create(const char* pattern, bool ignoreCase, char* error);
+    
+    ~RegexExtractor();
+    
+    bool                extract(uint32_t blockIdx, const char* line, uint32_t length, const char** key, uint32_t* keyLength) override;
+    
+private:
+    
+    RegexExtractor() {}
+    
+private:
+    
+    hs_database_t*      m_database = nullptr;
+};
+
+#endif // SE_SUPPORT_HYPERSCAN
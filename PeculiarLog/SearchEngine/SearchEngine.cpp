@@ -6,26 +6,71 @@
 //  Copyright © 2016 Alexander Hude. All rights reserved.
 //
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include <math.h>
+#include <stdlib.h>
+
 #include <thread>   // std::thread::hardware_concurrency()
+#include <algorithm>
+#include <new>
+#include <random>
 
 #include "SearchEngine.hpp"
 #include "HyperscanEngine.hpp"
+#include "PortableEngine.hpp"
+#include "UTF8Validator.hpp"
+#include "WorkerPool.hpp"
+#include "MemoryBudget.hpp"
+#include "TimestampParser.hpp"
+#include "MergedView.hpp"
 
-#define DEBUG_BLOCKS 1
 
 const char*  SearchEngine::s_eolPattern = "\n";
 
 SearchEngine::SearchEngine()
 {
     m_size = 0;
+    MemoryBudget::shared().attach(this);
+}
+
+void* SearchEngine::operator new(size_t size)
+{
+    void* pointer = nullptr;
+    if (posix_memalign(&pointer, alignof(SearchEngine), size) != 0)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void SearchEngine::operator delete(void* pointer)
+{
+    free(pointer);
 }
 
 SearchEngine::~SearchEngine()
 {
-    
+    stopCompiler();
+    WorkerPool::shared().detach(this);
+    MemoryBudget::shared().detach(this);
+}
+
+void SearchEngine::setIndexDir(const char* dir)
+{
+    m_indexDir = (dir)? dir : "";
+}
+
+void SearchEngine::setRecordHeader(const char* header)
+{
+    m_recordHeader = (header)? header : "";
+}
+
+void SearchEngine::setGramIndex(bool gramIndex)
+{
+    m_gramIndex = gramIndex;
 }
 
 SearchEngineError SearchEngine::init(const char* file)
@@ -42,104 +87,2772 @@ SearchEngineError SearchEngine::init(const char* file)
         return FileStatFailed;
     }
     
-    m_size = stat_buf.st_size;
+    m_size = stat_buf.st_size;
+    m_mtime = stat_buf.st_mtime;
+    
+    // pipes and sockets can't be mapped, their input is spilled to a file which is mapped instead
+    if (!S_ISREG(stat_buf.st_mode))
+        return initStream(file);
+    
+    m_mapSize = m_size;
+    m_mem = (const char*)mmap(nullptr, m_size, PROT_READ, MAP_FILE | MAP_SHARED, m_fd, 0);
+    if (m_mem == MAP_FAILED) {
+        printf("[!] mmap failed: %d.\n", errno);
+        return FileMapFailed;
+    }
+    
+    if (!m_indexDir.empty())
+        m_index.reset(new SidecarIndex(m_indexDir.c_str(), file, s_lineIndexStride));
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::initStream(const char* file)
+{
+    int spillFd = StreamInput::createSpillFile();
+    if (spillFd < 0)
+        return FileOpenFailed;
+    
+    // whole reserved range is mapped up front, so lines keep their addresses while the file grows
+    m_mem = (const char*)mmap(nullptr, StreamInput::s_reserveSize, PROT_READ, MAP_FILE | MAP_SHARED, spillFd, 0);
+    if (m_mem == MAP_FAILED) {
+        printf("[!] mmap failed: %d.\n", errno);
+        ::close(spillFd);
+        return FileMapFailed;
+    }
+    
+    // lines are indexed by stream reader which doesn't look for headers
+    if (!m_recordHeader.empty()) {
+        printf("[!] records are not supported for stream input, one record per line\n");
+        m_recordHeader.clear();
+    }
+    
+    m_size = 0;
+    m_mapSize = StreamInput::s_reserveSize;
+    m_stream.reset(new StreamInput(m_fd, spillFd, s_lineIndexStride));
+    m_fd = spillFd;
+    
+    printf("[+] reading stream input from %s\n", file);
+    return NoError;
+}
+
+uint64_t SearchEngine::totalBytes()
+{
+    return m_size;
+}
+
+uint32_t SearchEngine::blockCount()
+{
+    return m_blockCount;
+}
+
+bool SearchEngine::isStream()
+{
+    return m_stream != nullptr;
+}
+
+uint32_t SearchEngine::formatBlocks()
+{
+    uint32_t cores = std::thread::hardware_concurrency();
+    
+    // stream starts with an empty block, lines are appended to it as they arrive, see pollStream
+    if (m_stream) {
+        auto block = &m_blocks[0];
+        block->active = true;
+        block->indexed = true;
+        block->byteOffset = 0;
+        block->size = 0;
+        block->lines = 0;
+        block->maxLength = 0;
+        block->encoding = ASCIIEncoding;
+        block->lineIndex.clear();
+        m_blockCount = 1;
+        m_stats.fetchProgress.start(0);
+        return m_blockCount;
+    }
+    
+    // blocks restored from sidecar index are not scanned again, only appended tail is split,
+    // headers of records are not kept in the index, so blocks are scanned to find them
+    uint32_t count = 0;
+    uint64_t offset = 0;
+    std::vector<SidecarIndex::Block> indexed;
+    if (m_index && m_recordHeader.empty() && m_index->load(m_mem, m_size, m_mtime, indexed)) {
+        for (auto& entry : indexed) {
+            auto block = &m_blocks[count++];
+            block->active = true;
+            block->indexed = true;
+            block->byteOffset = entry.byteOffset;
+            block->size = entry.size;
+            block->lines = entry.lines;
+            block->maxLength = entry.maxLength;
+            block->encoding = entry.encoding;
+            block->lineIndex = std::move(entry.lineIndex);
+            if (!entry.grams.empty()) {
+                block->grams = std::make_shared<const std::vector<uint64_t>>(std::move(entry.grams));
+                m_indexMemory += block->grams->capacity() * sizeof(uint64_t);
+            }
+        }
+        offset = m_blocks[count - 1].byteOffset + m_blocks[count - 1].size;
+        
+        // last line continues in appended data or there is no room for new blocks, last block is scanned with the tail
+        if (offset < m_size && (offset == 0 || m_mem[offset - 1] != '\n' || count == MAX_BLOCK_COUNT)) {
+            count--;
+            m_blocks[count].indexed = false;
+            offset = m_blocks[count].byteOffset;
+        }
+    }
+    
+    // small head block goes first, so that rows can be shown before the rest of the file is fetched
+    if (count == 0 && m_size > 2 * s_headBlockSize) {
+        auto eol = (const char*)memchr(m_mem + s_headBlockSize, s_eolPattern[0], m_size - s_headBlockSize);
+        if (eol) {
+            auto block = &m_blocks[count++];
+            block->active = true;
+            block->indexed = false;
+            block->byteOffset = 0;
+            block->size = eol - m_mem + 1;
+            offset = block->size;
+        }
+    }
+    
+    if (offset < m_size || count == 0) {
+        uint32_t blocks = (m_size - offset > 1024*1024)? cores : 1;
+        blocks = std::min(blocks, MAX_BLOCK_COUNT - count);
+        printf("[+] use %d block (available %d logical cores)\n", blocks, cores);
+        
+        // every block ends at line boundary
+        uint64_t blockSize = (m_size - offset) / blocks;
+        for (uint32_t i = 0; i < blocks; i++) {
+            auto block = &m_blocks[count++];
+            block->active = true;
+            block->indexed = false;
+            block->byteOffset = offset;
+            
+            uint64_t end = m_size;
+            if (i + 1 < blocks && offset + blockSize < m_size) {
+                auto eol = (const char*)memchr(m_mem + offset + blockSize, s_eolPattern[0], m_size - offset - blockSize);
+                if (eol)
+                    end = eol - m_mem + 1;
+            }
+            block->size = end - offset;
+            offset = end;
+            
+            if (offset == m_size)
+                break;
+        }
+    }
+    
+    m_blockCount = count;
+    m_stats.fetchProgress.start(m_size);
+    
+    return count;
+}
+
+SearchEngineError SearchEngine::pollStream(SEStreamInfo* info)
+{
+    if (!info)
+        return BadArgument;
+    
+    memset(info, 0, sizeof(SEStreamInfo));
+    if (!m_stream)
+        return NotSupported;
+    
+    // scans of the previous poll are done or won't run anymore
+    mergeAppends(true);
+    
+    std::vector<StreamInput::Append> appends;
+    info->ended = m_stream->take(appends);
+    info->receivedBytes = m_stream->receivedBytes();
+    if (appends.empty())
+        return NoError;
+    
+    // blocks of a filter result which has been filtered to the end grow along with the file
+    bool filtered = m_filtered && m_filterResult;
+    bool complete = filtered;
+    for (int i = 0; filtered && i < m_blockCount; i++) {
+        complete &= m_filterResult->blocks[i].filtered;
+    }
+    
+    // no tasks are running, so blocks are extended in place
+    uint64_t touchedBlocks = 0;
+    for (auto& append : appends) {
+        uint32_t blockIdx = append.blockIdx;
+        auto block = &m_blocks[blockIdx];
+        if (blockIdx == m_blockCount) {
+            block->active = true;
+            block->indexed = true;
+            block->byteOffset = append.byteOffset;
+            block->size = 0;
+            block->lines = 0;
+            block->maxLength = 0;
+            block->encoding = ASCIIEncoding;
+            block->lineIndex.clear();
+            m_stats.fetch[blockIdx].reset();
+            m_blockCount++;
+            blockFetched(blockIdx);
+            
+            if (filtered) {
+                m_filterResult->blocks[blockIdx] = FilterResult::Block();
+                m_filterResult->blocks[blockIdx].filtered = complete;
+                m_filterResult->blockCount = m_blockCount;
+            }
+        }
+        
+        size_t capacity = block->lineIndex.capacity();
+        block->lineIndex.insert(block->lineIndex.end(), append.lineIndex.begin(), append.lineIndex.end());
+        m_indexMemory += (block->lineIndex.capacity() - capacity) * sizeof(uint64_t);
+        
+        block->size += append.size;
+        block->lines += append.lines;
+        block->maxLength = std::max(block->maxLength, append.maxLength);
+        block->encoding = std::max(block->encoding, append.encoding);
+        m_size = append.byteOffset + append.size;
+        m_stats.fetch[blockIdx].bytes.fetch_add(append.size, std::memory_order_relaxed);
+        m_stats.fetch[blockIdx].callbacks.fetch_add(append.lines, std::memory_order_relaxed);
+        m_stats.fetchProgress.grow(append.size);
+        m_stats.fetchProgress.add(blockIdx, append.size, append.lines, 0);
+        touchedBlocks |= 1ULL << blockIdx;
+        
+        info->lines += append.lines;
+        info->maxLength = std::max(info->maxLength, append.maxLength);
+    }
+    
+    if (filtered) {
+        filterAppends(appends);
+        info->filterTasks = uint32_t(m_appendScans.size());
+    }
+    
+    // time index doesn't cover appended lines, it's built again by the view which needs it
+    m_timeIndexed = false;
+    
+    for (auto& append : appends) {
+        scannedRange(append.byteOffset, append.size);
+    }
+    
+    // other cached results don't cover appended lines, blocks which grew are filtered again once they are used
+    m_filterCache.forEach([&](FilterResult& result) {
+        if (&result == m_filterResult.get())
+            return;
+        result.complete = false;
+        for (int i = 0; i < MAX_BLOCK_COUNT; i++) {
+            if ((touchedBlocks >> i) & 1)
+                result.blocks[i] = FilterResult::Block();
+        }
+    });
+    
+    MemoryBudget::shared().rebalance();
+    
+    return NoError;
+}
+
+void SearchEngine::filterAppends(const std::vector<StreamInput::Append>& appends)
+{
+    // appended lines of filtered blocks are scanned by filterAppended on workers and added in order
+    // by mergeAppends, blocks which are not filtered yet are scanned as a whole once filter is planned again
+    std::vector<uint32_t> scan;
+    bool replan = false;
+    for (uint32_t i = 0; i < appends.size(); i++) {
+        if (!m_filterResult->blocks[appends[i].blockIdx].filtered)
+            replan = true;
+        else if (!m_templateFilter)     // appended lines have no template until clustered again
+            scan.push_back(i);
+        else
+            continue;
+        m_stats.filterProgress.grow(appends[i].size);
+    }
+    
+    m_appendScans = std::vector<SEAppendScan>(scan.size());
+    for (uint32_t i = 0; i < scan.size(); i++) {
+        auto& append = appends[scan[i]];
+        auto& pending = m_appendScans[i];
+        pending.blockIdx = append.blockIdx;
+        pending.firstLine = append.firstLine;
+        pending.lines = append.lines;
+        pending.byteOffset = append.byteOffset;
+        pending.size = append.size;
+    }
+    m_appendResult = m_filterResult;
+    m_appendsPending = uint32_t(scan.size());
+    
+    // chunks planned before don't cover appended lines
+    if (replan) {
+        m_filterResult->complete = false;
+        m_chunks.clear();
+        m_chunkOrder.clear();
+        memset(m_blockChunks, 0, sizeof(m_blockChunks));
+    }
+    
+    if (scan.empty())
+        mergeAppends(true);
+}
+
+SearchEngineError SearchEngine::filterAppended(uint32_t index)
+{
+    if (index >= m_appendScans.size())
+        return BadArgument;
+    
+    auto& pending = m_appendScans[index];
+    if (pending.done.load(std::memory_order_acquire))
+        return BadArgument;
+    
+    ScanProbe probe;
+    uint64_t callbacks = 0;
+    uint64_t candidates = 0;
+    auto hits = (m_appendResult->watchlist.empty())? nullptr : &pending.hits;
+    uint32_t slot = acquireSlot();
+    pending.err = filterRange(slot, pending.byteOffset, pending.size, pending.firstLine, pending.matches, &pending.maxLength,
+                              &callbacks, &candidates, hits);
+    releaseSlot(slot);
+    probe.add(m_stats.filter[pending.blockIdx], pending.size, callbacks, pending.matches.size(), candidates);
+    m_stats.filterProgress.add(pending.blockIdx, pending.size, pending.lines, pending.matches.size());
+    
+    auto err = pending.err;
+    pending.done.store(true, std::memory_order_release);
+    m_appendsPending.fetch_sub(1, std::memory_order_acq_rel);
+    
+    return err;
+}
+
+void SearchEngine::mergeAppends(bool force)
+{
+    if (!m_appendResult)
+        return;
+    
+    // scans are merged at once to keep matches in order, forced merge drops blocks with scans
+    // which haven't run, they are filtered again as a whole
+    if (!force && m_appendsPending.load(std::memory_order_acquire) != 0)
+        return;
+    
+    auto result = m_appendResult;
+    bool replan = false;
+    for (auto& pending : m_appendScans) {
+        auto block = &result->blocks[pending.blockIdx];
+        if (!pending.done.load(std::memory_order_acquire) || pending.err != NoError) {
+            block->filtered = false;
+            replan = true;
+            continue;
+        }
+        if (!block->filtered)
+            continue;
+        block->matches.insert(block->matches.end(), pending.matches.begin(), pending.matches.end());
+        block->hits.insert(block->hits.end(), pending.hits.begin(), pending.hits.end());
+        block->maxLength = std::max(block->maxLength, pending.maxLength);
+    }
+    m_appendScans.clear();
+    m_appendResult.reset();
+    
+    if (replan)
+        result->complete = false;
+    
+    // pattern has changed since the poll, the result waits in the cache with appended lines included
+    if (result != m_filterResult)
+        return;
+    
+    if (replan) {
+        m_chunks.clear();
+        m_chunkOrder.clear();
+        memset(m_blockChunks, 0, sizeof(m_blockChunks));
+    }
+    
+    applyScope();
+    
+    if (m_filterResult->complete)
+        cacheFilterResult(m_filterKey, m_filterResult);
+}
+
+SearchEngineError SearchEngine::mergeScope(uint32_t *filteredLines)
+{
+    if (!filteredLines)
+        return BadArgument;
+    
+    // async filter merges on the worker which finished it while the caller may be reading the view
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    mergeAppends(false);
+    
+    if (!m_filterResult)
+        return NoError;
+    
+    // blocks with all chunks filtered take their matches over, the rest is merged from finished chunks
+    std::vector<const std::vector<uint32_t>*> lists;
+    uint32_t matchLines = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        assembleBlock(i);
+        readyMatches(i, lists);
+        for (auto matches : lists) {
+            matchLines += matches->size();
+        }
+    }
+    
+    // all blocks are filtered, keep result in the cache
+    storeFilterResult();
+    
+    applyScope();
+
+    // scope lines are counted only once all blocks are filtered, including lines borrowed between blocks
+    *filteredLines += m_filteredRows - matchLines;
+    
+    return NoError;
+}
+
+void SearchEngine::close()
+{
+    stopCompiler();
+    stopAsync();
+    MemoryBudget::shared().detach(this);
+    
+    m_aggregator.reset();
+    m_templateMiner.clear();
+    m_filterResult.reset();
+    m_filterCache.clear();
+    
+    // reader writes to the spill file until it's stopped
+    m_stream.reset();
+    
+    if (m_fd >= 0) {
+        munmap((void*)m_mem, m_mapSize);
+        ::close(m_fd);
+    }
+}
+
+SearchEngineError SearchEngine::getLine(uint32_t number, SELineInfo* lineInfo)
+{
+    if (!lineInfo)
+        return BadArgument;
+    
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    uint32_t absLine = number;
+    lineInfo->scope = false;
+    lineInfo->matchOffset = 0;
+    lineInfo->matchLength = 0;
+    
+    if (m_filtered) {
+        if (!m_filterResult || number >= m_filteredRows)
+            return BadArgument;
+        
+        absLine = lineForRow(number);
+        lineInfo->scope = !isMatchLine(absLine);
+        
+    }
+    
+    uint64_t pos = getLinePos(absLine, &lineInfo->length);
+    if (pos == -1) {
+        printf("[!] unable to find line %d\n", number);
+        return UnknownError;
+    }
+    
+    lineInfo->line = m_mem + pos;
+    lineInfo->number = absLine + 1; // correct display line number (starting from 1)
+    lineInfo->record = recordForLine(absLine);
+    m_viewportPos.store(pos, std::memory_order_relaxed);
+    
+    // skip \r at the end of the line if exists
+    if (lineInfo->length && lineInfo->line[lineInfo->length-1] == '\r')
+        lineInfo->length--;
+    
+    // most logs are ASCII, otherwise line is checked to let caller decode it without copying
+    lineInfo->encoding = fileEncoding();
+    if (lineInfo->encoding != ASCIIEncoding)
+        lineInfo->encoding = UTF8Validator::validate(lineInfo->line, lineInfo->length);
+    
+    // verifier knows which part of the line matched if it can't be found by the pattern itself
+    if (m_filtered && !lineInfo->scope && m_filterResult->verifier) {
+        m_filterResult->verifier->locate(lineInfo->line, lineInfo->length, &lineInfo->matchOffset, &lineInfo->matchLength);
+    }
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::getRowForAbsLine(uint32_t absLine, uint32_t* row)
+{
+    if (! row)
+        return BadArgument;
+    
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    // absolute line numbers start with 1
+    uint32_t target = (absLine)? absLine - 1 : 0;
+    
+    if (! m_filtered) {
+        *row = target;
+        return NoError;
+    }
+    
+    if (!m_filterResult || m_filteredRows == 0)
+        return BadArgument;
+    
+    // find last segment starting before target line
+    int blockIdx = m_blockCount - 1;
+    while (blockIdx > 0 && (m_blocks[blockIdx].segments.empty() || m_blocks[blockIdx].segments.front().lineStart > target))
+        blockIdx--;
+    
+    auto& segments = m_blocks[blockIdx].segments;
+    if (segments.empty() || segments.front().lineStart > target) {
+        *row = 0;
+        return NoError;
+    }
+    
+    auto segment = std::upper_bound(segments.begin(), segments.end(), target, [](uint32_t line, const SESegment& seg) {
+        return line < seg.lineStart;
+    }) - 1;
+    
+    uint32_t rowEnd = m_blocks[blockIdx].rowBase + m_blocks[blockIdx].rows;
+    if (segment + 1 != segments.end())
+        rowEnd = (segment + 1)->rowStart;
+    
+    // rows are empty if segment is covered by previous one, use the closest row before target line
+    if (rowEnd == segment->rowStart)
+        *row = (rowEnd)? rowEnd - 1 : 0;
+    else
+        *row = segment->rowStart + std::min(target - segment->lineStart, rowEnd - segment->rowStart - 1);
+    
+    
+    return NoError;
+}
+
+bool SearchEngine::isFiltered()
+{
+    return m_filtered;
+}
+
+SearchEngineError SearchEngine::getFilterInfo(SEBlockInfo* info)
+{
+    if (!info)
+        return BadArgument;
+    
+    info->lines = 0;
+    info->maxLength = 0;
+    
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    if (!m_filtered || !m_filterResult)
+        return NoError;
+    
+    info->lines = m_filteredRows;
+    for (int i = 0; i < m_blockCount; i++) {
+        if (m_filterResult->blocks[i].filtered) {
+            info->maxLength = std::max(info->maxLength, m_filterResult->blocks[i].maxLength);
+            continue;
+        }
+        for (uint32_t c = m_blockChunks[i]; c < m_blockChunks[i + 1]; c++) {
+            if (m_chunks[c].done.load(std::memory_order_acquire))
+                info->maxLength = std::max(info->maxLength, m_chunks[c].maxLength);
+        }
+    }
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::setScope(uint32_t before, uint32_t after)
+{
+    if (before > MAX_SCOPE_BEFORE || after > MAX_SCOPE_AFTER)
+        return BadArgument;
+    
+    m_scopeBefore = before;
+    m_scopeAfter = after;
+    printf("[+] set scope B%d A%d\n", m_scopeBefore, m_scopeAfter);
+    
+    // scope is a view property, rebuild segments from existing matches
+    if (m_filterResult && m_filterResult->complete)
+        applyScope();
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::compilePatternAsync(const char* pattern, SECompileCallback callback, void* userData, uint64_t* generation)
+{
+    if (!pattern || pattern[0] == 0)
+        return BadArgument;
+    
+    // settings are taken now, they may change before the request is handled
+    SECompileRequest request = {compileKey(pattern), callback, userData, ++m_compileGeneration};
+    if (generation)
+        *generation = request.generation;
+    
+    {
+        std::lock_guard<std::mutex> lock(m_compileLock);
+        if (m_compileStop)
+            return EngineOpFailed;
+        
+        if (!m_compileThread.joinable())
+            m_compileThread = std::thread(&SearchEngine::compileLoop, this);
+        m_compileQueue.push_back(request);
+    }
+    m_compileCond.notify_one();
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::setCacheBudget(uint64_t bytes)
+{
+    m_filterCache.setBudget(bytes);
+    return NoError;
+}
+
+SearchEngineError SearchEngine::setResidentLimit(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_residentLock);
+    
+    m_residentLimit = bytes;
+    if (bytes == 0) {
+        // ranges are not tracked without the limit
+        m_residentRanges.clear();
+        m_residentBytes = 0;
+        return NoError;
+    }
+    
+    while (m_residentBytes > bytes && !m_residentRanges.empty()) {
+        auto range = m_residentRanges.front();
+        m_residentRanges.pop_front();
+        m_residentBytes -= range.second;
+        releaseRange(range.first, range.second);
+    }
+    
+    return NoError;
+}
+
+void SearchEngine::prefetchRange(uint64_t pos, uint64_t size)
+{
+    // pages are released behind the scan in bounded mode, read ahead keeps the scan at disk speed
+    if (!m_residentLimit.load(std::memory_order_relaxed) || !size)
+        return;
+    
+    uint64_t page = getpagesize();
+    uint64_t start = pos / page * page;
+    madvise((void*)(m_mem + start), pos + size - start, MADV_WILLNEED);
+}
+
+void SearchEngine::scannedRange(uint64_t pos, uint64_t size)
+{
+    if (!m_residentLimit.load(std::memory_order_relaxed) || !size)
+        return;
+    
+    std::vector<std::pair<uint64_t, uint64_t>> released;
+    {
+        std::lock_guard<std::mutex> lock(m_residentLock);
+        
+        uint64_t limit = m_residentLimit.load(std::memory_order_relaxed);
+        if (!limit)
+            return;
+        
+        m_residentRanges.push_back({pos, size});
+        m_residentBytes += size;
+        while (m_residentBytes > limit && !m_residentRanges.empty()) {
+            released.push_back(m_residentRanges.front());
+            m_residentBytes -= m_residentRanges.front().second;
+            m_residentRanges.pop_front();
+        }
+    }
+    
+    for (auto& range : released) {
+        releaseRange(range.first, range.second);
+    }
+}
+
+void SearchEngine::releaseRange(uint64_t pos, uint64_t size)
+{
+    uint64_t page = getpagesize();
+    uint64_t viewport = m_viewportPos.load(std::memory_order_relaxed);
+    uint64_t keepStart = (viewport > s_viewportKeep)? viewport - s_viewportKeep : 0;
+    uint64_t keepEnd = (viewport == UINT64_MAX)? 0 : viewport + s_viewportKeep;
+    
+    auto release = [&](uint64_t start, uint64_t end) {
+        // pages shared with neighbouring ranges are left alone
+        start = (start + page - 1) / page * page;
+        end = end / page * page;
+        if (start >= end)
+            return;
+        
+        madvise((void*)(m_mem + start), end - start, MADV_DONTNEED);
+    #ifdef POSIX_FADV_DONTNEED
+        // page cache is dropped too where it's possible, file mapping alone doesn't own it
+        posix_fadvise(m_fd, start, end - start, POSIX_FADV_DONTNEED);
+    #endif
+        m_releasedBytes += end - start;
+    };
+    
+    uint64_t end = pos + size;
+    if (keepEnd <= pos || keepStart >= end) {
+        release(pos, end);
+    } else {
+        release(pos, std::max(pos, keepStart));
+        release(std::min(end, keepEnd), end);
+    }
+}
+
+SearchEngineError SearchEngine::setActive()
+{
+    WorkerPool::shared().setActive(this);
+    MemoryBudget::shared().setActive(this);
+    rebuildGrams();
+    return NoError;
+}
+
+SearchEngineError SearchEngine::dispatch(uint32_t count, SETaskCallback callback, void* userData)
+{
+    if (!callback)
+        return BadArgument;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        WorkerPool::shared().submit(this, [=] { callback(userData, i); });
+    }
+    return NoError;
+}
+
+// results of tasks of one async operation are reduced as they finish, the last one completes it
+struct AsyncOperation {
+    std::mutex              lock;
+    uint32_t                done = 0;
+    uint32_t                total = 0;
+    uint64_t                generation = 0;     // filter generation, 0 for fetch
+    SEBlockInfo             info = {0, 0, ASCIIEncoding, 0};
+    SearchEngineError       result = NoError;
+    SEProgressCallback      progress = nullptr;
+    SECompletionCallback    completion = nullptr;
+    void*                   userData = nullptr;
+    
+    // true for the task which finished the operation
+    bool finish(uint32_t index, SearchEngineError err, const SEBlockInfo& taskInfo)
+    {
+        uint32_t count;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (err != NoError) {
+                if (result == NoError)
+                    result = err;
+            } else {
+                info.lines += taskInfo.lines;
+                info.maxLength = std::max(info.maxLength, taskInfo.maxLength);
+                info.encoding = std::max(info.encoding, taskInfo.encoding);
+                info.records += taskInfo.records;
+            }
+            count = ++done;
+        }
+        
+        if (progress)
+            progress(userData, index, count, total);
+        return count == total;
+    }
+};
+
+bool SearchEngine::enterAsync(uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_asyncLock);
+    if (m_asyncStopped || (generation && generation != m_asyncGeneration))
+        return false;
+    
+    if (generation)
+        m_filterTasks++;
+    else
+        m_fetchTasks++;
+    return true;
+}
+
+void SearchEngine::leaveAsync(uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_asyncLock);
+    auto& running = (generation)? m_filterTasks : m_fetchTasks;
+    if (--running == 0)
+        m_asyncCond.notify_all();
+}
+
+uint64_t SearchEngine::supersedeAsync()
+{
+    // queued tasks of the previous filter see a new generation and don't start, running ones are cancelled
+    // and waited for, since the chunks they write to are replaced
+    std::unique_lock<std::mutex> lock(m_asyncLock);
+    uint64_t generation = ++m_asyncGeneration;
+    if (m_filterTasks) {
+        m_filterCancelled = true;
+        m_asyncCond.wait(lock, [this] { return m_filterTasks == 0; });
+        m_filterCancelled = false;
+    }
+    return generation;
+}
+
+void SearchEngine::stopAsync()
+{
+    // tasks dropped from the queue never start and detach waits for those taken by workers, flags go
+    // first, so that running tasks stop early and don't queue more of them after the owner is detached
+    {
+        std::lock_guard<std::mutex> lock(m_asyncLock);
+        m_asyncStopped = true;
+    }
+    m_filterCancelled = true;
+    WorkerPool::shared().detach(this);
+    
+    std::unique_lock<std::mutex> lock(m_asyncLock);
+    m_asyncCond.wait(lock, [this] { return m_filterTasks == 0 && m_fetchTasks == 0; });
+}
+
+SearchEngineError SearchEngine::fetchAsync(SEProgressCallback progress, SECompletionCallback completion, void* userData)
+{
+    if (!completion)
+        return BadArgument;
+    
+    auto operation = std::make_shared<AsyncOperation>();
+    operation->total = m_blockCount;
+    operation->progress = progress;
+    operation->completion = completion;
+    operation->userData = userData;
+    
+    if (operation->total == 0) {
+        completion(userData, NoError, &operation->info);
+        return NoError;
+    }
+    
+    // callbacks are called after the task has left, so they can start another operation or destroy the context
+    for (uint32_t i = 0; i < operation->total; i++) {
+        WorkerPool::shared().submit(this, [this, operation, i] {
+            if (!enterAsync(operation->generation))
+                return;
+            
+            SEBlockInfo info = {0, 0, ASCIIEncoding, 0};
+            auto err = fetch(i, &info);
+            if (err != NoError)
+                printf("[!] unable to fetch block %d: %d\n", i, err);
+            leaveAsync(operation->generation);
+            
+            if (operation->finish(i, err, info))
+                operation->completion(operation->userData, operation->result, &operation->info);
+        });
+    }
+    return NoError;
+}
+
+SearchEngineError SearchEngine::filterAsync(uint32_t viewportLine, SEProgressCallback progress, SECompletionCallback completion, void* userData)
+{
+    if (!completion)
+        return BadArgument;
+    
+    uint64_t generation = supersedeAsync();
+    
+    uint32_t chunks = 0;
+    uint32_t priorityChunks = 0;
+    auto err = planFilter(viewportLine, &chunks, &priorityChunks);
+    if (err != NoError)
+        return err;
+    
+    auto operation = std::make_shared<AsyncOperation>();
+    operation->total = chunks;
+    operation->generation = generation;
+    operation->progress = progress;
+    operation->completion = completion;
+    operation->userData = userData;
+    
+    // scope is merged once all chunks are filtered, the view reports filtered rows rather than matches,
+    // a superseded filter is cancelled since its chunks are gone
+    auto complete = [this, operation] {
+        SearchEngineError result = operation->result;
+        SEBlockInfo info = {0, 0, ASCIIEncoding, 0};
+        if (result == NoError && !enterAsync(operation->generation))
+            result = Cancelled;
+        if (result == NoError) {
+            uint32_t filteredLines = 0;
+            result = mergeScope(&filteredLines);
+            if (result == NoError)
+                result = getFilterInfo(&info);
+            leaveAsync(operation->generation);
+        }
+        operation->completion(operation->userData, result, &info);
+    };
+    
+    if (chunks == 0) {
+        complete();
+        return NoError;
+    }
+    
+    // chunks are planned in priority order, workers take them in order of submission
+    for (uint32_t i = 0; i < chunks; i++) {
+        WorkerPool::shared().submit(this, [this, operation, complete, i] {
+            SEBlockInfo info = {0, 0, ASCIIEncoding, 0};
+            SearchEngineError err = Cancelled;
+            if (enterAsync(operation->generation)) {
+                err = filterChunk(i, &info);
+                if (err != NoError && err != Cancelled)
+                    printf("[!] unable to filter chunk %d: %d\n", i, err);
+                leaveAsync(operation->generation);
+            }
+            
+            if (operation->finish(i, err, info))
+                complete();
+        });
+    }
+    return NoError;
+}
+
+size_t SearchEngine::memoryUsage()
+{
+    return m_indexMemory.load(std::memory_order_relaxed) + m_filterCache.getUsage();
+}
+
+size_t SearchEngine::trimCache(size_t bytes)
+{
+    return m_filterCache.trim(bytes);
+}
+
+void SearchEngine::cacheFilterResult(const FilterCacheKey& key, std::shared_ptr<FilterResult> result)
+{
+    m_filterCache.insert(key, result);
+    MemoryBudget::shared().rebalance();
+}
+
+SearchEngineError SearchEngine::setAggregation(const SEKeyExtractor* extractor, char* error)
+{
+    if (!extractor)
+        return BadArgument;
+    
+    m_aggregator.reset();
+    
+    auto keyExtractor = createExtractor(extractor, error);
+    if (!keyExtractor)
+        return BadArgument;
+    
+    m_aggregator.reset(new Aggregator(keyExtractor));
+    return NoError;
+}
+
+SearchEngineError SearchEngine::aggregate(uint32_t blockIdx)
+{
+    if (!m_aggregator)
+        return BadArgument;
+    
+    if (blockIdx > MAX_BLOCK_COUNT - 1)
+        return BadArgument;
+    
+    if (!m_blocks[blockIdx].active)
+        return BadArgument;
+    
+    // filtered lines are taken from the stored match index, without scanning the block again
+    const std::vector<uint32_t>* lines = nullptr;
+    if (m_filtered) {
+        if (!m_filterResult || !m_filterResult->blocks[blockIdx].filtered)
+            return BadArgument;
+        lines = &m_filterResult->blocks[blockIdx].matches;
+    }
+    
+    m_aggregator->reset(blockIdx);
+    forEachLine(blockIdx, lines, [&](const char* line, uint32_t length) {
+        m_aggregator->add(blockIdx, line, length);
+    });
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::mergeAggregation(uint32_t topK, SEKeyCount* keys, uint32_t* count, uint64_t* distinct)
+{
+    if (!m_aggregator)
+        return BadArgument;
+    
+    if (!count || (topK && !keys))
+        return BadArgument;
+    
+    *count = m_aggregator->merge(m_blockCount, topK, keys, distinct);
+    return NoError;
+}
+
+SearchEngineError SearchEngine::cluster(uint32_t blockIdx)
+{
+    if (blockIdx > MAX_BLOCK_COUNT - 1)
+        return BadArgument;
+    
+    if (!m_blocks[blockIdx].active)
+        return BadArgument;
+    
+    m_templateMiner.reset(blockIdx);
+    forEachLine(blockIdx, nullptr, [&](const char* line, uint32_t length) {
+        m_templateMiner.add(blockIdx, line, length);
+    });
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::mergeTemplates(uint32_t* templates)
+{
+    if (!templates)
+        return BadArgument;
+    
+    *templates = m_templateMiner.merge(m_blockCount);
+    m_templateGeneration++;
+    
+    printf("[+] %u templates found\n", *templates);
+    return NoError;
+}
+
+SearchEngineError SearchEngine::getTemplate(uint32_t templateId, SETemplateInfo* info)
+{
+    if (!info)
+        return BadArgument;
+    
+    auto entry = m_templateMiner.getTemplate(templateId);
+    if (!entry)
+        return BadArgument;
+    
+    uint32_t lineBase = 0;
+    for (int i = 0; i < entry->firstBlock; i++) {
+        lineBase += m_blocks[i].lines;
+    }
+    
+    info->text = entry->text.data();
+    info->length = uint32_t(entry->text.size());
+    info->count = entry->count;
+    info->firstLine = lineBase + entry->firstLine + 1;
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::getLineTemplate(uint32_t absLine, uint32_t* templateId)
+{
+    if (!templateId || !absLine)
+        return BadArgument;
+    
+    // absolute line numbers start with 1
+    uint32_t lineBase = 0;
+    int32_t blockIdx = findBlockForLine(absLine - 1, &lineBase);
+    if (blockIdx < 0)
+        return BadArgument;
+    
+    if (!m_templateMiner.getLineTemplate(blockIdx, absLine - 1 - lineBase, templateId))
+        return BadArgument;
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::setTemplateFilter(const uint32_t* templateIds, uint32_t count, bool representatives)
+{
+    if (!m_templateMiner.isMerged())
+        return BadArgument;
+    
+    // selection is a part of the key, so switching between template views is served from filter cache
+    FilterCacheKey key;
+    key.templates = true;
+    key.flags = (representatives)? 1 : 0;
+    key.pattern = std::to_string(m_templateGeneration) + ":";
+    if (!templateIds) {
+        key.pattern += "*";
+    } else {
+        std::vector<uint32_t> ids(templateIds, templateIds + count);
+        std::sort(ids.begin(), ids.end());
+        for (auto id : ids) {
+            key.pattern += std::to_string(id) + ",";
+        }
+    }
+    
+    auto result = m_filterCache.find(key);
+    EngineStats::count((result)? m_stats.cacheHits : m_stats.cacheMisses);
+    if (!result) {
+        result = std::make_shared<FilterResult>();
+        cacheFilterResult(key, result);
+    }
+    
+    m_templateMiner.select(templateIds, count, representatives);
+    
+    m_filtered = true;
+    m_templateFilter = true;
+    m_filterKey = key;
+    resetFilterResult(result);
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::filterTemplates(uint32_t blockIdx, SEBlockInfo* info)
+{
+    // template of every line is known after clustering, so no scan is needed
+    auto result = &m_filterResult->blocks[blockIdx];
+    
+    ScanProbe probe;
+    m_templateMiner.filter(blockIdx, result->matches);
+    
+    uint32_t maxLength = 0;
+    forEachLine(blockIdx, &result->matches, [&](const char* line, uint32_t length) {
+        maxLength = std::max(length, maxLength);
+    });
+    
+    info->lines = uint32_t(result->matches.size());
+    info->maxLength = maxLength;
+    
+    result->maxLength = maxLength;
+    result->filtered = true;
+    
+    probe.finish(m_stats.filter[blockIdx], 0, 0, result->matches.size());
+    m_stats.filterProgress.add(blockIdx, m_blocks[blockIdx].size, m_blocks[blockIdx].lines, result->matches.size());
+    
+    return NoError;
+}
+
+void SearchEngine::splitBlock(uint32_t blockIdx, const std::function<void(uint64_t, uint64_t, uint32_t)>& emit)
+{
+    // blocks are split at indexed lines, so the same line index always gives the same chunks
+    auto block = &m_blocks[blockIdx];
+    uint64_t blockEnd = block->byteOffset + block->size;
+    uint64_t start = block->byteOffset;
+    uint32_t firstLine = 0;
+    for (size_t i = 1; i < block->lineIndex.size(); i++) {
+        uint64_t pos = block->lineIndex[i];
+        if (pos - start >= s_filterChunkSize && pos < blockEnd) {
+            emit(start, pos - start, firstLine);
+            start = pos;
+            firstLine = uint32_t(i * s_lineIndexStride);
+        }
+    }
+    emit(start, blockEnd - start, firstLine);
+}
+
+SearchEngineError SearchEngine::planFilter(uint32_t viewportLine, uint32_t* chunks, uint32_t* priorityChunks)
+{
+    if (!chunks || !priorityChunks)
+        return BadArgument;
+    
+    *chunks = 0;
+    *priorityChunks = 0;
+    mergeAppends(true);
+    m_chunks.clear();
+    m_chunkOrder.clear();
+    memset(m_blockChunks, 0, sizeof(m_blockChunks));
+    m_filterCancelled = false;
+    
+    if (!m_filtered || !m_filterResult)
+        return NoError;
+    
+    // template filter doesn't scan and keeps whole blocks
+    auto split = [&](uint32_t blockIdx, const std::function<void(uint64_t, uint64_t, uint32_t)>& emit) {
+        if (m_templateFilter)
+            emit(m_blocks[blockIdx].byteOffset, m_blocks[blockIdx].size, 0);
+        else
+            splitBlock(blockIdx, emit);
+    };
+    
+    uint32_t count = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        m_blockChunks[i] = count;
+        if (m_filterResult->blocks[i].filtered)
+            continue;
+        split(i, [&](uint64_t, uint64_t, uint32_t) { count++; });
+    }
+    m_blockChunks[m_blockCount] = count;
+    
+    if (count == 0)
+        return NoError;
+    
+    m_chunks = std::vector<SEFilterChunk>(count);
+    count = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        if (m_filterResult->blocks[i].filtered)
+            continue;
+        m_stats.filter[i].reset();
+        split(i, [&](uint64_t pos, uint64_t size, uint32_t firstLine) {
+            auto& chunk = m_chunks[count++];
+            chunk.blockIdx = i;
+            chunk.byteOffset = pos;
+            chunk.size = size;
+            chunk.firstLine = firstLine;
+        });
+    }
+    
+    // chunk shown in the view goes first, then the beginning of the file,
+    // then the rest by distance from the view preferring chunks below it
+    uint32_t viewport = 0;
+    uint32_t lineBase = 0;
+    int32_t blockIdx = (viewportLine)? findBlockForLine(viewportLine - 1, &lineBase) : -1;
+    if (blockIdx >= 0) {
+        uint32_t line = viewportLine - 1 - lineBase;
+        auto chunk = std::upper_bound(m_chunks.begin(), m_chunks.end(), std::make_pair(uint32_t(blockIdx), line),
+            [](const std::pair<uint32_t, uint32_t>& pos, const SEFilterChunk& chunk) {
+                return pos < std::make_pair(chunk.blockIdx, chunk.firstLine);
+            });
+        viewport = (chunk == m_chunks.begin())? 0 : uint32_t(chunk - m_chunks.begin() - 1);
+    }
+    
+    m_chunkOrder.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        m_chunkOrder[i] = i;
+    }
+    auto rank = [&](uint32_t chunk) -> uint64_t {
+        if (chunk == viewport)
+            return 0;
+        if (chunk == 0)
+            return 1;
+        return (chunk > viewport)? 2 * uint64_t(chunk - viewport) : 2 * uint64_t(viewport - chunk) + 1;
+    };
+    std::stable_sort(m_chunkOrder.begin(), m_chunkOrder.end(), [&](uint32_t a, uint32_t b) {
+        return rank(a) < rank(b);
+    });
+    
+    *chunks = count;
+    *priorityChunks = (viewport == 0)? 1 : 2;
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::filterChunk(uint32_t chunkIdx, SEBlockInfo* info)
+{
+    if (!info)
+        return BadArgument;
+    
+    if (chunkIdx >= m_chunkOrder.size())
+        return BadArgument;
+    
+    if (m_filterCancelled.load(std::memory_order_relaxed))
+        return Cancelled;
+    
+    auto& chunk = m_chunks[m_chunkOrder[chunkIdx]];
+    
+    ScanProbe probe;
+    uint64_t callbacks = 0;
+    uint64_t candidates = 0;
+    bool skipped = !m_templateFilter && !mayMatch(m_filterResult->grams, chunk.byteOffset, chunk.size);
+    if (m_templateFilter) {
+        m_templateMiner.filter(chunk.blockIdx, chunk.matches);
+        forEachLine(chunk.blockIdx, &chunk.matches, [&](const char* line, uint32_t length) {
+            chunk.maxLength = std::max(length, chunk.maxLength);
+        });
+    } else if (skipped) {
+        // chunk misses trigrams the pattern requires, it has no matches
+        chunk.matches.clear();
+        chunk.hits.clear();
+        m_stats.skippedBytes.fetch_add(chunk.size, std::memory_order_relaxed);
+    } else {
+        uint32_t slot = acquireSlot();
+        auto hits = (m_filterResult->watchlist.empty())? nullptr : &chunk.hits;
+        prefetchRange(chunk.byteOffset, chunk.size);
+        auto err = filterRange(slot, chunk.byteOffset, chunk.size, chunk.firstLine, chunk.matches, &chunk.maxLength, &callbacks, &candidates, hits);
+        releaseSlot(slot);
+        scannedRange(chunk.byteOffset, chunk.size);
+        if (err != NoError)
+            return err;
+    }
+    
+    info->lines = uint32_t(chunk.matches.size());
+    info->maxLength = chunk.maxLength;
+    
+    probe.add(m_stats.filter[chunk.blockIdx], (m_templateFilter || skipped)? 0 : chunk.size, callbacks, chunk.matches.size(), candidates);
+    m_stats.filterProgress.add(chunk.blockIdx, chunk.size, chunkLines(m_chunkOrder[chunkIdx]), chunk.matches.size());
+    chunk.done.store(true, std::memory_order_release);
+    
+    return NoError;
+}
+
+void SearchEngine::cancelFilter()
+{
+    // chunks which are not started yet return immediately, caller waits for running ones
+    m_filterCancelled = true;
+}
+
+uint32_t SearchEngine::acquireSlot()
+{
+    std::unique_lock<std::mutex> lock(m_slotLock);
+    m_slotCond.wait(lock, [this] { return m_freeSlots != 0; });
+    
+    uint32_t slot = __builtin_ctzll(m_freeSlots);
+    m_freeSlots &= ~(1ULL << slot);
+    return slot;
+}
+
+void SearchEngine::releaseSlot(uint32_t slot)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_slotLock);
+        m_freeSlots |= 1ULL << slot;
+    }
+    m_slotCond.notify_one();
+}
+
+void SearchEngine::runOnWorkers(uint32_t count, const std::function<void()>& worker)
+{
+    // worker takes its items from a shared counter, so there is no use in more workers than the pool has
+    std::mutex doneLock;
+    std::condition_variable doneCond;
+    uint32_t running = std::min<uint32_t>(WorkerPool::shared().workerCount(), count);
+    for (uint32_t i = 0, n = running; i < n; i++) {
+        WorkerPool::shared().submit(this, [&]() {
+            worker();
+            std::lock_guard<std::mutex> lock(doneLock);
+            if (--running == 0)
+                doneCond.notify_one();
+        });
+    }
+    std::unique_lock<std::mutex> lock(doneLock);
+    doneCond.wait(lock, [&] { return running == 0; });
+}
+
+SearchEngineError SearchEngine::sampleChunk(uint32_t chunkIdx)
+{
+    if (!m_filtered || !m_filterResult)
+        return BadArgument;
+    
+    if (chunkIdx >= m_chunkOrder.size())
+        return BadArgument;
+    
+    if (m_filterCancelled.load(std::memory_order_relaxed))
+        return Cancelled;
+    
+    // template filter doesn't scan, its chunks are estimated from filtered ones
+    uint32_t c = m_chunkOrder[chunkIdx];
+    auto& chunk = m_chunks[c];
+    if (m_templateFilter || chunk.done.load(std::memory_order_acquire))
+        return NoError;
+    
+    // window is at a random line of the chunk, so every part of the file is represented,
+    // windows are placed the same way for the same file to keep estimates of similar patterns comparable
+    uint64_t chunkEnd = chunk.byteOffset + chunk.size;
+    uint64_t size = chunk.size / s_sampleRatio;
+    if (size < s_sampleWindowSize)
+        size = s_sampleWindowSize;
+    uint64_t start = chunk.byteOffset;
+    if (size < chunk.size) {
+        std::minstd_rand rng(uint32_t(chunk.byteOffset ^ m_size) + c);
+        start = lineStartAfter(chunk.byteOffset + rng() % (chunk.size - size), chunkEnd);
+    }
+    uint64_t end = lineStartAfter(std::min(start + size, chunkEnd), chunkEnd);
+    
+    std::vector<uint32_t> matches;
+    uint32_t maxLength = 0;
+    uint64_t callbacks = 0;
+    uint64_t candidates = 0;
+    if (mayMatch(m_filterResult->grams, start, end - start)) {
+        uint32_t slot = acquireSlot();
+        auto err = filterRange(slot, start, end - start, 0, matches, &maxLength, &callbacks, &candidates, nullptr);
+        releaseSlot(slot);
+        if (err != NoError)
+            return err;
+    }
+    chunk.sampleLines = uint32_t(std::count(m_mem + start, m_mem + end, '\n'));
+    chunk.sampleMatches = uint32_t(matches.size());
+    chunk.sampled.store(true, std::memory_order_release);
+    scannedRange(start, end - start);
+    
+    return NoError;
+}
+
+uint32_t SearchEngine::chunkLines(uint32_t c)
+{
+    auto& chunk = m_chunks[c];
+    if (c + 1 < m_blockChunks[chunk.blockIdx + 1])
+        return m_chunks[c + 1].firstLine - chunk.firstLine;
+    return m_blocks[chunk.blockIdx].lines - chunk.firstLine;
+}
+
+SearchEngineError SearchEngine::getMatchEstimate(SEMatchEstimate* estimate)
+{
+    if (!estimate)
+        return BadArgument;
+    
+    memset(estimate, 0, sizeof(SEMatchEstimate));
+    
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    if (!m_filtered || !m_filterResult)
+        return BadArgument;
+    
+    // filtered blocks and chunks are counted, every sampled chunk is a stratum estimated from its
+    // sample, chunks without sample get the rate of everything seen so far
+    uint64_t counted = 0;
+    uint64_t seenMatches = 0;
+    uint64_t seenLines = 0;
+    uint64_t pendingLines = 0;
+    double sampled = 0;
+    double variance = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        estimate->totalLines += m_blocks[i].lines;
+        if (m_filterResult->blocks[i].filtered) {
+            counted += m_filterResult->blocks[i].matches.size();
+            estimate->countedLines += m_blocks[i].lines;
+            continue;
+        }
+        
+        // block is not planned for filtering
+        if (m_blockChunks[i] == m_blockChunks[i + 1])
+            pendingLines += m_blocks[i].lines;
+        
+        for (uint32_t c = m_blockChunks[i]; c < m_blockChunks[i + 1]; c++) {
+            auto& chunk = m_chunks[c];
+            uint64_t lines = chunkLines(c);
+            if (chunk.done.load(std::memory_order_acquire)) {
+                counted += chunk.matches.size();
+                estimate->countedLines += lines;
+            } else if (chunk.sampled.load(std::memory_order_acquire) && chunk.sampleLines) {
+                double n = chunk.sampleLines;
+                double rate = chunk.sampleMatches / n;
+                sampled += rate * lines;
+                seenMatches += chunk.sampleMatches;
+                seenLines += chunk.sampleLines;
+                estimate->sampledLines += chunk.sampleLines;
+                
+                // lines of a sample are treated as independent, the rate is smoothed
+                // so that a sample without matches still leaves room for some
+                double p = (chunk.sampleMatches + 0.5) / (n + 1);
+                double fpc = (lines > n)? 1 - n / lines : 0;
+                variance += double(lines) * lines * p * (1 - p) / n * fpc;
+            } else {
+                pendingLines += lines;
+            }
+        }
+    }
+    
+    seenMatches += counted;
+    seenLines += estimate->countedLines;
+    double pending = 0;
+    if (pendingLines) {
+        if (seenLines) {
+            pending = double(seenMatches) / seenLines * pendingLines;
+            double p = (seenMatches + 0.5) / (seenLines + 1);
+            variance += double(pendingLines) * pendingLines * p * (1 - p) / seenLines;
+        } else {
+            // nothing seen yet, any number of pending lines can match
+            variance += double(pendingLines) * pendingLines;
+        }
+    }
+    
+    double matches = counted + sampled + pending;
+    double margin = 1.96 * sqrt(variance);
+    uint64_t unknownLines = estimate->totalLines - estimate->countedLines;
+    
+    estimate->exact = (unknownLines == 0);
+    estimate->matches = uint64_t(matches + 0.5);
+    estimate->low = std::max<uint64_t>(counted, (matches > margin)? uint64_t(matches - margin) : 0);
+    estimate->high = std::min<uint64_t>(counted + unknownLines, uint64_t(ceil(matches + margin)));
+    estimate->matches = std::min(std::max(estimate->matches, estimate->low), estimate->high);
+    
+    return NoError;
+}
+
+bool SearchEngine::assembleBlock(uint32_t blockIdx)
+{
+    auto result = &m_filterResult->blocks[blockIdx];
+    if (result->filtered)
+        return true;
+    
+    uint32_t first = m_blockChunks[blockIdx];
+    uint32_t last = m_blockChunks[blockIdx + 1];
+    if (first == last)
+        return false;
+    
+    for (uint32_t c = first; c < last; c++) {
+        if (!m_chunks[c].done.load(std::memory_order_acquire))
+            return false;
+    }
+    
+    result->matches.clear();
+    result->hits.clear();
+    result->maxLength = 0;
+    for (uint32_t c = first; c < last; c++) {
+        auto& chunk = m_chunks[c];
+        result->matches.insert(result->matches.end(), chunk.matches.begin(), chunk.matches.end());
+        result->hits.insert(result->hits.end(), chunk.hits.begin(), chunk.hits.end());
+        result->maxLength = std::max(result->maxLength, chunk.maxLength);
+        chunk.matches = std::vector<uint32_t>();
+        chunk.hits = std::vector<uint32_t>();
+    }
+    
+    // block result is used from here on, chunks are not looked at anymore
+    result->filtered = true;
+    
+    return true;
+}
+
+void SearchEngine::readyMatches(uint32_t blockIdx, std::vector<const std::vector<uint32_t>*>& lists)
+{
+    lists.clear();
+    if (m_filterResult->blocks[blockIdx].filtered) {
+        lists.push_back(&m_filterResult->blocks[blockIdx].matches);
+        return;
+    }
+    
+    for (uint32_t c = m_blockChunks[blockIdx]; c < m_blockChunks[blockIdx + 1]; c++) {
+        if (m_chunks[c].done.load(std::memory_order_acquire))
+            lists.push_back(&m_chunks[c].matches);
+    }
+}
+
+// windows of one find are scanned by urgent tasks, the task which scanned the last one reports the match
+struct FindOperation {
+    struct Window {
+        uint64_t    start;
+        uint64_t    end;
+    };
+    
+    std::shared_ptr<FilterResult>   pattern;
+    std::vector<Window>             windows;            // in order of distance from the line
+    bool                            forward = true;
+    std::atomic<uint32_t>           next {0};           // window to be taken by the next task
+    std::atomic<uint32_t>           best {0};           // nearest window with a match so far
+    std::mutex                      lock;
+    uint32_t                        bestLine = 0;       // window relative number of the nearest match
+    uint32_t                        running = 0;
+    SearchEngineError               result = NoError;
+    SEFindCallback                  callback = nullptr;
+    void*                           userData = nullptr;
+    
+    void found(uint32_t window, const std::vector<uint32_t>& matches)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (window < best) {
+            best = window;
+            bestLine = (forward)? matches.front() : matches.back();
+        }
+    }
+    
+    void fail(SearchEngineError err)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (result == NoError)
+            result = err;
+    }
+    
+    // true for the task which finished the find
+    bool leave()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return --running == 0;
+    }
+};
+
+SearchEngineError SearchEngine::findNextAsync(const char* pattern, uint32_t fromLine, SEDirection direction, SEFindCallback callback, void* userData)
+{
+    if (!pattern || pattern[0] == 0 || !callback)
+        return BadArgument;
+    
+    // settings are taken now, they may change before the windows are scanned
+    auto key = compileKey(pattern);
+    auto compiled = m_filterCache.find(key);
+    
+    // complete filter result of the same pattern already knows all matching lines
+    bool known = false;
+    bool found = false;
+    uint32_t absLine = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_viewLock);
+        if (m_filtered && !m_templateFilter && compiled && compiled == m_filterResult && m_filterResult->complete) {
+            known = true;
+            found = findFiltered(fromLine, direction, &absLine);
+        }
+    }
+    if (known) {
+        callback(userData, (found)? NoError : NotFound, absLine);
+        return NoError;
+    }
+    
+    auto operation = std::make_shared<FindOperation>();
+    operation->pattern = compiled;
+    operation->forward = (direction == ForwardDirection);
+    operation->callback = callback;
+    operation->userData = userData;
+    
+    // windows ruled out by trigram index have no match and aren't scanned
+    auto scanWindow = [this, operation](uint32_t idx, std::vector<uint32_t>& matches) -> SearchEngineError {
+        auto& window = operation->windows[idx];
+        matches.clear();
+        if (!mayMatch(operation->pattern->grams, window.start, window.end - window.start))
+            return NoError;
+        
+        uint64_t callbacks = 0;
+        uint64_t candidates = 0;
+        uint32_t slot = acquireSlot();
+        auto err = findRange(*operation->pattern, slot, window.start, window.end - window.start, matches, &callbacks, &candidates);
+        releaseSlot(slot);
+        scannedRange(window.start, window.end - window.start);
+        if (err == NoError && !matches.empty())
+            operation->found(idx, matches);
+        return err;
+    };
+    
+    // nearest match is turned to a line before the task leaves, callback is called afterwards,
+    // so it can start another find or destroy the context
+    auto resolve = [this, operation](uint32_t* absLine) -> SearchEngineError {
+        *absLine = 0;
+        if (operation->result != NoError)
+            return operation->result;
+        if (operation->best == operation->windows.size())
+            return NotFound;
+        
+        *absLine = lineForPos(operation->windows[operation->best].start) + operation->bestLine + 1;
+        return NoError;
+    };
+    
+    // workers take windows in order of distance and stop taking them once a nearer one has a match,
+    // so the nearest match is known when all windows before it are scanned, closing the context
+    // stops them between windows
+    auto scan = [this, operation, scanWindow, resolve] {
+        bool entered = enterAsync(0);
+        if (entered) {
+            std::vector<uint32_t> matches;
+            uint32_t idx;
+            while ((idx = operation->next++) < operation->best.load()) {
+                if (m_asyncStopped) {
+                    operation->fail(Cancelled);
+                    break;
+                }
+                if (scanWindow(idx, matches) != NoError) {
+                    operation->fail(EngineOpFailed);
+                    break;
+                }
+                if (!matches.empty())
+                    break;
+            }
+        } else {
+            operation->fail(Cancelled);
+        }
+        
+        uint32_t absLine = 0;
+        SearchEngineError result = operation->result;
+        bool last = operation->leave();
+        if (last && entered)
+            result = resolve(&absLine);
+        if (entered)
+            leaveAsync(0);
+        if (last)
+            operation->callback(operation->userData, result, absLine);
+    };
+    
+    // urgent tasks go before chunks of a running filter, the user waits for the match
+    WorkerPool::shared().submitUrgent(this, [this, operation, key, fromLine, scanWindow, resolve, scan] {
+        if (!enterAsync(0)) {
+            operation->callback(operation->userData, Cancelled, 0);
+            return;
+        }
+        
+        // first window is scanned right away, more tasks are started only if the match is further
+        std::vector<uint32_t> matches;
+        uint32_t absLine = 0;
+        auto err = planFind(*operation, key, fromLine);
+        uint32_t count = uint32_t(operation->windows.size());
+        operation->best = count;
+        operation->next = 1;
+        if (err == NoError && count)
+            err = scanWindow(0, matches);
+        if (err != NoError)
+            operation->fail(err);
+        bool done = (err != NoError || !matches.empty() || count < 2);
+        if (done) {
+            err = resolve(&absLine);
+        } else {
+            // worker takes its windows from a shared counter, so there is no use in more tasks than the pool has workers,
+            // tasks are queued under the lock close takes before it detaches the owner, so none is left behind
+            uint32_t tasks = std::min<uint32_t>(WorkerPool::shared().workerCount(), count - 1);
+            operation->running = tasks;
+            std::lock_guard<std::mutex> lock(m_asyncLock);
+            done = m_asyncStopped;
+            err = Cancelled;
+            for (uint32_t i = 0; !done && i < tasks; i++) {
+                WorkerPool::shared().submitUrgent(this, scan);
+            }
+        }
+        leaveAsync(0);
+        
+        if (done)
+            operation->callback(operation->userData, err, absLine);
+    });
+    return NoError;
+}
+
+SearchEngineError SearchEngine::planFind(FindOperation& operation, const FilterCacheKey& key, uint32_t fromLine)
+{
+    // compiled pattern is cached, so that the next find or filter with the same pattern doesn't compile it again
+    if (!operation.pattern) {
+        char error[MAX_ERROR_LENGTH + 1] = {0};
+        operation.pattern = compilePattern(key, error);
+        if (!operation.pattern)
+            return UnknownError;
+        cacheFilterResult(key, operation.pattern);
+    }
+    
+    // only the part of the file fetched without gaps is searched
+    uint64_t end = 0;
+    uint32_t totalLines = 0;
+    for (int i = 0; i < m_blockCount && isBlockFetched(i); i++) {
+        end = m_blocks[i].byteOffset + m_blocks[i].size;
+        totalLines += m_blocks[i].lines;
+    }
+    if (fromLine > totalLines)
+        return BadArgument;
+    
+    // lines start with 1, line 0 is before the first line going forward and after the last one going back
+    bool forward = operation.forward;
+    uint64_t pos = (forward)? 0 : end;
+    if (fromLine) {
+        // line lookup shares the prediction of sequential reads with the view
+        uint32_t length = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_viewLock);
+            pos = getLinePos(fromLine - 1, &length);
+        }
+        if (pos == -1)
+            return UnknownError;
+        if (forward)
+            pos = std::min(pos + length + 1, end);
+    }
+    
+    // windows grow with the distance from the line, so a nearby match is found after scanning few kilobytes
+    auto& windows = operation.windows;
+    uint64_t size = s_findWindowSize;
+    while ((forward)? pos < end : pos > 0) {
+        FindOperation::Window window;
+        if (forward) {
+            window = {pos, lineStartAfter(std::min(pos + size, end), end)};
+            pos = window.end;
+        } else {
+            window = {lineStartBefore((pos > size)? pos - size : 0), pos};
+            pos = window.start;
+        }
+        windows.push_back(window);
+        size = (size * 2 < s_filterChunkSize)? size * 2 : s_filterChunkSize;
+    }
+    return NoError;
+}
+
+SearchEngineError SearchEngine::getWatchlistHits(uint32_t topK, SEWatchlistHit* hits, uint32_t* count, uint32_t* matched)
+{
+    if (!count || (topK && !hits))
+        return BadArgument;
+    
+    std::lock_guard<std::mutex> lock(m_viewLock);
+    
+    if (!m_filtered || m_templateFilter || !m_filterResult || m_filterResult->watchlist.empty())
+        return BadArgument;
+    
+    // occurrences and lines of blocks filtered so far, final once filtering is complete
+    auto& watchlist = m_filterResult->watchlist;
+    std::vector<uint64_t> occurrences(watchlist.size());
+    std::vector<uint64_t> lines(watchlist.size());
+    for (int i = 0; i < m_blockCount; i++) {
+        if (!assembleBlock(i))
+            continue;
+        auto& blockHits = m_filterResult->blocks[i].hits;
+        for (size_t h = 0; h + 1 < blockHits.size(); h += 2) {
+            occurrences[blockHits[h]] += blockHits[h + 1];
+            lines[blockHits[h]]++;
+        }
+    }
+    
+    std::vector<uint32_t> entries;
+    for (uint32_t i = 0; i < lines.size(); i++) {
+        if (lines[i])
+            entries.push_back(i);
+    }
+    if (matched)
+        *matched = uint32_t(entries.size());
+    
+    // most frequent first, entries with the same count keep list order
+    uint32_t n = std::min<uint32_t>(topK, uint32_t(entries.size()));
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), [&](uint32_t a, uint32_t b) {
+        return (occurrences[a] != occurrences[b])? occurrences[a] > occurrences[b] : a < b;
+    });
+    for (uint32_t i = 0; i < n; i++) {
+        hits[i].entry = watchlist[entries[i]].c_str();
+        hits[i].length = uint32_t(watchlist[entries[i]].size());
+        hits[i].index = entries[i];
+        hits[i].count = occurrences[entries[i]];
+        hits[i].lines = lines[entries[i]];
+    }
+    *count = n;
+    
+    return NoError;
+}
+
+bool SearchEngine::findFiltered(uint32_t fromLine, SEDirection direction, uint32_t* absLine)
+{
+    // matches are sorted within blocks and blocks follow each other
+    bool forward = (direction == ForwardDirection);
+    uint32_t lineBase = 0;
+    bool found = false;
+    for (int i = 0; i < m_blockCount; i++) {
+        auto& matches = m_filterResult->blocks[i].matches;
+        if (forward) {
+            // first match after the line
+            uint32_t target = (fromLine > lineBase)? fromLine - lineBase : 0;
+            auto match = std::lower_bound(matches.begin(), matches.end(), target);
+            if (match != matches.end()) {
+                *absLine = lineBase + *match + 1;
+                return true;
+            }
+        } else {
+            // last match before the line
+            if (fromLine && fromLine <= lineBase + 1)
+                break;
+            auto match = (fromLine == 0)? matches.end() : std::lower_bound(matches.begin(), matches.end(), fromLine - 1 - lineBase);
+            if (match != matches.begin()) {
+                *absLine = lineBase + *(match - 1) + 1;
+                found = true;
+            }
+        }
+        lineBase += m_blocks[i].lines;
+    }
+    return found;
+}
+
+uint64_t SearchEngine::lineStartBefore(uint64_t pos)
+{
+    while (pos > 0 && m_mem[pos - 1] != '\n')
+        pos--;
+    return pos;
+}
+
+uint64_t SearchEngine::lineStartAfter(uint64_t pos, uint64_t end)
+{
+    if (pos == 0 || pos >= end || m_mem[pos - 1] == '\n')
+        return std::min(pos, end);
+    
+    auto eol = (const char*)memchr(m_mem + pos, '\n', end - pos);
+    return (eol)? eol - m_mem + 1 : end;
+}
+
+uint32_t SearchEngine::lineForPos(uint64_t pos)
+{
+    // line index gives the closest indexed line, the rest is counted
+    uint32_t lineBase = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        auto block = &m_blocks[i];
+        if (pos >= block->byteOffset + block->size) {
+            lineBase += block->lines;
+            continue;
+        }
+        
+        auto& lineIndex = block->lineIndex;
+        size_t idx = std::upper_bound(lineIndex.begin(), lineIndex.end(), pos) - lineIndex.begin() - 1;
+        uint32_t line = lineBase + uint32_t(idx * s_lineIndexStride);
+        for (uint64_t p = lineIndex[idx]; p < pos; line++) {
+            auto eol = (const char*)memchr(m_mem + p, '\n', pos - p);
+            if (!eol)
+                break;
+            p = eol - m_mem + 1;
+        }
+        return line;
+    }
+    return lineBase;
+}
+
+std::shared_ptr<KeyExtractor> SearchEngine::createExtractor(const SEKeyExtractor* extractor, char* error)
+{
+    switch (extractor->type) {
+        case ColumnKey:
+            return std::make_shared<ColumnExtractor>(extractor->delimiter, extractor->column);
+        case FieldKey:
+            if (!extractor->pattern || !extractor->pattern[0])
+                return nullptr;
+            return std::make_shared<FieldExtractor>(extractor->pattern);
+        default:
+            printf("[!] key type %d is not supported\n", extractor->type);
+            return nullptr;
+    }
+}
+
+void SearchEngine::forEachLine(uint32_t blockIdx, const std::vector<uint32_t>* lines, const std::function<void(const char*, uint32_t)>& func)
+{
+    auto block = &m_blocks[blockIdx];
+    uint64_t blockEnd = block->byteOffset + block->size;
+    uint64_t pos = block->byteOffset;
+    uint32_t line = 0;
+    
+    // lines read so far are reported in chunks, so that bounded memory mode can release them
+    uint64_t scanned = pos;
+    auto release = [&](uint64_t minSize) {
+        uint64_t end = std::min(pos, blockEnd);
+        if (end - scanned >= minSize) {
+            scannedRange(scanned, end - scanned);
+            scanned = end;
+        }
+    };
+    
+    auto emit = [&]() {
+        auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+        uint64_t end = (eol)? eol - m_mem : blockEnd;
+        uint32_t length = uint32_t(end - pos);
+        if (length && m_mem[end - 1] == '\r')
+            length--;
+        func(m_mem + pos, length);
+        pos = end + 1;
+        line++;
+        release(s_filterChunkSize);
+    };
+    
+    if (!lines) {
+        while (line < block->lines)
+            emit();
+        release(0);
+        return;
+    }
+    
+    // lines are sorted, jump over long gaps with line index and skip the rest
+    for (auto target : *lines) {
+        if (target / s_lineIndexStride != line / s_lineIndexStride) {
+            pos = block->lineIndex[target / s_lineIndexStride];
+            line = target - target % s_lineIndexStride;
+        }
+        for (; line < target; line++) {
+            auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+            if (!eol)
+                break;
+            pos = eol - m_mem + 1;
+        }
+        if (line < target)
+            break;
+        emit();
+    }
+    release(0);
+}
+
+SearchEngineError SearchEngine::getStats(SEStats* stats)
+{
+    if (!stats)
+        return BadArgument;
+    
+    memset(stats, 0, sizeof(SEStats));
+    
+    stats->blocks = m_blockCount;
+    for (int i = 0; i < m_blockCount; i++) {
+        m_stats.fetch[i].load(&stats->fetch[i]);
+        m_stats.filter[i].load(&stats->filter[i]);
+        
+        stats->indexMemory += m_blocks[i].lineIndex.capacity() * sizeof(uint64_t);
+        stats->indexMemory += m_blocks[i].segments.capacity() * sizeof(SESegment);
+        stats->indexMemory += m_blocks[i].gramChunks.capacity() * sizeof(SEGramChunk);
+        if (auto grams = std::atomic_load(&m_blocks[i].grams))
+            stats->indexMemory += grams->capacity() * sizeof(uint64_t);
+    }
+    
+    stats->compileTime = m_stats.compileTime.load(std::memory_order_relaxed);
+    stats->predictionHits = m_stats.predictionHits.load(std::memory_order_relaxed);
+    stats->predictionMisses = m_stats.predictionMisses.load(std::memory_order_relaxed);
+    stats->cacheHits = m_stats.cacheHits.load(std::memory_order_relaxed);
+    stats->cacheMisses = m_stats.cacheMisses.load(std::memory_order_relaxed);
+    stats->skippedBytes = m_stats.skippedBytes.load(std::memory_order_relaxed);
+    stats->cacheMemory = m_filterCache.getUsage();
+    if (m_aggregator)
+        stats->indexMemory += m_aggregator->memoryUsage();
+    stats->indexMemory += m_templateMiner.memoryUsage();
+    
+    {
+        std::lock_guard<std::mutex> lock(m_residentLock);
+        stats->residentLimit = m_residentLimit.load(std::memory_order_relaxed);
+        stats->residentBytes = m_residentBytes;
+    }
+    stats->releasedBytes = m_releasedBytes.load(std::memory_order_relaxed);
+    
+    return NoError;
+}
+
+SearchEngineError SearchEngine::getProgress(SEOperation operation, SEProgress* progress)
+{
+    if (!progress)
+        return BadArgument;
+    
+    switch (operation) {
+        case FetchOperation:
+            m_stats.fetchProgress.load(progress);
+            return NoError;
+        case FilterOperation:
+            m_stats.filterProgress.load(progress);
+            return NoError;
+    }
+    return BadArgument;
+}
+
+SearchEngineError SearchEngine::dumpStats(char* json, uint32_t size)
+{
+    if (!json || !size)
+        return BadArgument;
+    
+    SEStats stats;
+    auto err = getStats(&stats);
+    if (err != NoError)
+        return err;
+    
+    uint32_t len = 0;
+    auto append = [&](const char* format, auto... args) {
+        if (len < size)
+            len += snprintf(json + len, size - len, format, args...);
+    };
+    
+    auto appendChunks = [&](const char* name, SEChunkStats* chunks) {
+        append("\"%s\":[", name);
+        for (int i = 0; i < stats.blocks; i++) {
+            append("%s{\"bytes\":%llu,\"scanTime\":%llu,\"bytesPerSecond\":%llu,\"callbacks\":%llu,"
+                   "\"matches\":%llu,\"candidates\":%llu,\"scopeLines\":%llu,\"pageFaults\":%llu}", (i)? "," : "",
+                   chunks[i].bytes, chunks[i].scanTime, chunks[i].bytesPerSecond, chunks[i].callbacks,
+                   chunks[i].matches, chunks[i].candidates, chunks[i].scopeLines, chunks[i].pageFaults);
+        }
+        append("],");
+    };
+    
+    append("{\"blocks\":%u,", stats.blocks);
+    appendChunks("fetch", stats.fetch);
+    appendChunks("filter", stats.filter);
+    append("\"compileTime\":%llu,\"databaseSize\":%llu,\"scratchSize\":%llu,"
+           "\"predictionHits\":%llu,\"predictionMisses\":%llu,\"cacheHits\":%llu,\"cacheMisses\":%llu,"
+           "\"indexMemory\":%llu,\"cacheMemory\":%llu,"
+           "\"residentLimit\":%llu,\"residentBytes\":%llu,\"releasedBytes\":%llu,\"skippedBytes\":%llu}",
+           stats.compileTime, stats.databaseSize, stats.scratchSize,
+           stats.predictionHits, stats.predictionMisses, stats.cacheHits, stats.cacheMisses,
+           stats.indexMemory, stats.cacheMemory,
+           stats.residentLimit, stats.residentBytes, stats.releasedBytes, stats.skippedBytes);
+    
+    if (len >= size) {
+        printf("[!] stats buffer is too small (%d bytes required)\n", len + 1);
+        return BadArgument;
+    }
+    
+    return NoError;
+}
+
+void SearchEngine::compileLoop()
+{
+    std::unique_lock<std::mutex> lock(m_compileLock);
+    while (true) {
+        m_compileCond.wait(lock, [this] { return m_compileStop || !m_compileQueue.empty(); });
+        if (m_compileStop)
+            break;
+        
+        auto requests = std::move(m_compileQueue);
+        m_compileQueue.clear();
+        lock.unlock();
+        
+        // only the latest queued request is compiled, older ones are superseded
+        for (size_t i = 0; i + 1 < requests.size(); i++) {
+            if (requests[i].callback)
+                requests[i].callback(requests[i].userData, requests[i].generation, Cancelled, "");
+        }
+        
+        auto& request = requests.back();
+        char error[MAX_ERROR_LENGTH + 1] = {0};
+        SearchEngineError err = NoError;
+        
+        // compiled database is cached, so that following setPattern() doesn't compile it again
+        if (!m_filterCache.find(request.key)) {
+            auto result = compilePattern(request.key, error);
+            if (result)
+                cacheFilterResult(request.key, result);
+            else
+                err = UnknownError;
+        }
+        
+        // hyperscan compilation can't be interrupted, result of superseded request is only cached
+        if (request.generation != m_compileGeneration.load())
+            err = Cancelled;
+        
+        if (request.callback)
+            request.callback(request.userData, request.generation, err, error);
+        
+        lock.lock();
+    }
+    
+    for (auto& request : m_compileQueue) {
+        if (request.callback)
+            request.callback(request.userData, request.generation, Cancelled, "");
+    }
+    m_compileQueue.clear();
+}
+
+void SearchEngine::stopCompiler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_compileLock);
+        m_compileStop = true;
+    }
+    m_compileCond.notify_all();
+    
+    if (m_compileThread.joinable())
+        m_compileThread.join();
+}
+
+bool SearchEngine::restoreBlock(uint32_t blockIdx, SEBlockInfo* info)
+{
+    auto block = &m_blocks[blockIdx];
+    if (!block->indexed)
+        return false;
+    
+    info->lines = block->lines;
+    info->maxLength = block->maxLength;
+    info->encoding = block->encoding;
+    
+    m_stats.fetch[blockIdx].reset();
+    m_stats.fetchProgress.add(blockIdx, block->size, block->lines, 0);
+    blockFetched(blockIdx);
+    
+    return true;
+}
+
+void SearchEngine::indexGrams(uint32_t blockIdx)
+{
+    // lines keep coming to stream blocks, their chunks are always scanned
+    auto block = &m_blocks[blockIdx];
+    block->gramChunks.clear();
+    if (m_stream)
+        return;
+    
+    splitBlock(blockIdx, [&](uint64_t pos, uint64_t size, uint32_t firstLine) {
+        block->gramChunks.push_back({pos, size, firstLine});
+    });
+    
+    // bitmaps restored from sidecar index are used as they are, even if trigrams aren't indexed anymore
+    size_t words = block->gramChunks.size() * GramIndex::s_bitmapWords;
+    auto restored = std::atomic_load(&block->grams);
+    if (block->indexed && restored && restored->size() == words) {
+        m_indexMemory += block->gramChunks.capacity() * sizeof(SEGramChunk);
+        return;
+    }
+    
+    auto previous = std::atomic_exchange(&block->grams, std::shared_ptr<const std::vector<uint64_t>>());
+    if (previous)
+        m_indexMemory -= previous->capacity() * sizeof(uint64_t);
+    if (!m_gramIndex) {
+        block->gramChunks = std::vector<SEGramChunk>();
+        return;
+    }
+    
+    m_indexMemory += block->gramChunks.capacity() * sizeof(SEGramChunk);
+    buildGrams(blockIdx);
+    
+    // block restored from an index saved without trigrams is saved again
+    block->indexed = false;
+}
+
+void SearchEngine::buildGrams(uint32_t blockIdx)
+{
+    auto block = &m_blocks[blockIdx];
+    auto grams = std::make_shared<std::vector<uint64_t>>(block->gramChunks.size() * GramIndex::s_bitmapWords, 0);
+    for (size_t i = 0; i < block->gramChunks.size(); i++) {
+        auto& chunk = block->gramChunks[i];
+        prefetchRange(chunk.byteOffset, chunk.size);
+        GramIndex::build(m_mem + chunk.byteOffset, chunk.size, &(*grams)[i * GramIndex::s_bitmapWords]);
+        scannedRange(chunk.byteOffset, chunk.size);
+    }
+    
+    // bitmaps replaced meanwhile are released by the last filter using them
+    m_indexMemory += grams->capacity() * sizeof(uint64_t);
+    auto previous = std::atomic_exchange(&block->grams, std::shared_ptr<const std::vector<uint64_t>>(grams));
+    if (previous)
+        m_indexMemory -= previous->capacity() * sizeof(uint64_t);
+}
+
+size_t SearchEngine::trimIndex(size_t bytes)
+{
+    // filters running meanwhile keep the bitmaps they have taken and scan chunks without them afterwards
+    size_t released = 0;
+    for (uint32_t i = 0; i < MAX_BLOCK_COUNT && released < bytes; i++) {
+        auto grams = std::atomic_exchange(&m_blocks[i].grams, std::shared_ptr<const std::vector<uint64_t>>());
+        if (!grams)
+            continue;
+        
+        size_t size = grams->capacity() * sizeof(uint64_t);
+        m_indexMemory -= size;
+        released += size;
+        m_gramsDropped = true;
+    }
+    return released;
+}
+
+void SearchEngine::rebuildGrams()
+{
+    // bitmaps dropped by memory budget are built again by workers for blocks which still have chunks,
+    // filtering meanwhile scans those blocks as a whole
+    if (!m_gramsDropped.exchange(false))
+        return;
+    
+    for (uint32_t i = 0; i < m_blockCount; i++) {
+        if (!isBlockFetched(i) || m_blocks[i].gramChunks.empty() || std::atomic_load(&m_blocks[i].grams))
+            continue;
+        
+        WorkerPool::shared().submit(this, [this, i] {
+            if (!enterAsync(0))
+                return;
+            if (!std::atomic_load(&m_blocks[i].grams))
+                buildGrams(i);
+            leaveAsync(0);
+            MemoryBudget::shared().rebalance();
+        });
+    }
+}
+
+bool SearchEngine::mayMatch(const GramQuery& query, uint64_t pos, uint64_t size)
+{
+    if (query.empty())
+        return true;
+    
+    // range may cover several chunks or even blocks, it's ruled out only if all of them are
+    uint64_t end = pos + size;
+    for (int i = 0; i < m_blockCount; i++) {
+        auto block = &m_blocks[i];
+        if (block->byteOffset >= end || block->byteOffset + block->size <= pos)
+            continue;
+        auto grams = std::atomic_load(&block->grams);
+        if (!grams || (query.caseless() && block->encoding != ASCIIEncoding))
+            return true;
+        
+        auto& chunks = block->gramChunks;
+        auto chunk = std::upper_bound(chunks.begin(), chunks.end(), pos, [](uint64_t pos, const SEGramChunk& chunk) {
+            return pos < chunk.byteOffset;
+        });
+        if (chunk != chunks.begin())
+            chunk--;
+        for (; chunk != chunks.end() && chunk->byteOffset < end; chunk++) {
+            if (query.mayMatch(&(*grams)[(chunk - chunks.begin()) * GramIndex::s_bitmapWords]))
+                return true;
+        }
+    }
+    return false;
+}
+
+SearchEngineError SearchEngine::filterBlock(uint32_t slot, uint32_t blockIdx, std::vector<uint32_t>& matches, uint32_t* maxLength,
+                                            uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits)
+{
+    auto block = &m_blocks[blockIdx];
+    auto& query = m_filterResult->grams;
+    auto grams = std::atomic_load(&block->grams);
+    if (query.empty() || !grams || (query.caseless() && block->encoding != ASCIIEncoding))
+        return filterRange(slot, block->byteOffset, block->size, 0, matches, maxLength, callbacks, candidates, hits);
+    
+    // consecutive chunks which may match are scanned at once, lines and hits of every range follow previous ones
+    matches.clear();
+    if (hits)
+        hits->clear();
+    
+    auto& chunks = block->gramChunks;
+    auto chunkMayMatch = [&](size_t c) {
+        return query.mayMatch(&(*grams)[c * GramIndex::s_bitmapWords]);
+    };
+    std::vector<uint32_t> rangeMatches;
+    std::vector<uint32_t> rangeHits;
+    uint64_t skipped = 0;
+    for (size_t c = 0; c < chunks.size(); ) {
+        if (!chunkMayMatch(c)) {
+            skipped += chunks[c].size;
+            c++;
+            continue;
+        }
+        
+        size_t last = c;
+        while (last + 1 < chunks.size() && chunkMayMatch(last + 1))
+            last++;
+        
+        uint64_t pos = chunks[c].byteOffset;
+        uint64_t end = chunks[last].byteOffset + chunks[last].size;
+        auto err = filterRange(slot, pos, end - pos, chunks[c].firstLine, rangeMatches, maxLength, callbacks, candidates, (hits)? &rangeHits : nullptr);
+        if (err != NoError)
+            return err;
+        matches.insert(matches.end(), rangeMatches.begin(), rangeMatches.end());
+        if (hits)
+            hits->insert(hits->end(), rangeHits.begin(), rangeHits.end());
+        c = last + 1;
+    }
+    
+    m_stats.skippedBytes.fetch_add(skipped, std::memory_order_relaxed);
+    return NoError;
+}
+
+void SearchEngine::compileGrams(const FilterCacheKey& key, bool caseless, FilterResult* result)
+{
+    // approximate matches and field values don't contain the pattern as it is, templates aren't scanned
+    if (key.distance || key.fields || key.templates)
+        return;
+    
+    if (!key.watchlist) {
+        result->grams.addPattern(key.pattern, caseless);
+        return;
+    }
+    
+    for (auto& entry : result->watchlist) {
+        if (key.literal)
+            result->grams.addLiteral(entry, caseless);
+        else
+            result->grams.addPattern(entry, caseless);
+    }
+}
+
+void SearchEngine::blockFetched(uint32_t blockIdx)
+{
+    indexGrams(blockIdx);
+    
+    m_fetchedMask.fetch_or(1ULL << blockIdx, std::memory_order_release);
+    m_indexMemory += m_blocks[blockIdx].lineIndex.capacity() * sizeof(uint64_t);
+    m_indexMemory += m_blocks[blockIdx].records.capacity() * sizeof(uint32_t);
+    MemoryBudget::shared().rebalance();
+    
+    // the last fetched block joins records and saves the index if any block has been scanned
+    if (++m_fetchedBlocks != m_blockCount)
+        return;
+    
+    if (!m_recordHeader.empty())
+        joinRecords();
+    
+    if (!m_index)
+        return;
+    
+    std::vector<SidecarIndex::Block> blocks(m_blockCount);
+    bool scanned = false;
+    for (int i = 0; i < m_blockCount; i++) {
+        scanned |= !m_blocks[i].indexed;
+        blocks[i].byteOffset = m_blocks[i].byteOffset;
+        blocks[i].size = m_blocks[i].size;
+        blocks[i].lines = m_blocks[i].lines;
+        blocks[i].maxLength = m_blocks[i].maxLength;
+        blocks[i].encoding = m_blocks[i].encoding;
+        blocks[i].lineIndex = m_blocks[i].lineIndex;
+        if (auto grams = std::atomic_load(&m_blocks[i].grams))
+            blocks[i].grams = *grams;
+    }
+    
+    if (scanned && m_index->save(m_mem, m_size, m_mtime, blocks)) {
+        for (int i = 0; i < m_blockCount; i++) {
+            m_blocks[i].indexed = true;
+        }
+    }
+}
+
+bool SearchEngine::isBlockFetched(uint32_t blockIdx)
+{
+    return (m_fetchedMask.load(std::memory_order_acquire) >> blockIdx) & 1;
+}
+
+SearchEngineError SearchEngine::getOpenInfo(SEOpenInfo* info)
+{
+    if (!info)
+        return BadArgument;
+    
+    memset(info, 0, sizeof(SEOpenInfo));
+    
+    uint64_t fetchedBytes = 0;
+    uint64_t fetchedLines = 0;
+    bool ready = true;
+    for (int i = 0; i < m_blockCount; i++) {
+        if (!isBlockFetched(i)) {
+            ready = false;
+            continue;
+        }
+        
+        info->fetchedBlocks++;
+        fetchedBytes += m_blocks[i].size;
+        fetchedLines += m_blocks[i].lines;
+        if (ready) {
+            info->readyLines += m_blocks[i].lines;
+            info->readyMaxLength = std::max(info->readyMaxLength, m_blocks[i].maxLength);
+        }
+    }
+    
+    // average line length of fetched blocks is assumed for the rest of the file
+    info->complete = (info->fetchedBlocks == m_blockCount);
+    if (info->complete)
+        info->estimatedLines = uint32_t(fetchedLines);
+    else if (fetchedBytes)
+        info->estimatedLines = uint32_t(std::min<uint64_t>(fetchedLines * m_size / fetchedBytes, UINT32_MAX));
+    
+    return NoError;
+}
+
+SEEncoding SearchEngine::fileEncoding()
+{
+    // encodings are ordered, any invalid block makes the whole file invalid
+    SEEncoding encoding = ASCIIEncoding;
+    for (int i = 0; i < m_blockCount; i++) {
+        encoding = std::max(encoding, m_blocks[i].encoding);
+    }
+    return encoding;
+}
+
+void SearchEngine::resetFilterResult(std::shared_ptr<FilterResult> result)
+{
+    // async filter of the previous result is superseded like a new one
+    supersedeAsync();
+    
+    // appended lines scanned for the previous filter are added to its result before it's left
+    mergeAppends(true);
+    
+    m_filterResult = result;
+    m_filterResult->blockCount = m_blockCount;
+    m_filteredRows = 0;
+    
+    // chunks of previous filter are not running anymore, see cancelFilter
+    m_chunks.clear();
+    m_chunkOrder.clear();
+    memset(m_blockChunks, 0, sizeof(m_blockChunks));
+    
+    for (int block=0; block < MAX_BLOCK_COUNT; block++) {
+        m_blocks[block].rowBase = 0;
+        m_blocks[block].rows = 0;
+        m_blocks[block].segments.clear();
+    }
+    
+    m_predictedAbsLineNum = -1;
+    m_predictedLinePos = -1;
+    
+    // blocks restored from filter cache are done as soon as the filter starts
+    uint64_t totalBytes = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        totalBytes += m_blocks[i].size;
+    }
+    m_stats.filterProgress.start(totalBytes);
+    for (int i = 0; i < m_blockCount; i++) {
+        auto& block = m_filterResult->blocks[i];
+        if (block.filtered)
+            m_stats.filterProgress.add(i, m_blocks[i].size, m_blocks[i].lines, block.matches.size());
+    }
+}
+
+void SearchEngine::storeFilterResult()
+{
+    if (!m_filterResult || m_filterResult->complete)
+        return;
+    
+    for (int i = 0; i < m_blockCount; i++) {
+        if (!m_filterResult->blocks[i].filtered)
+            return;
+    }
+    
+    m_filterResult->complete = true;
+    
+    // re-insert to account match lines in the cache budget
+    cacheFilterResult(m_filterKey, m_filterResult);
+}
+
+void SearchEngine::applyScope()
+{
+    uint32_t totalLines = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        totalLines += m_blocks[i].lines;
+    }
+    
+    // every match adds its line and scope lines which are not covered by previous match yet,
+    // so segments are sorted by both row and line number across all blocks
+    // while filtering is in progress only finished chunks contribute matches
+    std::vector<const std::vector<uint32_t>*> lists;
+    int64_t lastLine = -1;
+    uint32_t row = 0;
+    uint32_t lineBase = 0;
+    bool records = m_recordsJoined.load(std::memory_order_acquire);
+    for (int i = 0; i < m_blockCount; i++) {
+        auto block = &m_blocks[i];
+        readyMatches(i, lists);
+        
+        block->rowBase = row;
+        block->segments.clear();
+        size_t capacity = block->segments.capacity();
+        for (auto matches : lists) {
+            for (auto match : *matches) {
+                int64_t line = lineBase + match;
+                int64_t first = line - m_scopeBefore;
+                int64_t last = line + m_scopeAfter;
+                if (records) {
+                    // whole record of the match and scope records around it
+                    int64_t record = recordForLine(uint32_t(line)) - 1;
+                    int64_t next = record + m_scopeAfter + 1;
+                    first = m_recordStarts[std::max(record - m_scopeBefore, int64_t(0))];
+                    last = (next < int64_t(m_recordStarts.size()))? int64_t(m_recordStarts[next]) - 1 : int64_t(totalLines) - 1;
+                }
+                first = std::max(first, lastLine + 1);
+                last = std::min(last, int64_t(totalLines) - 1);
+                
+                block->segments.push_back({row, uint32_t(first)});
+                if (last >= first) {
+                    row += uint32_t(last - first + 1);
+                    lastLine = last;
+                }
+            }
+        }
+        block->rows = row - block->rowBase;
+        lineBase += block->lines;
+        m_indexMemory += (block->segments.capacity() - capacity) * sizeof(SESegment);
+        
+        m_stats.filter[i].scopeLines.store(block->rows - block->segments.size(), std::memory_order_relaxed);
+        
+    }
+    
+    m_filteredRows = row;
+    m_predictedAbsLineNum = -1;
+    m_predictedLinePos = -1;
+}
+
+int32_t SearchEngine::findBlockForLine(uint32_t absLine, uint32_t* lineBase)
+{
+    // lines are numbered only up to the first block which is not fetched yet
+    uint64_t fetched = m_fetchedMask.load(std::memory_order_acquire);
+    uint32_t base = 0;
+    for (int i = 0; i < m_blockCount && ((fetched >> i) & 1); i++) {
+        if (absLine < base + m_blocks[i].lines) {
+            *lineBase = base;
+            return i;
+        }
+        base += m_blocks[i].lines;
+    }
+    return -1;
+}
+
+uint64_t SearchEngine::getLinePos(uint32_t absLine, uint32_t* length)
+{
+    uint32_t lineBase = 0;
+    int32_t blockIdx = findBlockForLine(absLine, &lineBase);
+    if (blockIdx < 0)
+        return -1;
+    
+    auto block = &m_blocks[blockIdx];
+    uint64_t blockEnd = block->byteOffset + block->size;
+    uint64_t pos = 0;
+    
+    if (absLine == m_predictedAbsLineNum) {
+        // sequential access, next line starts right after the previous one
+        pos = m_predictedLinePos;
+        EngineStats::count(m_stats.predictionHits);
+    } else {
+        EngineStats::count(m_stats.predictionMisses);
+        // start from the closest indexed line and skip the rest
+        uint32_t line = absLine - lineBase;
+        pos = block->lineIndex[line / s_lineIndexStride];
+        for (uint32_t skip = line % s_lineIndexStride; skip; skip--) {
+            auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+            if (!eol)
+                return -1;
+            pos = eol - m_mem + 1;
+        }
+    }
+    
+    auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+    uint64_t end = (eol)? eol - m_mem : blockEnd;
+    *length = uint32_t(end - pos);
+    
+    m_predictedAbsLineNum = absLine + 1;
+    m_predictedLinePos = end + 1;
+    
+    return pos;
+}
+
+bool SearchEngine::isMatchLine(uint32_t absLine)
+{
+    uint32_t lineBase = 0;
+    int32_t blockIdx = findBlockForLine(absLine, &lineBase);
+    if (blockIdx < 0)
+        return false;
+    
+    uint32_t line = absLine - lineBase;
+    if (m_filterResult->blocks[blockIdx].filtered) {
+        auto& matches = m_filterResult->blocks[blockIdx].matches;
+        return std::binary_search(matches.begin(), matches.end(), line);
+    }
+    
+    // block is still being filtered, look into the chunk with the line
+    auto first = m_chunks.begin() + m_blockChunks[blockIdx];
+    auto last = m_chunks.begin() + m_blockChunks[blockIdx + 1];
+    auto chunk = std::upper_bound(first, last, line, [](uint32_t line, const SEFilterChunk& chunk) {
+        return line < chunk.firstLine;
+    });
+    if (chunk == first || !(chunk - 1)->done.load(std::memory_order_acquire))
+        return false;
+    
+    auto& matches = (chunk - 1)->matches;
+    return std::binary_search(matches.begin(), matches.end(), line);
+}
+
+uint32_t SearchEngine::lineForRow(uint32_t row)
+{
+    // find block and segment with the row
+    int blockIdx = m_blockCount - 1;
+    while (blockIdx > 0 && (m_blocks[blockIdx].rows == 0 || m_blocks[blockIdx].rowBase > row))
+        blockIdx--;
+    
+    auto& segments = m_blocks[blockIdx].segments;
+    auto segment = std::upper_bound(segments.begin(), segments.end(), row, [](uint32_t row, const SESegment& seg) {
+        return row < seg.rowStart;
+    }) - 1;
+    
+    return segment->lineStart + (row - segment->rowStart);
+}
+
+void SearchEngine::joinRecords()
+{
+    // lines before the first header make a record, so every line belongs to one
+    m_recordStarts.clear();
+    m_recordStarts.push_back(0);
+    uint32_t lineBase = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        for (auto line : m_blocks[i].records) {
+            if (line < m_blocks[i].lines && lineBase + line != m_recordStarts.back())
+                m_recordStarts.push_back(lineBase + line);
+        }
+        lineBase += m_blocks[i].lines;
+    }
+    m_indexMemory += m_recordStarts.capacity() * sizeof(uint32_t);
+    m_recordsJoined.store(true, std::memory_order_release);
+    
+    printf("[+] %zu records with header \"%s\"\n", m_recordStarts.size(), m_recordHeader.c_str());
+}
+
+uint32_t SearchEngine::recordForLine(uint32_t absLine)
+{
+    if (!m_recordsJoined.load(std::memory_order_acquire))
+        return absLine + 1;
+    
+    return uint32_t(std::upper_bound(m_recordStarts.begin(), m_recordStarts.end(), absLine) - m_recordStarts.begin());
+}
+
+uint32_t SearchEngine::rowsBeforeLine(uint32_t absLine)
+{
+    // last segment starting at or before the line, its rows are consecutive lines
+    int blockIdx = m_blockCount - 1;
+    while (blockIdx > 0 && (m_blocks[blockIdx].segments.empty() || m_blocks[blockIdx].segments.front().lineStart > absLine))
+        blockIdx--;
+    
+    auto& segments = m_blocks[blockIdx].segments;
+    if (segments.empty() || segments.front().lineStart > absLine)
+        return 0;
+    
+    auto segment = std::upper_bound(segments.begin(), segments.end(), absLine, [](uint32_t line, const SESegment& seg) {
+        return line < seg.lineStart;
+    }) - 1;
+    
+    uint32_t rowEnd = m_blocks[blockIdx].rowBase + m_blocks[blockIdx].rows;
+    if (segment + 1 != segments.end())
+        rowEnd = (segment + 1)->rowStart;
+    
+    return segment->rowStart + std::min(absLine - segment->lineStart, rowEnd - segment->rowStart);
+}
+
+SearchEngineError SearchEngine::buildTimeIndex(uint32_t blockIdx)
+{
+    if (blockIdx > MAX_BLOCK_COUNT - 1)
+        return BadArgument;
+    
+    if (!m_blocks[blockIdx].active)
+        return BadArgument;
     
-    m_mem = (const char*)mmap(nullptr, m_size, PROT_READ, MAP_FILE | MAP_SHARED, m_fd, 0);
-    if (m_mem == MAP_FAILED) {
-        printf("[!] mmap failed: %d.\n", errno);
-        return FileMapFailed;
-    }
+    // latest timestamp of every indexed range of lines, turned into time before the range by finishTimeIndex
+    auto block = &m_blocks[blockIdx];
+    const int64_t noTime = TimestampParser::s_noTime;
+    size_t capacity = block->timeIndex.capacity();
+    block->timeIndex.assign((block->lines + s_lineIndexStride - 1) / s_lineIndexStride, noTime);
+    uint32_t line = 0;
+    forEachLine(blockIdx, nullptr, [&](const char* data, uint32_t length) {
+        auto& latest = block->timeIndex[line++ / s_lineIndexStride];
+        latest = std::max(latest, TimestampParser::parse(data, length));
+    });
+    m_indexMemory += (block->timeIndex.capacity() - capacity) * sizeof(int64_t);
     
     return NoError;
 }
 
-uint64_t SearchEngine::totalBytes()
+void SearchEngine::finishTimeIndex()
 {
-    return m_size;
+    int64_t time = TimestampParser::s_noTime;
+    for (int i = 0; i < m_blockCount; i++) {
+        for (auto& entry : m_blocks[i].timeIndex) {
+            int64_t latest = entry;
+            entry = time;
+            time = std::max(time, latest);
+        }
+    }
+    m_timeIndexed = true;
+    MemoryBudget::shared().rebalance();
 }
 
-uint32_t SearchEngine::formatBlocks()
+bool SearchEngine::hasTimeIndex()
 {
-    uint32_t cores = std::thread::hardware_concurrency();
-    uint32_t blocks = (m_size > 1024*1024)? cores : 1;
-    printf("[+] use %d block (available %d logical cores)\n", blocks, cores);
-    
-    size_t psize = strlen(s_eolPattern);
-    uint64_t blockSize = m_size / blocks;
-    uint64_t offset = blockSize;
-    
-    m_blocks[0].byteOffset = 0;
-    m_blocks[0].size = 0;
-    m_blocks[0].active = true;
-    int i = 1;
-    for (; i < blocks; i++) {
-        m_blocks[i].active = true;
-        m_blocks[i].byteOffset = strstr(m_mem + offset, s_eolPattern) - m_mem + psize; // FIXME: !!! if file doesn't end with \n
-        m_blocks[i-1].size = m_blocks[i].byteOffset - m_blocks[i-1].byteOffset;
-        offset += blockSize;
-    }
-    m_blocks[i-1].size = m_size - m_blocks[i-1].byteOffset;
-    m_blockCount = blocks;
-    
-    return blocks;
+    return m_timeIndexed;
 }
 
-SearchEngineError SearchEngine::mergeScope(uint32_t *filteredLines)
+uint32_t SearchEngine::viewRows()
 {
-    if (!filteredLines)
-        return BadArgument;
+    if (m_filtered)
+        return m_filteredRows;
     
-    uint32_t extraLines = 0;
-    int32_t headLines = 0;
-    int32_t tailLines = 0;
-    int32_t linesLeft = 0;
-    int32_t carry = 0;
-    for (int i = 1; i < m_blockCount; i++) {
-        headLines = m_blocks[i].headLines;
-        if (m_blocks[i-1].filteredLines)
-            tailLines = m_blocks[i-1].tailLines;
-        else
-            tailLines = m_blocks[i-1].headLines - carry;
-        linesLeft = headLines + tailLines;
-        carry = 0;
-        if(tailLines < 0) {
-            carry = (linesLeft > 0)? headLines - linesLeft : (headLines > 0)? headLines : 0;
-            m_blocks[i].lendedTailLines = carry;
-            if (m_beforeTracker[i].getSize() < carry)
-                m_beforeTracker[i].setSize(carry);
-        #if DEBUG_BLOCKS
-            printf("[#] merge %d line(s) <= into block %d tail <%+d> from block %d head <%+d>\n", carry, i-1, tailLines, i, headLines);
-        #endif
-        } else if (headLines < 0) {
-            carry = (linesLeft > 0)? tailLines - linesLeft : (tailLines > 0)? tailLines : 0;
-            m_blocks[i-1].lendedHeadLines = carry;
-            if (m_afterTracker[i-1].getSize() < carry)
-                m_afterTracker[i-1].setSize(carry);
-        #if DEBUG_BLOCKS
-            printf("[#] merge %d line(s) => from block %d tail <%+d> into block %d head <%+d>\n", carry, i-1, tailLines, i, headLines);
-        #endif
-        } else {
-            carry = 0;
-        }
-        extraLines += carry;
+    uint32_t lines = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        lines += m_blocks[i].lines;
     }
+    return lines;
+}
 
-    *filteredLines += extraLines;
+uint32_t SearchEngine::viewRowLine(uint32_t row)
+{
+    return (m_filtered)? lineForRow(row) : row;
+}
+
+int64_t SearchEngine::viewRowTime(uint32_t row)
+{
+    uint32_t line = viewRowLine(row);
+    return lineTime(line, line, 0);
+}
+
+int64_t SearchEngine::viewRowTime(uint32_t row, uint32_t knownRow, int64_t knownTime)
+{
+    if (knownRow >= row)
+        return viewRowTime(row);
     
-    return NoError;
+    return lineTime(viewRowLine(row), viewRowLine(knownRow), knownTime);
 }
 
-void SearchEngine::close()
+uint32_t SearchEngine::viewRowsBefore(int64_t time)
 {
-    if (m_fd >= 0) {
-        munmap((void*)m_mem, m_size);
-        ::close(m_fd);
+    uint32_t line = firstLineAtTime(time);
+    return (m_filtered)? rowsBeforeLine(line) : line;
+}
+
+int64_t SearchEngine::lineTime(uint32_t absLine, uint32_t knownLine, int64_t knownTime)
+{
+    uint32_t lineBase = 0;
+    int32_t blockIdx = findBlockForLine(absLine, &lineBase);
+    if (blockIdx < 0 || m_blocks[blockIdx].timeIndex.empty())
+        return TimestampParser::s_noTime;
+    
+    // lines of the indexed range up to this one are parsed, no more than s_lineIndexStride
+    auto block = &m_blocks[blockIdx];
+    uint32_t line = absLine - lineBase;
+    uint32_t range = line / s_lineIndexStride;
+    uint32_t first = range * s_lineIndexStride;
+    int64_t time = block->timeIndex[range];
+    
+    // time of an earlier line of the same range is carried over, lines up to it are only skipped
+    uint32_t parseFrom = first;
+    if (knownLine < absLine && knownLine >= lineBase + first) {
+        time = knownTime;
+        parseFrom = knownLine - lineBase + 1;
     }
+    
+    uint64_t pos = block->lineIndex[range];
+    uint64_t blockEnd = block->byteOffset + block->size;
+    for (uint32_t i = first; i <= line && pos < blockEnd; i++) {
+        auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+        uint64_t end = (eol)? eol - m_mem : blockEnd;
+        if (i >= parseFrom)
+            time = std::max(time, TimestampParser::parse(m_mem + pos, uint32_t(end - pos)));
+        pos = end + 1;
+    }
+    return time;
 }
 
-bool SearchEngine::isFiltered()
+uint32_t SearchEngine::firstLineAtTime(int64_t time)
 {
-    return m_filtered;
+    // time is monotonic, so the line is within the last indexed range starting before the time
+    uint32_t lineBase = 0;
+    int32_t blockIdx = -1;
+    uint32_t blockBase = 0;
+    for (int i = 0; i < m_blockCount; i++) {
+        if (m_blocks[i].timeIndex.empty())
+            continue;
+        if (m_blocks[i].timeIndex.front() >= time)
+            break;
+        blockIdx = i;
+        blockBase = lineBase;
+        lineBase += m_blocks[i].lines;
+    }
+    if (blockIdx < 0)
+        return 0;
+    
+    auto& timeIndex = m_blocks[blockIdx].timeIndex;
+    uint32_t range = uint32_t(std::lower_bound(timeIndex.begin(), timeIndex.end(), time) - timeIndex.begin()) - 1;
+    uint32_t first = range * s_lineIndexStride;
+    uint32_t last = std::min(first + s_lineIndexStride, m_blocks[blockIdx].lines);
+    
+    // all lines of the range are earlier, the next range starts at or after the time
+    auto block = &m_blocks[blockIdx];
+    int64_t lineTime = timeIndex[range];
+    uint64_t pos = block->lineIndex[range];
+    uint64_t blockEnd = block->byteOffset + block->size;
+    for (uint32_t line = first; line < last; line++) {
+        auto eol = (const char*)memchr(m_mem + pos, '\n', blockEnd - pos);
+        uint64_t end = (eol)? eol - m_mem : blockEnd;
+        lineTime = std::max(lineTime, TimestampParser::parse(m_mem + pos, uint32_t(end - pos)));
+        if (lineTime >= time)
+            return blockBase + line;
+        pos = end + 1;
+    }
+    return blockBase + last;
 }
 
 // MARK: - C export
@@ -156,12 +2869,20 @@ extern "C" {
         if (context->back == Hyperscan) {
             context->engine = new HyperscanEngine();
         } else
+    #endif
+    #if SE_SUPPORT_PORTABLE
+        if (context->back == Portable) {
+            context->engine = new PortableEngine();
+        } else
     #endif
         {
             printf("[!] unknown engine back\n");
             return BadArgument;
         }
         
+        context->engine->setIndexDir(context->indexDir);
+        context->engine->setRecordHeader(context->recordHeader);
+        context->engine->setGramIndex(context->gramIndex);
         if (context->engine->init(file) != NoError) {
             printf("[!] unable to init engine\n");
             return InitFailed;
@@ -169,6 +2890,7 @@ extern "C" {
         
         context->blocks = context->engine->formatBlocks();
         context->bytes = context->engine->totalBytes();
+        context->stream = context->engine->isStream();
         
         return NoError;
     }
@@ -180,6 +2902,30 @@ extern "C" {
         return context->engine->fetch(blockIdx, info);
     }
 
+    SearchEngineError se_get_open_info(struct SEContext* context, struct SEOpenInfo* info) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getOpenInfo(info);
+    }
+    
+    SearchEngineError se_poll_stream(struct SEContext* context, struct SEStreamInfo* info) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        auto err = context->engine->pollStream(info);
+        context->blocks = context->engine->blockCount();
+        context->bytes = context->engine->totalBytes();
+        return err;
+    }
+    
+    SearchEngineError se_filter_appended(struct SEContext* context, uint32_t index) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->filterAppended(index);
+    }
+    
     SearchEngineError se_merge_scope(struct SEContext* context, uint32_t* filteredLines) {
         if (! (context && context->engine))
             return InvalidContext;
@@ -219,6 +2965,27 @@ extern "C" {
         return context->engine->setIgnoreCase(ignoreCase);
     }
     
+    SearchEngineError se_set_fuzzy(struct SEContext* context, uint32_t distance, bool hamming) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setFuzzy(distance, hamming);
+    }
+    
+    SearchEngineError se_set_field_mode(struct SEContext* context, bool fieldMode) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setFieldMode(fieldMode);
+    }
+    
+    SearchEngineError se_set_utf8(struct SEContext* context, bool utf8) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setUTF8(utf8);
+    }
+    
     SearchEngineError se_set_scope(struct SEContext* context, uint32_t before, uint32_t after) {
         if (! (context && context->engine))
             return InvalidContext;
@@ -237,6 +3004,13 @@ extern "C" {
         return context->engine->setPattern(pattern, error);
     }
     
+    SearchEngineError se_compile_pattern_async(struct SEContext* context, const char* pattern, SECompileCallback callback, void* userData, uint64_t* generation) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->compilePatternAsync(pattern, callback, userData, generation);
+    }
+    
     SearchEngineError se_filter(struct SEContext* context, uint32_t blockIdx, struct SEBlockInfo* info) {
         if (! (context && context->engine))
             return InvalidContext;
@@ -244,6 +3018,215 @@ extern "C" {
         return context->engine->filter(blockIdx, info);
     }
     
+    SearchEngineError se_plan_filter(struct SEContext* context, uint32_t viewportLine, uint32_t* chunks, uint32_t* priorityChunks) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->planFilter(viewportLine, chunks, priorityChunks);
+    }
+    
+    SearchEngineError se_filter_chunk(struct SEContext* context, uint32_t chunkIdx, struct SEBlockInfo* info) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->filterChunk(chunkIdx, info);
+    }
+    
+    SearchEngineError se_cancel_filter(struct SEContext* context) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        context->engine->cancelFilter();
+        return NoError;
+    }
+    
+    SearchEngineError se_sample_chunk(struct SEContext* context, uint32_t chunkIdx) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->sampleChunk(chunkIdx);
+    }
+    
+    SearchEngineError se_get_match_estimate(struct SEContext* context, struct SEMatchEstimate* estimate) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getMatchEstimate(estimate);
+    }
+    
+    SearchEngineError se_find_next_async(struct SEContext* context, const char* pattern, uint32_t fromAbsLine, SEDirection direction,
+                                         SEFindCallback callback, void* userData) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->findNextAsync(pattern, fromAbsLine, direction, callback, userData);
+    }
+    
+    SearchEngineError se_get_filter_info(struct SEContext* context, struct SEBlockInfo* info) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getFilterInfo(info);
+    }
+    
+    SearchEngineError se_set_watchlist(struct SEContext* context, const char* path, bool literal, char* error) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        if (!path)
+            return BadArgument;
+        
+        return context->engine->setWatchlist(path, literal, error);
+    }
+    
+    SearchEngineError se_get_watchlist_hits(struct SEContext* context, uint32_t topK, struct SEWatchlistHit* hits, uint32_t* count, uint32_t* matched) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getWatchlistHits(topK, hits, count, matched);
+    }
+    
+    SearchEngineError se_set_aggregation(struct SEContext* context, const struct SEKeyExtractor* extractor, char* error) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        if (error) {
+            memset(error, 0, MAX_ERROR_LENGTH + 1);
+        }
+        
+        return context->engine->setAggregation(extractor, error);
+    }
+    
+    SearchEngineError se_aggregate(struct SEContext* context, uint32_t blockIdx) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->aggregate(blockIdx);
+    }
+    
+    SearchEngineError se_merge_aggregation(struct SEContext* context, uint32_t topK, struct SEKeyCount* keys, uint32_t* count, uint64_t* distinct) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->mergeAggregation(topK, keys, count, distinct);
+    }
+    
+    SearchEngineError se_cluster(struct SEContext* context, uint32_t blockIdx) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->cluster(blockIdx);
+    }
+    
+    SearchEngineError se_merge_templates(struct SEContext* context, uint32_t* templates) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->mergeTemplates(templates);
+    }
+    
+    SearchEngineError se_get_template(struct SEContext* context, uint32_t templateId, struct SETemplateInfo* info) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getTemplate(templateId, info);
+    }
+    
+    SearchEngineError se_get_line_template(struct SEContext* context, uint32_t absLine, uint32_t* templateId) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getLineTemplate(absLine, templateId);
+    }
+    
+    SearchEngineError se_set_template_filter(struct SEContext* context, const uint32_t* templateIds, uint32_t count, bool representatives) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setTemplateFilter(templateIds, count, representatives);
+    }
+    
+    SearchEngineError se_set_cache_budget(struct SEContext* context, uint64_t bytes) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setCacheBudget(bytes);
+    }
+    
+    SearchEngineError se_set_memory_budget(uint64_t bytes) {
+        MemoryBudget::shared().setLimit(bytes);
+        return NoError;
+    }
+    
+    SearchEngineError se_get_memory_budget(struct SEMemoryBudget* budget) {
+        if (!budget)
+            return BadArgument;
+        
+        size_t usage = 0;
+        bool exceeded = false;
+        MemoryBudget::shared().getUsage(&usage, &exceeded);
+        budget->limit = MemoryBudget::shared().getLimit();
+        budget->usage = usage;
+        budget->exceeded = exceeded;
+        return NoError;
+    }
+    
+    SearchEngineError se_set_active(struct SEContext* context) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setActive();
+    }
+    
+    SearchEngineError se_dispatch(struct SEContext* context, uint32_t count, SETaskCallback callback, void* userData) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->dispatch(count, callback, userData);
+    }
+    
+    SearchEngineError se_fetch_async(struct SEContext* context, SEProgressCallback progress, SECompletionCallback completion, void* userData) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->fetchAsync(progress, completion, userData);
+    }
+    
+    SearchEngineError se_filter_async(struct SEContext* context, uint32_t viewportLine, SEProgressCallback progress, SECompletionCallback completion, void* userData) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->filterAsync(viewportLine, progress, completion, userData);
+    }
+    
+    SearchEngineError se_set_resident_limit(struct SEContext* context, uint64_t bytes) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->setResidentLimit(bytes);
+    }
+    
+    SearchEngineError se_get_stats(struct SEContext* context, struct SEStats* stats) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getStats(stats);
+    }
+    
+    SearchEngineError se_get_progress(struct SEContext* context, SEOperation operation, struct SEProgress* progress) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->getProgress(operation, progress);
+    }
+    
+    SearchEngineError se_dump_stats(struct SEContext* context, char* json, uint32_t size) {
+        if (! (context && context->engine))
+            return InvalidContext;
+        
+        return context->engine->dumpStats(json, size);
+    }
+    
     void se_destroy(struct SEContext* context) {
         if (context->engine) {
             context->engine->close();
@@ -252,6 +3235,61 @@ extern "C" {
         }
     }
     
+    SearchEngineError se_merge_init(const struct SEContext* sources, uint32_t count, struct SEMergeContext* merge) {
+        if (!merge)
+            return InvalidContext;
+        
+        if (!sources || count == 0)
+            return BadArgument;
+        
+        std::vector<SearchEngine*> engines;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!sources[i].engine)
+                return InvalidContext;
+            engines.push_back(sources[i].engine);
+        }
+        
+        merge->merge = new MergedView(engines);
+        merge->sources = count;
+        merge->rows = 0;
+        
+        auto err = merge->merge->open();
+        if (err != NoError) {
+            printf("[!] unable to open merged view\n");
+            delete merge->merge;
+            merge->merge = nullptr;
+            return err;
+        }
+        
+        merge->rows = merge->merge->rows();
+        
+        return NoError;
+    }
+    
+    SearchEngineError se_merge_refresh(struct SEMergeContext* merge) {
+        if (! (merge && merge->merge))
+            return InvalidContext;
+        
+        auto err = merge->merge->refresh();
+        merge->rows = merge->merge->rows();
+        
+        return err;
+    }
+    
+    SearchEngineError se_merge_get_line(struct SEMergeContext* merge, uint64_t row, struct SEMergedLineInfo* info) {
+        if (! (merge && merge->merge))
+            return InvalidContext;
+        
+        return merge->merge->getLine(row, info);
+    }
+    
+    void se_merge_destroy(struct SEMergeContext* merge) {
+        if (merge->merge) {
+            delete merge->merge;
+            merge->merge = nullptr;
+        }
+    }
+    
 #ifdef __cplusplus
 }
 #endif
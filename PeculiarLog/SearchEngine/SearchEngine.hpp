@@ -13,20 +13,31 @@
 #include <stdio.h>
 #include <stdint.h>
 
-// for CF_ENUM
+// for CF_ENUM, other hosts get the plain C form of it
+#ifdef __APPLE__
 #include "CoreFoundation/CoreFoundation.h"
+#else
+#define CF_ENUM(_type, _name) _type _name; enum : _type
+#endif
 
 // MARK: - Config
 
-#define SE_SUPPORT_HYPERSCAN    1
+#ifndef SE_SUPPORT_HYPERSCAN
+#define SE_SUPPORT_HYPERSCAN    1   // x86 only, builds for other hosts define it to 0
+#endif
+#define SE_SUPPORT_PCRE2        1   // confirm patterns unsupported by hyperscan with PCRE2
+#define SE_SUPPORT_PORTABLE     SE_SUPPORT_PCRE2    // memchr line scan with PCRE2 patterns, runs on any host
 
 // MARK: - C header
 
 #ifdef __cplusplus
     class SearchEngine;
+    class MergedView;
     #define SEARCH_ENGINE_TYPE   SearchEngine*
+    #define MERGED_VIEW_TYPE     MergedView*
 #else
     #define SEARCH_ENGINE_TYPE   void*
+    #define MERGED_VIEW_TYPE     void*
 #endif
 
 #ifdef __cplusplus
@@ -37,6 +48,9 @@ extern "C" {
     static const uint32_t MAX_SCOPE_BEFORE  = 10;
     static const uint32_t MAX_SCOPE_AFTER   = 10;
     static const uint32_t MAX_ERROR_LENGTH  = 64;
+    static const uint32_t MAX_FUZZY_DISTANCE = 4;
+    static const uint64_t FILTER_CACHE_BUDGET = 256 * 1024 * 1024;
+    static const uint64_t PROCESS_MEMORY_BUDGET = 1024 * 1024 * 1024;     // line indexes and filter caches of all documents
 
     typedef CF_ENUM(int, SearchEngineError) {
         NoError,
@@ -48,12 +62,37 @@ extern "C" {
         FileMapFailed,
         InitFailed,
         EngineOpFailed,
+        Cancelled,
+        NotFound,
         
         UnknownError
     };
 
     typedef CF_ENUM(int, SearchEngineBack) {
-        Hyperscan
+        Hyperscan,
+        Portable                        // no SIMD regex library, runs where hyperscan isn't available
+    };
+
+    typedef CF_ENUM(int, SEOperation) {
+        FetchOperation,
+        FilterOperation
+    };
+
+    typedef CF_ENUM(int, SEKeyType) {
+        ColumnKey,
+        RegexKey,
+        FieldKey
+    };
+
+    typedef CF_ENUM(int, SEEncoding) {
+        ASCIIEncoding,
+        UTF8Encoding,
+        InvalidUTF8Encoding
+    };
+
+    typedef CF_ENUM(int, SEDirection) {
+        ForwardDirection,
+        BackwardDirection
     };
 
     struct SEContext {
@@ -61,11 +100,43 @@ extern "C" {
         SEARCH_ENGINE_TYPE      engine;
         uint32_t                blocks;
         uint64_t                bytes;
+        const char*             indexDir;   // directory for sidecar indexes, NULL to always scan the file
+        const char*             recordHeader;   // regex matching the first line of a record, NULL for one record per line
+        bool                    gramIndex;  // fetch builds trigram bitmaps of filter chunks, chunks a pattern can't match aren't scanned
+        bool                    stream;     // file is a pipe or a socket, lines keep coming, see se_poll_stream
     };
 
     struct SEBlockInfo {
         uint32_t    lines;
         uint32_t    maxLength;
+        SEEncoding  encoding;           // text encoding detected by fetch
+        uint32_t    records;            // records starting in the block, counted by fetch if records have a header
+    };
+    
+    struct SEOpenInfo {
+        uint32_t    readyLines;         // lines of blocks fetched from the beginning of the file without gaps
+        uint32_t    readyMaxLength;
+        uint32_t    estimatedLines;     // extrapolated from fetched blocks, exact once all blocks are fetched
+        uint32_t    fetchedBlocks;
+        bool        complete;
+    };
+    
+    struct SEStreamInfo {
+        uint32_t    lines;              // lines appended since the previous poll
+        uint32_t    maxLength;          // max length of appended lines
+        uint64_t    receivedBytes;      // input read so far, including the line which is not complete yet
+        bool        ended;              // input is closed, no more lines will be appended
+        uint32_t    filterTasks;        // appended ranges of filtered blocks to scan with se_filter_appended
+    };
+    
+    struct SEMatchEstimate {
+        uint64_t    matches;            // estimated number of matching lines
+        uint64_t    low;                // 95% confidence interval of the estimate
+        uint64_t    high;
+        uint64_t    countedLines;       // lines of filtered chunks, their matches are counted exactly
+        uint64_t    sampledLines;       // lines of sample windows in chunks which are not filtered yet
+        uint64_t    totalLines;
+        bool        exact;              // all chunks are filtered
     };
     
     struct SELineInfo {
@@ -73,20 +144,185 @@ extern "C" {
         uint32_t    length;
         uint32_t    number;
         bool        scope;
+        uint32_t    matchOffset;        // span of matched field value, zero length if not available
+        uint32_t    matchLength;
+        SEEncoding  encoding;           // line can be decoded in place if it's not InvalidUTF8Encoding
+        uint32_t    record;             // number of the record containing the line, same as number if records are lines
+    };
+    
+    struct SEMergeContext {
+        MERGED_VIEW_TYPE        merge;
+        uint32_t                sources;
+        uint64_t                rows;       // rows of all source views
+    };
+    
+    struct SEMergedLineInfo {
+        struct SELineInfo   line;           // number is the line number within the source document
+        uint32_t            source;         // index of the source context
+        int64_t             time;           // microseconds since epoch, INT64_MIN if no line before has a timestamp
+    };
+    
+    struct SEChunkStats {
+        uint64_t    bytes;              // bytes scanned
+        uint64_t    scanTime;           // scan time in nanoseconds
+        uint64_t    bytesPerSecond;     // scan throughput
+        uint64_t    callbacks;          // number of match callbacks
+        uint64_t    matches;            // number of matching lines
+        uint64_t    candidates;         // prefiltered lines passed to PCRE2 or field verifier
+        uint64_t    scopeLines;         // number of scope lines added to the view
+        uint64_t    pageFaults;         // page faults during the scan
+    };
+    
+    // snapshot of the running or the last operation, filter starts with every new pattern
+    struct SEProgress {
+        uint64_t    bytes;              // bytes scanned so far, blocks restored from index or cache count as scanned
+        uint64_t    totalBytes;
+        uint64_t    lines;              // lines indexed by fetch or scanned by filter
+        uint64_t    matches;            // matching lines, filter only
+        uint64_t    elapsedTime;        // nanoseconds since the operation started, stops once it's complete
+        uint64_t    remainingTime;      // nanoseconds estimated from scan rate so far, 0 until anything is scanned
+        bool        complete;
+    };
+    
+    struct SEStats {
+        uint32_t            blocks;
+        struct SEChunkStats fetch[MAX_BLOCK_COUNT];
+        struct SEChunkStats filter[MAX_BLOCK_COUNT];
+        uint64_t            compileTime;        // last pattern compilation time in nanoseconds
+        uint64_t            databaseSize;       // compiled pattern databases
+        uint64_t            scratchSize;        // scratch space of all workers, shared by all documents
+        uint64_t            predictionHits;     // lines found without index lookup in getLine
+        uint64_t            predictionMisses;
+        uint64_t            cacheHits;          // patterns restored from filter cache
+        uint64_t            cacheMisses;
+        uint64_t            indexMemory;        // line index and filtered view
+        uint64_t            cacheMemory;        // filter cache
+        uint64_t            residentLimit;      // bounded memory mode, 0 if scanned pages are never released
+        uint64_t            residentBytes;      // scanned file pages kept mapped
+        uint64_t            releasedBytes;      // scanned file pages released so far
+        uint64_t            skippedBytes;       // filtered bytes ruled out by trigram index instead of being scanned
+    };
+    
+    struct SEMemoryBudget {
+        uint64_t    limit;
+        uint64_t    usage;              // line indexes, filtered views, trigram bitmaps and filter caches of all documents
+        bool        exceeded;           // usage stays over the limit with nothing left to evict
+    };
+    
+    struct SEWatchlistHit {
+        const char* entry;              // valid until filter changes
+        uint32_t    length;
+        uint32_t    index;              // entry number in the watchlist file, empty lines are not counted
+        uint64_t    count;              // number of times the entry occurs
+        uint64_t    lines;              // number of lines containing the entry
+    };
+    
+    struct SEKeyExtractor {
+        SEKeyType   type;
+        const char* pattern;            // regex or field name
+        char        delimiter;          // column delimiter, 0 to split on whitespace
+        uint32_t    column;             // column index starting from 0
+    };
+    
+    struct SEKeyCount {
+        const char* key;                // valid until next aggregation
+        uint32_t    length;
+        uint64_t    count;
+    };
+    
+    struct SETemplateInfo {
+        const char* text;               // valid until next merge of templates
+        uint32_t    length;
+        uint64_t    count;              // number of lines
+        uint32_t    firstLine;          // absolute number of the first line
     };
     
+    // called on engine compile thread, error string is valid only during the call
+    typedef void (*SECompileCallback)(void* userData, uint64_t generation, SearchEngineError result, const char* error);
+    
+    // called on shared worker thread for every task index
+    typedef void (*SETaskCallback)(void* userData, uint32_t index);
+    
+    // called on shared worker thread once a task of an async operation is done, index is the block
+    // of fetch or the planned chunk of filter, done counts finished tasks out of total
+    typedef void (*SEProgressCallback)(void* userData, uint32_t index, uint32_t done, uint32_t total);
+    
+    // called once per async operation, on the worker which finished the last task or on the calling
+    // thread if there was nothing to do, info holds lines of all blocks for fetch and rows of the
+    // filtered view with scope merged for filter, it's valid only during the call
+    typedef void (*SECompletionCallback)(void* userData, SearchEngineError result, const struct SEBlockInfo* info);
+    
+    // called once per find, on the worker which scanned the last window or on the calling thread if the
+    // filtered view already knows the answer, absLine is the matching line if result is NoError
+    typedef void (*SEFindCallback)(void* userData, SearchEngineError result, uint32_t absLine);
+    
     SearchEngineError   se_init(const char* file, struct SEContext* context);
     SearchEngineError   se_fetch(struct SEContext* context, uint32_t blockIdx, struct SEBlockInfo* info);
+    SearchEngineError   se_get_open_info(struct SEContext* context, struct SEOpenInfo* info);
+    // appends lines received from stream input to the view, must not be called while fetch or filter
+    // tasks of the context are running, appended lines of a filtered view are scanned by filterTasks
+    // dispatched to shared workers and their matches are added by se_merge_scope once all of them are done
+    SearchEngineError   se_poll_stream(struct SEContext* context, struct SEStreamInfo* info);
+    SearchEngineError   se_filter_appended(struct SEContext* context, uint32_t index);
     SearchEngineError   se_merge_scope(struct SEContext* context, uint32_t* filteredLines);
     SearchEngineError   se_get_line(struct SEContext* context, uint32_t lineNumber, struct SELineInfo* lineInfo);
     SearchEngineError   se_get_row_for_abs_line(struct SEContext* context, uint32_t absLine, uint32_t* row);
     bool                se_is_filtered(struct SEContext* context);
     SearchEngineError   se_set_literal(struct SEContext* context, const char* literal);
     SearchEngineError   se_set_pattern(struct SEContext* context, const char* pattern, char* error);
+    SearchEngineError   se_compile_pattern_async(struct SEContext* context, const char* pattern, SECompileCallback callback, void* userData, uint64_t* generation);
     SearchEngineError   se_set_ignore_case(struct SEContext* context, bool ignoreCase);
+    SearchEngineError   se_set_fuzzy(struct SEContext* context, uint32_t distance, bool hamming);
+    SearchEngineError   se_set_field_mode(struct SEContext* context, bool fieldMode);
+    SearchEngineError   se_set_utf8(struct SEContext* context, bool utf8);
     SearchEngineError   se_set_scope(struct SEContext* context, uint32_t before, uint32_t after);
     SearchEngineError   se_filter(struct SEContext* context, uint32_t blockIdx, struct SEBlockInfo* info);
+    SearchEngineError   se_plan_filter(struct SEContext* context, uint32_t viewportLine, uint32_t* chunks, uint32_t* priorityChunks);
+    SearchEngineError   se_filter_chunk(struct SEContext* context, uint32_t chunkIdx, struct SEBlockInfo* info);
+    SearchEngineError   se_cancel_filter(struct SEContext* context);
+    // scans a small window of a planned chunk, windows are dispatched behind priority chunks,
+    // so the estimate keeps refining in background while the rest of the file is filtered
+    SearchEngineError   se_sample_chunk(struct SEContext* context, uint32_t chunkIdx);
+    SearchEngineError   se_get_match_estimate(struct SEContext* context, struct SEMatchEstimate* estimate);
+    // pattern is compiled with current settings and searched for in the whole document, filtered or not,
+    // windows around the line are scanned by urgent tasks of shared workers, so find doesn't wait for a filter
+    SearchEngineError   se_find_next_async(struct SEContext* context, const char* pattern, uint32_t fromAbsLine, SEDirection direction,
+                                           SEFindCallback callback, void* userData);
+    SearchEngineError   se_set_watchlist(struct SEContext* context, const char* path, bool literal, char* error);
+    SearchEngineError   se_get_watchlist_hits(struct SEContext* context, uint32_t topK, struct SEWatchlistHit* hits, uint32_t* count, uint32_t* matched);
+    SearchEngineError   se_set_aggregation(struct SEContext* context, const struct SEKeyExtractor* extractor, char* error);
+    SearchEngineError   se_aggregate(struct SEContext* context, uint32_t blockIdx);
+    SearchEngineError   se_merge_aggregation(struct SEContext* context, uint32_t topK, struct SEKeyCount* keys, uint32_t* count, uint64_t* distinct);
+    SearchEngineError   se_cluster(struct SEContext* context, uint32_t blockIdx);
+    SearchEngineError   se_merge_templates(struct SEContext* context, uint32_t* templates);
+    SearchEngineError   se_get_template(struct SEContext* context, uint32_t templateId, struct SETemplateInfo* info);
+    SearchEngineError   se_get_line_template(struct SEContext* context, uint32_t absLine, uint32_t* templateId);
+    SearchEngineError   se_set_template_filter(struct SEContext* context, const uint32_t* templateIds, uint32_t count, bool representatives);
+    SearchEngineError   se_set_cache_budget(struct SEContext* context, uint64_t bytes);
+    SearchEngineError   se_set_resident_limit(struct SEContext* context, uint64_t bytes);
+    SearchEngineError   se_set_memory_budget(uint64_t bytes);
+    SearchEngineError   se_get_memory_budget(struct SEMemoryBudget* budget);
+    SearchEngineError   se_set_active(struct SEContext* context);
+    SearchEngineError   se_dispatch(struct SEContext* context, uint32_t count, SETaskCallback callback, void* userData);
+    // all blocks are fetched or all planned chunks are filtered on shared workers, callbacks aren't called
+    // if an error is returned, pending operations are dropped without completion when the context is destroyed,
+    // a new async filter cancels the previous one which completes with Cancelled, completion merges the
+    // filtered view on a worker, so lines and rows read meanwhile are serialized with the merge
+    SearchEngineError   se_fetch_async(struct SEContext* context, SEProgressCallback progress, SECompletionCallback completion, void* userData);
+    SearchEngineError   se_filter_async(struct SEContext* context, uint32_t viewportLine, SEProgressCallback progress, SECompletionCallback completion, void* userData);
+    SearchEngineError   se_get_filter_info(struct SEContext* context, struct SEBlockInfo* info);
+    SearchEngineError   se_get_stats(struct SEContext* context, struct SEStats* stats);
+    // counters are read without locks, so progress can be polled from any thread while workers scan
+    SearchEngineError   se_get_progress(struct SEContext* context, SEOperation operation, struct SEProgress* progress);
+    SearchEngineError   se_dump_stats(struct SEContext* context, char* json, uint32_t size);
     void                se_destroy(struct SEContext* context);
+    
+    // rows of the current views of fetched documents ordered by their timestamps, views are filtered
+    // with se_* calls of every source, then se_merge_refresh picks up the changes
+    SearchEngineError   se_merge_init(const struct SEContext* sources, uint32_t count, struct SEMergeContext* merge);
+    SearchEngineError   se_merge_refresh(struct SEMergeContext* merge);
+    SearchEngineError   se_merge_get_line(struct SEMergeContext* merge, uint64_t row, struct SEMergedLineInfo* info);
+    void                se_merge_destroy(struct SEMergeContext* merge);
 
 #ifdef __cplusplus
 }
@@ -96,7 +332,23 @@ extern "C" {
 
 #ifdef __cplusplus
 
-#include "ScopeTracker.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FilterCache.hpp"
+#include "EngineStats.hpp"
+#include "Aggregator.hpp"
+#include "TemplateMiner.hpp"
+#include "SidecarIndex.hpp"
+#include "StreamInput.hpp"
+
+struct FindOperation;
 
 class SearchEngine {
     
@@ -104,64 +356,360 @@ public:
     SearchEngine();
     virtual ~SearchEngine();
     
+    // progress counters are cache line aligned, which plain new doesn't respect before C++17
+    static  void*               operator new(size_t size);
+    static  void                operator delete(void* pointer);
+    
+            void                setIndexDir(const char* dir);
+            // lines from one header line up to the next one make a record, a match anywhere in the record
+            // brings the whole record to the filtered view and scope counts records, must be set before init,
+            // patterns still match within single lines, so a match spanning lines of a record isn't found
+            void                setRecordHeader(const char* header);
+            // trigrams of every filter chunk are indexed by fetch and saved with sidecar index,
+            // chunks missing trigrams of the literals a pattern requires are skipped, must be set before init
+            void                setGramIndex(bool gramIndex);
     virtual SearchEngineError   init(const char* file);
             uint64_t            totalBytes();
             uint32_t            formatBlocks();
+            uint32_t            blockCount();
+            bool                isStream();
+            // lines indexed by stream reader are appended to the last block or start new blocks,
+            // appended lines of filtered blocks are scanned on workers and merged by mergeScope
+            SearchEngineError   pollStream(SEStreamInfo* info);
+            SearchEngineError   filterAppended(uint32_t index);
     virtual SearchEngineError   fetch(uint32_t blockIdx, SEBlockInfo* info) = 0;
             SearchEngineError   mergeScope(uint32_t* filteredLines);
+            SearchEngineError   getOpenInfo(SEOpenInfo* info);
     virtual void                close();
 
-    virtual SearchEngineError   getLine(uint32_t number, SELineInfo* lineInfo) = 0;
-    virtual SearchEngineError   getRowForAbsLine(uint32_t absLine, uint32_t* row) = 0;
+    virtual SearchEngineError   getLine(uint32_t number, SELineInfo* lineInfo);
+    virtual SearchEngineError   getRowForAbsLine(uint32_t absLine, uint32_t* row);
     
             bool                isFiltered();
+            SearchEngineError   getFilterInfo(SEBlockInfo* info);
     virtual SearchEngineError   setPattern(const char* pattern, char* error) = 0;
+            SearchEngineError   compilePatternAsync(const char* pattern, SECompileCallback callback, void* userData, uint64_t* generation);
     virtual SearchEngineError   setIgnoreCase(bool ignoreCase) = 0;
-    virtual SearchEngineError   setScope(uint32_t before, uint32_t after) = 0;
+    virtual SearchEngineError   setFuzzy(uint32_t distance, bool hamming) = 0;
+    virtual SearchEngineError   setFieldMode(bool fieldMode) = 0;
+    virtual SearchEngineError   setUTF8(bool utf8) = 0;
+    virtual SearchEngineError   setScope(uint32_t before, uint32_t after);
     virtual SearchEngineError   filter(uint32_t blockIdx, SEBlockInfo* info) = 0;
+            SearchEngineError   planFilter(uint32_t viewportLine, uint32_t* chunks, uint32_t* priorityChunks);
+            SearchEngineError   filterChunk(uint32_t chunkIdx, SEBlockInfo* info);
+            void                cancelFilter();
+            // sample windows of planned chunks give an estimate before the chunks are filtered,
+            // estimate is refined with exact counts of filtered chunks, index is the same as for filterChunk
+            SearchEngineError   sampleChunk(uint32_t chunkIdx);
+            SearchEngineError   getMatchEstimate(SEMatchEstimate* estimate);
+            SearchEngineError   findNextAsync(const char* pattern, uint32_t fromLine, SEDirection direction, SEFindCallback callback, void* userData);
+    
+            // watchlist filters lines containing any entry of the list and counts occurrences and lines per entry
+    virtual SearchEngineError   setWatchlist(const char* path, bool literal, char* error) = 0;
+            SearchEngineError   getWatchlistHits(uint32_t topK, SEWatchlistHit* hits, uint32_t* count, uint32_t* matched);
+            SearchEngineError   setCacheBudget(uint64_t bytes);
+            // pages of scanned file ranges beyond the limit are released, so that files larger
+            // than RAM don't push everything else out, the line shown in the view stays mapped
+            SearchEngineError   setResidentLimit(uint64_t bytes);
+    
+            // documents share workers and memory budget, the active one is served first and evicted last
+            SearchEngineError   setActive();
+            SearchEngineError   dispatch(uint32_t count, SETaskCallback callback, void* userData);
+            SearchEngineError   fetchAsync(SEProgressCallback progress, SECompletionCallback completion, void* userData);
+            SearchEngineError   filterAsync(uint32_t viewportLine, SEProgressCallback progress, SECompletionCallback completion, void* userData);
+            size_t              memoryUsage();
+            size_t              trimCache(size_t bytes);
+            // trigram bitmaps of a document in the background are dropped and built again once it's active
+            size_t              trimIndex(size_t bytes);
+    
+            SearchEngineError   setAggregation(const SEKeyExtractor* extractor, char* error);
+            SearchEngineError   aggregate(uint32_t blockIdx);
+            SearchEngineError   mergeAggregation(uint32_t topK, SEKeyCount* keys, uint32_t* count, uint64_t* distinct);
+    
+            SearchEngineError   cluster(uint32_t blockIdx);
+            SearchEngineError   mergeTemplates(uint32_t* templates);
+            SearchEngineError   getTemplate(uint32_t templateId, SETemplateInfo* info);
+            SearchEngineError   getLineTemplate(uint32_t absLine, uint32_t* templateId);
+            SearchEngineError   setTemplateFilter(const uint32_t* templateIds, uint32_t count, bool representatives);
+    
+            // time of a line is the latest timestamp found on it or on any line before it, so lines
+            // without timestamp stay with their record and time never goes back within the file,
+            // blocks are indexed on workers and finished once all of them are done
+            SearchEngineError   buildTimeIndex(uint32_t blockIdx);
+            void                finishTimeIndex();
+            bool                hasTimeIndex();
+    
+            // rows of the current view, filtered or not, for views combining several documents
+            uint32_t            viewRows();
+            uint32_t            viewRowLine(uint32_t row);
+            int64_t             viewRowTime(uint32_t row);
+            // time of an earlier row is carried over, so that rows read in order don't parse the same lines again
+            int64_t             viewRowTime(uint32_t row, uint32_t knownRow, int64_t knownTime);
+            uint32_t            viewRowsBefore(int64_t time);
+    
+    virtual SearchEngineError   getStats(SEStats* stats);
+            SearchEngineError   getProgress(SEOperation operation, SEProgress* progress);
+            SearchEngineError   dumpStats(char* json, uint32_t size);
+    
+protected:
+    
+            SearchEngineError   initStream(const char* file);
+            void                filterAppends(const std::vector<StreamInput::Append>& appends);
+            void                mergeAppends(bool force);
+    
+    virtual FilterCacheKey      compileKey(const char* pattern) = 0;
+    virtual std::shared_ptr<FilterResult> compilePattern(const FilterCacheKey& key, char* error) = 0;
+            void                compileLoop();
+            void                stopCompiler();
+    
+    virtual std::shared_ptr<KeyExtractor> createExtractor(const SEKeyExtractor* extractor, char* error);
+            SearchEngineError   filterTemplates(uint32_t blockIdx, SEBlockInfo* info);
+    
+    // scans lines within [pos, pos + size) of a block, numbers of matching lines start with firstLine,
+    // slot selects verifier state of the calling worker, scratch space belongs to the worker thread,
+    // watchlist entries found on every matching line are collected to hits if it's not null, each entry
+    // followed by the number of times it occurs on the line
+    virtual SearchEngineError   filterRange(uint32_t slot, uint64_t pos, uint64_t size, uint32_t firstLine, std::vector<uint32_t>& matches,
+                                            uint32_t* maxLength, uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits) = 0;
+    // scans lines within [pos, pos + size) with a pattern compiled apart from the filter, matching lines start with 0
+    virtual SearchEngineError   findRange(const FilterResult& pattern, uint32_t slot, uint64_t pos, uint64_t size, std::vector<uint32_t>& matches,
+                                          uint64_t* callbacks, uint64_t* candidates) = 0;
+            uint32_t            acquireSlot();
+            void                releaseSlot(uint32_t slot);
+            // tasks of async operations are counted while they run, so that a new filter or close waits
+            // for them, tasks of a superseded filter don't start, generation is 0 for tasks of fetch
+            bool                enterAsync(uint64_t generation);
+            void                leaveAsync(uint64_t generation);
+            uint64_t            supersedeAsync();
+            void                stopAsync();
+            bool                assembleBlock(uint32_t blockIdx);
+            uint32_t            chunkLines(uint32_t chunk);
+            void                splitBlock(uint32_t blockIdx, const std::function<void(uint64_t, uint64_t, uint32_t)>& emit);
+            void                runOnWorkers(uint32_t count, const std::function<void()>& worker);
+            void                readyMatches(uint32_t blockIdx, std::vector<const std::vector<uint32_t>*>& lists);
+            bool                findFiltered(uint32_t fromLine, SEDirection direction, uint32_t* absLine);
+            SearchEngineError   planFind(FindOperation& operation, const FilterCacheKey& key, uint32_t fromLine);
+            uint64_t            lineStartBefore(uint64_t pos);
+            uint64_t            lineStartAfter(uint64_t pos, uint64_t end);
+            uint32_t            lineForPos(uint64_t pos);
+            void                forEachLine(uint32_t blockIdx, const std::vector<uint32_t>* lines, const std::function<void(const char*, uint32_t)>& func);
+    
+            SEEncoding          fileEncoding();
+    
+            void                prefetchRange(uint64_t pos, uint64_t size);
+            void                scannedRange(uint64_t pos, uint64_t size);
+            void                releaseRange(uint64_t pos, uint64_t size);
+    
+            bool                restoreBlock(uint32_t blockIdx, SEBlockInfo* info);
+            void                indexGrams(uint32_t blockIdx);
+            void                buildGrams(uint32_t blockIdx);
+            void                rebuildGrams();
+            bool                mayMatch(const GramQuery& query, uint64_t pos, uint64_t size);
+            // scans a whole block except for its chunks ruled out by trigram index
+            SearchEngineError   filterBlock(uint32_t slot, uint32_t blockIdx, std::vector<uint32_t>& matches, uint32_t* maxLength,
+                                            uint64_t* callbacks, uint64_t* candidates, std::vector<uint32_t>* hits);
+            void                compileGrams(const FilterCacheKey& key, bool caseless, FilterResult* result);
+            void                blockFetched(uint32_t blockIdx);
+            bool                isBlockFetched(uint32_t blockIdx);
+    
+            void                cacheFilterResult(const FilterCacheKey& key, std::shared_ptr<FilterResult> result);
+            void                resetFilterResult(std::shared_ptr<FilterResult> result);
+            void                storeFilterResult();
+            void                applyScope();
+    
+            int32_t             findBlockForLine(uint32_t absLine, uint32_t* lineBase);
+            uint64_t            getLinePos(uint32_t absLine, uint32_t* length);
+            bool                isMatchLine(uint32_t absLine);
+            uint32_t            lineForRow(uint32_t row);
+            void                joinRecords();
+            uint32_t            recordForLine(uint32_t absLine);
+            uint32_t            rowsBeforeLine(uint32_t absLine);
+            int64_t             lineTime(uint32_t absLine, uint32_t knownLine, int64_t knownTime);
+            uint32_t            firstLineAtTime(int64_t time);
     
 protected:
     
-    static const char*  s_eolPattern;
+    static const char*      s_eolPattern;
+    static const uint32_t   s_lineIndexStride = 128;
+    static const uint64_t   s_headBlockSize = 1024 * 1024;     // first block of big files, fetched quickly to show first rows
+    static const uint64_t   s_filterChunkSize = 4 * 1024 * 1024;   // unit of prioritized filtering
+    static const uint64_t   s_findWindowSize = 64 * 1024;          // first window of find next, doubles up to chunk size
+    static const uint64_t   s_sampleRatio = 100;                    // part of every chunk scanned by sampling
+    static const uint64_t   s_sampleWindowSize = 16 * 1024;        // smallest sample window
+    static const uint64_t   s_viewportKeep = 256 * 1024;            // mapped around the last line read by getLine in bounded memory mode
     
 protected:
 
     const char*     m_mem   = nullptr;
     size_t          m_size  = 0;
+    size_t          m_mapSize = 0;      // spill file of stream input is mapped with room to grow
+    int64_t         m_mtime = 0;
+    
+    // stream input
+    std::unique_ptr<StreamInput>    m_stream;
+    
+    // sidecar index
+    std::string                     m_indexDir;
+    std::unique_ptr<SidecarIndex>   m_index;
+    std::atomic<uint32_t>           m_fetchedBlocks {0};
+    std::atomic<uint64_t>           m_fetchedMask {0};      // blocks can be read by other threads once their bit is set
+    
+    // multi-line records
+    std::string                     m_recordHeader;
+    std::vector<uint32_t>           m_recordStarts;         // first line of every record, lines before the first header make a record too
+    std::atomic<bool>               m_recordsJoined {false};    // records of all blocks are joined once the last block is fetched
+    
+    // trigram index
+    bool                            m_gramIndex = false;
     
     // optimizations
+    struct SESegment {
+        uint32_t    rowStart;           // first row of the segment in filtered view
+        uint32_t    lineStart;          // absolute line number of the first row
+    };
+    
+    struct SEGramChunk {
+        uint64_t    byteOffset;
+        uint64_t    size;
+        uint32_t    firstLine;          // block relative number of the first line
+    };
+    
     struct SEBlock {
         bool        active;             // block is in use
         uint64_t    byteOffset;         // block start address within the file
         uint32_t    lines;              // total number of lines
-        uint32_t    filteredLines;      // total number of pattern matching lines
-        uint32_t    scopeLines;         // total number of scope lines
-        int32_t     headLines;          // number of spare lines at the beginning of a block
-        int32_t     tailLines;          // number of spare lines at the end of a block
-        int32_t     lendedHeadLines;    // number of lines to lend to the head of next block
-        int32_t     lendedTailLines;    // number of lines to lend to the tail of previous block
         uint64_t    size;               // block size
+        uint32_t    maxLength;          // max line length
+        SEEncoding  encoding;           // ASCII, valid or invalid UTF-8
+        bool        indexed;            // restored from or saved to sidecar index
+        
+        std::vector<uint64_t>   lineIndex;  // offset of every s_lineIndexStride line within the file
+        std::vector<int64_t>    timeIndex;  // time of the line before every indexed line, see buildTimeIndex
+        std::vector<uint32_t>   records;    // block relative numbers of lines matching record header
+        std::vector<SEGramChunk> gramChunks;    // filter chunks of the block, see splitBlock
+        // GramIndex::s_bitmapWords per chunk, null if trigrams aren't indexed or memory budget dropped them,
+        // filters take it with std::atomic_load since the budget may drop it from any thread
+        std::shared_ptr<const std::vector<uint64_t>> grams;
+        
+        // filtered view
+        uint32_t                rowBase;    // first row of the block in filtered view
+        uint32_t                rows;       // number of rows including scope lines
+        std::vector<SESegment>  segments;   // one segment per match, starting from its 'before' scope
     };
     
-    SEBlock         m_blocks[MAX_BLOCK_COUNT] = {0};
+    SEBlock         m_blocks[MAX_BLOCK_COUNT] = {};
     uint32_t        m_blockCount = 0;
 
     // getting lines
-    uint32_t        m_recentBlock = 0;
-    uint32_t        m_recentLineOffset = 0;
-    uint32_t        m_recentAbsLineOffset = 0;
-    uint32_t        m_predictedAbsLineNum = 0;
-    uint32_t        m_predictedLineNum = 0;
-    uint64_t        m_predictedLinePos = 0;
+    uint32_t        m_predictedAbsLineNum = -1;
+    uint64_t        m_predictedLinePos = -1;
     
     // filter
     bool            m_filtered = false;
     bool            m_ignoreCase = false;
+    uint32_t        m_fuzzyDistance = 0;    // approximate matching is off when 0
+    bool            m_fuzzyHamming = false; // substitutions only instead of edit distance
+    bool            m_fieldMode = false;    // pattern is a field query for JSON or key=value lines
+    bool            m_utf8 = true;          // patterns match code points if whole file is valid UTF-8
+    bool            m_templateFilter = false;   // lines are selected by template instead of pattern
     uint32_t        m_scopeBefore = 0;
     uint32_t        m_scopeAfter = 0;
-
-    ScopeTracker<MAX_SCOPE_BEFORE, TrackingPolicy::Ring>  m_beforeTracker[MAX_BLOCK_COUNT];
-    ScopeTracker<MAX_SCOPE_AFTER, TrackingPolicy::Fixed>  m_afterTracker[MAX_BLOCK_COUNT];
+    uint32_t        m_filteredRows = 0;
+    
+    // prioritized filtering, chunk results are moved to their block once all chunks of the block are done
+    struct SEFilterChunk {
+        uint32_t                blockIdx;
+        uint32_t                firstLine;  // block relative number of the first line
+        uint64_t                byteOffset;
+        uint64_t                size;
+        std::vector<uint32_t>   matches;    // block relative numbers of matching lines
+        std::vector<uint32_t>   hits;       // watchlist entries found on matching lines, each with its occurrences on the line
+        uint32_t                maxLength = 0;
+        uint32_t                sampleLines = 0;    // lines and matches of the sample window
+        uint32_t                sampleMatches = 0;
+        std::atomic<bool>       sampled {false};    // sample counts are set, estimate reads them while chunks are filtered
+        std::atomic<bool>       done {false};
+    };
+    
+    std::vector<SEFilterChunk>      m_chunks;                       // in file order
+    std::vector<uint32_t>           m_chunkOrder;                   // in order of filtering
+    uint32_t                        m_blockChunks[MAX_BLOCK_COUNT + 1] = {};    // first chunk of every block
+    std::atomic<bool>               m_filterCancelled {false};
+    
+    // appended lines of filtered blocks, scanned on workers and added to the result they were polled for
+    struct SEAppendScan {
+        uint32_t                blockIdx;
+        uint32_t                firstLine;  // block relative number of the first appended line
+        uint32_t                lines;
+        uint64_t                byteOffset;
+        uint64_t                size;
+        std::vector<uint32_t>   matches;
+        std::vector<uint32_t>   hits;
+        uint32_t                maxLength = 0;
+        SearchEngineError       err = NoError;
+        std::atomic<bool>       done {false};
+    };
+    
+    std::vector<SEAppendScan>       m_appendScans;                  // in order of appending
+    std::shared_ptr<FilterResult>   m_appendResult;
+    std::atomic<uint32_t>           m_appendsPending {0};
+    
+    // async operations, every filterAsync starts a new generation
+    std::mutex                      m_asyncLock;
+    std::condition_variable         m_asyncCond;
+    uint64_t                        m_asyncGeneration = 0;
+    uint32_t                        m_filterTasks = 0;
+    uint32_t                        m_fetchTasks = 0;
+    std::atomic<bool>               m_asyncStopped {false};     // context is closing, tasks don't start anymore, find stops between windows
+    
+    // filtered view is merged by the worker completing an async filter while the caller reads it
+    std::mutex                      m_viewLock;
+    
+    // chunks of the same block are filtered concurrently, so per-worker state is indexed by slot instead of block
+    std::mutex                      m_slotLock;
+    std::condition_variable         m_slotCond;
+    uint64_t                        m_freeSlots = (1ULL << MAX_BLOCK_COUNT) - 1;
+    
+    // bounded memory mode, scanned ranges are released in order of scanning
+    std::mutex                      m_residentLock;
+    std::deque<std::pair<uint64_t, uint64_t>> m_residentRanges;
+    std::atomic<uint64_t>           m_residentLimit {0};
+    uint64_t                        m_residentBytes = 0;
+    std::atomic<uint64_t>           m_releasedBytes {0};
+    std::atomic<uint64_t>           m_viewportPos {UINT64_MAX};
+    
+    // filter cache
+    FilterCache                     m_filterCache {FILTER_CACHE_BUDGET};
+    std::atomic<uint64_t>           m_indexMemory {0};              // line index of fetched blocks
+    std::atomic<bool>               m_gramsDropped {false};         // memory budget dropped trigram bitmaps
+    bool                            m_timeIndexed = false;
+    FilterCacheKey                  m_filterKey;
+    std::shared_ptr<FilterResult>   m_filterResult;
+    
+    // aggregation
+    std::unique_ptr<Aggregator>     m_aggregator;
+    
+    // templates
+    TemplateMiner                   m_templateMiner;
+    uint32_t                        m_templateGeneration = 0;   // keeps cached template filters of previous clustering apart
+    
+    // instrumentation
+    EngineStats                     m_stats;
+    
+    // background compilation
+    struct SECompileRequest {
+        FilterCacheKey      key;
+        SECompileCallback   callback;
+        void*               userData;
+        uint64_t            generation;
+    };
+    
+    std::thread                     m_compileThread;
+    std::mutex                      m_compileLock;
+    std::condition_variable         m_compileCond;
+    std::vector<SECompileRequest>   m_compileQueue;
+    std::atomic<uint64_t>           m_compileGeneration {0};    // latest requested compilation
+    bool                            m_compileStop = false;
     
 private:
     
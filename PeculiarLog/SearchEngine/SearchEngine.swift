@@ -15,16 +15,38 @@ class SearchEngine {
         var tail: Int32 = 0
     }
     
-    private var context = SEContext()
+    fileprivate var context = SEContext()
+    private var indexDir : UnsafeMutablePointer<Int8>?
+    private var recordHeader : UnsafeMutablePointer<Int8>?
     private var scopeBlock : [ScopeBlocks]!
+    private let fetchGroup = DispatchGroup()
+    private let filterGroup = DispatchGroup()
+    private var filterGeneration = 0            // main queue only, discards updates of superseded filters
+    private let filterUpdateLock = NSLock()
+    private var filterUpdateScheduled = false
+    private var streamTimer : Timer?
     
     private         var blockLines : [Int]!
-    private(set)    var totalLines : UInt32 = 0
+    private(set)    var totalLines : UInt32 = 0     // lines available so far while file is being opened
+    private(set)    var estimatedLines : UInt32 = 0
+    private(set)    var isLoading : Bool = false
     private(set)    var maxEntryLength : Int = 0
     private(set)    var filteredLines : UInt32 = 0
     private(set)    var maxFilteredLength : Int = 0
+    private(set)    var isFiltering : Bool = false
+    private(set)    var matchEstimate : SEMatchEstimate?    // expected matching lines while filtering in background
     private(set)    var ignoreCase : Bool = false
+    private(set)    var fuzzyDistance : UInt32 = 0
+    private(set)    var fuzzyHamming : Bool = false
+    private(set)    var fieldMode : Bool = false
 
+    // called on main queue when more lines become available while file is being opened
+    var loadProgress: (() -> Void)?
+    
+    // called on main queue when more rows are filtered in background, handler picks them up with mergeFilter()
+    // so that it can keep the view at the same lines, rows are merged right away if there is no handler
+    var filterProgress: (() -> Void)?
+    
     var lineCount: Int {
         get {
             if (se_is_filtered(&context)) {
@@ -51,6 +73,19 @@ class SearchEngine {
         }
     }
     
+    var totalLinesString: String {
+        get {
+            return isLoading ? "~\(estimatedLines)" : "\(totalLines)"
+        }
+    }
+    
+    var matchEstimateString: String? {
+        get {
+            guard let estimate = matchEstimate else { return nil }
+            return "~\(estimate.matches) matches expected (\(estimate.low)–\(estimate.high))"
+        }
+    }
+    
     var totalBytesString: String {
         get {
             let formatter:ByteCountFormatter = ByteCountFormatter()
@@ -60,51 +95,267 @@ class SearchEngine {
     }
     
     init(_ file: String) {
-        context.back = .Hyperscan
+        // hyperscan is x86 only, portable engine runs anywhere and is chosen with "engine" default
+        context.back = (UserDefaults.standard.string(forKey: "engine") == "portable")? .Portable : .Hyperscan
+        
+        // line index is kept in caches, so reopening the same file doesn't scan it again
+        if let caches = FileManager.default.urls(for: .cachesDirectory, in: .userDomainMask).first {
+            let dir = caches.appendingPathComponent("Index", isDirectory: true)
+            if (try? FileManager.default.createDirectory(at: dir, withIntermediateDirectories: true, attributes: nil)) != nil {
+                indexDir = strdup(dir.path)
+                context.indexDir = UnsafePointer(indexDir)
+            }
+        }
+        
+        // multi-line records like stack traces start at lines matching the header, e.g. a leading timestamp
+        if let header = UserDefaults.standard.string(forKey: "recordHeader"), !header.isEmpty {
+            recordHeader = strdup(header)
+            context.recordHeader = UnsafePointer(recordHeader)
+        }
+        
+        // trigram bitmaps take an extra pass on first open, rare patterns skip most of the file afterwards
+        context.gramIndex = UserDefaults.standard.bool(forKey: "gramIndex")
+        
         guard se_init(file, &context) == .NoError else {
             print("[+] unable to init SearchEngine")
             return
         }
+        
+        // logs larger than RAM can be opened with a ceiling on resident pages (in MB),
+        // scanned ranges beyond it are released back to the page cache
+        let residentLimit = UserDefaults.standard.integer(forKey: "residentLimit")
+        if (residentLimit > 0) {
+            se_set_resident_limit(&context, UInt64(residentLimit) * 1024 * 1024)
+        }
 
-        let stime = DispatchTime.now()
-        let group = DispatchGroup()
-        let queue = DispatchQueue.global()
+        // blocks are fetched in background, only the first one is awaited
+        // since engine makes it small enough to show first rows right away
+        isLoading = true
+        let firstBlock = DispatchGroup()
         scopeBlock = [ScopeBlocks](repeating: ScopeBlocks(), count: Int(context.blocks))
-        for i in 0..<context.blocks {
-            queue.async(group: group) {
-                var blockInfo = SEBlockInfo()
-                guard se_fetch(&self.context, i, &blockInfo) == .NoError else {
-                    print("[!] unable to load block \(i)")
-                    return
-                }
-
-                queue.sync() {
-                    self.totalLines += blockInfo.lines
-                    if (self.maxEntryLength < blockInfo.maxLength) {
-                        self.maxEntryLength = Int(blockInfo.maxLength)
-                    }
+        firstBlock.enter()
+        fetchGroup.enter()
+        let started = fetchAsync(progress: { (i) in
+            if (i == 0) {
+                firstBlock.leave()
+            }
+            DispatchQueue.main.async {
+                self.updateOpenInfo()
+            }
+        }, completion: { (result) in
+            if (result != .NoError) {
+                print("[!] unable to load blocks")
+            }
+            self.fetchGroup.leave()
+        })
+        if (!started) {
+            print("[!] unable to start loading")
+            firstBlock.leave()
+            fetchGroup.leave()
+        }
+        
+        firstBlock.wait()
+        updateOpenInfo()
+        print("[+] first rows ready (\(totalLines) lines of ~\(estimatedLines))")
+        
+        // lines of a pipe keep coming, they are picked up from the engine a few times a second
+        if (context.stream) {
+            let timer = Timer(timeInterval: 0.25, repeats: true) { [weak self] (_) in
+                self?.pollStream()
+            }
+            RunLoop.main.add(timer, forMode: .common)
+            streamTimer = timer
+        }
+    }
+    
+    private func pollStream() {
+        // engine extends blocks in place, so lines are appended only while no tasks are running
+        guard fetchGroup.wait(timeout: .now()) == .success, filterGroup.wait(timeout: .now()) == .success else {
+            return
+        }
+        
+        var info = SEStreamInfo()
+        guard se_poll_stream(&context, &info) == .NoError else {
+            print("[!] unable to poll stream input")
+            return
+        }
+        
+        if (info.ended) {
+            streamTimer?.invalidate()
+            streamTimer = nil
+        }
+        
+        guard info.lines > 0 else { return }
+        
+        totalLines += info.lines
+        maxEntryLength = max(maxEntryLength, Int(info.maxLength))
+        loadProgress?()
+        
+        // appended lines of the filtered view are scanned on workers, the view picks up their matches
+        // once all of them are done, unless a new filter has started meanwhile
+        if (info.filterTasks > 0) {
+            let generation = filterGeneration
+            dispatch(info.filterTasks, group: filterGroup) { (i) in
+                if (se_filter_appended(&self.context, i) != .NoError) {
+                    print("[!] unable to filter appended lines \(i)")
                 }
             }
+            filterGroup.notify(queue: DispatchQueue.main) {
+                guard generation == self.filterGeneration else { return }
+                self.updateFilter()
+            }
+        } else if (se_is_filtered(&context)) {
+            updateFilter()
         }
         
-        group.wait()
-        let etime = DispatchTime.now()
-        let microTime = etime.uptimeNanoseconds - stime.uptimeNanoseconds
-        let dtime = Double(microTime) / 1_000_000
-        print("[+] engine ready (\(totalLines) lines, \(maxEntryLength) cols) in \(dtime)ms")
+        if (info.ended) {
+            print("[+] stream input ended (\(totalLines) lines, \(maxEntryLength) cols)")
+        }
+    }
+    
+    private func updateOpenInfo() {
+        var info = SEOpenInfo()
+        guard se_get_open_info(&context, &info) == .NoError else {
+            return
+        }
+        
+        guard isLoading else { return }
+        
+        totalLines = info.readyLines
+        maxEntryLength = Int(info.readyMaxLength)
+        estimatedLines = info.estimatedLines
+        if (info.complete) {
+            isLoading = false
+            print("[+] engine ready (\(totalLines) lines, \(maxEntryLength) cols) in \(scanTime(filter: false))ms")
+        }
+        
+        loadProgress?()
+    }
+    
+    // operations over the whole file need all blocks to be fetched
+    fileprivate func waitLoaded() {
+        fetchGroup.wait()
+        updateOpenInfo()
+    }
+    
+    // keeps task body alive until every index is run
+    private class WorkerTask {
+        let body: (UInt32) -> Void
+        
+        init(_ body: @escaping (UInt32) -> Void) {
+            self.body = body
+        }
+    }
+    
+    // keeps callbacks alive until async operation completes
+    private class AsyncTask {
+        let progress: (UInt32) -> Void
+        let completion: (SearchEngineError) -> Void
+        
+        init(_ progress: @escaping (UInt32) -> Void, _ completion: @escaping (SearchEngineError) -> Void) {
+            self.progress = progress
+            self.completion = completion
+        }
+    }
+    
+    // engine fetches all blocks on its workers, progress is called with every fetched block,
+    // callbacks run on engine workers and aren't called at all if the fetch isn't started
+    private func fetchAsync(progress: @escaping (UInt32) -> Void, completion: @escaping (SearchEngineError) -> Void) -> Bool {
+        let task = Unmanaged.passRetained(AsyncTask(progress, completion)).toOpaque()
+        let res = se_fetch_async(&context, { (userData, index, done, total) in
+            let task = Unmanaged<AsyncTask>.fromOpaque(userData!).takeUnretainedValue()
+            task.progress(index)
+        }, { (userData, result, info) in
+            let task = Unmanaged<AsyncTask>.fromOpaque(userData!).takeRetainedValue()
+            task.completion(result)
+        }, task)
+        
+        guard res == .NoError else {
+            Unmanaged<AsyncTask>.fromOpaque(task).release()
+            return false
+        }
+        return true
+    }
+    
+    // runs body for every index on engine workers shared by all open documents,
+    // tasks of the active document go first, see setActive()
+    private func dispatch(_ count: UInt32, group: DispatchGroup, _ body: @escaping (UInt32) -> Void) {
+        let task = WorkerTask { (i) in
+            body(i)
+            group.leave()
+        }
+        for _ in 0..<count {
+            group.enter()
+            _ = Unmanaged.passRetained(task)
+        }
+        let res = se_dispatch(&context, count, { (userData, index) in
+            let task = Unmanaged<WorkerTask>.fromOpaque(userData!).takeRetainedValue()
+            task.body(index)
+        }, Unmanaged.passUnretained(task).toOpaque())
+        
+        guard res == .NoError else {
+            print("[!] unable to dispatch tasks")
+            for i in 0..<count {
+                Unmanaged.passUnretained(task).release()
+                body(i)
+                group.leave()
+            }
+            return
+        }
+    }
+    
+    // document in front gets workers first and loses cached filter results and trigram bitmaps last
+    func setActive() {
+        se_set_active(&context)
+    }
+    
+    // line indexes of open documents don't fit the memory budget even with everything else evicted
+    static var memoryBudgetExceeded: Bool {
+        var budget = SEMemoryBudget()
+        return se_get_memory_budget(&budget) == .NoError && budget.exceeded
     }
     
     deinit {
+        streamTimer?.invalidate()
         se_destroy(&context)
+        free(indexDir)
+        free(recordHeader)
+    }
+    
+    var statsJSON: String {
+        get {
+            var json = [CChar](repeating: 0, count: 64 * 1024)
+            guard se_dump_stats(&context, &json, UInt32(json.count)) == .NoError else {
+                print("[!] unable to dump engine stats")
+                return "{}"
+            }
+            return String(cString: json)
+        }
+    }
+    
+    // blocks are scanned in parallel, so the longest block scan is the total time
+    private func scanTime(filter: Bool) -> Double {
+        var stats = SEStats()
+        guard se_get_stats(&context, &stats) == .NoError else {
+            return 0
+        }
+        
+        let blocks = Int(stats.blocks)
+        var chunks = filter ? stats.filter : stats.fetch
+        let maxTime = withUnsafeBytes(of: &chunks) { raw -> UInt64 in
+            let chunkStats = raw.bindMemory(to: SEChunkStats.self)
+            return chunkStats.prefix(blocks).map { $0.scanTime }.max() ?? 0
+        }
+        return Double(maxTime) / 1_000_000
     }
     
-    func getLine(_ number: Int) -> (line: String, number:Int, scope: Bool, newWidth: Bool) {
+    func getLine(_ number: Int) -> (line: String, number:Int, scope: Bool, newWidth: Bool, match: NSRange) {
         var lineInfo = SELineInfo()
         guard se_get_line(&context, UInt32(number), &lineInfo) == .NoError else {
-            return ("[!] unable to get line \(number)", 0, false, false)
+            return ("[!] unable to get line \(number)", 0, false, false, NSMakeRange(NSNotFound, 0))
         }
         
-        // while max length is calculated borrowed lines between blocks are not taken into account,
+        // while max length is calculated scope lines are not taken into account,
         // therefore we need to inform table if bigger log entry is detected
         var newWidth = false
         if (maxFilteredLength != 0) {
@@ -115,7 +366,65 @@ class SearchEngine {
             }
         }
         
-        return (String(bytesNoCopy: UnsafeMutableRawPointer(mutating:lineInfo.line), length:Int(lineInfo.length), encoding:.ascii, freeWhenDone: false)!, Int(lineInfo.number), lineInfo.scope, newWidth)
+        let bytes = UnsafeRawBufferPointer(start: lineInfo.line, count: Int(lineInfo.length))
+        let line = SearchEngine.decode(lineInfo)
+        
+        // field value span is reported by engine, regex matches are highlighted by the view
+        var match = NSMakeRange(NSNotFound, 0)
+        if (lineInfo.matchLength != 0) {
+            match = NSMakeRange(Int(lineInfo.matchOffset), Int(lineInfo.matchLength))
+            if (lineInfo.encoding != .ASCIIEncoding) {
+                // span is in bytes, view needs UTF-16 offsets
+                let start = String(decoding: UnsafeRawBufferPointer(rebasing: bytes[0..<match.location]), as: UTF8.self).utf16.count
+                let length = String(decoding: UnsafeRawBufferPointer(rebasing: bytes[match.location..<NSMaxRange(match)]), as: UTF8.self).utf16.count
+                match = NSMakeRange(start, length)
+            }
+        }
+        
+        return (line, Int(lineInfo.number), lineInfo.scope, newWidth, match)
+    }
+    
+    // valid lines are decoded in place, broken sequences of invalid ones are replaced
+    fileprivate static func decode(_ lineInfo: SELineInfo) -> String {
+        switch lineInfo.encoding {
+        case .ASCIIEncoding:
+            return String(bytesNoCopy: UnsafeMutableRawPointer(mutating:lineInfo.line), length:Int(lineInfo.length), encoding:.ascii, freeWhenDone: false)!
+        case .UTF8Encoding:
+            return String(bytesNoCopy: UnsafeMutableRawPointer(mutating:lineInfo.line), length:Int(lineInfo.length), encoding:.utf8, freeWhenDone: false)!
+        default:
+            return String(decoding: UnsafeRawBufferPointer(start: lineInfo.line, count: Int(lineInfo.length)), as: UTF8.self)
+        }
+    }
+    
+    // keeps completion alive while windows around the line are scanned on engine workers
+    private class FindRequest {
+        let completion: (Int?) -> Void
+        
+        init(_ completion: @escaping (Int?) -> Void) {
+            self.completion = completion
+        }
+    }
+    
+    // nearest line matching the pattern after (or before) the line, whether the view is filtered or not,
+    // chunks around it are scanned if needed, completion is called on main queue with nil if there is no match
+    func findNext(_ pattern: String, from absLine: Int, backward: Bool, completion: @escaping (Int?) -> Void) {
+        let request = Unmanaged.passRetained(FindRequest(completion)).toOpaque()
+        let res = se_find_next_async(&context, pattern, UInt32(absLine), backward ? .BackwardDirection : .ForwardDirection, { (userData, result, line) in
+            let request = Unmanaged<FindRequest>.fromOpaque(userData!).takeRetainedValue()
+            if (result != .NoError && result != .NotFound && result != .Cancelled) {
+                print("[!] unable to find next match: \(result)")
+            }
+            DispatchQueue.main.async {
+                request.completion(result == .NoError ? Int(line) : nil)
+            }
+        }, request)
+        
+        guard res == .NoError else {
+            print("[!] unable to find next match from line \(absLine)")
+            Unmanaged<FindRequest>.fromOpaque(request).release()
+            completion(nil)
+            return
+        }
     }
     
     func getRowForAbsLine(_ absLine: Int) -> Int {
@@ -137,16 +446,50 @@ class SearchEngine {
         return true;
     }
 
+    func setFuzzy(_ distance: UInt32, hamming: Bool) -> Bool {
+        guard se_set_fuzzy(&context, distance, hamming) == .NoError else {
+            print("[!] unable to set fuzzy distance")
+            return false
+        }
+        
+        self.fuzzyDistance = distance
+        self.fuzzyHamming = hamming
+        return true;
+    }
+
+    func setFieldMode(_ fieldMode: Bool) -> Bool {
+        guard se_set_field_mode(&context, fieldMode) == .NoError else {
+            print("[!] unable to set field mode")
+            return false
+        }
+        
+        self.fieldMode = fieldMode
+        return true;
+    }
+
     func setScope(_ before: UInt32, _ after: UInt32) -> Bool {
         guard se_set_scope(&context, before, after) == .NoError else {
             print("[!] unable to set scope")
             return false
         }
         
+        // scope is applied to existing filter result without scanning
+        if (se_is_filtered(&context)) {
+            var filterInfo = SEBlockInfo()
+            guard se_get_filter_info(&context, &filterInfo) == .NoError else {
+                print("[!] unable to get filter info")
+                return false
+            }
+            filteredLines = filterInfo.lines
+            maxFilteredLength = Int(filterInfo.maxLength)
+        }
+        
         return true;
     }
     
     func setPattern(_ pattern: String) -> (Bool, String) {
+        cancelFilter()
+        
         let cError = UnsafeMutablePointer<Int8>.allocate(capacity: Int(MAX_ERROR_LENGTH) + 1)
         guard se_set_pattern(&context, pattern, cError) == .NoError else {
             print("[!] unable to set pattern")
@@ -157,40 +500,358 @@ class SearchEngine {
         return (true, "")
     }
     
-    func filter() -> Bool {
+    // filters lines containing any entry of the list, one literal or regex per line of the file
+    func setWatchlist(_ path: String, literal: Bool) -> (Bool, String) {
+        cancelFilter()
         
-        filteredLines = 0
-        maxFilteredLength = 0
+        let cError = UnsafeMutablePointer<Int8>.allocate(capacity: Int(MAX_ERROR_LENGTH) + 1)
+        cError.initialize(repeating: 0, count: Int(MAX_ERROR_LENGTH) + 1)
+        defer { cError.deallocate() }
+        
+        guard se_set_watchlist(&context, path, literal, cError) == .NoError else {
+            print("[!] unable to set watchlist")
+            return (false, String(cString: cError))
+        }
+        
+        return (true, "")
+    }
+    
+    // entries found in filtered lines so far with number of occurrences and lines containing them, most frequent first
+    func watchlistHits(topK: UInt32 = 100) -> (hits: [(entry: String, index: Int, count: UInt64, lines: UInt64)], matched: UInt32) {
+        var hits = [SEWatchlistHit](repeating: SEWatchlistHit(), count: Int(topK))
+        var count : UInt32 = 0
+        var matched : UInt32 = 0
+        guard se_get_watchlist_hits(&context, topK, &hits, &count, &matched) == .NoError else {
+            print("[!] unable to get watchlist hits")
+            return ([], 0)
+        }
+        
+        let result = hits[0..<Int(count)].map { (hit) -> (entry: String, index: Int, count: UInt64, lines: UInt64) in
+            let data = Data(bytes: hit.entry, count: Int(hit.length))
+            return (String(decoding: data, as: UTF8.self), Int(hit.index), hit.count, hit.lines)
+        }
+        return (result, matched)
+    }
+    
+    // keeps completion alive while pattern is compiled on engine thread
+    private class CompileRequest {
+        let completion: (Bool, String) -> Void
+        
+        init(_ completion: @escaping (Bool, String) -> Void) {
+            self.completion = completion
+        }
+    }
+    
+    // completion is called on main queue, unless request is superseded by a newer pattern
+    func compilePattern(_ pattern: String, completion: @escaping (Bool, String) -> Void) {
+        let request = Unmanaged.passRetained(CompileRequest(completion)).toOpaque()
+        let res = se_compile_pattern_async(&context, pattern, { (userData, generation, result, error) in
+            let request = Unmanaged<CompileRequest>.fromOpaque(userData!).takeRetainedValue()
+            guard result != .Cancelled else { return }
+            
+            let message = String(cString: error!)
+            DispatchQueue.main.async {
+                request.completion(result == .NoError, message)
+            }
+        }, request, nil)
+        
+        guard res == .NoError else {
+            print("[!] unable to compile pattern")
+            Unmanaged<CompileRequest>.fromOpaque(request).release()
+            completion(false, "")
+            return
+        }
+    }
+    
+    // chunks around viewport line and at the beginning of the file are filtered first, filter returns
+    // as soon as they are merged and the rest of the file is filtered in background, see filterProgress
+    func filter(viewportLine: Int = 0) -> Bool {
+        waitLoaded()
+        cancelFilter()
+        
+        var chunks : UInt32 = 0
+        var priorityChunks : UInt32 = 0
+        guard se_plan_filter(&context, UInt32(viewportLine), &chunks, &priorityChunks) == .NoError else {
+            print("[!] unable to plan filter")
+            return false
+        }
+        
+        filterGeneration += 1
+        let generation = filterGeneration
+        isFiltering = true
+        
+        // chunks are taken by workers in order of dispatch, a small sample of every chunk goes right
+        // behind priority ones and tells how many matches to expect before the rest is filtered
+        let filterChunk = { (i: UInt32) -> SearchEngineError in
+            var blockInfo = SEBlockInfo()
+            let res = se_filter_chunk(&self.context, i, &blockInfo)
+            if (res != .NoError && res != .Cancelled) {
+                print("[!] unable to filter chunk \(i)")
+            }
+            return res
+        }
+        
+        let priority = DispatchGroup()
+        for _ in 0..<priorityChunks {
+            priority.enter()
+        }
+        dispatch(priorityChunks, group: filterGroup) { (i) in
+            _ = filterChunk(i)
+            priority.leave()
+        }
+        dispatch(chunks, group: filterGroup) { (i) in
+            let res = se_sample_chunk(&self.context, i)
+            if (res == .NoError) {
+                self.scheduleFilterUpdate(generation)
+            } else if (res != .Cancelled) {
+                print("[!] unable to sample chunk \(i)")
+            }
+        }
+        dispatch(chunks - priorityChunks, group: filterGroup) { (i) in
+            if (filterChunk(priorityChunks + i) == .NoError) {
+                self.scheduleFilterUpdate(generation)
+            }
+        }
+        
+        priority.wait()
+        mergeFilter()
+        
+        filterGroup.notify(queue: DispatchQueue.main) {
+            guard generation == self.filterGeneration, self.isFiltering else { return }
+            self.isFiltering = false
+            self.updateFilter()
+            print("[+] filter ready (\(self.filteredLines) lines, \(self.maxFilteredLength) cols) in \(self.scanTime(filter: true))ms")
+        }
+        
+        return true;
+    }
+    
+    // merges rows filtered so far into the view
+    func mergeFilter() {
+        var rows : UInt32 = 0
+        se_merge_scope(&context, &rows)
+        
+        var filterInfo = SEBlockInfo()
+        guard se_get_filter_info(&context, &filterInfo) == .NoError else {
+            print("[!] unable to get filter info")
+            return
+        }
+        filteredLines = filterInfo.lines
+        maxFilteredLength = Int(filterInfo.maxLength)
+        
+        // estimate is refined with every filtered chunk
+        var estimate = SEMatchEstimate()
+        matchEstimate = (isFiltering && se_get_match_estimate(&context, &estimate) == .NoError && !estimate.exact) ? estimate : nil
+    }
+    
+    // operations over all filtered lines need background filtering to finish
+    func waitFiltered() {
+        filterGroup.wait()
+        mergeFilter()
+    }
+    
+    // chunks which are not started yet are skipped, running ones are waited for before filter state changes
+    private func cancelFilter() {
+        se_cancel_filter(&context)
+        filterGroup.wait()
+        filterGeneration += 1
+        isFiltering = false
+        matchEstimate = nil
+    }
+    
+    private func updateFilter() {
+        if let filterProgress = filterProgress {
+            filterProgress()
+        } else {
+            mergeFilter()
+        }
+    }
+    
+    // updates are coalesced, so that view is not rebuilt for every chunk
+    private func scheduleFilterUpdate(_ generation: Int) {
+        filterUpdateLock.lock()
+        let scheduled = filterUpdateScheduled
+        filterUpdateScheduled = true
+        filterUpdateLock.unlock()
+        guard !scheduled else { return }
+        
+        DispatchQueue.main.asyncAfter(deadline: .now() + 0.1) {
+            self.filterUpdateLock.lock()
+            self.filterUpdateScheduled = false
+            self.filterUpdateLock.unlock()
+            
+            guard generation == self.filterGeneration, self.isFiltering else { return }
+            self.updateFilter()
+        }
+    }
+    
+    // counts keys over filtered lines (or the whole file) and returns most frequent ones
+    func aggregate(_ type: SEKeyType, pattern: String = "", delimiter: Character = " ", column: UInt32 = 0, topK: UInt32 = 20) -> (keys: [(key: String, count: UInt64)], distinct: UInt64, error: String) {
+        waitLoaded()
+        waitFiltered()
+        
+        let cError = UnsafeMutablePointer<Int8>.allocate(capacity: Int(MAX_ERROR_LENGTH) + 1)
+        defer { cError.deallocate() }
+        
+        let res = pattern.withCString { (cPattern) -> SearchEngineError in
+            var extractor = SEKeyExtractor()
+            extractor.type = type
+            extractor.pattern = cPattern
+            extractor.delimiter = (delimiter == " ")? 0 : Int8(delimiter.unicodeScalars.first!.value & 0x7f)
+            extractor.column = column
+            return se_set_aggregation(&context, &extractor, cError)
+        }
+        guard res == .NoError else {
+            print("[!] unable to set aggregation")
+            return ([], 0, String(cString: cError))
+        }
         
         let group = DispatchGroup()
-        let queue = DispatchQueue.global()
-        let stime = DispatchTime.now()
-        for i in 0..<context.blocks {
-            queue.async(group: group) {
-                var blockInfo = SEBlockInfo()
-                guard se_filter(&self.context, i, &blockInfo) == .NoError else {
-                    print("[!] unable to filter block \(i)")
-                    return
-                }
-                
-                queue.sync() {
-                    self.filteredLines += blockInfo.lines
-                    if (self.maxFilteredLength < blockInfo.maxLength) {
-                        self.maxFilteredLength = Int(blockInfo.maxLength)
-                    }
-                }
+        dispatch(context.blocks, group: group) { (i) in
+            guard se_aggregate(&self.context, i) == .NoError else {
+                print("[!] unable to aggregate block \(i)")
+                return
+            }
+        }
+        
+        group.wait()
+        
+        var keys = [SEKeyCount](repeating: SEKeyCount(), count: Int(topK))
+        var count : UInt32 = 0
+        var distinct : UInt64 = 0
+        guard se_merge_aggregation(&context, topK, &keys, &count, &distinct) == .NoError else {
+            print("[!] unable to merge aggregation")
+            return ([], 0, "")
+        }
+        
+        let result = keys[0..<Int(count)].map { (entry) -> (key: String, count: UInt64) in
+            let data = Data(bytes: entry.key, count: Int(entry.length))
+            return (String(decoding: data, as: UTF8.self), entry.count)
+        }
+        
+        print("[+] aggregation ready (\(distinct) distinct keys)")
+        return (result, distinct, "")
+    }
+    
+    // assigns every line a message template, returns number of templates
+    func clusterTemplates() -> UInt32 {
+        waitLoaded()
+        
+        let group = DispatchGroup()
+        dispatch(context.blocks, group: group) { (i) in
+            guard se_cluster(&self.context, i) == .NoError else {
+                print("[!] unable to cluster block \(i)")
+                return
             }
         }
         
         group.wait()
-        let etime = DispatchTime.now()
-        let microTime = etime.uptimeNanoseconds - stime.uptimeNanoseconds
-        let dtime = Double(microTime) / 1_000_000
+        
+        var templates : UInt32 = 0
+        guard se_merge_templates(&context, &templates) == .NoError else {
+            print("[!] unable to merge templates")
+            return 0
+        }
+        
+        return templates
+    }
+    
+    func getTemplate(_ templateId: UInt32) -> (text: String, count: UInt64, firstLine: Int)? {
+        var info = SETemplateInfo()
+        guard se_get_template(&context, templateId, &info) == .NoError else {
+            return nil
+        }
+        
+        let data = Data(bytes: info.text, count: Int(info.length))
+        return (String(decoding: data, as: UTF8.self), info.count, Int(info.firstLine))
+    }
+    
+    // empty list selects all templates, follow with filter() to build the view
+    func setTemplateFilter(_ templateIds: [UInt32], representatives: Bool) -> Bool {
+        cancelFilter()
+        
+        let res = (templateIds.isEmpty)?
+            se_set_template_filter(&context, nil, 0, representatives) :
+            se_set_template_filter(&context, templateIds, UInt32(templateIds.count), representatives)
+        guard res == .NoError else {
+            print("[!] unable to set template filter")
+            return false
+        }
+        
+        return true
+    }
+    
+}
 
-        se_merge_scope(&context, &filteredLines)
+// rows of several documents interleaved by their timestamps, every document keeps its own view,
+// so documents are filtered one by one and the merged view picks up their rows with refresh()
+class MergedLog {
+    
+    private var merge = SEMergeContext()
+    private let sources : [SearchEngine]
+    
+    var lineCount: Int {
+        get {
+            return Int(merge.rows)
+        }
+    }
+    
+    init?(_ sources: [SearchEngine]) {
+        self.sources = sources
         
-        print("[+] filter ready (\(filteredLines) lines, \(maxFilteredLength) cols) in \(dtime)ms")
-        return true;
+        // time index of every document is built with the first merge
+        var contexts = sources.map { (source) -> SEContext in
+            source.waitLoaded()
+            return source.context
+        }
+        guard se_merge_init(&contexts, UInt32(contexts.count), &merge) == .NoError else {
+            print("[!] unable to merge documents")
+            return nil
+        }
+        
+        print("[+] merged \(sources.count) documents (\(merge.rows) lines)")
+    }
+    
+    deinit {
+        se_merge_destroy(&merge)
+    }
+    
+    // views of documents have changed, e.g. filtered or appended
+    func refresh() {
+        guard se_merge_refresh(&merge) == .NoError else {
+            print("[!] unable to refresh merged view")
+            return
+        }
+    }
+    
+    // filters every document with the same pattern, empty pattern shows all lines
+    func filter(_ pattern: String) -> (Bool, String) {
+        for source in sources {
+            let (res, error) = source.setPattern(pattern)
+            guard res else {
+                return (false, error)
+            }
+            if (pattern.count != 0) {
+                guard source.filter() else {
+                    return (false, "")
+                }
+            }
+        }
+        for source in sources {
+            source.waitFiltered()
+        }
+        
+        refresh()
+        return (true, "")
+    }
+    
+    func getLine(_ row: Int) -> (line: String, source: Int, number: Int, scope: Bool) {
+        var info = SEMergedLineInfo()
+        guard se_merge_get_line(&merge, UInt64(row), &info) == .NoError else {
+            return ("[!] unable to get line \(row)", 0, 0, false)
+        }
+        
+        return (SearchEngine.decode(info.line), Int(info.source), Int(info.line.number), info.line.scope)
     }
     
 }
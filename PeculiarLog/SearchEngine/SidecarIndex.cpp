@@ -0,0 +1,207 @@
+//
+//  SidecarIndex.cpp
+//  PeculiarLog
+//
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "SearchEngine.hpp"
+#include "SidecarIndex.hpp"
+
+static const char s_magic[8] = {'P', 'L', 'I', 'D', 'X', 0, 0, 0};
+
+SidecarIndex::SidecarIndex(const char* dir, const char* file, uint32_t lineIndexStride)
+    : m_stride(lineIndexStride)
+{
+    char path[PATH_MAX];
+    m_path = (realpath(file, path))? path : file;
+
+    // one index per path, files with the same name in different directories don't collide
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.plidx", (unsigned long long)hash(m_path.data(), m_path.size()));
+    m_indexPath = std::string(dir) + name;
+
+    mkdir(dir, 0755);
+}
+
+uint64_t SidecarIndex::hash(const char* data, uint64_t size)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (uint64_t i = 0; i < size; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint64_t SidecarIndex::headHash(const char* mem, uint64_t size)
+{
+    return hash(mem, (size < s_hashWindow)? size : s_hashWindow);
+}
+
+uint64_t SidecarIndex::tailHash(const char* mem, uint64_t size)
+{
+    uint64_t length = (size < s_hashWindow)? size : s_hashWindow;
+    return hash(mem + size - length, length);
+}
+
+bool SidecarIndex::load(const char* mem, uint64_t size, int64_t mtime, std::vector<Block>& blocks)
+{
+    blocks.clear();
+
+    int fd = ::open(m_indexPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(Header)) {
+        ::close(fd);
+        return false;
+    }
+
+    uint64_t indexSize = st.st_size;
+    auto data = (const char*)mmap(nullptr, indexSize, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    auto header = (const Header*)data;
+    auto records = (const BlockRecord*)(header + 1);
+    auto path = (const char*)(records + header->blockCount);
+
+    // appended file keeps indexed part intact, anything else is indexed from scratch
+    bool valid = memcmp(header->magic, s_magic, sizeof(s_magic)) == 0 &&
+                 header->version == s_version &&
+                 header->blockCount > 0 && header->blockCount <= MAX_BLOCK_COUNT &&
+                 uint64_t(path - data) + header->pathLength <= indexSize &&
+                 header->pathLength == m_path.size() && memcmp(path, m_path.data(), m_path.size()) == 0;
+
+    if (valid) {
+        if (header->size == size)
+            valid = header->mtime == mtime;
+        else
+            valid = header->size < size;
+    }
+
+    valid = valid && headHash(mem, header->size) == header->headHash && tailHash(mem, header->size) == header->tailHash;
+
+    // blocks follow each other from the beginning of the file, a stale or corrupt record would
+    // otherwise let line lookups index past the line index or outside the block
+    uint64_t blockEnd = 0;
+    for (uint32_t i = 0; valid && i < header->blockCount; i++) {
+        auto& record = records[i];
+        valid = record.byteOffset == blockEnd &&
+                record.size <= header->size - record.byteOffset &&
+                record.indexCount == record.lines / m_stride + 1 &&
+                record.indexOffset % sizeof(uint64_t) == 0 &&
+                record.indexOffset <= indexSize &&
+                record.indexCount <= (indexSize - record.indexOffset) / sizeof(uint64_t) &&
+                record.gramOffset % sizeof(uint64_t) == 0 &&
+                record.gramOffset <= indexSize &&
+                record.gramCount <= (indexSize - record.gramOffset) / sizeof(uint64_t) &&
+                record.encoding <= InvalidUTF8Encoding;
+        if (!valid)
+            break;
+        
+        // line starts ascend within the block, the first one is the block start
+        auto lineIndex = (const uint64_t*)(data + record.indexOffset);
+        blockEnd = record.byteOffset + record.size;
+        valid = lineIndex[0] == record.byteOffset;
+        for (uint32_t k = 1; valid && k < record.indexCount; k++)
+            valid = lineIndex[k] > lineIndex[k - 1] && lineIndex[k] <= blockEnd;
+        if (!valid)
+            break;
+
+        blocks.emplace_back();
+        auto& block = blocks.back();
+        block.byteOffset = record.byteOffset;
+        block.size = record.size;
+        block.lines = record.lines;
+        block.maxLength = record.maxLength;
+        block.encoding = (SEEncoding)record.encoding;
+
+        block.lineIndex.assign(lineIndex, lineIndex + record.indexCount);
+        
+        auto grams = (const uint64_t*)(data + record.gramOffset);
+        block.grams.assign(grams, grams + record.gramCount);
+    }
+
+    uint64_t indexedSize = header->size;
+    munmap((void*)data, indexSize);
+
+    if (!valid) {
+        blocks.clear();
+        return false;
+    }
+
+    printf("[+] index restored (%llu of %llu bytes)\n", (unsigned long long)indexedSize, (unsigned long long)size);
+    return true;
+}
+
+bool SidecarIndex::save(const char* mem, uint64_t size, int64_t mtime, const std::vector<Block>& blocks)
+{
+    Header header = {};
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.blockCount = uint32_t(blocks.size());
+    header.size = size;
+    header.mtime = mtime;
+    header.headHash = headHash(mem, size);
+    header.tailHash = tailHash(mem, size);
+    header.pathLength = uint32_t(m_path.size());
+
+    uint64_t offset = sizeof(Header) + blocks.size() * sizeof(BlockRecord) + ((m_path.size() + 7) & ~7ULL);
+    std::vector<BlockRecord> records(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        records[i].byteOffset = blocks[i].byteOffset;
+        records[i].size = blocks[i].size;
+        records[i].indexOffset = offset;
+        records[i].lines = blocks[i].lines;
+        records[i].maxLength = blocks[i].maxLength;
+        records[i].encoding = blocks[i].encoding;
+        records[i].indexCount = uint32_t(blocks[i].lineIndex.size());
+        offset += blocks[i].lineIndex.size() * sizeof(uint64_t);
+        records[i].gramOffset = offset;
+        records[i].gramCount = blocks[i].grams.size();
+        offset += blocks[i].grams.size() * sizeof(uint64_t);
+    }
+
+    // written aside and renamed, so concurrent readers never see a partial index
+    std::string tmpPath = m_indexPath + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file) {
+        printf("[!] unable to create index %s\n", tmpPath.c_str());
+        return false;
+    }
+
+    static const char padding[8] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(records.data(), sizeof(BlockRecord), records.size(), file) == records.size() &&
+              fwrite(m_path.data(), 1, m_path.size(), file) == m_path.size() &&
+              fwrite(padding, 1, (8 - m_path.size() % 8) % 8, file) == (8 - m_path.size() % 8) % 8;
+    for (size_t i = 0; ok && i < blocks.size(); i++) {
+        auto& lineIndex = blocks[i].lineIndex;
+        auto& grams = blocks[i].grams;
+        // empty arrays have no data pointer to pass to fwrite
+        ok = (lineIndex.empty() || fwrite(lineIndex.data(), sizeof(uint64_t), lineIndex.size(), file) == lineIndex.size()) &&
+             (grams.empty() || fwrite(grams.data(), sizeof(uint64_t), grams.size(), file) == grams.size());
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), m_indexPath.c_str()) != 0) {
+        printf("[!] unable to write index %s\n", m_indexPath.c_str());
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
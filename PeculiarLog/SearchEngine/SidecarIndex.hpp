@@ -0,0 +1,69 @@
+//
+//  SidecarIndex.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// block layout, line index and trigram bitmaps saved between sessions, so reopening a file doesn't scan it again
+class SidecarIndex {
+
+public:
+    static const uint32_t s_version     = 2;
+    static const uint64_t s_hashWindow  = 64 * 1024;    // bytes hashed at the beginning and at the end
+
+    struct Block {
+        uint64_t                byteOffset;
+        uint64_t                size;
+        uint32_t                lines;
+        uint32_t                maxLength;
+        SEEncoding              encoding;
+        std::vector<uint64_t>   lineIndex;
+        std::vector<uint64_t>   grams;      // bitmaps of filter chunks, empty if trigrams aren't indexed
+    };
+
+    SidecarIndex(const char* dir, const char* file, uint32_t lineIndexStride);
+
+    // restores blocks if the file is the same or has been appended to since it was indexed,
+    // blocks cover the beginning of the file up to the indexed size
+    bool                load(const char* mem, uint64_t size, int64_t mtime, std::vector<Block>& blocks);
+    bool                save(const char* mem, uint64_t size, int64_t mtime, const std::vector<Block>& blocks);
+
+private:
+
+    // all fields are naturally aligned, arrays follow the header and can be used in place
+    struct Header {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    blockCount;
+        uint64_t    size;               // indexed file size
+        int64_t     mtime;
+        uint64_t    headHash;
+        uint64_t    tailHash;
+        uint32_t    pathLength;         // path follows block records, padded to 8 bytes
+        uint32_t    reserved;
+    };
+
+    struct BlockRecord {
+        uint64_t    byteOffset;
+        uint64_t    size;
+        uint64_t    indexOffset;        // line index position within the index file
+        uint32_t    lines;
+        uint32_t    maxLength;
+        uint32_t    encoding;
+        uint32_t    indexCount;
+        uint64_t    gramOffset;         // trigram bitmaps position within the index file
+        uint64_t    gramCount;
+    };
+
+    static uint64_t     hash(const char* data, uint64_t size);
+    static uint64_t     headHash(const char* mem, uint64_t size);
+    static uint64_t     tailHash(const char* mem, uint64_t size);
+
+    std::string         m_path;         // indexed file
+    std::string         m_indexPath;
+    uint32_t            m_stride;       // line index keeps every m_stride line start of a block
+};
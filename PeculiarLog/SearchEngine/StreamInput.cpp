@@ -0,0 +1,198 @@
+//
+//  StreamInput.cpp
+//  PeculiarLog
+//
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "SearchEngine.hpp"
+#include "StreamInput.hpp"
+#include "UTF8Validator.hpp"
+
+int StreamInput::createSpillFile()
+{
+    const char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/PeculiarLog.XXXXXX", (dir && dir[0])? dir : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("[!] unable to create spill file %s: %d\n", path, errno);
+        return -1;
+    }
+    unlink(path);
+
+    return fd;
+}
+
+StreamInput::StreamInput(int fd, int spillFd, uint32_t lineIndexStride)
+    : m_fd(fd), m_spillFd(spillFd), m_stride(lineIndexStride)
+{
+    m_reader = std::thread(&StreamInput::readLoop, this);
+}
+
+StreamInput::~StreamInput()
+{
+    // reader wakes up at least every s_latency to check for stop
+    m_stop = true;
+    if (m_reader.joinable())
+        m_reader.join();
+
+    ::close(m_fd);
+}
+
+bool StreamInput::take(std::vector<Append>& appends)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    appends.clear();
+    appends.swap(m_appends);
+    return m_ended;
+}
+
+uint64_t StreamInput::receivedBytes()
+{
+    return m_received.load(std::memory_order_relaxed);
+}
+
+void StreamInput::readLoop()
+{
+    // buffer starts with the first line which is not indexed yet, the rest of the line is awaited
+    // and the line is indexed once it's complete, so pieces never split lines or multibyte sequences
+    std::vector<char> buffer(s_readSize);
+    size_t used = 0;
+    size_t spilled = 0;
+    bool failed = false;
+    bool eof = false;
+    const int latency = s_latency;
+    auto lastIndexed = std::chrono::steady_clock::now();
+
+    auto flush = [&]() {
+        if (!spill(buffer.data() + spilled, used - spilled)) {
+            failed = true;
+            return;
+        }
+        spilled = used;
+        lastIndexed = std::chrono::steady_clock::now();
+
+        size_t complete = used;
+        while (complete && buffer[complete - 1] != '\n')
+            complete--;
+        if (complete)
+            index(m_spillSize - used, buffer.data(), complete);
+
+        memmove(buffer.data(), buffer.data() + complete, used - complete);
+        used -= complete;
+        spilled = used;
+
+        // single line doesn't fit, buffer grows until the line ends
+        if (used == buffer.size())
+            buffer.resize(buffer.size() * 2);
+    };
+
+    while (!m_stop && !failed && !eof) {
+        struct pollfd pfd = {m_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, latency);
+        if (ready < 0 && errno != EINTR) {
+            printf("[!] unable to wait for stream input: %d\n", errno);
+            failed = true;
+            break;
+        }
+
+        if (ready > 0) {
+            ssize_t count = read(m_fd, buffer.data() + used, buffer.size() - used);
+            if (count == 0 || (count < 0 && errno != EINTR && errno != EAGAIN)) {
+                // last line is terminated, so that it's counted like the rest
+                eof = true;
+                if (used && buffer[used - 1] != '\n') {
+                    if (used == buffer.size())
+                        buffer.resize(buffer.size() + 1);
+                    buffer[used++] = '\n';
+                }
+            } else if (count > 0) {
+                used += count;
+                m_received += count;
+            }
+        }
+
+        // lines are indexed in big pieces while input keeps coming and right away when it pauses
+        auto waited = std::chrono::steady_clock::now() - lastIndexed;
+        if (used > spilled && (eof || ready == 0 || used == buffer.size() || waited >= std::chrono::milliseconds(latency)))
+            flush();
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_ended = true;
+    printf("[+] stream input %s after %llu bytes\n", (failed)? "failed" : "closed", (unsigned long long)m_spillSize);
+}
+
+bool StreamInput::spill(const char* data, size_t size)
+{
+    if (m_spillSize + size > s_reserveSize) {
+        printf("[!] stream input exceeds reserved size\n");
+        return false;
+    }
+
+    // spill file is append-only, mapped pages show new data as soon as it's written
+    while (size) {
+        ssize_t count = write(m_spillFd, data, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0) {
+            printf("[!] unable to write spill file: %d\n", errno);
+            return false;
+        }
+        data += count;
+        size -= count;
+        m_spillSize += count;
+    }
+    return true;
+}
+
+void StreamInput::index(uint64_t pos, const char* data, uint64_t size)
+{
+    // last block keeps growing once there is no room for more blocks
+    if (m_blockStarted && pos - m_blockOffset >= s_blockSize && m_blockIdx + 1 < MAX_BLOCK_COUNT) {
+        m_blockIdx++;
+        m_blockLines = 0;
+        m_blockStarted = false;
+    }
+
+    Append append;
+    append.blockIdx = m_blockIdx;
+    append.byteOffset = pos;
+    append.size = size;
+    append.firstLine = m_blockLines;
+    append.lines = 0;
+    append.maxLength = 0;
+    append.encoding = UTF8Validator::validate(data, size);
+
+    if (!m_blockStarted) {
+        m_blockStarted = true;
+        m_blockOffset = pos;
+        append.lineIndex.push_back(pos);
+    }
+
+    // same line index as fetch builds, every m_stride line start of the block
+    const char* line = data;
+    const char* end = data + size;
+    while (line < end) {
+        auto eol = (const char*)memchr(line, '\n', end - line);
+        append.maxLength = std::max(append.maxLength, uint32_t(eol - line));
+        append.lines++;
+        if (++m_blockLines % m_stride == 0)
+            append.lineIndex.push_back(pos + (eol + 1 - data));
+        line = eol + 1;
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_appends.push_back(std::move(append));
+}
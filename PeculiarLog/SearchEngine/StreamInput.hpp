@@ -0,0 +1,72 @@
+//
+//  StreamInput.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// input of a pipe or a socket is appended to a spill file as it arrives, so that lines can be mapped
+// like lines of a regular file, complete lines are indexed on the reader thread and handed to the engine
+class StreamInput {
+
+public:
+    static const uint64_t s_reserveSize = 1ULL << 40;           // address range reserved for the spill file
+    static const uint64_t s_readSize    = 4 * 1024 * 1024;      // lines are indexed in pieces of up to this size
+    static const uint64_t s_blockSize   = 64 * 1024 * 1024;     // next block is started once the last one grows beyond
+    static const int      s_latency     = 100;                  // ms, input received so far is indexed if no more arrives
+
+    // complete lines appended to a block, pieces are taken by the engine in order
+    struct Append {
+        uint32_t                blockIdx;
+        uint64_t                byteOffset;     // first appended line within the spill file
+        uint64_t                size;
+        uint32_t                firstLine;      // block relative number of the first appended line
+        uint32_t                lines;
+        uint32_t                maxLength;
+        SEEncoding              encoding;
+        std::vector<uint64_t>   lineIndex;      // continues line index of the block
+    };
+
+    // spill file is unlinked right away and goes away with its descriptor
+    static int          createSpillFile();
+
+    // takes over input descriptor, spill file is written but not closed
+    StreamInput(int fd, int spillFd, uint32_t lineIndexStride);
+    ~StreamInput();
+
+    // moves pieces indexed so far to the caller, returns true once input is closed and nothing is left
+    bool                take(std::vector<Append>& appends);
+    uint64_t            receivedBytes();
+
+private:
+
+    void                readLoop();
+    bool                spill(const char* data, size_t size);
+    void                index(uint64_t pos, const char* data, uint64_t size);
+
+private:
+
+    int                     m_fd;
+    int                     m_spillFd;
+    uint32_t                m_stride;
+
+    std::thread             m_reader;
+    std::atomic<bool>       m_stop {false};
+    std::atomic<uint64_t>   m_received {0};
+
+    std::mutex              m_lock;
+    std::vector<Append>     m_appends;
+    bool                    m_ended = false;
+
+    // reader thread only
+    uint64_t                m_spillSize = 0;
+    uint32_t                m_blockIdx = 0;
+    uint64_t                m_blockOffset = 0;
+    uint32_t                m_blockLines = 0;
+    bool                    m_blockStarted = false;
+};
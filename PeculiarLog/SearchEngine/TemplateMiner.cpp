@@ -0,0 +1,304 @@
+//
+//  TemplateMiner.cpp
+//  PeculiarLog
+//
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "SearchEngine.hpp"
+#include "TemplateMiner.hpp"
+
+static const char*      s_wildcard = "<*>";
+static const uint32_t   s_wildcardLength = 3;
+
+static bool isWildcard(const char* token, uint32_t length)
+{
+    return length == s_wildcardLength && memcmp(token, s_wildcard, s_wildcardLength) == 0;
+}
+
+static bool hasDigits(const char* token, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++) {
+        if (token[i] >= '0' && token[i] <= '9')
+            return true;
+    }
+    return false;
+}
+
+// MARK: - Tree
+
+TemplateMiner::Tree::Tree()
+{
+    clear();
+}
+
+void TemplateMiner::Tree::clear()
+{
+    clusters.clear();
+    m_nodes.clear();
+    m_nodes.emplace_back();
+}
+
+uint32_t TemplateMiner::Tree::child(uint32_t node, const Token& token)
+{
+    m_key.assign(token.first, token.second);
+    auto it = m_nodes[node].children.find(m_key);
+    if (it != m_nodes[node].children.end())
+        return it->second;
+
+    // too many distinct tokens at this position, most likely it is a variable
+    if (m_nodes[node].children.size() >= s_maxChildren && !isWildcard(token.first, token.second)) {
+        m_key = s_wildcard;
+        it = m_nodes[node].children.find(m_key);
+        if (it != m_nodes[node].children.end())
+            return it->second;
+    }
+
+    uint32_t idx = uint32_t(m_nodes.size());
+    m_nodes[node].children.emplace(m_key, idx);
+    m_nodes.emplace_back();
+    return idx;
+}
+
+uint32_t TemplateMiner::Tree::insert(const std::vector<Token>& tokens, uint64_t count, uint32_t line)
+{
+    // first level is the number of tokens, then few leading tokens with numbers treated as variables
+    char length[16];
+    uint32_t size = snprintf(length, sizeof(length), "%zu", tokens.size());
+    uint32_t node = child(0, Token(length, size));
+
+    for (uint32_t d = 0; d < s_depth && d < tokens.size(); d++) {
+        auto& token = tokens[d];
+        if (hasDigits(token.first, token.second))
+            node = child(node, Token(s_wildcard, s_wildcardLength));
+        else
+            node = child(node, token);
+    }
+
+    // pick cluster with the most equal tokens, wildcard is equal only to a wildcard of another template
+    int64_t best = -1;
+    double bestSimilarity = -1;
+    for (auto idx : m_nodes[node].clusters) {
+        auto& cluster = clusters[idx];
+        uint32_t equal = 0;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            auto& t = cluster.tokens[i];
+            if (t.size() == tokens[i].second && memcmp(t.data(), tokens[i].first, t.size()) == 0)
+                equal++;
+        }
+        double similarity = (tokens.size())? double(equal) / tokens.size() : 1.0;
+        if (similarity > bestSimilarity) {
+            bestSimilarity = similarity;
+            best = idx;
+        }
+    }
+
+    if (best >= 0 && bestSimilarity >= s_similarity) {
+        auto& cluster = clusters[best];
+        for (size_t i = 0; i < tokens.size(); i++) {
+            auto& t = cluster.tokens[i];
+            if (t.size() != tokens[i].second || memcmp(t.data(), tokens[i].first, t.size()) != 0)
+                t = s_wildcard;
+        }
+        cluster.count += count;
+        return uint32_t(best);
+    }
+
+    uint32_t idx = uint32_t(clusters.size());
+    clusters.emplace_back();
+    auto& cluster = clusters.back();
+    cluster.tokens.reserve(tokens.size());
+    for (auto& token : tokens) {
+        cluster.tokens.emplace_back(token.first, token.second);
+    }
+    cluster.count = count;
+    cluster.firstLine = line;
+    m_nodes[node].clusters.push_back(idx);
+
+    return idx;
+}
+
+size_t TemplateMiner::Tree::memoryUsage() const
+{
+    size_t size = m_nodes.capacity() * sizeof(Node) + clusters.capacity() * sizeof(Cluster);
+    for (auto& node : m_nodes) {
+        size += node.children.size() * (sizeof(std::string) + sizeof(uint32_t) + 2 * sizeof(void*));
+        size += node.clusters.capacity() * sizeof(uint32_t);
+    }
+    for (auto& cluster : clusters) {
+        for (auto& token : cluster.tokens) {
+            size += sizeof(std::string) + token.capacity();
+        }
+    }
+    return size;
+}
+
+// MARK: - Miner
+
+void TemplateMiner::reset(uint32_t blockIdx)
+{
+    auto& worker = m_workers[blockIdx];
+    worker.tree.clear();
+    worker.lines.clear();
+    worker.templates.clear();
+    m_merged = false;
+}
+
+void TemplateMiner::add(uint32_t blockIdx, const char* line, uint32_t length)
+{
+    auto& worker = m_workers[blockIdx];
+    auto& tokens = worker.tokens;
+    tokens.clear();
+
+    const char* p = line;
+    const char* end = line + length;
+    auto isSpace = [](char c) { return c == ' ' || c == '\t'; };
+    while (tokens.size() < s_maxTokens) {
+        while (p < end && isSpace(*p))
+            p++;
+        if (p == end)
+            break;
+        const char* start = p;
+        while (p < end && !isSpace(*p))
+            p++;
+        tokens.emplace_back(start, uint32_t(p - start));
+    }
+
+    worker.lines.push_back(worker.tree.insert(tokens, 1, uint32_t(worker.lines.size())));
+}
+
+uint32_t TemplateMiner::merge(uint32_t blockCount)
+{
+    // block templates are clustered once again, so that the same message generalized
+    // differently in different blocks ends up in one template
+    Tree tree;
+    std::vector<Token> tokens;
+
+    m_templates.clear();
+    for (uint32_t b = 0; b < blockCount; b++) {
+        auto& worker = m_workers[b];
+        worker.templates.resize(worker.tree.clusters.size());
+        for (size_t c = 0; c < worker.tree.clusters.size(); c++) {
+            auto& cluster = worker.tree.clusters[c];
+            tokens.clear();
+            for (auto& token : cluster.tokens) {
+                tokens.emplace_back(token.data(), uint32_t(token.size()));
+            }
+
+            uint32_t id = tree.insert(tokens, cluster.count, cluster.firstLine);
+            if (id == m_templates.size()) {
+                m_templates.emplace_back();
+                m_templates.back().firstBlock = b;
+                m_templates.back().firstLine = cluster.firstLine;
+            }
+            worker.templates[c] = id;
+        }
+    }
+
+    for (size_t id = 0; id < m_templates.size(); id++) {
+        auto& cluster = tree.clusters[id];
+        auto& text = m_templates[id].text;
+        for (auto& token : cluster.tokens) {
+            if (!text.empty())
+                text += ' ';
+            text += token;
+        }
+        m_templates[id].count = cluster.count;
+    }
+
+    m_blockCount = blockCount;
+    m_merged = true;
+    m_selected.clear();
+
+    return uint32_t(m_templates.size());
+}
+
+const TemplateMiner::Template* TemplateMiner::getTemplate(uint32_t templateId)
+{
+    if (!m_merged || templateId >= m_templates.size())
+        return nullptr;
+
+    return &m_templates[templateId];
+}
+
+bool TemplateMiner::getLineTemplate(uint32_t blockIdx, uint32_t line, uint32_t* templateId)
+{
+    if (!m_merged || blockIdx >= m_blockCount)
+        return false;
+
+    auto& worker = m_workers[blockIdx];
+    if (line >= worker.lines.size())
+        return false;
+
+    *templateId = worker.templates[worker.lines[line]];
+    return true;
+}
+
+void TemplateMiner::select(const uint32_t* ids, uint32_t count, bool representatives)
+{
+    m_selected.assign((m_templates.size() + 63) / 64, (ids)? 0 : ~0ULL);
+    for (uint32_t i = 0; ids && i < count; i++) {
+        if (ids[i] < m_templates.size())
+            m_selected[ids[i] / 64] |= 1ULL << (ids[i] % 64);
+    }
+    m_representatives = representatives;
+}
+
+void TemplateMiner::filter(uint32_t blockIdx, std::vector<uint32_t>& matches)
+{
+    matches.clear();
+
+    auto isSelected = [&](uint32_t id) {
+        return (m_selected[id / 64] >> (id % 64)) & 1;
+    };
+
+    if (m_representatives) {
+        for (uint32_t id = 0; id < m_templates.size(); id++) {
+            if (m_templates[id].firstBlock == blockIdx && isSelected(id))
+                matches.push_back(m_templates[id].firstLine);
+        }
+        std::sort(matches.begin(), matches.end());
+        return;
+    }
+
+    // resolve selection for block clusters once, then it is a single lookup per line
+    auto& worker = m_workers[blockIdx];
+    std::vector<char> mask(worker.templates.size());
+    for (size_t c = 0; c < worker.templates.size(); c++) {
+        mask[c] = isSelected(worker.templates[c]);
+    }
+
+    for (uint32_t line = 0; line < worker.lines.size(); line++) {
+        if (mask[worker.lines[line]])
+            matches.push_back(line);
+    }
+}
+
+void TemplateMiner::clear()
+{
+    for (auto& worker : m_workers) {
+        worker.tree.clear();
+        worker.lines = std::vector<uint32_t>();
+        worker.templates.clear();
+    }
+    m_templates.clear();
+    m_selected.clear();
+    m_blockCount = 0;
+    m_merged = false;
+}
+
+size_t TemplateMiner::memoryUsage() const
+{
+    size_t size = sizeof(TemplateMiner);
+    for (auto& worker : m_workers) {
+        size += worker.tree.memoryUsage();
+        size += worker.lines.capacity() * sizeof(uint32_t);
+        size += worker.templates.capacity() * sizeof(uint32_t);
+    }
+    for (auto& entry : m_templates) {
+        size += sizeof(Template) + entry.text.capacity();
+    }
+    return size + m_selected.capacity() * sizeof(uint64_t);
+}
@@ -0,0 +1,95 @@
+//
+//  TemplateMiner.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Drain-like clustering of lines into message templates, variable tokens are replaced with "<*>"
+class TemplateMiner {
+
+public:
+    static const uint32_t s_maxTokens       = 128;  // tokens after this one are not compared
+    static const uint32_t s_depth           = 2;    // leading tokens used to pick a leaf of the tree
+    static const uint32_t s_maxChildren     = 100;  // other tokens go to wildcard child
+    static constexpr double s_similarity    = 0.4;  // minimal share of equal tokens to join a cluster
+
+    struct Template {
+        std::string     text;               // tokens joined with space
+        uint64_t        count = 0;
+        uint32_t        firstBlock = 0;
+        uint32_t        firstLine = 0;      // block relative number of first line
+    };
+
+    // blocks are clustered in parallel, every block has its own tree
+    void                reset(uint32_t blockIdx);
+    void                add(uint32_t blockIdx, const char* line, uint32_t length);
+
+    // joins templates of all blocks, template IDs are assigned in order of first line
+    uint32_t            merge(uint32_t blockCount);
+    bool                isMerged() { return m_merged; }
+
+    const Template*     getTemplate(uint32_t templateId);
+    bool                getLineTemplate(uint32_t blockIdx, uint32_t line, uint32_t* templateId);
+
+    // no IDs selects all templates, representatives keep only first line of every template
+    void                select(const uint32_t* ids, uint32_t count, bool representatives);
+    void                filter(uint32_t blockIdx, std::vector<uint32_t>& matches);
+
+    void                clear();
+    size_t              memoryUsage() const;
+
+private:
+
+    typedef std::pair<const char*, uint32_t> Token;
+
+    struct Cluster {
+        std::vector<std::string>    tokens;
+        uint64_t                    count = 0;
+        uint32_t                    firstLine = 0;
+    };
+
+    class Tree {
+    public:
+        Tree();
+
+        uint32_t        insert(const std::vector<Token>& tokens, uint64_t count, uint32_t line);
+        void            clear();
+        size_t          memoryUsage() const;
+
+        std::vector<Cluster>    clusters;
+
+    private:
+        struct Node {
+            std::unordered_map<std::string, uint32_t>   children;
+            std::vector<uint32_t>                       clusters;   // only in leaves
+        };
+
+        uint32_t        child(uint32_t node, const Token& token);
+
+        std::vector<Node>   m_nodes;
+        std::string         m_key;          // reused for lookups
+    };
+
+    struct Worker {
+        Tree                    tree;
+        std::vector<uint32_t>   lines;      // cluster of every line
+        std::vector<uint32_t>   templates;  // global template of every cluster
+        std::vector<Token>      tokens;     // reused for tokenizing
+    };
+
+    Worker                  m_workers[MAX_BLOCK_COUNT];
+    uint32_t                m_blockCount = 0;
+    std::vector<Template>   m_templates;
+    std::atomic<bool>       m_merged {false};
+
+    // selection
+    std::vector<uint64_t>   m_selected;     // bitmap of selected templates
+    bool                    m_representatives = false;
+};
@@ -0,0 +1,206 @@
+//
+//  TimestampParser.cpp
+//  PeculiarLog
+//
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "TimestampParser.hpp"
+
+static const int64_t s_usPerSecond = 1000000;
+static const int64_t s_secondsPerDay = 86400;
+
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// fixed number of digits, false if any of them is missing
+static inline bool digits(const char*& p, const char* end, uint32_t count, uint32_t* value)
+{
+    if (end - p < count)
+        return false;
+
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!isDigit(p[i]))
+            return false;
+        v = v * 10 + (p[i] - '0');
+    }
+    p += count;
+    *value = v;
+    return true;
+}
+
+// fraction of a second up to microseconds, the rest of the digits is skipped
+static inline int64_t fraction(const char*& p, const char* end)
+{
+    int64_t us = 0;
+    int64_t scale = s_usPerSecond / 10;
+    for (; p < end && isDigit(*p); p++) {
+        us += (*p - '0') * scale;
+        scale /= 10;
+    }
+    return us;
+}
+
+int64_t TimestampParser::daysFromCivil(int64_t year, uint32_t month, uint32_t day)
+{
+    // proleptic Gregorian calendar, days since 1970-01-01
+    year -= (month <= 2);
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t yoe = uint32_t(year - era * 400);
+    uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + int64_t(doe) - 719468;
+}
+
+int64_t TimestampParser::parse(const char* line, uint32_t length)
+{
+    // timestamp starting near the end of the search range is read past it
+    const uint32_t searchLength = s_searchLength;
+    const char* end = line + std::min(length, searchLength + 32);
+    const char* last = line + std::min(length, searchLength);
+
+    // epoch is accepted only before any other text, digits elsewhere are too likely to be something else
+    const char* p = line;
+    while (p < last && !isDigit(*p) && !((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z'))
+        p++;
+
+    int64_t time = s_noTime;
+    if (p < last && isDigit(*p) && parseEpoch(p, end, &time))
+        return time;
+
+    for (; p < last; p++) {
+        bool wordStart = (p == line || !((p[-1] | 0x20) >= 'a' && (p[-1] | 0x20) <= 'z'));
+        if (isDigit(*p) && (p == line || !isDigit(p[-1])) && parseISO(p, end, &time))
+            return time;
+        if (wordStart && *p >= 'A' && *p <= 'S' && parseSyslog(p, end, &time))
+            return time;
+    }
+
+    return s_noTime;
+}
+
+bool TimestampParser::parseISO(const char* p, const char* end, int64_t* time)
+{
+    uint32_t year, month, day, hour, minute, second;
+    if (!digits(p, end, 4, &year) || p == end || (*p != '-' && *p != '/'))
+        return false;
+    char separator = *p++;
+    if (!digits(p, end, 2, &month) || p == end || *p++ != separator || !digits(p, end, 2, &day))
+        return false;
+    if (p == end || (*p != 'T' && *p != ' '))
+        return false;
+    p++;
+    if (!digits(p, end, 2, &hour) || p == end || *p++ != ':' || !digits(p, end, 2, &minute) ||
+        p == end || *p++ != ':' || !digits(p, end, 2, &second))
+        return false;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    int64_t us = 0;
+    if (p < end && (*p == '.' || *p == ',')) {
+        p++;
+        us = fraction(p, end);
+    }
+
+    // local time without offset is taken as is, logs of one system are merged in the same zone
+    int64_t offset = 0;
+    if (p < end && *p == ' ')
+        p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+        int64_t sign = (*p == '-')? -1 : 1;
+        const char* q = p + 1;
+        uint32_t offsetHour, offsetMinute;
+        if (digits(q, end, 2, &offsetHour)) {
+            if (q < end && *q == ':')
+                q++;
+            if (!digits(q, end, 2, &offsetMinute))
+                offsetMinute = 0;
+            offset = sign * (offsetHour * 3600 + offsetMinute * 60);
+        }
+    }
+
+    int64_t seconds = daysFromCivil(year, month, day) * s_secondsPerDay + hour * 3600 + minute * 60 + second - offset;
+    *time = seconds * s_usPerSecond + us;
+    return true;
+}
+
+bool TimestampParser::parseSyslog(const char* p, const char* end, int64_t* time)
+{
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (end - p < 15 || p[3] != ' ')
+        return false;
+
+    const char* found = nullptr;
+    for (const char* m = months; *m; m += 3) {
+        if (!memcmp(m, p, 3)) {
+            found = m;
+            break;
+        }
+    }
+    if (!found)
+        return false;
+
+    uint32_t month = uint32_t(found - months) / 3 + 1;
+    p += 4;
+
+    // day is padded with a space
+    uint32_t day, hour, minute, second;
+    if (*p == ' ')
+        p++;
+    if (p < end && isDigit(*p) && (p + 1 == end || !isDigit(p[1]))) {
+        day = *p++ - '0';
+    } else if (!digits(p, end, 2, &day)) {
+        return false;
+    }
+    if (p == end || *p++ != ' ')
+        return false;
+    if (!digits(p, end, 2, &hour) || p == end || *p++ != ':' || !digits(p, end, 2, &minute) ||
+        p == end || *p++ != ':' || !digits(p, end, 2, &second))
+        return false;
+    if (day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    int64_t us = 0;
+    if (p < end && *p == '.') {
+        p++;
+        us = fraction(p, end);
+    }
+
+    int64_t seconds = daysFromCivil(1970, month, day) * s_secondsPerDay + hour * 3600 + minute * 60 + second;
+    *time = seconds * s_usPerSecond + us;
+    return true;
+}
+
+bool TimestampParser::parseEpoch(const char* p, const char* end, int64_t* time)
+{
+    const char* start = p;
+    int64_t value = 0;
+    for (; p < end && isDigit(*p); p++) {
+        value = value * 10 + (*p - '0');
+    }
+
+    // digits run into a date, let ISO parser take it
+    if (p < end && (*p == '-' || *p == '/' || *p == ':'))
+        return false;
+
+    size_t count = p - start;
+    if (count == 10) {
+        int64_t us = 0;
+        if (p < end && *p == '.') {
+            p++;
+            us = fraction(p, end);
+        }
+        *time = value * s_usPerSecond + us;
+        return true;
+    }
+    if (count == 13) {
+        *time = value * 1000;
+        return true;
+    }
+    return false;
+}
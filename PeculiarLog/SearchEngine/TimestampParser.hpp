@@ -0,0 +1,28 @@
+//
+//  TimestampParser.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <stdint.h>
+
+class TimestampParser {
+
+public:
+    static const uint32_t s_searchLength = 64;      // timestamp is looked for at the beginning of the line only
+    static const int64_t  s_noTime = INT64_MIN;
+
+    // microseconds since epoch of the first timestamp in the line, s_noTime if there is none:
+    //   2016-11-14T10:20:30.123456Z, 2016-11-14 10:20:30,123 +0100, 2016/11/14 10:20:30
+    //   Nov 14 10:20:30 (syslog, year is unknown and taken as 1970)
+    //   1479118830, 1479118830.123, 1479118830123 (epoch seconds or milliseconds leading the line)
+    static int64_t      parse(const char* line, uint32_t length);
+
+private:
+
+    static bool         parseISO(const char* p, const char* end, int64_t* time);
+    static bool         parseSyslog(const char* p, const char* end, int64_t* time);
+    static bool         parseEpoch(const char* p, const char* end, int64_t* time);
+    static int64_t      daysFromCivil(int64_t year, uint32_t month, uint32_t day);
+};
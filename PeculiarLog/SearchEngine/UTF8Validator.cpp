@@ -0,0 +1,102 @@
+//
+//  UTF8Validator.cpp
+//  PeculiarLog
+//
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <string.h>
+
+#include "UTF8Validator.hpp"
+
+uint64_t UTF8Validator::asciiPrefix(const uint8_t* data, uint64_t size)
+{
+    uint64_t i = 0;
+    
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= size; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(data + i)) >= 0x80)
+            break;
+    }
+#endif
+    
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+            break;
+    }
+    
+    while (i < size && data[i] < 0x80)
+        i++;
+    
+    return i;
+}
+
+SEEncoding UTF8Validator::validate(const char* data, uint64_t size)
+{
+    // logs are mostly ASCII, so multibyte sequences are checked one by one between ASCII runs
+    auto p = (const uint8_t*)data;
+    auto end = p + size;
+    bool ascii = true;
+    
+    while (p < end) {
+        p += asciiPrefix(p, end - p);
+        if (p == end)
+            break;
+        
+        ascii = false;
+        
+        // second byte range excludes overlong forms, surrogates and code points above U+10FFFF
+        uint8_t c = *p;
+        uint32_t tail;
+        uint8_t low = 0x80;
+        uint8_t high = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            tail = 1;
+        } else if (c == 0xE0) {
+            tail = 2;
+            low = 0xA0;
+        } else if (c == 0xED) {
+            tail = 2;
+            high = 0x9F;
+        } else if (c >= 0xE1 && c <= 0xEF) {
+            tail = 2;
+        } else if (c == 0xF0) {
+            tail = 3;
+            low = 0x90;
+        } else if (c == 0xF4) {
+            tail = 3;
+            high = 0x8F;
+        } else if (c >= 0xF1 && c <= 0xF3) {
+            tail = 3;
+        } else {
+            return InvalidUTF8Encoding;
+        }
+        
+        if (uint64_t(end - p) <= tail)
+            return InvalidUTF8Encoding;
+        
+        if (p[1] < low || p[1] > high)
+            return InvalidUTF8Encoding;
+        
+        for (uint32_t i = 2; i <= tail; i++) {
+            if ((p[i] & 0xC0) != 0x80)
+                return InvalidUTF8Encoding;
+        }
+        
+        p += tail + 1;
+    }
+    
+    return (ascii)? ASCIIEncoding : UTF8Encoding;
+}
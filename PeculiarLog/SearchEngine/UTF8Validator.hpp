@@ -0,0 +1,21 @@
+//
+//  UTF8Validator.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include "SearchEngine.hpp"
+
+class UTF8Validator {
+
+public:
+    // ASCII if there are no bytes above 0x7f, otherwise UTF8 or InvalidUTF8 for malformed,
+    // overlong or surrogate sequences
+    static SEEncoding   validate(const char* data, uint64_t size);
+
+private:
+
+    // length of ASCII run at the beginning of data, checked with SIMD where available
+    static uint64_t     asciiPrefix(const uint8_t* data, uint64_t size);
+};
@@ -0,0 +1,143 @@
+//
+//  WorkerPool.cpp
+//  PeculiarLog
+//
+
+#include <algorithm>
+
+#include "WorkerPool.hpp"
+
+WorkerPool& WorkerPool::shared()
+{
+    // workers live until the process exits, so the pool is never destroyed
+    static WorkerPool* pool = new WorkerPool();
+    return *pool;
+}
+
+WorkerPool::WorkerPool()
+{
+    uint32_t count = std::max(std::thread::hardware_concurrency(), 1u);
+    for (uint32_t i = 0; i < count; i++) {
+        m_workers.emplace_back(&WorkerPool::run, this);
+        m_workers.back().detach();
+    }
+}
+
+uint32_t WorkerPool::workerCount() const
+{
+    return uint32_t(m_workers.size());
+}
+
+void WorkerPool::detach(const void* owner)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    m_urgent.erase(std::remove_if(m_urgent.begin(), m_urgent.end(), [owner](const std::pair<const void*, Task>& task) {
+        return task.first == owner;
+    }), m_urgent.end());
+
+    auto it = std::find_if(m_queues.begin(), m_queues.end(), [owner](const Queue& queue) { return queue.owner == owner; });
+    if (it != m_queues.end()) {
+        m_queues.erase(it);
+        if (m_next >= m_queues.size())
+            m_next = 0;
+    }
+    if (m_active == owner)
+        m_active = nullptr;
+
+    // a task taken just before may not have told its owner it's running yet, a callback
+    // of the owner's own task may detach it, so that task isn't waited for
+    auto self = std::this_thread::get_id();
+    m_idle.wait(lock, [&] {
+        return std::none_of(m_running.begin(), m_running.end(), [&](const std::pair<const void*, std::thread::id>& running) {
+            return running.first == owner && running.second != self;
+        });
+    });
+}
+
+void WorkerPool::setActive(const void* owner)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_active = owner;
+}
+
+void WorkerPool::submit(const void* owner, Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        auto it = std::find_if(m_queues.begin(), m_queues.end(), [owner](const Queue& queue) { return queue.owner == owner; });
+        if (it == m_queues.end()) {
+            m_queues.push_back({owner, {}});
+            it = m_queues.end() - 1;
+        }
+        it->tasks.push_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+void WorkerPool::submitUrgent(const void* owner, Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        m_urgent.emplace_back(owner, std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+bool WorkerPool::next(Task& task, const void*& owner)
+{
+    if (!m_urgent.empty()) {
+        owner = m_urgent.front().first;
+        task = std::move(m_urgent.front().second);
+        m_urgent.pop_front();
+        return true;
+    }
+
+    for (auto& queue : m_queues) {
+        if (queue.owner == m_active && !queue.tasks.empty()) {
+            owner = queue.owner;
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // round robin over background documents, one task at a time
+    for (size_t i = 0; i < m_queues.size(); i++) {
+        auto& queue = m_queues[(m_next + i) % m_queues.size()];
+        if (queue.tasks.empty())
+            continue;
+
+        owner = queue.owner;
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        m_next = (m_next + i + 1) % m_queues.size();
+        return true;
+    }
+
+    return false;
+}
+
+void WorkerPool::run()
+{
+    auto self = std::this_thread::get_id();
+    for (;;) {
+        Task task;
+        const void* owner = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_cond.wait(lock, [&] { return next(task, owner); });
+            m_running.emplace_back(owner, self);
+        }
+        task();
+        task = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_running.erase(std::find(m_running.begin(), m_running.end(), std::make_pair(owner, self)));
+        }
+        m_idle.notify_all();
+    }
+}
@@ -0,0 +1,56 @@
+//
+//  WorkerPool.hpp
+//  PeculiarLog
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// process-wide workers shared by all open documents, tasks of the active document go first
+// and other documents take turns, so a large background file doesn't hold up the rest
+class WorkerPool {
+
+public:
+    typedef std::function<void()> Task;
+
+    static WorkerPool&  shared();
+
+    // drops queued tasks of the owner and waits for those already taken by workers,
+    // except the one running on the calling thread
+    void                detach(const void* owner);
+    void                setActive(const void* owner);
+    void                submit(const void* owner, Task task);
+    // urgent tasks go before queued tasks of any document, for short requests the user waits for
+    void                submitUrgent(const void* owner, Task task);
+    uint32_t            workerCount() const;
+
+private:
+
+    WorkerPool();
+
+    void                run();
+    bool                next(Task& task, const void*& owner);
+
+private:
+
+    struct Queue {
+        const void*         owner;
+        std::deque<Task>    tasks;
+    };
+
+    std::mutex                  m_lock;
+    std::condition_variable     m_cond;
+    std::vector<Queue>          m_queues;           // in order of first submitted task
+    std::deque<std::pair<const void*, Task>> m_urgent;
+    std::vector<std::pair<const void*, std::thread::id>> m_running;    // owners of tasks being run
+    std::condition_variable     m_idle;
+    const void*                 m_active = nullptr;
+    size_t                      m_next = 0;         // next queue to take a task from if the active one is empty
+    std::vector<std::thread>    m_workers;
+};
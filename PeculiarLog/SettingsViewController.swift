@@ -29,6 +29,9 @@ class SettingsViewController: NSViewController {
     
     private(set) var ignoreCase = false
     private(set) var showLines = true
+    private(set) var fuzzyDistance : UInt32 = 0
+    private(set) var fuzzyHamming = false
+    private(set) var fieldMode = false
 
     var matchColor: NSColor {
         get {
@@ -76,6 +79,15 @@ class SettingsViewController: NSViewController {
             showLines = showlines
             showLinesButton.state = (showlines == true) ? .on : .off
         }
+        if let distance = userDefaults?.integer(forKey: "fuzzyDistance") {
+            fuzzyDistance = UInt32(min(distance, Int(MAX_FUZZY_DISTANCE)))
+        }
+        if let hamming = userDefaults?.bool(forKey: "fuzzyHamming") {
+            fuzzyHamming = hamming
+        }
+        if let fields = userDefaults?.bool(forKey: "fieldMode") {
+            fieldMode = fields
+        }
         if let scopeBefore = userDefaults?.integer(forKey: "scopeBefore") {
             scopeBeforeField.integerValue = scopeBefore
         }
@@ -103,6 +115,8 @@ class SettingsViewController: NSViewController {
             [ "⇧⌘↓", "A+   " ],
             [ "⇧⌘c", "case " ],
             [ "⇧⌘l", "lines" ],
+            [ "⇧⌥↑", "D+   " ],
+            [ "⇧⌥↓", "D-   " ],
         ]
         
         let cols = 2
@@ -153,7 +167,26 @@ class SettingsViewController: NSViewController {
             return String(UnicodeScalar(x)!)
         }
 
-        if (event.modifierFlags.contains([.control, .shift])) {
+        if (event.modifierFlags.contains([.option, .shift])) {
+            switch event.charactersIgnoringModifiers! {
+                case intToString(x: NSUpArrowFunctionKey):
+                    if (fuzzyDistance < MAX_FUZZY_DISTANCE) {
+                        fuzzyDistance += 1
+                        userDefaults?.set(fuzzyDistance, forKey: "fuzzyDistance")
+                        self.delegate?.settingsChanged()
+                    }
+                    return nil
+                case intToString(x: NSDownArrowFunctionKey):
+                    if (fuzzyDistance > 0) {
+                        fuzzyDistance -= 1
+                        userDefaults?.set(fuzzyDistance, forKey: "fuzzyDistance")
+                        self.delegate?.settingsChanged()
+                    }
+                    return nil
+                default:
+                    break;
+            }
+        } else if (event.modifierFlags.contains([.control, .shift])) {
             switch event.charactersIgnoringModifiers! {
                 case intToString(x: NSUpArrowFunctionKey):
                     if (scopeBeforeField.integerValue < MAX_SCOPE_BEFORE) {
@@ -194,6 +227,18 @@ class SettingsViewController: NSViewController {
                 userDefaults?.set(showLines, forKey: "showLines")
                 self.delegate?.settingsChanged()
                 return nil
+            case "H":
+                // count substitutions only instead of full edit distance
+                fuzzyHamming = !fuzzyHamming
+                userDefaults?.set(fuzzyHamming, forKey: "fuzzyHamming")
+                self.delegate?.settingsChanged()
+                return nil
+            case "K":
+                // pattern is a field query for JSON or key=value lines
+                fieldMode = !fieldMode
+                userDefaults?.set(fieldMode, forKey: "fieldMode")
+                self.delegate?.settingsChanged()
+                return nil
             case intToString(x: NSDownArrowFunctionKey):
                 if (scopeAfterField.integerValue < MAX_SCOPE_AFTER) {
                     scopeAfterField.integerValue += 1
@@ -60,16 +60,23 @@ class ViewController: NSViewController {
             self.view.window?.delegate = self
             
             guard let engine = representedObject as? SearchEngine else { return }
+            
+            engine.loadProgress = { [weak self] in
+                self?.logViewController.loadProgress()
+                self?.updateStatus()
+            }
 
             // setup engine from settings
             ignoreCase.isHidden = !settingsViewController.ignoreCase
             guard engine.setIgnoreCase(settingsViewController.ignoreCase) else { return }
+            guard engine.setFuzzy(settingsViewController.fuzzyDistance, hamming: settingsViewController.fuzzyHamming) else { return }
+            guard engine.setFieldMode(settingsViewController.fieldMode) else { return }
             guard engine.setScope(settingsViewController.scopeBefore, settingsViewController.scopeAfter) else { return }
             logViewController.showLineNumbers(settingsViewController.showLines)
             updateStatus()
             
             // set center status
-            centerStatus.stringValue = "\(engine.lineCount) of \(engine.totalLines) lines displayed"
+            centerStatus.stringValue = "\(engine.lineCount) of \(engine.totalLinesString) lines displayed"
             let selected = logViewController.tableView.numberOfSelectedRows
             if selected > 1 {
                 centerStatus.stringValue += " (\(selected) selected)"
@@ -118,6 +125,22 @@ class ViewController: NSViewController {
         })
     }
     
+    @IBAction func findNextMatch(_ sender: Any) {
+        logViewController.gotoMatch(backward: false) { [weak self] (found) in
+            if (!found) {
+                self?.setError("Match not found")
+            }
+        }
+    }
+    
+    @IBAction func findPreviousMatch(_ sender: Any) {
+        logViewController.gotoMatch(backward: true) { [weak self] (found) in
+            if (!found) {
+                self?.setError("Match not found")
+            }
+        }
+    }
+    
     @IBAction func copyAbsoluteLineNumber(_ sender: Any) {
         guard let engine = representedObject as? SearchEngine else { return }
         guard logViewController.tableView.numberOfSelectedRows > 0 else { return }
@@ -140,8 +163,16 @@ class ViewController: NSViewController {
         
         let before = settingsViewController.scopeBefore
         let after = settingsViewController.scopeAfter
+        let distance = settingsViewController.fuzzyDistance
+        let fields = settingsViewController.fieldMode
         var status = ""
-        if (before != 0 || after != 0) {
+        if (before != 0 || after != 0 || distance != 0 || fields) {
+            if (fields) {
+                status += "F "
+            }
+            if (distance != 0) {
+                status += settingsViewController.fuzzyHamming ? "H\(distance) " : "D\(distance) "
+            }
             if (before != 0) {
                 status += "B\(before) "
             }
@@ -156,12 +187,15 @@ class ViewController: NSViewController {
         }
         
         // set center status
-        centerStatus.stringValue = "\(engine.lineCount) of \(engine.totalLines) lines displayed"
+        centerStatus.stringValue = "\(engine.lineCount) of \(engine.totalLinesString) lines displayed"
         let selected = logViewController.tableView.numberOfSelectedRows
         if selected > 1 {
             centerStatus.stringValue += " (\(selected) selected)"
         }
         centerStatus.stringValue += ", \(engine.totalBytesString) total"
+        if let estimate = engine.matchEstimateString {
+            centerStatus.stringValue += ", \(estimate)"
+        }
 
         // handle menu
         if engine.isFiltered {
@@ -194,7 +228,9 @@ class ViewController: NSViewController {
     func filteredContent(_ fileHandle: FileHandle) {
         guard let engine = representedObject as? SearchEngine else { return }
         
-        let filteredRows = logViewController.tableView.numberOfRows
+        // rows may still be filtered in background
+        engine.waitFiltered()
+        let filteredRows = engine.lineCount
         for rowIndex in 0..<filteredRows {
             let lineInfo = engine.getLine(rowIndex)
             let selectedLine = lineInfo.line + "\n"
@@ -220,6 +256,7 @@ extension ViewController: NSWindowDelegate {
     
     func windowDidBecomeMain(_ notification: Notification) {
         settingsViewController.bindShortcuts()
+        (representedObject as? SearchEngine)?.setActive()
     }
 }
 
@@ -236,7 +273,6 @@ extension ViewController: NSTextFieldDelegate {
         }
         
         logViewController.filterLog(with:patternField.stringValue, matchColor: settingsViewController.matchColor, scopeColor: settingsViewController.scopeColor)
-        updateStatus()
     }
     
     func controlTextDidEndEditingCommon(_ obj: Notification) {
@@ -265,7 +301,6 @@ extension ViewController: NSTextFieldDelegate {
             }
         } else {
             logViewController.filterLog(with:textField.stringValue, matchColor: settingsViewController.matchColor, scopeColor: settingsViewController.scopeColor, reportError: true)
-            updateStatus()
         }
     }
     
@@ -294,12 +329,23 @@ extension ViewController: SettingsDelegate {
     func settingsChanged() {
         guard let engine = self.representedObject as? SearchEngine else { return }
         
+        let caseChanged = engine.ignoreCase != settingsViewController.ignoreCase
+        let fuzzyChanged = engine.fuzzyDistance != settingsViewController.fuzzyDistance || engine.fuzzyHamming != settingsViewController.fuzzyHamming
+        let fieldsChanged = engine.fieldMode != settingsViewController.fieldMode
+        
         ignoreCase.isHidden = !settingsViewController.ignoreCase
         guard engine.setIgnoreCase(settingsViewController.ignoreCase) else { return }
+        guard engine.setFuzzy(settingsViewController.fuzzyDistance, hamming: settingsViewController.fuzzyHamming) else { return }
+        guard engine.setFieldMode(settingsViewController.fieldMode) else { return }
         guard engine.setScope(settingsViewController.scopeBefore, settingsViewController.scopeAfter) else { return }
 
         logViewController.showLineNumbers(settingsViewController.showLines)
-        logViewController.filterLog(with:patternField.stringValue, matchColor: settingsViewController.matchColor, scopeColor: settingsViewController.scopeColor)
+        if (caseChanged || fuzzyChanged || fieldsChanged) {
+            logViewController.filterLog(with:patternField.stringValue, matchColor: settingsViewController.matchColor, scopeColor: settingsViewController.scopeColor)
+        } else {
+            // scope and colors don't require filtering again
+            logViewController.updateScope(matchColor: settingsViewController.matchColor, scopeColor: settingsViewController.scopeColor)
+        }
         updateStatus()
     }
 }
@@ -311,6 +357,10 @@ extension ViewController: LogViewDelegate {
         setError(error)
     }
     
+    func filterChanged() {
+        updateStatus()
+    }
+    
     func selectionChanged() {
         updateStatus()
     }